@@ -0,0 +1,180 @@
+# This file is part of min-server.
+#
+# min-server is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# min-server is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with min-server.  If not, see <http:#www.gnu.org/licenses/>.
+
+
+# Packs every file under INPUT_DIR into OUTPUT, a C++ source with the
+# table src/Assets.cpp searches. Run with
+#
+#   cmake -DINPUT_DIR=dir -DOUTPUT=file.cpp [-DBROTLI=path] [-DGZIP=path] -P PackAssets.cmake
+#
+# Entries are sorted by path. `x.br` and `x.gz` next to `x` become its
+# precompressed variants, missing ones are made with the given programs
+# and kept when smaller.
+
+cmake_minimum_required(VERSION 3.20)
+
+set(MIME_html "text/html; charset=utf-8")
+set(MIME_htm "text/html; charset=utf-8")
+set(MIME_css "text/css; charset=utf-8")
+set(MIME_js "text/javascript; charset=utf-8")
+set(MIME_mjs "text/javascript; charset=utf-8")
+set(MIME_json "application/json")
+set(MIME_map "application/json")
+set(MIME_txt "text/plain; charset=utf-8")
+set(MIME_xml "application/xml")
+set(MIME_csv "text/csv")
+set(MIME_svg "image/svg+xml")
+set(MIME_png "image/png")
+set(MIME_jpg "image/jpeg")
+set(MIME_jpeg "image/jpeg")
+set(MIME_gif "image/gif")
+set(MIME_webp "image/webp")
+set(MIME_avif "image/avif")
+set(MIME_ico "image/x-icon")
+set(MIME_woff "font/woff")
+set(MIME_woff2 "font/woff2")
+set(MIME_ttf "font/ttf")
+set(MIME_otf "font/otf")
+set(MIME_wasm "application/wasm")
+set(MIME_pdf "application/pdf")
+set(MIME_mp3 "audio/mpeg")
+set(MIME_wav "audio/wav")
+set(MIME_mp4 "video/mp4")
+set(MIME_webm "video/webm")
+set(MIME_zip "application/zip")
+set(MIME_gz "application/gzip")
+
+
+# Appends `static const U8 name[] = {...};` with the file's bytes.
+function(append_array out name path)
+    file(READ "${path}" hex HEX)
+    if ("${hex}" STREQUAL "")
+        set(hex "00")
+    endif()
+    string(REGEX REPLACE "(................................................................)" "\\1\n" hex "${hex}")
+    string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," hex "${hex}")
+    set(${out} "${${out}}alignas(16) static const U8 ${name}[] =\n{\n${hex}\n};\n\n" PARENT_SCOPE)
+endfunction()
+
+
+# Sets result to the ETag of the file without quotes, the first 128 bits of
+# its SHA-256 like ContentTag in src/HttpCache.cpp.
+function(content_tag result path)
+    file(SHA256 "${path}" hash)
+    string(SUBSTRING "${hash}" 0 32 hash)
+    set(${result} "${hash}" PARENT_SCOPE)
+endfunction()
+
+
+# Sets result to the compressed file when it is smaller than the original.
+function(compress result path suffix program)
+    set(${result} "" PARENT_SCOPE)
+    file(SIZE "${path}" size)
+
+    set(candidate "${path}.${suffix}")
+    if (NOT EXISTS "${candidate}")
+        if (NOT program OR NOT EXISTS "${program}")
+            return()
+        endif()
+        set(candidate "${TEMP_DIR}/variant.${suffix}")
+        if ("${suffix}" STREQUAL "br")
+            execute_process(COMMAND "${program}" -9 -f -o "${candidate}" "${path}" RESULT_VARIABLE failed)
+        else()
+            execute_process(COMMAND "${program}" -9 -n -c "${path}" OUTPUT_FILE "${candidate}" RESULT_VARIABLE failed)
+        endif()
+        if (failed)
+            return()
+        endif()
+    endif()
+
+    file(SIZE "${candidate}" compressedSize)
+    if (compressedSize LESS size)
+        set(${result} "${candidate}" PARENT_SCOPE)
+    endif()
+endfunction()
+
+
+get_filename_component(OUTPUT_DIR "${OUTPUT}" DIRECTORY)
+set(TEMP_DIR "${OUTPUT_DIR}/PackAssets.tmp")
+file(MAKE_DIRECTORY "${TEMP_DIR}")
+
+file(GLOB_RECURSE files LIST_DIRECTORIES false RELATIVE "${INPUT_DIR}" "${INPUT_DIR}/*")
+list(SORT files)
+
+set(arrays "")
+set(entries "")
+set(count 0)
+
+foreach(file ${files})
+    # Variants of a file that is packed itself.
+    if (file MATCHES "^(.*)\\.(br|gz)$" AND EXISTS "${INPUT_DIR}/${CMAKE_MATCH_1}")
+        continue()
+    endif()
+
+    set(path "${INPUT_DIR}/${file}")
+    file(SIZE "${path}" size)
+    file(TIMESTAMP "${path}" mtime "%s" UTC)
+
+    get_filename_component(extension "${file}" LAST_EXT)
+    string(SUBSTRING "${extension}" 1 -1 extension)
+    string(TOLOWER "${extension}" extension)
+    set(mime "${MIME_${extension}}")
+    if ("${mime}" STREQUAL "")
+        set(mime "application/octet-stream")
+    endif()
+
+    append_array(arrays "asset${count}" "${path}")
+    set(variants "")
+    foreach(variant br gz)
+        if ("${variant}" STREQUAL "br")
+            compress(compressed "${path}" br "${BROTLI}")
+        else()
+            compress(compressed "${path}" gz "${GZIP}")
+        endif()
+        if ("${compressed}" STREQUAL "")
+            set(variants "${variants}, { nullptr, 0, \"\" }")
+        else()
+            file(SIZE "${compressed}" compressedSize)
+            content_tag(compressedTag "${compressed}")
+            append_array(arrays "asset${count}_${variant}" "${compressed}")
+            set(variants "${variants}, { asset${count}_${variant}, ${compressedSize}, \"\\\"${compressedTag}\\\"\" }")
+        endif()
+    endforeach()
+
+    string(REPLACE "\\" "\\\\" escaped "${file}")
+    string(REPLACE "\"" "\\\"" escaped "${escaped}")
+    # The identity ETag matches what the server computes for files on disk.
+    content_tag(tag "${path}")
+    string(APPEND entries
+           "    { \"/${escaped}\", \"${mime}\", ${mtime}, { asset${count}, ${size}, \"\\\"${tag}\\\"\" }${variants} },\n")
+    math(EXPR count "${count} + 1")
+endforeach()
+
+file(REMOVE_RECURSE "${TEMP_DIR}")
+
+if (count EQUAL 0)
+    set(entries "    { \"\", \"\", 0, { nullptr, 0, \"\" }, { nullptr, 0, \"\" }, { nullptr, 0, \"\" } }\n")
+endif()
+
+file(WRITE "${OUTPUT}.tmp"
+"// Generated by cmake/PackAssets.cmake from ${INPUT_DIR}, do not edit.\n\n"
+"#include \"Assets.hpp\"\n\n\n"
+"${arrays}"
+"extern const EmbeddedAsset embeddedAssets[] =\n{\n${entries}};\n\n"
+"extern const Size embeddedAssetCount = ${count};\n")
+
+# Untouched when nothing changed, so the binary is not relinked.
+file(COPY_FILE "${OUTPUT}.tmp" "${OUTPUT}" ONLY_IF_DIFFERENT)
+file(REMOVE "${OUTPUT}.tmp")
@@ -0,0 +1,474 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "AccessLog.hpp"
+#include "Utils.hpp"
+
+#include <ctime>
+
+
+// Longer paths are cut, the interned ones are bounded in number and size
+// and start over when full.
+static constexpr Size maxPathLength = 512;
+static constexpr Size pathSlotCount = 1 << 16;
+static constexpr Size maxPathArenaSize = 8 << 20;
+
+static constexpr StrView filePrefix = "access-";
+static constexpr StrView fileSuffix = ".msal";
+
+
+AccessLog::AccessLog() :
+    active(nullptr),
+    pathCount(0),
+    clockOffsetNs(0),
+    stopping(false),
+    running(false),
+    file(nullptr),
+    fileBytes(0),
+    fileOpenedS(0),
+    writtenCount(0),
+    droppedCount(0)
+{
+    // Requests answered before any route is looked at, e.g. not found.
+    routes.emplace_back("-");
+}
+
+
+AccessLog::~AccessLog()
+{
+    Stop();
+}
+
+
+auto
+AccessLog::SetOptions(const AccessLogOptions& newOptions) -> void
+{
+    options = newOptions;
+    options.blockRecords = std::max<U32>(options.blockRecords, 1);
+    options.maxPendingBlocks = std::max<U32>(options.maxPendingBlocks, 1);
+}
+
+
+auto
+AccessLog::IsEnabled() const -> B
+{
+    return running;
+}
+
+
+auto
+AccessLog::AddRoute(StrView name) -> U16
+{
+    // Routes come and go with reconfiguration, a name keeps its number.
+    LockGuard<Mutex> lock(mutex);
+    auto known = std::find(routes.begin(), routes.end(), name);
+    if (known != routes.end())
+    {
+        return U16(known - routes.begin());
+    }
+
+    routes.emplace_back(name);
+    return U16(routes.size() - 1);
+}
+
+
+auto
+AccessLog::Start(mg_mgr* mgr, const CpuPlacement* placement) -> void
+{
+    if (options.directory.empty() || running)
+    {
+        return;
+    }
+
+    std::error_code error;
+    std::filesystem::create_directories(options.directory, error);
+    if (error)
+    {
+        LogErr("Cannot create the access log directory ", options.directory);
+        return;
+    }
+
+    // Blocks for the one being filled, the one being written and the queue,
+    // allocated up front so appending never allocates.
+    auto blockCount = options.maxPendingBlocks + 2;
+    for (U32 i = 0; i < blockCount; ++i)
+    {
+        auto block = std::make_unique<Block>();
+        block->records.reserve(options.blockRecords);
+        block->pathIndexes.reserve(options.blockRecords);
+        freeBlocks.push_back(block.get());
+        blocks.push_back(std::move(block));
+    }
+    active = freeBlocks.back();
+    freeBlocks.pop_back();
+
+    pathSlots.assign(pathSlotCount, PathSlot{ 0, 0, 0 });
+    pathArena.reserve(maxPathArenaSize);
+    Size blockPathSlots = std::bit_ceil(Size(options.blockRecords) * 2);
+    blockPaths.assign(blockPathSlots, { 0, 0 });
+    SyncClock();
+
+    running = true;
+    stopping = false;
+    writer = Thread([this]() { Write(); });
+    placement->PlaceThread(writer);
+    mg_timer_add(mgr, options.flushIntervalMs, MG_TIMER_REPEAT, AccessLog::OnFlushTimer, this);
+}
+
+
+auto
+AccessLog::Stop() -> void
+{
+    if (!running)
+    {
+        return;
+    }
+
+    Seal();
+    {
+        LockGuard<Mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    writer.join();
+    running = false;
+
+    if (file != nullptr)
+    {
+        std::fclose(file);
+        file = nullptr;
+    }
+}
+
+
+auto
+AccessLog::SyncClock() -> void
+{
+    auto unixNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::system_clock::now().time_since_epoch()
+                  ).count();
+    clockOffsetNs = I64(unixNs) - I64(GetHighResTimeNS());
+}
+
+
+auto
+AccessLog::ToUnixMs(U64 timeNs) const -> U64
+{
+    return U64(I64(timeNs) + clockOffsetNs) / 1000000;
+}
+
+
+auto
+AccessLog::InternPath(StrView path) -> U64
+{
+    path = path.substr(0, maxPathLength);
+    // Zero marks a free slot.
+    auto key = HashBytes(path.data(), path.size()) | 1;
+
+    auto mask = pathSlots.size() - 1;
+    for (auto i = MixHash(key) & mask;; i = (i + 1) & mask)
+    {
+        auto& slot = pathSlots[i];
+        if (slot.key == key)
+        {
+            return key;
+        }
+        if (slot.key == 0)
+        {
+            // Kept at half load, the rest are written without a name until
+            // the table starts over.
+            if (pathCount < pathSlots.size() / 2 && pathArena.size() + path.size() <= maxPathArenaSize)
+            {
+                slot = { key, U32(pathArena.size()), U32(path.size()) };
+                pathArena.append(path);
+                pathCount++;
+            }
+            return key;
+        }
+    }
+}
+
+
+auto
+AccessLog::FindPath(U64 key) const -> StrView
+{
+    auto mask = pathSlots.size() - 1;
+    for (auto i = MixHash(key) & mask;; i = (i + 1) & mask)
+    {
+        auto& slot = pathSlots[i];
+        if (slot.key == key)
+        {
+            return StrView(pathArena).substr(slot.offset, slot.length);
+        }
+        if (slot.key == 0)
+        {
+            return StrView();
+        }
+    }
+}
+
+
+auto
+AccessLog::Append(const AccessRecord& record) -> void
+{
+    active->records.push_back(record);
+    if (active->records.size() >= options.blockRecords)
+    {
+        Seal();
+    }
+}
+
+
+// Numbers the distinct paths of the block and copies them into it, so the
+// writer does not touch the intern table.
+auto
+AccessLog::ResolvePaths(Block* block) -> void
+{
+    auto mask = blockPaths.size() - 1;
+    std::fill(blockPaths.begin(), blockPaths.end(), Pair<U64, U32>(0, 0));
+
+    Vec<Pair<U32, U32>> ranges;
+    block->pathIndexes.clear();
+    block->pathBytes.clear();
+
+    for (auto& record : block->records)
+    {
+        for (auto i = MixHash(record.path) & mask;; i = (i + 1) & mask)
+        {
+            auto& slot = blockPaths[i];
+            if (slot.first == record.path)
+            {
+                block->pathIndexes.push_back(slot.second);
+                break;
+            }
+            if (slot.first == 0)
+            {
+                auto path = FindPath(record.path);
+                slot = { record.path, U32(ranges.size()) };
+                ranges.emplace_back(U32(block->pathBytes.size()), U32(path.size()));
+                block->pathBytes.append(path);
+                block->pathIndexes.push_back(slot.second);
+                break;
+            }
+        }
+    }
+
+    block->paths.clear();
+    for (auto [offset, length] : ranges)
+    {
+        block->paths.push_back(StrView(block->pathBytes).substr(offset, length));
+    }
+
+    if (pathCount >= pathSlots.size() / 2 || pathArena.size() >= maxPathArenaSize - maxPathLength)
+    {
+        std::fill(pathSlots.begin(), pathSlots.end(), PathSlot{ 0, 0, 0 });
+        pathArena.clear();
+        pathCount = 0;
+    }
+}
+
+
+auto
+AccessLog::Seal() -> void
+{
+    if (active->records.empty())
+    {
+        return;
+    }
+
+    Block* next = nullptr;
+    {
+        LockGuard<Mutex> lock(mutex);
+        if (!freeBlocks.empty())
+        {
+            next = freeBlocks.back();
+            freeBlocks.pop_back();
+        }
+    }
+
+    // The writer is behind, the block's records are lost.
+    if (next == nullptr)
+    {
+        droppedCount += active->records.size();
+        active->records.clear();
+        return;
+    }
+
+    ResolvePaths(active);
+    {
+        LockGuard<Mutex> lock(mutex);
+        queue.push_back(active);
+    }
+    wake.notify_one();
+    active = next;
+}
+
+
+auto
+AccessLog::OnFlushTimer(void* accessLog) -> void
+{
+    auto log = (AccessLog*)accessLog;
+    log->Seal();
+    // Follows adjustments of the wall clock.
+    log->SyncClock();
+}
+
+
+auto
+AccessLog::Write() -> void
+{
+    for (;;)
+    {
+        Block* block = nullptr;
+        {
+            UniqueLock<Mutex> lock(mutex);
+            wake.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty())
+            {
+                return;
+            }
+            block = queue.front();
+            queue.pop_front();
+            if (writerRoutes.size() != routes.size())
+            {
+                writerRoutes = routes;
+            }
+        }
+
+        encoded.clear();
+        EncodeAccessBlock(
+                           block->records.data(),
+                           block->pathIndexes.data(),
+                           block->records.size(),
+                           block->paths,
+                           writerRoutes,
+                           &encoded
+                         );
+
+        auto count = block->records.size();
+        if (Rotate(encoded.size()) && std::fwrite(encoded.data(), 1, encoded.size(), file) == encoded.size())
+        {
+            // Readers only ever see whole blocks, or a cut one at the end.
+            std::fflush(file);
+            fileBytes += encoded.size();
+            writtenCount += count;
+        }
+        else
+        {
+            droppedCount += count;
+        }
+
+        block->records.clear();
+        LockGuard<Mutex> lock(mutex);
+        freeBlocks.push_back(block);
+    }
+}
+
+
+// Makes sure a file with room for nextBytes more is open.
+auto
+AccessLog::Rotate(Size nextBytes) -> B
+{
+    auto nowS = (U64)std::time(nullptr);
+
+    if (file != nullptr)
+    {
+        auto full = fileBytes > accessFileHeaderSize && fileBytes + nextBytes > options.maxFileBytes;
+        auto old = options.rotateIntervalS != 0 && nowS >= fileOpenedS + options.rotateIntervalS;
+        if (!full && !old)
+        {
+            return true;
+        }
+        std::fclose(file);
+        file = nullptr;
+    }
+
+    // Names sort by the time they were started at.
+    C stamp[32];
+    auto time = (std::time_t)nowS;
+    std::tm utc;
+    gmtime_r(&time, &utc);
+    std::strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &utc);
+
+    auto base = options.directory + "/" + Str(filePrefix) + stamp;
+    auto path = base + Str(fileSuffix);
+    for (U32 i = 1; FileExists(path); ++i)
+    {
+        path = base + "-" + std::to_string(i) + Str(fileSuffix);
+    }
+
+    file = std::fopen(path.c_str(), "wb");
+    if (file == nullptr)
+    {
+        LogErr("Cannot open the access log ", path);
+        return false;
+    }
+
+    U32 header[2] = { accessLogMagic, accessLogVersion };
+    std::fwrite(header, 1, sizeof(header), file);
+    fileBytes = sizeof(header);
+    fileOpenedS = nowS;
+
+    Prune();
+    return true;
+}
+
+
+auto
+AccessLog::Prune() -> void
+{
+    if (options.maxFiles == 0)
+    {
+        return;
+    }
+
+    Vec<Str> names;
+    std::error_code error;
+    for (auto& entry : std::filesystem::directory_iterator(options.directory, error))
+    {
+        auto name = entry.path().filename().string();
+        if (name.starts_with(filePrefix) && name.ends_with(fileSuffix))
+        {
+            names.push_back(std::move(name));
+        }
+    }
+    if (names.size() <= options.maxFiles)
+    {
+        return;
+    }
+
+    std::sort(names.begin(), names.end());
+    for (Size i = 0; i < names.size() - options.maxFiles; ++i)
+    {
+        std::filesystem::remove(options.directory + "/" + names[i], error);
+    }
+}
+
+
+auto
+AccessLog::GetWrittenCount() const -> U64
+{
+    return writtenCount;
+}
+
+
+auto
+AccessLog::GetDroppedCount() const -> U64
+{
+    return droppedCount;
+}
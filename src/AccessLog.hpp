@@ -0,0 +1,153 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+#include "AccessLogFormat.hpp"
+#include "CpuPlacement.hpp"
+
+#include "mongoose/mongoose.h"
+
+#include <cstdio>
+
+
+struct AccessLogOptions
+{
+    // Files are written here, the log is off when empty.
+    Str directory;
+    // A block is handed to the writer when it has this many records, or
+    // flushIntervalMs after the last one was.
+    U32 blockRecords = 16384;
+    U32 flushIntervalMs = 1000;
+    // A new file is started when the current one reaches either.
+    U64 maxFileBytes = 256ull << 20;
+    U32 rotateIntervalS = 3600;
+    // The oldest files beyond this many are deleted, zero keeps them all.
+    U32 maxFiles = 48;
+    // Blocks waiting for the writer, records beyond are dropped instead of
+    // holding up the event loop.
+    U32 maxPendingBlocks = 8;
+};
+
+
+// Request on its way to the access log, kept with its connection.
+struct PendingAccess
+{
+    // Zero when no request is being timed.
+    U64 startNs;
+    U64 path;
+    // Where the response starts in everything queued on the connection.
+    U64 responseStart;
+    // Interim responses in front of the final one.
+    U32 interimLength;
+    U16 route;
+    U16 status;
+    U8 method;
+    // Handed to its handler, a streamed body may still be coming in before.
+    B dispatched;
+};
+
+
+// Fixed width records appended on the event loop into a block, which a
+// writer thread encodes column by column and appends to the current file.
+// Request paths are interned, records carry a key only.
+class AccessLog
+{
+public:
+    AccessLog();
+    ~AccessLog();
+
+    void SetOptions(const AccessLogOptions& newOptions);
+    B IsEnabled() const;
+
+    // Registers the name the route's records are written with, from any
+    // thread.
+    U16 AddRoute(StrView name);
+
+    // The writer thread is moved off the reactor's CPU by placement.
+    void Start(mg_mgr* mgr, const CpuPlacement* placement);
+    // Writes what was appended so far and joins the writer.
+    void Stop();
+
+    // Event loop side.
+    U64 InternPath(StrView path);
+    void Append(const AccessRecord& record);
+    // Unix time in milliseconds of a GetHighResTimeNS() reading.
+    U64 ToUnixMs(U64 timeNs) const;
+
+    U64 GetWrittenCount() const;
+    U64 GetDroppedCount() const;
+
+private:
+    struct Block
+    {
+        Vec<AccessRecord> records;
+        Vec<U32> pathIndexes;
+        Vec<StrView> paths;
+        Str pathBytes;
+    };
+
+    struct PathSlot
+    {
+        U64 key;
+        U32 offset;
+        U32 length;
+    };
+
+    AccessLogOptions options;
+    // Guarded by mutex, the writer works on a copy.
+    Vec<Str> routes;
+
+    // Event loop side.
+    Block* active;
+    Vec<PathSlot> pathSlots;
+    U32 pathCount;
+    Str pathArena;
+    Vec<Pair<U64, U32>> blockPaths;
+    I64 clockOffsetNs;
+
+    Vec<UniquePtr<Block>> blocks;
+    Vec<Block*> freeBlocks;
+    Deque<Block*> queue;
+    Thread writer;
+    Mutex mutex;
+    ConditionVariable wake;
+    B stopping;
+    B running;
+
+    // Writer side.
+    std::FILE* file;
+    U64 fileBytes;
+    U64 fileOpenedS;
+    Str encoded;
+    Vec<Str> writerRoutes;
+
+    Atomic<U64> writtenCount;
+    Atomic<U64> droppedCount;
+
+    void Seal();
+    void ResolvePaths(Block* block);
+    StrView FindPath(U64 key) const;
+    void SyncClock();
+    void Write();
+    B Rotate(Size nextBytes);
+    void Prune();
+
+    static void OnFlushTimer(void* accessLog);
+};
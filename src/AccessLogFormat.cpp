@@ -0,0 +1,389 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "AccessLogFormat.hpp"
+
+
+static constexpr Arr<StrView, 10> methodNames =
+{
+    "OTHER", "GET", "HEAD", "POST", "PUT", "DELETE", "PATCH", "OPTIONS", "CONNECT", "TRACE"
+};
+
+
+auto
+ParseAccessMethod(StrView method) -> AccessMethod
+{
+    for (Size i = 1; i < methodNames.size(); ++i)
+    {
+        if (method == methodNames[i])
+        {
+            return (AccessMethod)i;
+        }
+    }
+
+    return AccessMethod::Other;
+}
+
+
+auto
+GetAccessMethodName(AccessMethod method) -> StrView
+{
+    return ((Size)method < methodNames.size())? methodNames[(Size)method] : methodNames[0];
+}
+
+
+enum class AccessColumn : U8
+{
+    Time,
+    Bytes,
+    Path,
+    Ip,
+    Latency,
+    Port,
+    Route,
+    Status,
+    Method,
+    Flags,
+    Count
+};
+
+
+template <typename T>
+static auto Put(U8*& at, T value) -> void
+{
+    memcpy(at, &value, sizeof(T));
+    at += sizeof(T);
+}
+
+
+template <typename T>
+static auto Get(const U8* data) -> T
+{
+    T value;
+    memcpy(&value, data, sizeof(T));
+    return value;
+}
+
+
+static constexpr Size maxVarintSize = 10;
+
+
+static auto PutVarint(U8*& at, U64 value) -> void
+{
+    while (value >= 0x80)
+    {
+        *at++ = U8(value | 0x80);
+        value >>= 7;
+    }
+    *at++ = U8(value);
+}
+
+
+// Advances data, null when the varint runs past end.
+static auto GetVarint(const U8* data, const U8* end, U64* value) -> const U8*
+{
+    U64 result = 0;
+    for (U32 shift = 0; shift < 64 && data < end; shift += 7)
+    {
+        auto byte = *data++;
+        result |= U64(byte & 0x7f) << shift;
+        if (byte < 0x80)
+        {
+            *value = result;
+            return data;
+        }
+    }
+
+    return nullptr;
+}
+
+
+static auto ZigZag(I64 value) -> U64
+{
+    return (U64(value) << 1) ^ U64(value >> 63);
+}
+
+
+static auto UnZigZag(U64 value) -> I64
+{
+    return I64(value >> 1) ^ -I64(value & 1);
+}
+
+
+// Runs column writer on a length prefixed section at the cursor.
+template <typename Writer>
+static auto PutColumn(U8*& at, Writer writer) -> void
+{
+    auto lengthAt = at;
+    at += sizeof(U32);
+    writer();
+    auto length = U32(at - lengthAt - sizeof(U32));
+    memcpy(lengthAt, &length, sizeof(U32));
+}
+
+
+template <typename Names>
+static auto GetNamesSize(const Names& names) -> Size
+{
+    auto size = maxVarintSize;
+    for (auto& name : names)
+    {
+        size += maxVarintSize + name.size();
+    }
+
+    return size;
+}
+
+
+auto
+EncodeAccessBlock(
+                   const AccessRecord* records,
+                   const U32* pathIndexes,
+                   Size count,
+                   const Vec<StrView>& paths,
+                   const Vec<Str>& routes,
+                   Str* out
+                 ) -> void
+{
+    auto minTimeMs = ~U64(0);
+    U64 maxTimeMs = 0;
+    for (Size i = 0; i < count; ++i)
+    {
+        minTimeMs = std::min(minTimeMs, records[i].timeMs);
+        maxTimeMs = std::max(maxTimeMs, records[i].timeMs);
+    }
+
+    // Written through a cursor into room for the largest encoding, then cut
+    // to what was used.
+    auto recordSize = 6 * maxVarintSize + sizeof(U32) + sizeof(U16) + 2 * sizeof(U8);
+    auto columnsSize = (Size)AccessColumn::Count * sizeof(U32);
+    auto maxSize = accessBlockHeaderSize + columnsSize + count * recordSize + GetNamesSize(paths) + GetNamesSize(routes);
+    auto headerAt = out->size();
+    out->resize(headerAt + maxSize);
+    auto begin = (U8*)out->data() + headerAt;
+    auto at = begin;
+
+    Put<U32>(at, accessBlockMagic);
+    Put<U32>(at, U32(count));
+    Put<U32>(at, 0);
+    Put<U64>(at, count? minTimeMs : 0);
+    Put<U64>(at, maxTimeMs);
+
+    // Records come in the order responses finish, close to time order.
+    PutColumn(at, [&]()
+    {
+        auto previous = minTimeMs;
+        for (Size i = 0; i < count; ++i)
+        {
+            PutVarint(at, ZigZag(I64(records[i].timeMs - previous)));
+            previous = records[i].timeMs;
+        }
+    });
+    PutColumn(at, [&]() { for (Size i = 0; i < count; ++i) PutVarint(at, records[i].bytes); });
+    PutColumn(at, [&]() { for (Size i = 0; i < count; ++i) PutVarint(at, pathIndexes[i]); });
+    // Addresses repeat rather than grow, raw words decode fastest.
+    PutColumn(at, [&]() { for (Size i = 0; i < count; ++i) Put<U32>(at, records[i].ip); });
+    PutColumn(at, [&]() { for (Size i = 0; i < count; ++i) PutVarint(at, records[i].latencyUs); });
+    PutColumn(at, [&]() { for (Size i = 0; i < count; ++i) Put<U16>(at, records[i].port); });
+    PutColumn(at, [&]() { for (Size i = 0; i < count; ++i) PutVarint(at, records[i].route); });
+    PutColumn(at, [&]() { for (Size i = 0; i < count; ++i) PutVarint(at, records[i].status); });
+    PutColumn(at, [&]() { for (Size i = 0; i < count; ++i) *at++ = records[i].method; });
+    PutColumn(at, [&]() { for (Size i = 0; i < count; ++i) *at++ = records[i].flags; });
+
+    auto putNames = [&](const auto& names)
+    {
+        PutVarint(at, names.size());
+        for (StrView name : names)
+        {
+            PutVarint(at, name.size());
+            memcpy(at, name.data(), name.size());
+            at += name.size();
+        }
+    };
+    putNames(paths);
+    putNames(routes);
+
+    auto bodySize = U32(at - begin - accessBlockHeaderSize);
+    memcpy(begin + 2 * sizeof(U32), &bodySize, sizeof(U32));
+    out->resize(headerAt + (at - begin));
+}
+
+
+auto
+PeekAccessBlock(const U8* data, Size size, U64* minTimeMs, U64* maxTimeMs) -> Size
+{
+    if (size < accessBlockHeaderSize || Get<U32>(data) != accessBlockMagic)
+    {
+        return 0;
+    }
+
+    auto blockSize = accessBlockHeaderSize + Get<U32>(data + 8);
+    if (blockSize > size)
+    {
+        return 0;
+    }
+    *minTimeMs = Get<U64>(data + 12);
+    *maxTimeMs = Get<U64>(data + 20);
+
+    return blockSize;
+}
+
+
+template <typename T>
+static auto DecodeVarints(const U8* data, const U8* end, Vec<T>* column, Size count) -> B
+{
+    column->resize(count);
+    auto values = column->data();
+
+    for (Size i = 0; i < count; ++i)
+    {
+        // Single byte values are the common case for most columns.
+        if (data < end && *data < 0x80)
+        {
+            values[i] = T(*data++);
+            continue;
+        }
+        U64 value;
+        data = GetVarint(data, end, &value);
+        if (data == nullptr)
+        {
+            return false;
+        }
+        values[i] = T(value);
+    }
+
+    return data == end;
+}
+
+
+template <typename T>
+static auto DecodeRaw(const U8* data, const U8* end, Vec<T>* column, Size count) -> B
+{
+    if (Size(end - data) != count * sizeof(T))
+    {
+        return false;
+    }
+    column->resize(count);
+    memcpy(column->data(), data, count * sizeof(T));
+
+    return true;
+}
+
+
+static auto DecodeNames(const U8*& data, const U8* end, Vec<StrView>* names) -> B
+{
+    U64 count;
+    data = GetVarint(data, end, &count);
+    if (data == nullptr || count > Size(end - data))
+    {
+        return false;
+    }
+
+    names->resize(count);
+    for (auto& name : *names)
+    {
+        U64 length;
+        data = GetVarint(data, end, &length);
+        if (data == nullptr || length > Size(end - data))
+        {
+            return false;
+        }
+        name = StrView((CStr)data, length);
+        data += length;
+    }
+
+    return true;
+}
+
+
+auto
+DecodeAccessBlock(const U8* data, Size size, AccessBlock* block) -> Size
+{
+    auto blockSize = PeekAccessBlock(data, size, &block->minTimeMs, &block->maxTimeMs);
+    if (blockSize == 0)
+    {
+        return 0;
+    }
+
+    Size count = Get<U32>(data + 4);
+    auto end = data + blockSize;
+    data += accessBlockHeaderSize;
+
+    for (U32 column = 0; column < (U32)AccessColumn::Count; ++column)
+    {
+        if (end - data < (I64)sizeof(U32))
+        {
+            return 0;
+        }
+        auto length = Get<U32>(data);
+        data += sizeof(U32);
+        if (length > Size(end - data))
+        {
+            return 0;
+        }
+        auto columnEnd = data + length;
+
+        B decoded = false;
+        switch ((AccessColumn)column)
+        {
+            case AccessColumn::Time:
+                decoded = DecodeVarints(data, columnEnd, &block->timeMs, count);
+                if (decoded)
+                {
+                    auto previous = block->minTimeMs;
+                    for (auto& timeMs : block->timeMs)
+                    {
+                        previous += UnZigZag(timeMs);
+                        timeMs = previous;
+                    }
+                }
+                break;
+            case AccessColumn::Bytes:   decoded = DecodeVarints(data, columnEnd, &block->bytes, count); break;
+            case AccessColumn::Path:    decoded = DecodeVarints(data, columnEnd, &block->path, count); break;
+            case AccessColumn::Ip:      decoded = DecodeRaw(data, columnEnd, &block->ip, count); break;
+            case AccessColumn::Latency: decoded = DecodeVarints(data, columnEnd, &block->latencyUs, count); break;
+            case AccessColumn::Port:    decoded = DecodeRaw(data, columnEnd, &block->port, count); break;
+            case AccessColumn::Route:   decoded = DecodeVarints(data, columnEnd, &block->route, count); break;
+            case AccessColumn::Status:  decoded = DecodeVarints(data, columnEnd, &block->status, count); break;
+            case AccessColumn::Method:  decoded = DecodeRaw(data, columnEnd, &block->method, count); break;
+            case AccessColumn::Flags:   decoded = DecodeRaw(data, columnEnd, &block->flags, count); break;
+            case AccessColumn::Count:   break;
+        }
+        if (!decoded)
+        {
+            return 0;
+        }
+        data = columnEnd;
+    }
+
+    if (!DecodeNames(data, end, &block->paths) || !DecodeNames(data, end, &block->routes))
+    {
+        return 0;
+    }
+
+    // Indexes are checked once here, so queries need not.
+    for (auto path : block->path)
+    {
+        if (path >= block->paths.size())
+        {
+            return 0;
+        }
+    }
+
+    return blockSize;
+}
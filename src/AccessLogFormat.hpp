@@ -0,0 +1,134 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+
+
+// Access log files are a file header followed by independent blocks. A
+// block stores each field of its records as a column of its own, with
+// deltas and varints, followed by the request paths and route names its
+// records refer to. Shared by the server and tools/AccessLogQuery.cpp, so
+// it depends on nothing else. Little endian, as the hosts writing it.
+//
+//   file:   "MSAL" U32 version
+//   block:  "MSAB" U32 count U32 bodySize U64 minTimeMs U64 maxTimeMs
+//           { U32 length, bytes } per column, in AccessColumn order
+//           varint pathCount { varint length, bytes } per path
+//           varint routeCount { varint length, bytes } per route
+
+constexpr U32 accessLogMagic = 0x4c41534d;
+constexpr U32 accessBlockMagic = 0x4241534d;
+constexpr U32 accessLogVersion = 1;
+constexpr Size accessFileHeaderSize = 8;
+constexpr Size accessBlockHeaderSize = 28;
+
+
+enum class AccessMethod : U8
+{
+    Other,
+    Get,
+    Head,
+    Post,
+    Put,
+    Delete,
+    Patch,
+    Options,
+    Connect,
+    Trace
+};
+
+AccessMethod ParseAccessMethod(StrView method);
+StrView GetAccessMethodName(AccessMethod method);
+
+
+enum AccessFlags : U8
+{
+    accessTLS = 1,
+    accessHttp2 = 2
+};
+
+
+// One request, as the event loop appends it.
+struct AccessRecord
+{
+    // Unix time the request came in.
+    U64 timeMs;
+    // Bytes of the response, head included, interim 1xx responses not.
+    U64 bytes;
+    // Key of the request path, see AccessLog::InternPath.
+    U64 path;
+    // Host byte order.
+    U32 ip;
+    // Until the whole response was queued for sending.
+    U32 latencyUs;
+    U16 port;
+    U16 route;
+    // Zero when the response was not seen, e.g. the client went away.
+    U16 status;
+    U8 method;
+    U8 flags;
+};
+
+
+// The records of a block, a vector per column.
+struct AccessBlock
+{
+    Vec<U64> timeMs;
+    Vec<U64> bytes;
+    // Index into paths.
+    Vec<U32> path;
+    Vec<U32> ip;
+    Vec<U32> latencyUs;
+    Vec<U16> port;
+    Vec<U16> route;
+    Vec<U16> status;
+    Vec<U8> method;
+    Vec<U8> flags;
+
+    Vec<StrView> paths;
+    // Indexed by AccessRecord::route.
+    Vec<StrView> routes;
+
+    U64 minTimeMs;
+    U64 maxTimeMs;
+
+    Size GetCount() const { return timeMs.size(); }
+};
+
+
+// Appends the block of count records to out. pathIndexes maps each record
+// to one of paths.
+void EncodeAccessBlock(
+                        const AccessRecord* records,
+                        const U32* pathIndexes,
+                        Size count,
+                        const Vec<StrView>& paths,
+                        const Vec<Str>& routes,
+                        Str* out
+                      );
+
+// Reads the time range and size of the block at data without decoding it.
+// Returns the size of the whole block, zero when it is not one or is cut
+// short.
+Size PeekAccessBlock(const U8* data, Size size, U64* minTimeMs, U64* maxTimeMs);
+
+// Decodes the block at data. The names in block point into data. Returns
+// the size of the block, zero when it is malformed.
+Size DecodeAccessBlock(const U8* data, Size size, AccessBlock* block);
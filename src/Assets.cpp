@@ -0,0 +1,320 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "Assets.hpp"
+#include "Utils.hpp"
+
+#include <algorithm>
+
+
+// The table is generated when the build packs a directory, see ASSET_DIR
+// in CMakeLists.txt.
+#if EMBEDDED_ASSETS
+extern const EmbeddedAsset embeddedAssets[];
+extern const Size embeddedAssetCount;
+#else
+static const EmbeddedAsset* const embeddedAssets = nullptr;
+static constexpr Size embeddedAssetCount = 0;
+#endif
+
+
+struct EmbeddedFile
+{
+    const AssetRepresentation* representation;
+    Size position;
+};
+
+
+static auto LowerBound(StrView path) -> const EmbeddedAsset*
+{
+    auto end = embeddedAssets + embeddedAssetCount;
+    return std::lower_bound(
+                             embeddedAssets,
+                             end,
+                             path,
+                             [](const EmbeddedAsset& asset, StrView path)
+                             {
+                                 return StrView(asset.path) < path;
+                             }
+                           );
+}
+
+
+auto
+FindEmbeddedAsset(StrView path) -> const EmbeddedAsset*
+{
+    auto asset = LowerBound(path);
+    if (asset != embeddedAssets + embeddedAssetCount && StrView(asset->path) == path)
+    {
+        return asset;
+    }
+
+    return nullptr;
+}
+
+
+auto
+GetEmbeddedAssetCount() -> Size
+{
+    return embeddedAssetCount;
+}
+
+
+auto
+SelectRepresentation(
+                      const EmbeddedAsset& asset,
+                      StrView acceptEncoding,
+                      CStr* contentEncoding
+                    ) -> const AssetRepresentation&
+{
+    if (asset.brotli.data != nullptr && AcceptsEncoding(acceptEncoding, "br"))
+    {
+        *contentEncoding = "br";
+        return asset.brotli;
+    }
+    if (asset.gzip.data != nullptr && AcceptsEncoding(acceptEncoding, "gzip"))
+    {
+        *contentEncoding = "gzip";
+        return asset.gzip;
+    }
+
+    *contentEncoding = nullptr;
+    return asset.identity;
+}
+
+
+// Also resolves `x.br` and `x.gz` to the variants of `x`, as mongoose
+// looks for `path.gz` when asked.
+static auto FindRepresentation(StrView path) -> const AssetRepresentation*
+{
+    auto asset = FindEmbeddedAsset(path);
+    if (asset != nullptr)
+    {
+        return &asset->identity;
+    }
+
+    if (path.ends_with(".gz") || path.ends_with(".br"))
+    {
+        asset = FindEmbeddedAsset(path.substr(0, path.size() - 3));
+        if (asset != nullptr)
+        {
+            auto variant = path.ends_with(".gz")? &asset->gzip : &asset->brotli;
+            return (variant->data != nullptr)? variant : nullptr;
+        }
+    }
+
+    return nullptr;
+}
+
+
+// Whether the path is a directory prefix of the asset's path.
+static auto IsUnder(StrView directory, const EmbeddedAsset& asset) -> B
+{
+    StrView path = asset.path;
+    if (directory.empty() || directory == "/")
+    {
+        return true;
+    }
+    if (directory.back() == '/')
+    {
+        directory.remove_suffix(1);
+    }
+
+    return
+        path.size() > directory.size() &&
+        path.starts_with(directory) &&
+        path[directory.size()] == '/';
+}
+
+
+// The first entry under a directory. Its entries sort right after the
+// directory's path with a slash, not after the path itself: '-' and '.'
+// sort before '/', so /app.js comes between /app and /app/index.html.
+static auto FirstUnder(StrView directory) -> const EmbeddedAsset*
+{
+    if (!directory.empty() && directory.back() == '/')
+    {
+        directory.remove_suffix(1);
+    }
+
+    auto first = LowerBound(Str(directory) + '/');
+    if (first != embeddedAssets + embeddedAssetCount && IsUnder(directory, *first))
+    {
+        return first;
+    }
+
+    return nullptr;
+}
+
+
+static auto EmbeddedStat(CStr path, size_t* size, time_t* mtime) -> int
+{
+    auto asset = FindEmbeddedAsset(path);
+    if (asset != nullptr)
+    {
+        if (size != nullptr)
+        {
+            *size = asset->identity.size;
+        }
+        if (mtime != nullptr)
+        {
+            *mtime = (time_t)asset->mtime;
+        }
+        return MG_FS_READ;
+    }
+
+    auto variant = FindRepresentation(path);
+    if (variant != nullptr)
+    {
+        asset = FindEmbeddedAsset(StrView(path).substr(0, strlen(path) - 3));
+        if (size != nullptr)
+        {
+            *size = variant->size;
+        }
+        if (mtime != nullptr)
+        {
+            *mtime = (time_t)asset->mtime;
+        }
+        return MG_FS_READ;
+    }
+
+    return (FirstUnder(path) != nullptr)? MG_FS_DIR : 0;
+}
+
+
+static auto EmbeddedTag(CStr path, C* buffer, size_t length) -> bool
+{
+    auto representation = FindRepresentation(path);
+    if (representation == nullptr || strlen(representation->etag) >= length)
+    {
+        return false;
+    }
+    strcpy(buffer, representation->etag);
+
+    return true;
+}
+
+
+static auto EmbeddedList(CStr path, void (*fn)(CStr, void*), void* userData) -> void
+{
+    StrView directory = path;
+    if (!directory.empty() && directory.back() == '/')
+    {
+        directory.remove_suffix(1);
+    }
+
+    auto first = FirstUnder(directory);
+    if (first == nullptr)
+    {
+        return;
+    }
+
+    StrView previous;
+    for (auto asset = first; asset != embeddedAssets + embeddedAssetCount; ++asset)
+    {
+        if (!IsUnder(directory, *asset))
+        {
+            break;
+        }
+
+        // First component below the directory, listed once.
+        auto name = StrView(asset->path).substr(directory.size() + 1);
+        name = name.substr(0, name.find('/'));
+        if (name == previous)
+        {
+            continue;
+        }
+        previous = name;
+
+        Str entry(name);
+        fn(entry.c_str(), userData);
+    }
+}
+
+
+static auto EmbeddedOpen(CStr path, int flags) -> void*
+{
+    auto representation = FindRepresentation(path);
+    if (representation == nullptr || (flags & MG_FS_WRITE) != 0)
+    {
+        return nullptr;
+    }
+
+    return new EmbeddedFile{ representation, 0 };
+}
+
+
+static auto EmbeddedClose(void* fd) -> void
+{
+    delete (EmbeddedFile*)fd;
+}
+
+
+static auto EmbeddedRead(void* fd, void* buffer, size_t length) -> size_t
+{
+    auto file = (EmbeddedFile*)fd;
+    auto size = file->representation->size;
+    length = std::min<Size>(length, size - file->position);
+    memcpy(buffer, file->representation->data + file->position, length);
+    file->position += length;
+
+    return length;
+}
+
+
+static auto EmbeddedWrite(void*, const void*, size_t) -> size_t
+{
+    return 0;
+}
+
+
+static auto EmbeddedSeek(void* fd, size_t offset) -> size_t
+{
+    auto file = (EmbeddedFile*)fd;
+    file->position = std::min<Size>(offset, file->representation->size);
+
+    return file->position;
+}
+
+
+static auto EmbeddedRename(CStr, CStr) -> bool
+{
+    return false;
+}
+
+
+static auto EmbeddedRemove(CStr) -> bool
+{
+    return false;
+}
+
+
+mg_fs embeddedFs =
+{
+    EmbeddedStat,
+    EmbeddedList,
+    EmbeddedOpen,
+    EmbeddedClose,
+    EmbeddedRead,
+    EmbeddedWrite,
+    EmbeddedSeek,
+    EmbeddedRename,
+    EmbeddedRemove,
+    EmbeddedRemove,
+    EmbeddedTag
+};
@@ -0,0 +1,63 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+
+#include "mongoose/mongoose.h"
+
+
+struct AssetRepresentation
+{
+    // Null when the asset has no such variant.
+    const U8* data;
+    U64 size;
+    CStr etag;
+};
+
+
+// A file packed into the binary by cmake/PackAssets.cmake, with everything
+// a response needs worked out at build time.
+struct EmbeddedAsset
+{
+    // Request path, with the leading slash.
+    CStr path;
+    CStr mimeType;
+    I64 mtime;
+    AssetRepresentation identity;
+    AssetRepresentation brotli;
+    AssetRepresentation gzip;
+};
+
+
+// Binary search over the table, null when the path is not embedded.
+const EmbeddedAsset* FindEmbeddedAsset(StrView path);
+Size GetEmbeddedAssetCount();
+
+// The variant to send for an Accept-Encoding header, contentEncoding is
+// set to the coding or to null for the identity.
+const AssetRepresentation& SelectRepresentation(
+                                                 const EmbeddedAsset& asset,
+                                                 StrView acceptEncoding,
+                                                 CStr* contentEncoding
+                                               );
+
+// Read only mongoose file system over the table, for mg_http_serve_file
+// and mg_http_serve_dir. Paths are request paths.
+extern mg_fs embeddedFs;
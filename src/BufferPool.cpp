@@ -0,0 +1,201 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "BufferPool.hpp"
+
+#include <bit>
+#include <cstdlib>
+
+
+BufferPool::BufferPool() :
+    freeLists{},
+    slabBytes(0),
+    largeBytes(0),
+    cachedBytes(0),
+    usedBytes(0),
+    hitCount(0),
+    missCount(0)
+{
+}
+
+
+BufferPool::~BufferPool()
+{
+    for (auto sizeClass = slabClassShift - minClassShift + 1; sizeClass < classCount; ++sizeClass)
+    {
+        while (freeLists[sizeClass] != nullptr)
+        {
+            auto block = freeLists[sizeClass];
+            freeLists[sizeClass] = block->next;
+            free(block);
+        }
+    }
+
+    for (auto slab : slabs)
+    {
+        free(slab);
+    }
+}
+
+
+auto
+BufferPool::SetOptions(const BufferPoolOptions& newOptions) -> void
+{
+    options = newOptions;
+}
+
+
+auto
+BufferPool::ClassOf(Size size) -> U32
+{
+    auto shift = (U32)std::bit_width(std::max(size, Size(1) << minClassShift) - 1);
+    return shift - minClassShift;
+}
+
+
+auto
+BufferPool::Carve(U32 sizeClass) -> B
+{
+    // Zeroed, like the blocks it is split into have to be.
+    auto slab = (U8*)calloc(1, slabSize);
+    if (slab == nullptr)
+    {
+        return false;
+    }
+    slabs.push_back(slab);
+    slabBytes += slabSize;
+
+    auto blockSize = Size(1) << (sizeClass + minClassShift);
+    for (auto offset = slabSize; offset >= blockSize; offset -= blockSize)
+    {
+        auto block = (FreeBlock*)(slab + offset - blockSize);
+        block->next = freeLists[sizeClass];
+        freeLists[sizeClass] = block;
+    }
+
+    return true;
+}
+
+
+auto
+BufferPool::Acquire(Size size) -> void*
+{
+    auto sizeClass = ClassOf(size);
+    if (sizeClass >= classCount)
+    {
+        missCount++;
+        return calloc(1, size);
+    }
+
+    auto blockSize = Size(1) << (sizeClass + minClassShift);
+    auto block = freeLists[sizeClass];
+    if (block != nullptr)
+    {
+        hitCount++;
+    }
+    else
+    {
+        missCount++;
+        if (sizeClass + minClassShift <= slabClassShift)
+        {
+            if (!Carve(sizeClass))
+            {
+                return nullptr;
+            }
+            block = freeLists[sizeClass];
+        }
+        else
+        {
+            block = (FreeBlock*)calloc(1, blockSize);
+            if (block == nullptr)
+            {
+                return nullptr;
+            }
+            largeBytes += blockSize;
+            cachedBytes += blockSize;
+        }
+    }
+
+    if (sizeClass + minClassShift > slabClassShift)
+    {
+        cachedBytes -= blockSize;
+    }
+    freeLists[sizeClass] = block->next;
+    block->next = nullptr;
+    usedBytes += blockSize;
+
+    return block;
+}
+
+
+auto
+BufferPool::Release(void* block, Size size) -> void
+{
+    auto sizeClass = ClassOf(size);
+    if (sizeClass >= classCount)
+    {
+        free(block);
+        return;
+    }
+
+    auto blockSize = Size(1) << (sizeClass + minClassShift);
+    usedBytes -= blockSize;
+
+    if (sizeClass + minClassShift > slabClassShift)
+    {
+        if (cachedBytes + blockSize > options.maxCachedBytes)
+        {
+            largeBytes -= blockSize;
+            free(block);
+            return;
+        }
+        cachedBytes += blockSize;
+    }
+
+    auto freeBlock = (FreeBlock*)block;
+    freeBlock->next = freeLists[sizeClass];
+    freeLists[sizeClass] = freeBlock;
+}
+
+
+auto
+BufferPool::GetReservedBytes() const -> U64
+{
+    return slabBytes + largeBytes;
+}
+
+
+auto
+BufferPool::GetUsedBytes() const -> U64
+{
+    return usedBytes;
+}
+
+
+auto
+BufferPool::GetHitCount() const -> U64
+{
+    return hitCount;
+}
+
+
+auto
+BufferPool::GetMissCount() const -> U64
+{
+    return missCount;
+}
@@ -0,0 +1,83 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+
+
+struct BufferPoolOptions
+{
+    // Released blocks of the classes above the slab ones are kept for reuse
+    // up to this many bytes, the rest goes back to the system.
+    U64 maxCachedBytes = 16 << 20;
+};
+
+
+// Size classed free lists for connections, TLS contexts and IO buffers.
+// Belongs to one event loop and is not locked. Blocks are handed out zeroed
+// and have to be given back zeroed, with the size they were asked for.
+class BufferPool
+{
+public:
+    // Classes are the powers of two from 64 B to 256 KB, larger blocks are
+    // not pooled.
+    static constexpr U32 minClassShift = 6;
+    static constexpr U32 maxClassShift = 18;
+    static constexpr U32 classCount = maxClassShift - minClassShift + 1;
+    // Classes up to this size are carved out of slabs that are never given
+    // back, so connection state does not fragment the heap.
+    static constexpr U32 slabClassShift = 12;
+    static constexpr Size slabSize = 64 * 1024;
+
+    BufferPool();
+    ~BufferPool();
+
+    void SetOptions(const BufferPoolOptions& newOptions);
+
+    void* Acquire(Size size);
+    void Release(void* block, Size size);
+
+    // Slabs and blocks of the pooled classes, in use or not.
+    U64 GetReservedBytes() const;
+    // Pooled blocks handed out, by class size.
+    U64 GetUsedBytes() const;
+    U64 GetHitCount() const;
+    U64 GetMissCount() const;
+
+private:
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+
+    BufferPoolOptions options;
+    Arr<FreeBlock*, classCount> freeLists;
+    Vec<void*> slabs;
+    U64 slabBytes;
+    // Blocks of the classes above the slab ones, and those of them that
+    // are on the free lists.
+    U64 largeBytes;
+    U64 cachedBytes;
+    U64 usedBytes;
+    U64 hitCount;
+    U64 missCount;
+
+    static U32 ClassOf(Size size);
+    B Carve(U32 sizeClass);
+};
@@ -0,0 +1,381 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "ByteRanges.hpp"
+#include "HeaderCache.hpp"
+#include "Utils.hpp"
+
+
+// Ranges closer than this are sent as one, the bytes between cost less
+// than another part head.
+static constexpr U64 maxRangeGap = 80;
+// Past this many after coalescing the whole representation is cheaper to
+// send and to read for the client.
+static constexpr Size maxRanges = 64;
+
+
+static auto Trim(StrView text) -> StrView
+{
+    while (!text.empty() && (text.front() == ' ' || text.front() == '\t'))
+    {
+        text.remove_prefix(1);
+    }
+    while (!text.empty() && (text.back() == ' ' || text.back() == '\t'))
+    {
+        text.remove_suffix(1);
+    }
+
+    return text;
+}
+
+
+static auto ParseNumber(StrView text, U64* value) -> B
+{
+    if (text.empty())
+    {
+        return false;
+    }
+
+    U64 result = 0;
+    for (auto c : text)
+    {
+        if (c < '0' || c > '9' || result > (~U64(0) - 9) / 10)
+        {
+            return false;
+        }
+        result = result * 10 + U64(c - '0');
+    }
+    *value = result;
+
+    return true;
+}
+
+
+auto
+ParseRanges(StrView header, U64 size, Vec<ByteRange>* ranges) -> RangeResult
+{
+    static constexpr StrView unit = "bytes=";
+
+    ranges->clear();
+    header = Trim(header);
+    if (header.size() < unit.size() || mg_ncasecmp(header.data(), unit.data(), unit.size()) != 0)
+    {
+        return RangeResult::Whole;
+    }
+    header.remove_prefix(unit.size());
+
+    Size specs = 0;
+    while (!header.empty())
+    {
+        auto end = header.find(',');
+        auto spec = Trim(header.substr(0, end));
+        header = (end == StrView::npos)? StrView() : header.substr(end + 1);
+        // Empty list elements are allowed.
+        if (spec.empty())
+        {
+            continue;
+        }
+
+        auto dash = spec.find('-');
+        if (dash == StrView::npos)
+        {
+            return RangeResult::Whole;
+        }
+        auto firstText = spec.substr(0, dash);
+        auto lastText = spec.substr(dash + 1);
+        specs++;
+
+        U64 first;
+        U64 last;
+        if (firstText.empty())
+        {
+            // The final suffix bytes, all of them when there are fewer.
+            U64 suffix;
+            if (!ParseNumber(lastText, &suffix))
+            {
+                return RangeResult::Whole;
+            }
+            if (suffix == 0 || size == 0)
+            {
+                continue;
+            }
+            first = size - std::min(suffix, size);
+            last = size - 1;
+        }
+        else
+        {
+            if (!ParseNumber(firstText, &first))
+            {
+                return RangeResult::Whole;
+            }
+            last = ~U64(0);
+            if (!lastText.empty() && (!ParseNumber(lastText, &last) || last < first))
+            {
+                return RangeResult::Whole;
+            }
+            if (first >= size)
+            {
+                continue;
+            }
+            last = std::min(last, size - 1);
+        }
+
+        ranges->push_back({ first, last });
+    }
+
+    if (specs == 0)
+    {
+        return RangeResult::Whole;
+    }
+    if (ranges->empty())
+    {
+        return RangeResult::Unsatisfiable;
+    }
+
+    // Overlapping ranges could otherwise ask for the file many times over.
+    std::sort(
+               ranges->begin(),
+               ranges->end(),
+               [](const ByteRange& a, const ByteRange& b) { return a.first < b.first; }
+             );
+    Size kept = 0;
+    for (Size i = 1; i < ranges->size(); ++i)
+    {
+        auto& previous = (*ranges)[kept];
+        auto& range = (*ranges)[i];
+        if (range.first <= previous.last + 1 + maxRangeGap)
+        {
+            previous.last = std::max(previous.last, range.last);
+        }
+        else
+        {
+            (*ranges)[++kept] = range;
+        }
+    }
+    ranges->resize(kept + 1);
+
+    if (ranges->size() > maxRanges)
+    {
+        ranges->clear();
+        return RangeResult::Whole;
+    }
+
+    return RangeResult::Partial;
+}
+
+
+auto
+IfRangeMatches(StrView ifRange, StrView etag, time_t modified) -> B
+{
+    ifRange = Trim(ifRange);
+
+    if (ifRange.starts_with("W/"))
+    {
+        return false;
+    }
+    if (ifRange.starts_with('"'))
+    {
+        return ifRange == etag;
+    }
+
+    time_t date;
+    return modified > 0 && ParseHttpDate(ifRange, &date) && date == modified;
+}
+
+
+FileBody::FileBody(mg_fs* fs, void* fd, U64 size, StrView contentType, Vec<ByteRange> ranges) :
+    fs(fs),
+    fd(fd),
+    size(size),
+    contentType(contentType),
+    ranges(std::move(ranges)),
+    length(0),
+    httpHandler(nullptr),
+    next(0),
+    position(0),
+    started(false)
+{
+    if (!IsMultipart())
+    {
+        for (auto& range : this->ranges)
+        {
+            length += range.last - range.first + 1;
+        }
+        return;
+    }
+
+    // Unique enough not to turn up in the parts, a random start and a count.
+    static U64 boundaryCounter = 0;
+    if (boundaryCounter == 0)
+    {
+        RandomBytes((U8*)&boundaryCounter, sizeof(boundaryCounter));
+    }
+    auto number = ++boundaryCounter;
+    boundary = BytesToHex((const U8*)&number, sizeof(number));
+    multipartType = "multipart/byteranges; boundary=" + boundary;
+
+    for (auto& range : this->ranges)
+    {
+        length += RenderPartHead(range).size() + range.last - range.first + 1;
+    }
+    length += boundary.size() + 8;
+}
+
+
+FileBody::~FileBody()
+{
+    fs->cl(fd);
+}
+
+
+auto
+FileBody::IsMultipart() const -> B
+{
+    return ranges.size() > 1;
+}
+
+
+auto
+FileBody::GetMultipartType() const -> const Str&
+{
+    return multipartType;
+}
+
+
+auto
+FileBody::GetLength() const -> U64
+{
+    return length;
+}
+
+
+auto
+FileBody::RenderPartHead(const ByteRange& range) const -> Str
+{
+    return
+        "\r\n--" + boundary +
+        "\r\nContent-Type: " + contentType +
+        "\r\nContent-Range: bytes " + std::to_string(range.first) + "-" + std::to_string(range.last) +
+        "/" + std::to_string(size) + "\r\n\r\n";
+}
+
+
+// Tops up the send buffer, true once everything is in it.
+auto
+FileBody::Fill(mg_connection* c) -> B
+{
+    // Read into the buffer directly, at most its size at a time.
+    if (c->send.size < MG_IO_SIZE)
+    {
+        mg_iobuf_resize(&c->send, MG_IO_SIZE);
+    }
+
+    while (c->send.len < c->send.size)
+    {
+        if (next == ranges.size())
+        {
+            if (IsMultipart())
+            {
+                auto end = "\r\n--" + boundary + "--\r\n";
+                mg_send(c, end.data(), end.size());
+            }
+            return true;
+        }
+
+        auto& range = ranges[next];
+        if (!started)
+        {
+            if (IsMultipart())
+            {
+                auto head = RenderPartHead(range);
+                mg_send(c, head.data(), head.size());
+            }
+            fs->sk(fd, range.first);
+            position = range.first;
+            started = true;
+            continue;
+        }
+
+        auto space = std::min<U64>(c->send.size - c->send.len, range.last + 1 - position);
+        auto n = fs->rd(fd, c->send.buf + c->send.len, space);
+        c->send.len += n;
+        position += n;
+        // Truncated on disk meanwhile, the response can not be completed.
+        if (n == 0)
+        {
+            c->is_draining = 1;
+            return true;
+        }
+
+        if (position > range.last)
+        {
+            next++;
+            started = false;
+        }
+    }
+
+    return false;
+}
+
+
+auto
+FileBody::Send(mg_connection* c, FileBody* body) -> void
+{
+    if (body->Fill(c))
+    {
+        c->is_resp = 0;
+        delete body;
+        return;
+    }
+
+    body->httpHandler = c->pfn;
+    c->pfn = FileBody::OnEvent;
+    c->pfn_data = body;
+}
+
+
+auto
+FileBody::OnEvent(mg_connection* c, I ev, void*, void* bodyPtr) -> void
+{
+    auto body = (FileBody*)bodyPtr;
+
+    if (ev == MG_EV_CLOSE)
+    {
+        c->pfn = body->httpHandler;
+        c->pfn_data = nullptr;
+        delete body;
+        return;
+    }
+    if ((ev != MG_EV_WRITE && ev != MG_EV_POLL) || !body->Fill(c))
+    {
+        return;
+    }
+
+    c->pfn = body->httpHandler;
+    c->pfn_data = nullptr;
+    c->is_resp = 0;
+    delete body;
+
+    // A pipelined request sitting in the receive buffer gets no read event
+    // of its own.
+    if (c->recv.len > 0 && !c->is_draining && !c->is_closing)
+    {
+        long n = 0;
+        mg_call(c, MG_EV_READ, &n);
+    }
+}
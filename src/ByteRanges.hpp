@@ -0,0 +1,100 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+
+#include "mongoose/mongoose.h"
+
+#include <ctime>
+
+
+// Inclusive, as Content-Range writes them.
+struct ByteRange
+{
+    U64 first;
+    U64 last;
+};
+
+
+enum class RangeResult : U8
+{
+    // No usable Range, the whole representation is sent.
+    Whole,
+    Partial,
+    // 416, none of the ranges overlaps the representation.
+    Unsatisfiable
+};
+
+
+// The Range header of a GET (RFC 7233) for a representation of size bytes.
+// Suffix and open ended ranges are resolved, the ranges sorted and
+// coalesced where they overlap or are closer than a multipart part head.
+// A header that does not parse, or is still too many pieces after that,
+// is ignored, as the RFC allows.
+RangeResult ParseRanges(StrView header, U64 size, Vec<ByteRange>* ranges);
+
+// Whether If-Range names the representation: a strong tag equal to etag or
+// the date it was modified at. Weak tags never do.
+B IfRangeMatches(StrView ifRange, StrView etag, time_t modified);
+
+
+// Body read from a mongoose file system as the send buffer drains, like
+// mg_http_serve_file does, but for any set of ranges. A single range is
+// sent as it is, several as multipart/byteranges, with the part heads
+// rendered on the way. Nothing of the file is held besides the handle,
+// so a mapped file is copied straight from its mapping to the socket's
+// buffer, and only the ranges asked for are touched.
+class FileBody
+{
+public:
+    // Takes over fd, it is closed once the body is sent or the connection
+    // closes.
+    FileBody(mg_fs* fs, void* fd, U64 size, StrView contentType, Vec<ByteRange> ranges);
+    ~FileBody();
+
+    B IsMultipart() const;
+    // multipart/byteranges with the boundary, for the response head.
+    const Str& GetMultipartType() const;
+    U64 GetLength() const;
+
+    // After the response head, hands the connection's writes to the body
+    // until it is sent, then back to its HTTP handler.
+    static void Send(mg_connection* c, FileBody* body);
+
+private:
+    mg_fs* fs;
+    void* fd;
+    U64 size;
+    Str contentType;
+    Vec<ByteRange> ranges;
+    Str boundary;
+    Str multipartType;
+    U64 length;
+
+    mg_event_handler_t httpHandler;
+    Size next;
+    U64 position;
+    B started;
+
+    Str RenderPartHead(const ByteRange& range) const;
+    B Fill(mg_connection* c);
+
+    static void OnEvent(mg_connection* c, I ev, void* evData, void* body);
+};
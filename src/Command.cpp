@@ -0,0 +1,589 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "Command.hpp"
+#include "Utils.hpp"
+
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+
+// What a vforked child needs before exec. It shares the server's memory
+// until then, so it only makes system calls and reports a failure in error.
+struct ChildSetup
+{
+    C* const* argv;
+    I32 stdIn;
+    I32 stdOut;
+    I32 stdErr;
+    I32 uid;
+    I32 gid;
+    volatile I32 error;
+};
+
+
+[[noreturn]] static auto RunChild(ChildSetup* setup) -> void
+{
+    // The server ignores SIGPIPE, which the command would inherit. Its own
+    // process group lets a timeout kill whatever the command started.
+    struct sigaction defaultAction = {};
+    defaultAction.sa_handler = SIG_DFL;
+    sigaction(SIGPIPE, &defaultAction, nullptr);
+    setpgid(0, 0);
+
+    auto ok = true;
+    if (setup->stdIn != -1)
+    {
+        ok = dup2(setup->stdIn, STDIN_FILENO) != -1;
+    }
+    else
+    {
+        auto devNull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        ok = devNull != -1 && dup2(devNull, STDIN_FILENO) != -1;
+    }
+    ok = ok && dup2(setup->stdOut, STDOUT_FILENO) != -1 && dup2(setup->stdErr, STDERR_FILENO) != -1;
+#ifdef SYS_close_range
+    // Descriptors opened without close-on-exec, e.g. files being served.
+    if (ok)
+    {
+        syscall(SYS_close_range, STDERR_FILENO + 1, ~0U, 0);
+    }
+#endif
+
+    // Raw system calls: the libc wrappers apply the change to every thread
+    // they know of, which in a vfork child are the server's threads.
+    if (ok && setup->gid >= 0)
+    {
+        ok = syscall(SYS_setgroups, 0, nullptr) == 0 && syscall(SYS_setresgid, setup->gid, setup->gid, setup->gid) == 0;
+    }
+    if (ok && setup->uid >= 0)
+    {
+        ok = syscall(SYS_setresuid, setup->uid, setup->uid, setup->uid) == 0;
+    }
+
+    if (ok)
+    {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, nullptr);
+        execvp(setup->argv[0], setup->argv);
+    }
+
+    setup->error = errno;
+    _exit(127);
+}
+
+
+// The child's pid, or -1 with the reason in setup->error.
+static auto StartChild(ChildSetup* setup) -> I32
+{
+    // Commands of a server running as root would run as root.
+    if (geteuid() == 0 && (setup->uid < 0 || setup->gid < 0))
+    {
+        setup->error = EPERM;
+        return -1;
+    }
+
+    // Blocked so no handler runs in the child on the shared memory, the
+    // child clears the mask before exec.
+    sigset_t all;
+    sigset_t previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+
+    auto pid = vfork();
+    if (pid == 0)
+    {
+        RunChild(setup);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+
+    if (pid == -1)
+    {
+        setup->error = errno;
+    }
+    else if (setup->error != 0)
+    {
+        waitpid(pid, nullptr, 0);
+        pid = -1;
+    }
+
+    return pid;
+}
+
+
+CommandRunner::CommandRunner() :
+    mgr(nullptr),
+    placement(nullptr),
+    failedCount(0)
+{
+}
+
+
+auto
+CommandRunner::SetOptions(const CommandOptions& newOptions) -> void
+{
+    options = newOptions;
+}
+
+
+auto
+CommandRunner::Start(mg_mgr* manager, const CpuPlacement* cpuPlacement) -> void
+{
+    mgr = manager;
+    placement = cpuPlacement;
+}
+
+
+auto
+CommandRunner::Stop() -> void
+{
+    for (auto command : running)
+    {
+        for (auto c : { command->stdIn, command->stdOut, command->stdErr })
+        {
+            if (c != nullptr)
+            {
+                c->fn_data = nullptr;
+                c->is_closing = 1;
+            }
+        }
+        kill(-command->pid, SIGKILL);
+        waitpid(command->pid, nullptr, 0);
+        delete command;
+    }
+    running.clear();
+
+    for (auto command : queued)
+    {
+        delete command;
+    }
+    queued.clear();
+}
+
+
+auto
+CommandRunner::Run(const Vec<Str>& args, StrView input, CommandCallback callback) -> Command*
+{
+    auto command = new Command{
+                                this,
+                                args,
+                                Str(input),
+                                std::move(callback),
+                                CommandResult(),
+                                -1,
+                                nullptr,
+                                nullptr,
+                                nullptr,
+                                0,
+                                false
+                              };
+
+    if (running.size() < options.maxRunning)
+    {
+        if (Spawn(command))
+        {
+            return command;
+        }
+        command->result.status = CommandStatus::SpawnFailed;
+    }
+    else if (queued.size() < options.maxQueued)
+    {
+        queued.push_back(command);
+        return command;
+    }
+    else
+    {
+        command->result.status = CommandStatus::Rejected;
+    }
+
+    failedCount++;
+    command->callback(command->result);
+    delete command;
+
+    return nullptr;
+}
+
+
+auto
+CommandRunner::Forget(Command* command) -> void
+{
+    auto position = std::find(queued.begin(), queued.end(), command);
+    if (position != queued.end())
+    {
+        queued.erase(position);
+        delete command;
+        return;
+    }
+
+    command->callback = nullptr;
+}
+
+
+auto
+CommandRunner::Spawn(Command* command) -> B
+{
+    if (command->args.empty())
+    {
+        command->result.code = EINVAL;
+        return false;
+    }
+
+    // [0] stays with the server, [1] becomes the child's descriptor. Both
+    // are close-on-exec, dup2 clears it on the child's copy.
+    I32 inPair[2] = { -1, -1 };
+    I32 outPair[2] = { -1, -1 };
+    I32 errPair[2] = { -1, -1 };
+    auto hasInput = !command->input.empty();
+    auto type = SOCK_STREAM | SOCK_CLOEXEC;
+
+    auto ok =
+        (!hasInput || socketpair(AF_UNIX, type, 0, inPair) == 0) &&
+        socketpair(AF_UNIX, type, 0, outPair) == 0 &&
+        socketpair(AF_UNIX, type, 0, errPair) == 0;
+    auto err = ok? 0 : errno;
+
+    Vec<C*> argv;
+    for (auto& arg : command->args)
+    {
+        argv.push_back(arg.data());
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid = -1;
+    if (ok)
+    {
+        ChildSetup setup = {
+                             argv.data(),
+                             hasInput? inPair[1] : -1,
+                             outPair[1],
+                             errPair[1],
+                             options.uid,
+                             options.gid,
+                             0
+                           };
+        pid = StartChild(&setup);
+        ok = pid != -1;
+        err = setup.error;
+    }
+
+    for (auto fd : { inPair[1], outPair[1], errPair[1] })
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+    }
+
+    if (!ok)
+    {
+        for (auto fd : { inPair[0], outPair[0], errPair[0] })
+        {
+            if (fd != -1)
+            {
+                close(fd);
+            }
+        }
+        command->result.code = err;
+        return false;
+    }
+
+    if (placement != nullptr)
+    {
+        placement->PlaceProcess(pid);
+    }
+
+    command->pid = pid;
+    command->deadlineMs = (options.timeoutMs != 0)? mg_millis() + options.timeoutMs : 0;
+    running.push_back(command);
+
+    command->stdOut = Wrap(outPair[0], command);
+    command->stdErr = Wrap(errPair[0], command);
+    if (hasInput)
+    {
+        command->stdIn = Wrap(inPair[0], command);
+        if (command->stdIn != nullptr)
+        {
+            // Closed once the input is out, the child then reads EOF.
+            mg_send(command->stdIn, command->input.data(), command->input.size());
+            command->stdIn->is_draining = 1;
+        }
+        command->input = Str();
+    }
+
+    if (command->stdOut == nullptr || command->stdErr == nullptr)
+    {
+        Kill(command, CommandStatus::SpawnFailed);
+    }
+
+    return true;
+}
+
+
+auto
+CommandRunner::Wrap(I32 fd, Command* command) -> mg_connection*
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    auto c = mg_wrapfd(mgr, fd, CommandRunner::OnStreamEvent, command);
+    if (c == nullptr)
+    {
+        close(fd);
+    }
+
+    return c;
+}
+
+
+auto
+CommandRunner::Kill(Command* command, CommandStatus status) -> void
+{
+    if (command->killed)
+    {
+        return;
+    }
+
+    command->killed = true;
+    command->result.status = status;
+    failedCount++;
+    kill(-command->pid, SIGKILL);
+
+    // Descendants outside the group may still hold the other ends.
+    for (auto c : { command->stdIn, command->stdOut, command->stdErr })
+    {
+        if (c != nullptr)
+        {
+            c->is_closing = 1;
+        }
+    }
+}
+
+
+auto
+CommandRunner::TryFinish(Command* command) -> void
+{
+    if (command->stdOut != nullptr || command->stdErr != nullptr)
+    {
+        return;
+    }
+
+    // The output can end before the child is reaped, Update tries again.
+    I32 status = 0;
+    auto reaped = waitpid(command->pid, &status, WNOHANG);
+    if (reaped == 0 || (reaped == -1 && errno != ECHILD))
+    {
+        return;
+    }
+
+    if (command->stdIn != nullptr)
+    {
+        command->stdIn->fn_data = nullptr;
+        command->stdIn->is_closing = 1;
+        command->stdIn = nullptr;
+    }
+
+    if (reaped == -1)
+    {
+        // Reaped elsewhere, e.g. with SIGCHLD ignored.
+        command->result.code = -1;
+    }
+    else if (WIFSIGNALED(status))
+    {
+        command->result.code = WTERMSIG(status);
+        if (!command->killed)
+        {
+            command->result.status = CommandStatus::Signaled;
+        }
+    }
+    else
+    {
+        command->result.code = WEXITSTATUS(status);
+    }
+
+    Finish(command);
+}
+
+
+auto
+CommandRunner::Finish(Command* command) -> void
+{
+    running.erase(std::find(running.begin(), running.end(), command));
+
+    while (running.size() < options.maxRunning && !queued.empty())
+    {
+        auto next = queued.front();
+        queued.pop_front();
+        if (!Spawn(next))
+        {
+            next->result.status = CommandStatus::SpawnFailed;
+            failedCount++;
+            next->callback(next->result);
+            delete next;
+        }
+    }
+
+    if (command->callback)
+    {
+        command->callback(command->result);
+    }
+    delete command;
+}
+
+
+auto
+CommandRunner::Update(U64 nowMs) -> void
+{
+    if (running.empty())
+    {
+        return;
+    }
+
+    // Copied, finishing a command changes the list.
+    auto current = running;
+    for (auto command : current)
+    {
+        if (!command->killed && command->deadlineMs != 0 && nowMs >= command->deadlineMs)
+        {
+            Kill(command, CommandStatus::TimedOut);
+        }
+        TryFinish(command);
+    }
+}
+
+
+auto
+CommandRunner::OnStreamEvent(mg_connection* c, I ev, void*, void* commandPtr) -> void
+{
+    auto command = (Command*)commandPtr;
+    if (command == nullptr)
+    {
+        return;
+    }
+
+    auto runner = command->runner;
+
+    if (ev == MG_EV_READ)
+    {
+        if (c != command->stdIn && !command->killed)
+        {
+            auto& output =
+                (c == command->stdOut)? command->result.output : command->result.errorOutput;
+            if (output.size() + c->recv.len > runner->options.maxOutputSize)
+            {
+                runner->Kill(command, CommandStatus::OutputTooLarge);
+            }
+            else
+            {
+                output.append((CStr)c->recv.buf, c->recv.len);
+            }
+        }
+        c->recv.len = 0;
+    }
+    else if (ev == MG_EV_CLOSE)
+    {
+        if (c == command->stdIn)
+        {
+            command->stdIn = nullptr;
+        }
+        else if (c == command->stdOut)
+        {
+            command->stdOut = nullptr;
+        }
+        else if (c == command->stdErr)
+        {
+            command->stdErr = nullptr;
+        }
+        runner->TryFinish(command);
+    }
+}
+
+
+auto
+CommandRunner::GetRunningCount() const -> U32
+{
+    return (U32)running.size();
+}
+
+
+auto
+CommandRunner::GetQueuedCount() const -> U32
+{
+    return (U32)queued.size();
+}
+
+
+auto
+CommandRunner::GetFailedCount() const -> U64
+{
+    return failedCount;
+}
+
+
+auto
+ExecCommandSync(const Vec<Str>& args, StrView stdinContents, I32 uid, I32 gid) -> Err
+{
+    if (args.empty())
+    {
+        return Err::Fail;
+    }
+
+    I32 inPair[2] = { -1, -1 };
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, inPair) != 0)
+    {
+        return Err::Fail;
+    }
+
+    Vec<C*> argv;
+    for (auto& arg : args)
+    {
+        argv.push_back((C*)arg.c_str());
+    }
+    argv.push_back(nullptr);
+
+    // The output goes where the server's does.
+    ChildSetup setup = { argv.data(), inPair[1], STDOUT_FILENO, STDERR_FILENO, uid, gid, 0 };
+    auto pid = StartChild(&setup);
+    close(inPair[1]);
+
+    auto ok = pid != -1;
+    for (Size sent = 0; ok && sent < stdinContents.size();)
+    {
+        auto n = send(inPair[0], stdinContents.data() + sent, stdinContents.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        ok = n > 0;
+        sent += (ok)? (Size)n : 0;
+    }
+    close(inPair[0]);
+
+    I32 status = 0;
+    while (pid != -1 && waitpid(pid, &status, 0) == -1 && errno == EINTR)
+    {
+    }
+
+    return (ok && WIFEXITED(status) && WEXITSTATUS(status) == 0)? Err::Ok : Err::Fail;
+}
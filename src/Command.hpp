@@ -0,0 +1,133 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+#include "CpuPlacement.hpp"
+
+#include "mongoose/mongoose.h"
+
+
+struct CommandOptions
+{
+    // Commands running at once, the rest wait in order.
+    U32 maxRunning = 8;
+    U32 maxQueued = 256;
+    // The command's process group is killed past it, zero waits forever.
+    U32 timeoutMs = 30000;
+    // Per output stream, the command is killed when it writes more.
+    U32 maxOutputSize = 1024 * 1024;
+    // Identity the children run as, -1 keeps the server's. A server running
+    // as root refuses to start commands until both are set.
+    I32 uid = -1;
+    I32 gid = -1;
+};
+
+
+enum class CommandStatus : U8
+{
+    Exited,
+    Signaled,
+    TimedOut,
+    OutputTooLarge,
+    SpawnFailed,
+    // The queue was full.
+    Rejected
+};
+
+
+struct CommandResult
+{
+    CommandStatus status;
+    // Exit code, or the signal for Signaled.
+    I32 code;
+    Str output;
+    Str errorOutput;
+};
+
+
+using CommandCallback = Func<void(const CommandResult&)>;
+
+
+class CommandRunner;
+
+
+struct Command
+{
+    CommandRunner* runner;
+    Vec<Str> args;
+    Str input;
+    CommandCallback callback;
+    CommandResult result;
+    I32 pid;
+    mg_connection* stdIn;
+    mg_connection* stdOut;
+    mg_connection* stdErr;
+    U64 deadlineMs;
+    B killed;
+};
+
+
+// Runs external commands without blocking the event loop. Children are
+// started with vfork, which does not copy the server's address space, drop
+// to the configured uid and gid before exec, and talk to the server over
+// socket pairs polled by the same mongoose manager as the connections.
+// Runs on the reactor thread.
+class CommandRunner
+{
+public:
+    CommandRunner();
+
+    void SetOptions(const CommandOptions& newOptions);
+    // Started commands are moved off the reactor's CPU by placement.
+    void Start(mg_mgr* mgr, const CpuPlacement* placement);
+    // Kills what is still running, without calling back.
+    void Stop();
+
+    // The callback gets the result once the command exited and its output
+    // is read. It is called before returning, and null is returned, when
+    // the command could not be queued or started.
+    Command* Run(const Vec<Str>& args, StrView input, CommandCallback callback);
+    // A queued command is dropped, a running one finishes without calling
+    // back.
+    void Forget(Command* command);
+
+    // Called once per event loop iteration, reaps and times out children.
+    void Update(U64 nowMs);
+
+    U32 GetRunningCount() const;
+    U32 GetQueuedCount() const;
+    U64 GetFailedCount() const;
+
+private:
+    CommandOptions options;
+    mg_mgr* mgr;
+    const CpuPlacement* placement;
+    Vec<Command*> running;
+    Deque<Command*> queued;
+    U64 failedCount;
+
+    B Spawn(Command* command);
+    mg_connection* Wrap(I32 fd, Command* command);
+    void Kill(Command* command, CommandStatus status);
+    void TryFinish(Command* command);
+    void Finish(Command* command);
+
+    static void OnStreamEvent(mg_connection* c, I ev, void* evData, void* command);
+};
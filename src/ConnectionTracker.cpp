@@ -0,0 +1,451 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "ConnectionTracker.hpp"
+
+
+ConnectionTracker::ConnectionTracker() :
+    freeList(nullptr),
+    bodyLimitResolver(nullptr),
+    activeCount(0),
+    phaseCounts{},
+    acceptPaused(false),
+    rejectedCount(0),
+    timedOutCount(0),
+    oversizedCount(0)
+{
+    SetLimits(ConnectionLimits());
+}
+
+
+auto
+ConnectionTracker::SetLimits(const ConnectionLimits& newLimits) -> void
+{
+    // The pool is referenced by live connections, it can only be rebuilt
+    // before the server starts accepting.
+    if (activeCount != 0)
+    {
+        return;
+    }
+
+    limits = newLimits;
+    records.assign(limits.maxConnections, ConnectionRecord());
+    freeList = nullptr;
+
+    for (auto& record : records)
+    {
+        record.nextFree = freeList;
+        freeList = &record;
+    }
+}
+
+
+auto
+ConnectionTracker::GetLimits() const -> const ConnectionLimits&
+{
+    return limits;
+}
+
+
+auto
+ConnectionTracker::AddListener(mg_connection* listener) -> void
+{
+    if (listener != nullptr)
+    {
+        listeners.push_back(listener);
+    }
+}
+
+
+auto
+ConnectionTracker::GetListeners() const -> const Vec<mg_connection*>&
+{
+    return listeners;
+}
+
+
+auto
+ConnectionTracker::SetBodyLimitResolver(BodyLimitResolver resolver) -> void
+{
+    bodyLimitResolver = resolver;
+}
+
+
+auto
+ConnectionTracker::Admit(mg_connection* c, U64 nowMs) -> ConnectionRecord*
+{
+    if (freeList == nullptr)
+    {
+        rejectedCount++;
+        return nullptr;
+    }
+
+    auto record = freeList;
+    freeList = record->nextFree;
+
+    record->c = c;
+    record->nextFree = nullptr;
+    record->requestsServed = 0;
+    record->headerLength = 0;
+    record->headerScanned = 0;
+    record->maxBodySize = limits.maxRequestBodySize;
+    record->closeAfterResponse = false;
+    record->tlsCredentials = nullptr;
+    record->webSocket = nullptr;
+    record->eventStream = nullptr;
+    record->bodyStream = nullptr;
+    record->proxyExchange = nullptr;
+    record->command = nullptr;
+    record->http2 = nullptr;
+    record->bytesWritten = 0;
+    record->access.startNs = 0;
+    record->phase = ConnectionPhase::ReadingHeaders;
+    phaseCounts[(U32)record->phase]++;
+    SetPhase(record, ConnectionPhase::ReadingHeaders, nowMs);
+
+    activeCount++;
+    if (activeCount == limits.maxConnections &&
+        limits.admissionPolicy == AdmissionPolicy::Queue)
+    {
+        PauseAccept(true);
+    }
+
+    return record;
+}
+
+
+auto
+ConnectionTracker::Release(ConnectionRecord* record) -> void
+{
+    wheel.Cancel(record);
+    phaseCounts[(U32)record->phase]--;
+    record->c = nullptr;
+    record->nextFree = freeList;
+    freeList = record;
+
+    activeCount--;
+    if (acceptPaused)
+    {
+        PauseAccept(false);
+    }
+}
+
+
+auto
+ConnectionTracker::SetPhase(
+                             ConnectionRecord* record,
+                             ConnectionPhase phase,
+                             U64 nowMs
+                           ) -> void
+{
+    phaseCounts[(U32)record->phase]--;
+    phaseCounts[(U32)phase]++;
+    record->phase = phase;
+    auto timeout = (phase == ConnectionPhase::ReadingHeaders)?
+        limits.headerTimeoutMs : limits.idleTimeoutMs;
+    wheel.Schedule(record, nowMs + timeout);
+}
+
+
+auto
+ConnectionTracker::RejectBody(ConnectionRecord* record) -> void
+{
+    auto c = record->c;
+    oversizedCount++;
+
+    mg_http_reply(c, 413, "Connection: close\r\n", "Request body too large\n");
+    c->recv.len = 0;
+    c->is_draining = 1;
+    record->closeAfterResponse = true;
+    phaseCounts[(U32)record->phase]--;
+    phaseCounts[(U32)ConnectionPhase::Responding]++;
+    record->phase = ConnectionPhase::Responding;
+}
+
+
+auto
+ConnectionTracker::OnRead(ConnectionRecord* record, U64 nowMs) -> void
+{
+    auto c = record->c;
+
+    if (record->closeAfterResponse && c->is_draining)
+    {
+        c->recv.len = 0;
+        return;
+    }
+
+    if (record->phase == ConnectionPhase::Idle)
+    {
+        SetPhase(record, ConnectionPhase::ReadingHeaders, nowMs);
+    }
+
+    if (record->phase == ConnectionPhase::ReadingHeaders)
+    {
+        mg_http_message hm;
+        auto headerLength = ParseRequest(record, &hm);
+        if (headerLength <= 0)
+        {
+            // Incomplete or malformed, the latter is handled by http_cb.
+            return;
+        }
+
+        record->maxBodySize =
+            bodyLimitResolver? bodyLimitResolver(&hm) : limits.maxRequestBodySize;
+
+        auto contentLength = FindHeader(&hm, KnownHeader::ContentLength);
+        if (
+             contentLength != nullptr &&
+             mg_to64(*contentLength) > (I64)record->maxBodySize
+           )
+        {
+            RejectBody(record);
+            return;
+        }
+
+        // Clients sending large bodies wait for this before they start.
+        auto expect = FindHeader(&hm, KnownHeader::Expect);
+        if (expect != nullptr && mg_vcasecmp(expect, "100-continue") == 0)
+        {
+            mg_printf(c, "HTTP/1.1 100 Continue\r\n\r\n");
+        }
+
+        record->headerLength = headerLength;
+        SetPhase(record, ConnectionPhase::ReadingBody, nowMs);
+    }
+    else if (record->phase == ConnectionPhase::ReadingBody)
+    {
+        SetPhase(record, ConnectionPhase::ReadingBody, nowMs);
+    }
+
+    // Catches chunked and length-less bodies as they grow.
+    if (
+         record->phase == ConnectionPhase::ReadingBody &&
+         c->recv.len > record->headerLength + record->maxBodySize
+       )
+    {
+        RejectBody(record);
+    }
+}
+
+
+auto
+ConnectionTracker::ParseRequest(ConnectionRecord* record, mg_http_message* hm) -> I32
+{
+    return parser.Parse(record->c, &record->headerScanned, hm);
+}
+
+
+auto
+ConnectionTracker::ForgetParse() -> void
+{
+    parser.Forget();
+}
+
+
+auto
+ConnectionTracker::OnRequest(ConnectionRecord* record, U64 nowMs) -> void
+{
+    record->requestsServed++;
+    if (record->requestsServed >= limits.maxRequestsPerConnection)
+    {
+        record->closeAfterResponse = true;
+    }
+    SetPhase(record, ConnectionPhase::Responding, nowMs);
+}
+
+
+auto
+ConnectionTracker::OnWrite(ConnectionRecord* record, U64 nowMs) -> void
+{
+    if (record->phase == ConnectionPhase::Responding)
+    {
+        SetPhase(record, ConnectionPhase::Responding, nowMs);
+    }
+}
+
+
+auto
+ConnectionTracker::OnPoll(ConnectionRecord* record, U64 nowMs) -> void
+{
+    auto c = record->c;
+
+    if (record->phase == ConnectionPhase::Idle)
+    {
+        TrimBuffers(c);
+        return;
+    }
+
+    if (record->phase != ConnectionPhase::Responding || c->is_resp)
+    {
+        return;
+    }
+
+    if (record->closeAfterResponse)
+    {
+        c->is_draining = 1;
+        return;
+    }
+
+    auto next = (c->recv.len > 0)?
+        ConnectionPhase::ReadingHeaders : ConnectionPhase::Idle;
+    SetPhase(record, next, nowMs);
+}
+
+
+auto
+ConnectionTracker::TrimBuffers(mg_connection* c) -> void
+{
+    // The send buffer may still be draining after the phase changed.
+    if (c->recv.len == 0 && c->recv.size > limits.idleBufferSize)
+    {
+        mg_iobuf_free(&c->recv);
+    }
+    if (c->send.len == 0 && c->send.size > limits.idleBufferSize)
+    {
+        mg_iobuf_free(&c->send);
+    }
+}
+
+
+auto
+ConnectionTracker::OnUpgrade(ConnectionRecord* record) -> void
+{
+    wheel.Cancel(record);
+    phaseCounts[(U32)record->phase]--;
+    phaseCounts[(U32)ConnectionPhase::Upgraded]++;
+    record->phase = ConnectionPhase::Upgraded;
+}
+
+
+auto
+ConnectionTracker::ExpireIdle(U64 nowMs) -> void
+{
+    wheel.Advance(nowMs, ConnectionTracker::OnExpired, this);
+}
+
+
+auto
+ConnectionTracker::Drain() -> void
+{
+    // Closes only this process's copies of the sockets.
+    for (auto listener : listeners)
+    {
+        listener->is_closing = 1;
+    }
+    listeners.clear();
+    acceptPaused = false;
+
+    for (auto& record : records)
+    {
+        auto c = record.c;
+        if (c == nullptr)
+        {
+            continue;
+        }
+
+        // A fresh connection is left to deliver its first request, the
+        // client would not retry it.
+        // HTTP/2 connections send GOAWAY and finish their streams first.
+        record.closeAfterResponse = true;
+        if (
+             record.phase == ConnectionPhase::Idle ||
+             (record.phase == ConnectionPhase::Upgraded && record.http2 == nullptr)
+           )
+        {
+            c->is_draining = 1;
+        }
+    }
+}
+
+
+auto
+ConnectionTracker::OnExpired(TimerWheelNode* node, void* tracker) -> void
+{
+    auto record = static_cast<ConnectionRecord*>(node);
+    static_cast<ConnectionTracker*>(tracker)->timedOutCount++;
+    // The record goes back to the pool on MG_EV_CLOSE.
+    record->c->is_closing = 1;
+}
+
+
+auto
+ConnectionTracker::PauseAccept(B pause) -> void
+{
+    acceptPaused = pause;
+
+    for (auto listener : listeners)
+    {
+        listener->is_full = pause;
+#if MG_ENABLE_EPOLL
+        // Level triggered epoll would keep waking up on a listener that we
+        // refuse to accept from, so drop it from the interest set instead.
+        epoll_event ev = {};
+        ev.events = EPOLLERR | EPOLLHUP | (pause ? 0u : (U32)EPOLLIN);
+        ev.data.ptr = listener;
+        epoll_ctl(
+                   listener->mgr->epoll_fd,
+                   EPOLL_CTL_MOD,
+                   (I)(Size)listener->fd,
+                   &ev
+                 );
+#endif
+    }
+}
+
+
+auto
+ConnectionTracker::GetActiveCount() const -> U32
+{
+    return activeCount;
+}
+
+
+auto
+ConnectionTracker::GetPhaseCount(ConnectionPhase phase) const -> U32
+{
+    return phaseCounts[(U32)phase];
+}
+
+
+auto
+ConnectionTracker::GetInFlightCount() const -> U32
+{
+    return phaseCounts[(U32)ConnectionPhase::ReadingBody] +
+           phaseCounts[(U32)ConnectionPhase::Responding];
+}
+
+
+auto
+ConnectionTracker::GetRejectedCount() const -> U64
+{
+    return rejectedCount;
+}
+
+
+auto
+ConnectionTracker::GetTimedOutCount() const -> U64
+{
+    return timedOutCount;
+}
+
+
+auto
+ConnectionTracker::GetOversizedCount() const -> U64
+{
+    return oversizedCount;
+}
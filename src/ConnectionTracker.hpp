@@ -0,0 +1,178 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+#include "TimerWheel.hpp"
+#include "HttpParser.hpp"
+#include "AccessLog.hpp"
+
+#include "mongoose/mongoose.h"
+
+
+enum class AdmissionPolicy : U8
+{
+    // Stop accepting and leave new connections in the kernel backlog.
+    Queue,
+    // Accept and immediately answer with 503.
+    Reject
+};
+
+
+struct ConnectionLimits
+{
+    U32 maxConnections = 4096;
+    AdmissionPolicy admissionPolicy = AdmissionPolicy::Queue;
+    // Time allowed from the first byte of a request until its header
+    // block is complete. Not refreshed by partial reads.
+    U32 headerTimeoutMs = 10000;
+    // Time without progress while reading a body, sending a response or
+    // waiting for the next request on a keep-alive connection.
+    U32 idleTimeoutMs = 60000;
+    U32 maxRequestsPerConnection = 1000;
+    U64 maxRequestBodySize = MG_MAX_RECV_SIZE;
+    // Empty receive and send buffers of an idle keep-alive connection
+    // larger than this are given back, smaller ones are kept for the next
+    // request.
+    U32 idleBufferSize = 16 * 1024;
+};
+
+
+enum class ConnectionPhase : U8
+{
+    ReadingHeaders,
+    ReadingBody,
+    Responding,
+    Idle,
+    // Switched to another protocol or streaming an open ended response, no
+    // longer timed out by the tracker.
+    Upgraded
+};
+
+
+struct TLSCredentials;
+class WebSocketConnection;
+struct EventStream;
+struct BodyStream;
+struct ProxyExchange;
+struct Command;
+class Http2Session;
+
+
+struct ConnectionRecord : TimerWheelNode
+{
+    mg_connection* c;
+    ConnectionRecord* nextFree;
+    U32 requestsServed;
+    U32 headerLength;
+    // Bytes of an incomplete header block already searched for its end.
+    U32 headerScanned;
+    U64 maxBodySize;
+    ConnectionPhase phase;
+    B closeAfterResponse;
+    // Credentials the TLS session was set up with, null for plain HTTP.
+    TLSCredentials* tlsCredentials;
+    WebSocketConnection* webSocket;
+    EventStream* eventStream;
+    // Request body being handed to a streaming handler.
+    BodyStream* bodyStream;
+    // Request forwarded to an upstream whose response is not complete.
+    ProxyExchange* proxyExchange;
+    // Command whose result the response waits for.
+    Command* command;
+    // Set once ALPN picked h2, each stream then has a record of its own.
+    Http2Session* http2;
+    // Bytes sent to the client so far.
+    U64 bytesWritten;
+    PendingAccess access;
+};
+
+
+// Body size limit for a request, given its parsed header block.
+using BodyLimitResolver = U64(*)(mg_http_message* hm);
+
+
+// Fixed pool of per-connection bookkeeping, referenced by the accepted
+// connection's fn_data. Sized once from the limits, so memory does not grow
+// with load.
+class ConnectionTracker
+{
+public:
+    ConnectionTracker();
+
+    void SetLimits(const ConnectionLimits& newLimits);
+    const ConnectionLimits& GetLimits() const;
+
+    void AddListener(mg_connection* listener);
+    const Vec<mg_connection*>& GetListeners() const;
+    // Overrides maxRequestBodySize per request, e.g. per route.
+    void SetBodyLimitResolver(BodyLimitResolver resolver);
+
+    ConnectionRecord* Admit(mg_connection* c, U64 nowMs);
+    void Release(ConnectionRecord* record);
+
+    void OnRead(ConnectionRecord* record, U64 nowMs);
+    // Parses the request at the start of the receive buffer, reusing a
+    // parse of the same buffer made earlier on the same event.
+    I32 ParseRequest(ConnectionRecord* record, mg_http_message* hm);
+    // Called on each event, before anything may change the receive buffer.
+    void ForgetParse();
+    void OnRequest(ConnectionRecord* record, U64 nowMs);
+    void OnWrite(ConnectionRecord* record, U64 nowMs);
+    void OnPoll(ConnectionRecord* record, U64 nowMs);
+    void OnUpgrade(ConnectionRecord* record);
+    // Answers 413 and closes once the response is out.
+    void RejectBody(ConnectionRecord* record);
+
+    // Called once per event loop iteration.
+    void ExpireIdle(U64 nowMs);
+    // Stops accepting, closes idle keep-alive and upgraded connections and
+    // the rest once their response is out.
+    void Drain();
+
+    U32 GetActiveCount() const;
+    U32 GetPhaseCount(ConnectionPhase phase) const;
+    // Requests admitted whose response is not complete yet.
+    U32 GetInFlightCount() const;
+    U64 GetRejectedCount() const;
+    U64 GetTimedOutCount() const;
+    U64 GetOversizedCount() const;
+
+private:
+    ConnectionLimits limits;
+    Vec<ConnectionRecord> records;
+    ConnectionRecord* freeList;
+    Vec<mg_connection*> listeners;
+    TimerWheel wheel;
+    BodyLimitResolver bodyLimitResolver;
+    HttpParser parser;
+    U32 activeCount;
+    Arr<U32, 5> phaseCounts;
+    B acceptPaused;
+
+    U64 rejectedCount;
+    U64 timedOutCount;
+    U64 oversizedCount;
+
+    void SetPhase(ConnectionRecord* record, ConnectionPhase phase, U64 nowMs);
+    void TrimBuffers(mg_connection* c);
+    void PauseAccept(B pause);
+
+    static void OnExpired(TimerWheelNode* node, void* tracker);
+};
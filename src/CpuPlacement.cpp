@@ -0,0 +1,167 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "CpuPlacement.hpp"
+#include "Utils.hpp"
+
+#include <cerrno>
+#include <pthread.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+
+CpuPlacement::CpuPlacement() :
+    placeProcesses(false),
+    reactorCpu(-1),
+    node(-1),
+    remoteCpuCount(0)
+{
+    CPU_ZERO(&processCpus);
+}
+
+
+auto
+CpuPlacement::SetOptions(const CpuPlacementOptions& newOptions) -> void
+{
+    options = newOptions;
+}
+
+
+auto
+CpuPlacement::Apply() -> void
+{
+    auto cpu = options.reactorCpu;
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+    {
+        return;
+    }
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        CPU_ZERO(&allowed);
+    }
+
+    cpu_set_t reactor;
+    CPU_ZERO(&reactor);
+    CPU_SET(cpu, &reactor);
+    if (sched_setaffinity(0, sizeof(reactor), &reactor) != 0)
+    {
+        LogErr("Cannot pin the event loop to CPU ", cpu, ", errno ", errno);
+        return;
+    }
+    reactorCpu = cpu;
+
+    CPU_ZERO(&processCpus);
+    if (options.commandCpus.empty())
+    {
+        processCpus = allowed;
+        CPU_CLR(cpu, &processCpus);
+    }
+    for (auto commandCpu : options.commandCpus)
+    {
+        if (commandCpu < CPU_SETSIZE)
+        {
+            CPU_SET(commandCpu, &processCpus);
+        }
+    }
+    // With nowhere else to go they stay with the reactor.
+    placeProcesses = CPU_COUNT(&processCpus) > 0;
+
+    // The thread is on its CPU once pinned.
+    unsigned currentCpu = 0;
+    unsigned currentNode = 0;
+    if (syscall(SYS_getcpu, &currentCpu, &currentNode, nullptr) == 0)
+    {
+        node = (I32)currentNode;
+    }
+
+    // Preferred rather than bound, a full node falls back to the others.
+    if (options.localMemory && node >= 0 && node < 64)
+    {
+        unsigned long nodeMask = 1UL << node;
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodeMask, 65) != 0)
+        {
+            LogErr("Cannot prefer memory of NUMA node ", node, ", errno ", errno);
+        }
+    }
+
+    Log("Event loop pinned to CPU ", cpu, ", NUMA node ", node);
+}
+
+
+auto
+CpuPlacement::PlaceProcess(I32 pid) const -> void
+{
+    if (placeProcesses)
+    {
+        sched_setaffinity(pid, sizeof(processCpus), &processCpus);
+    }
+}
+
+
+auto
+CpuPlacement::PlaceThread(Thread& thread) const -> void
+{
+    if (placeProcesses)
+    {
+        pthread_setaffinity_np(thread.native_handle(), sizeof(processCpus), &processCpus);
+    }
+}
+
+
+auto
+CpuPlacement::OnAccept(I32 fd) -> void
+{
+#ifdef SO_INCOMING_CPU
+    if (reactorCpu < 0)
+    {
+        return;
+    }
+
+    I32 cpu = -1;
+    socklen_t length = sizeof(cpu);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &length) == 0 && cpu >= 0 && cpu != reactorCpu)
+    {
+        remoteCpuCount++;
+    }
+#endif
+}
+
+
+auto
+CpuPlacement::GetReactorCpu() const -> I32
+{
+    return reactorCpu;
+}
+
+
+auto
+CpuPlacement::GetNode() const -> I32
+{
+    return (reactorCpu < 0)? -1 : node;
+}
+
+
+auto
+CpuPlacement::GetRemoteCpuCount() const -> U64
+{
+    return remoteCpuCount;
+}
@@ -0,0 +1,70 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+
+#include <sched.h>
+
+
+struct CpuPlacementOptions
+{
+    // CPU the event loop runs on, -1 leaves it to the scheduler.
+    I32 reactorCpu = -1;
+    // Memory allocated once pinned, connection buffers, pools and the
+    // pages of mapped files, prefers the NUMA node of reactorCpu.
+    B localMemory = true;
+    // CPUs commands and the server's helper threads run on. Empty for the
+    // ones the server was allowed to use, less reactorCpu, so they do not
+    // compete with the event loop.
+    Vec<U32> commandCpus;
+};
+
+
+// Keeps the event loop on one core and its memory on that core's node.
+class CpuPlacement
+{
+public:
+    CpuPlacement();
+
+    void SetOptions(const CpuPlacementOptions& newOptions);
+    // Pins the calling thread, the reactor, before it sets up anything.
+    void Apply();
+    // Moves a process started from the reactor off its CPU.
+    void PlaceProcess(I32 pid) const;
+    // Same for a helper thread, which would inherit the reactor's pin.
+    void PlaceThread(Thread& thread) const;
+    // Notes where the kernel processed a new connection's packets, its
+    // interrupts are best steered to the reactor's CPU.
+    void OnAccept(I32 fd);
+
+    I32 GetReactorCpu() const;
+    // NUMA node of the reactor's CPU, -1 when not pinned.
+    I32 GetNode() const;
+    // Accepted connections whose packets arrived on another CPU.
+    U64 GetRemoteCpuCount() const;
+
+private:
+    CpuPlacementOptions options;
+    cpu_set_t processCpus;
+    B placeProcesses;
+    I32 reactorCpu;
+    I32 node;
+    U64 remoteCpuCount;
+};
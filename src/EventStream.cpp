@@ -0,0 +1,257 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "EventStream.hpp"
+
+#include <charconv>
+
+
+EventBroker::EventBroker() :
+    heartbeat(std::make_shared<Str>(":\n\n")),
+    streamCount(0),
+    idleChannelCount(0),
+    useCount(0),
+    eventCount(0),
+    evictedCount(0)
+{
+}
+
+
+auto
+EventBroker::SetOptions(const EventStreamOptions& newOptions) -> void
+{
+    options = newOptions;
+    DropIdleChannels();
+}
+
+
+auto
+EventBroker::GetOptions() const -> const EventStreamOptions&
+{
+    return options;
+}
+
+
+auto
+EventBroker::Encode(U64 id, StrView data, CStr event) -> SharedBuffer
+{
+    auto buffer = std::make_shared<Str>();
+    buffer->reserve(data.size() + 32);
+
+    *buffer += "id: " + std::to_string(id) + "\n";
+    if (event != nullptr)
+    {
+        *buffer += Str("event: ") + event + "\n";
+    }
+
+    // Every line of the payload needs its own field.
+    while (true)
+    {
+        auto end = data.find('\n');
+        auto line = data.substr(0, end);
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.remove_suffix(1);
+        }
+
+        *buffer += "data: ";
+        buffer->append(line);
+        *buffer += "\n";
+
+        if (end == StrView::npos)
+        {
+            break;
+        }
+        data.remove_prefix(end + 1);
+    }
+    *buffer += "\n";
+
+    return buffer;
+}
+
+
+auto
+EventBroker::Open(mg_connection* c, CStr channelName, StrView lastEventId) -> EventStream*
+{
+    auto& channel = channels[channelName];
+    if (channel.listeners.empty() && channel.lastUse != 0)
+    {
+        idleChannelCount--;
+    }
+    channel.lastUse = ++useCount;
+
+    auto stream = new EventStream{ c, Str(channelName), (U32)channel.listeners.size(), SendQueue() };
+    channel.listeners.push_back(stream);
+    streamCount++;
+
+    U64 lastId = 0;
+    auto parsed = std::from_chars(lastEventId.data(), lastEventId.data() + lastEventId.size(), lastId);
+    if (parsed.ec == std::errc() && !lastEventId.empty())
+    {
+        for (auto& [id, buffer] : channel.history)
+        {
+            if (id > lastId)
+            {
+                Enqueue(stream, buffer);
+            }
+        }
+    }
+
+    return stream;
+}
+
+
+auto
+EventBroker::Close(EventStream* stream) -> void
+{
+    auto channel = channels.find(stream->channel);
+    auto& listeners = channel->second.listeners;
+
+    auto moved = listeners.back();
+    moved->index = stream->index;
+    listeners[stream->index] = moved;
+    listeners.pop_back();
+
+    // History outlives the listeners, reconnects after a gap still replay.
+    if (listeners.empty() && channel->second.history.empty())
+    {
+        channels.erase(channel);
+    }
+    else if (listeners.empty())
+    {
+        channel->second.lastUse = ++useCount;
+        idleChannelCount++;
+        DropIdleChannels();
+    }
+
+    streamCount--;
+    delete stream;
+}
+
+
+auto
+EventBroker::Broadcast(CStr channelName, StrView data, CStr event) -> U32
+{
+    auto found = channels.find(channelName);
+    if (found == channels.end())
+    {
+        // Nobody listens and there is no history to keep it for.
+        if (options.historySize == 0)
+        {
+            eventCount++;
+            return 0;
+        }
+        found = channels.emplace(channelName, Channel()).first;
+        idleChannelCount++;
+    }
+    auto& channel = found->second;
+    channel.lastUse = ++useCount;
+
+    auto id = channel.nextId++;
+    auto buffer = Encode(id, data, event);
+    eventCount++;
+
+    if (options.historySize != 0)
+    {
+        if (channel.history.size() >= options.historySize)
+        {
+            channel.history.pop_front();
+        }
+        channel.history.emplace_back(id, buffer);
+    }
+
+    for (auto stream : channel.listeners)
+    {
+        Enqueue(stream, buffer);
+    }
+    auto listenerCount = (U32)channel.listeners.size();
+
+    DropIdleChannels();
+
+    return listenerCount;
+}
+
+
+auto
+EventBroker::Enqueue(EventStream* stream, const SharedBuffer& buffer) -> void
+{
+    if (!stream->sendQueue.Push(stream->c, buffer, options.limits))
+    {
+        evictedCount++;
+    }
+}
+
+
+auto
+EventBroker::DropIdleChannels() -> void
+{
+    while (idleChannelCount > options.maxIdleChannels)
+    {
+        auto oldest = channels.end();
+        for (auto channel = channels.begin(); channel != channels.end(); ++channel)
+        {
+            if (
+                 channel->second.listeners.empty() &&
+                 (oldest == channels.end() || channel->second.lastUse < oldest->second.lastUse)
+               )
+            {
+                oldest = channel;
+            }
+        }
+
+        channels.erase(oldest);
+        idleChannelCount--;
+    }
+}
+
+
+auto
+EventBroker::OnHeartbeat(void* brokerPtr) -> void
+{
+    auto broker = static_cast<EventBroker*>(brokerPtr);
+
+    // Keeps proxies from timing out quiet streams and surfaces dead peers.
+    for (auto& [name, channel] : broker->channels)
+    {
+        for (auto stream : channel.listeners)
+        {
+            broker->Enqueue(stream, broker->heartbeat);
+        }
+    }
+}
+
+
+auto
+EventBroker::GetStreamCount() const -> U32
+{
+    return streamCount;
+}
+
+
+auto
+EventBroker::GetEventCount() const -> U64
+{
+    return eventCount;
+}
+
+
+auto
+EventBroker::GetEvictedCount() const -> U64
+{
+    return evictedCount;
+}
@@ -0,0 +1,98 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+#include "SendQueue.hpp"
+
+#include "mongoose/mongoose.h"
+
+
+struct EventStreamOptions
+{
+    // Events kept per channel for Last-Event-ID replay.
+    U32 historySize = 256;
+    U32 heartbeatMs = 15000;
+    // Channels without listeners kept for their history, the least
+    // recently used beyond this are dropped.
+    U32 maxIdleChannels = 1024;
+    SendQueueLimits limits;
+};
+
+
+// A text/event-stream response held open on one connection.
+struct EventStream
+{
+    mg_connection* c;
+    Str channel;
+    // Position in the channel's listener list.
+    U32 index;
+    SendQueue sendQueue;
+};
+
+
+// Channels of server-sent events. Events are encoded once and the same
+// buffer is queued on every listener and kept for replay. Runs on the
+// reactor thread.
+class EventBroker
+{
+public:
+    EventBroker();
+
+    void SetOptions(const EventStreamOptions& newOptions);
+    const EventStreamOptions& GetOptions() const;
+
+    // A reconnecting client gets the retained events newer than the
+    // Last-Event-ID it sent.
+    EventStream* Open(mg_connection* c, CStr channel, StrView lastEventId);
+    void Close(EventStream* stream);
+
+    // Returns the number of listeners the event was queued for.
+    U32 Broadcast(CStr channel, StrView data, CStr event);
+
+    U32 GetStreamCount() const;
+    U64 GetEventCount() const;
+    U64 GetEvictedCount() const;
+
+    // Repeating mongoose timer, one for all streams.
+    static void OnHeartbeat(void* broker);
+
+private:
+    struct Channel
+    {
+        Vec<EventStream*> listeners;
+        Deque<Pair<U64, SharedBuffer>> history;
+        U64 nextId = 1;
+        U64 lastUse = 0;
+    };
+
+    EventStreamOptions options;
+    UMap<Str, Channel> channels;
+    SharedBuffer heartbeat;
+    U32 streamCount;
+    U32 idleChannelCount;
+    U64 useCount;
+    U64 eventCount;
+    U64 evictedCount;
+
+    void Enqueue(EventStream* stream, const SharedBuffer& buffer);
+    void DropIdleChannels();
+
+    static SharedBuffer Encode(U64 id, StrView data, CStr event);
+};
@@ -0,0 +1,262 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "HeaderCache.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+
+
+static constexpr U32 minStatus = 100;
+static constexpr U32 maxStatus = 599;
+
+static constexpr StrView datePrefix = "Date: ";
+
+
+static auto ReasonPhrase(U32 status) -> CStr
+{
+    switch (status)
+    {
+    case 100: return "Continue";
+    case 101: return "Switching Protocols";
+    case 103: return "Early Hints";
+    case 200: return "OK";
+    case 201: return "Created";
+    case 202: return "Accepted";
+    case 203: return "Non-Authoritative Information";
+    case 204: return "No Content";
+    case 205: return "Reset Content";
+    case 206: return "Partial Content";
+    case 300: return "Multiple Choices";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 308: return "Permanent Redirect";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 406: return "Not Acceptable";
+    case 408: return "Request Timeout";
+    case 409: return "Conflict";
+    case 410: return "Gone";
+    case 411: return "Length Required";
+    case 412: return "Precondition Failed";
+    case 413: return "Content Too Large";
+    case 414: return "URI Too Long";
+    case 415: return "Unsupported Media Type";
+    case 416: return "Range Not Satisfiable";
+    case 417: return "Expectation Failed";
+    case 418: return "I'm a teapot";
+    case 421: return "Misdirected Request";
+    case 422: return "Unprocessable Content";
+    case 426: return "Upgrade Required";
+    case 428: return "Precondition Required";
+    case 429: return "Too Many Requests";
+    case 431: return "Request Header Fields Too Large";
+    case 451: return "Unavailable For Legal Reasons";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    case 505: return "HTTP Version Not Supported";
+    default: return "";
+    }
+}
+
+
+auto
+StatusLine(U32 code) -> StrView
+{
+    static const auto lines = []()
+    {
+        Vec<Str> rendered;
+        for (auto status = minStatus; status <= maxStatus; ++status)
+        {
+            rendered.push_back("HTTP/1.1 " + std::to_string(status) + " " + ReasonPhrase(status) + "\r\n");
+        }
+        return rendered;
+    }();
+
+    // Out of range codes are answered as a server error rather than
+    // written into the status line.
+    if (code < minStatus || code > maxStatus)
+    {
+        code = 500;
+    }
+    return lines[code - minStatus];
+}
+
+
+auto
+ContentLengthLine(B notModified, U64 length, C* buffer) -> StrView
+{
+    if (notModified)
+    {
+        return StrView();
+    }
+
+    static constexpr StrView name = "Content-Length: ";
+    auto end = std::copy(name.begin(), name.end(), buffer);
+    end = std::to_chars(end, buffer + contentLengthLineSize, length).ptr;
+    *end++ = '\r';
+    *end++ = '\n';
+    return StrView(buffer, end - buffer);
+}
+
+
+auto
+FormatHttpDate(time_t time, C* out) -> B
+{
+    tm utc;
+    return
+        gmtime_r(&time, &utc) != nullptr &&
+        strftime(out, httpDateLength + 1, "%a, %d %b %Y %H:%M:%S GMT", &utc) == httpDateLength;
+}
+
+
+auto
+ParseHttpDate(StrView text, time_t* time) -> B
+{
+    if (text.size() != httpDateLength)
+    {
+        return false;
+    }
+
+    // Copied for the terminating zero strptime needs.
+    C date[httpDateLength + 1];
+    memcpy(date, text.data(), httpDateLength);
+    date[httpDateLength] = 0;
+
+    tm utc = {};
+    auto end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &utc);
+    if (end != date + httpDateLength)
+    {
+        return false;
+    }
+    *time = timegm(&utc);
+
+    return true;
+}
+
+
+auto
+SendPieces(mg_connection* c, const StrView* pieces, Size count, Size reserve) -> B
+{
+    Size length = 0;
+    for (Size i = 0; i < count; ++i)
+    {
+        length += pieces[i].size();
+    }
+
+    length += reserve;
+
+    auto& send = c->send;
+    if (send.size - send.len < length && !mg_iobuf_resize(&send, send.len + length))
+    {
+        mg_error(c, "oom");
+        return false;
+    }
+
+    for (Size i = 0; i < count; ++i)
+    {
+        if (!pieces[i].empty())
+        {
+            memcpy(send.buf + send.len, pieces[i].data(), pieces[i].size());
+            send.len += pieces[i].size();
+        }
+    }
+
+    return true;
+}
+
+
+auto
+SendPieces(mg_connection* c, std::initializer_list<StrView> pieces, Size reserve) -> B
+{
+    return SendPieces(c, pieces.begin(), pieces.size(), reserve);
+}
+
+
+HeaderCache::HeaderCache() :
+    renderedAt(0)
+{
+    date = Str(datePrefix) + Str(httpDateLength, ' ') + "\r\n";
+    Update(time(nullptr));
+    SetHsts("");
+}
+
+
+auto
+HeaderCache::SetHsts(StrView value) -> void
+{
+    hsts = value;
+
+    for (U32 i = 0; i < connectionHeaders.size(); ++i)
+    {
+        auto secure = (i & 1) != 0;
+        auto close = (i & 2) != 0;
+
+        auto& headers = connectionHeaders[i];
+        headers.clear();
+        if (secure && !hsts.empty())
+        {
+            headers += "Strict-Transport-Security: " + hsts + "\r\n";
+        }
+        if (close)
+        {
+            headers += "Connection: close\r\n";
+        }
+    }
+}
+
+
+auto
+HeaderCache::Update(time_t now) -> void
+{
+    if (now == renderedAt)
+    {
+        return;
+    }
+    renderedAt = now;
+
+    C rendered[httpDateLength + 1];
+    if (FormatHttpDate(now, rendered))
+    {
+        memcpy(date.data() + datePrefix.size(), rendered, httpDateLength);
+    }
+}
+
+
+auto
+HeaderCache::GetDate() const -> StrView
+{
+    return date;
+}
+
+
+auto
+HeaderCache::GetConnectionHeaders(B secure, B close) const -> StrView
+{
+    return connectionHeaders[(secure? 1 : 0) | (close? 2 : 0)];
+}
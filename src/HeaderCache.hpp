@@ -0,0 +1,79 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+
+#include "mongoose/mongoose.h"
+
+#include <ctime>
+#include <initializer_list>
+
+
+// "HTTP/1.1 404 Not Found\r\n", rendered once for every code.
+StrView StatusLine(U32 code);
+
+// Room for ContentLengthLine.
+constexpr Size contentLengthLineSize = 40;
+// "Content-Length: 1234\r\n" for a 200, nothing for the 304 answering the
+// same conditional request. RFC 9110 section 8.6 lets a 304 carry only the
+// length the 200 would have had, leaving it out is always valid.
+StrView ContentLengthLine(B notModified, U64 length, C* buffer);
+
+// IMF-fixdate, "Sun, 06 Nov 1994 08:49:37 GMT", always this long.
+constexpr Size httpDateLength = 29;
+// Writes httpDateLength characters and a terminating zero.
+B FormatHttpDate(time_t time, C* out);
+// IMF-fixdate only, the obsolete formats are treated as invalid.
+B ParseHttpDate(StrView text, time_t* time);
+
+// Appends the pieces to the send buffer, which grows at most once, with
+// room for reserve more bytes the caller writes itself. False when it
+// could not grow, the connection is closed then.
+B SendPieces(mg_connection* c, const StrView* pieces, Size count, Size reserve = 0);
+B SendPieces(mg_connection* c, std::initializer_list<StrView> pieces, Size reserve = 0);
+
+
+// Header lines most responses carry, kept rendered so responses copy them
+// instead of formatting them.
+class HeaderCache
+{
+public:
+    HeaderCache();
+
+    // Strict-Transport-Security value for secure connections, none when
+    // empty.
+    void SetHsts(StrView value);
+    // Called once per event loop iteration, renders Date again when the
+    // second changed.
+    void Update(time_t now);
+
+    // The Date line. It is rewritten in place, views of it stay valid.
+    StrView GetDate() const;
+    // Strict-Transport-Security and Connection: close, as the connection
+    // needs them.
+    StrView GetConnectionHeaders(B secure, B close) const;
+
+private:
+    Str date;
+    time_t renderedAt;
+    Str hsts;
+    // Indexed by secure and close.
+    Arr<Str, 4> connectionHeaders;
+};
@@ -0,0 +1,712 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "Hpack.hpp"
+
+
+struct StaticField
+{
+    StrView name;
+    StrView value;
+};
+
+
+// RFC 7541 appendix A, index 1 first.
+static constexpr StaticField staticTable[] =
+{
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" }
+};
+
+static constexpr U32 staticTableCount = sizeof(staticTable) / sizeof(staticTable[0]);
+static_assert(staticTableCount == 61);
+
+// Table size both sides start with, and the most we use when encoding.
+static constexpr U32 defaultTableSize = 4096;
+
+
+struct HuffmanCode
+{
+    U32 bits;
+    U8 length;
+};
+
+
+// RFC 7541 appendix B, by symbol, 256 is EOS.
+static constexpr HuffmanCode huffmanCodes[257] =
+{
+    { 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 },
+    { 0xfffffe4, 28 }, { 0xfffffe5, 28 }, { 0xfffffe6, 28 }, { 0xfffffe7, 28 },
+    { 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+    { 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 },
+    { 0xfffffed, 28 }, { 0xfffffee, 28 }, { 0xfffffef, 28 }, { 0xffffff0, 28 },
+    { 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+    { 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 },
+    { 0xffffff8, 28 }, { 0xffffff9, 28 }, { 0xffffffa, 28 }, { 0xffffffb, 28 },
+    { 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 },
+    { 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 },
+    { 0x3fa, 10 }, { 0x3fb, 10 }, { 0xf9, 8 }, { 0x7fb, 11 },
+    { 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+    { 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 },
+    { 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 },
+    { 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 },
+    { 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 },
+    { 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 }, { 0x5e, 7 },
+    { 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+    { 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 },
+    { 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 }, { 0x6a, 7 },
+    { 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 },
+    { 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 },
+    { 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 }, { 0x1ffb, 13 },
+    { 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+    { 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 },
+    { 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 },
+    { 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 },
+    { 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 },
+    { 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 },
+    { 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+    { 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 },
+    { 0x7fc, 11 }, { 0x3ffd, 14 }, { 0x1ffd, 13 }, { 0xffffffc, 28 },
+    { 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 },
+    { 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 },
+    { 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 }, { 0x7fffdc, 23 },
+    { 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+    { 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 },
+    { 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 }, { 0x7fffe3, 23 },
+    { 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 },
+    { 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 },
+    { 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 }, { 0x3fffdb, 22 },
+    { 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+    { 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 },
+    { 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 }, { 0x7fffec, 23 },
+    { 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 },
+    { 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 },
+    { 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 }, { 0x3fffe4, 22 },
+    { 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+    { 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 },
+    { 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 }, { 0x1ffffec, 25 },
+    { 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 },
+    { 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 },
+    { 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 },
+    { 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+    { 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 },
+    { 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 },
+    { 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 },
+    { 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 },
+    { 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 }, { 0x1ffffef, 25 },
+    { 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+    { 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 },
+    { 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 }, { 0x7ffffea, 27 },
+    { 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 },
+    { 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 },
+    { 0x3fffffff, 30 }
+};
+
+
+struct HuffmanTransition
+{
+    U8 next;
+    U8 symbol;
+    U8 flags;
+};
+
+
+static constexpr U8 huffmanEmits = 1;
+static constexpr U8 huffmanFails = 2;
+
+
+// The code tree has 256 internal nodes, which are the states of a decoder
+// consuming four bits at a time. No code is shorter than five bits, so a
+// step completes at most one symbol.
+struct HuffmanDecoderTable
+{
+    Arr<Arr<HuffmanTransition, 16>, 256> transitions;
+    // Padding is a prefix of EOS, at most seven ones.
+    Arr<B, 256> accepting;
+};
+
+
+static auto BuildHuffmanDecoderTable() -> HuffmanDecoderTable
+{
+    // Children are internal nodes, or ~symbol for leaves. The root is
+    // nobody's child, so 0 marks a missing one.
+    Vec<Arr<I16, 2>> tree(1, Arr<I16, 2>{ 0, 0 });
+    Vec<U8> depth(1, 0);
+    Vec<B> allOnes(1, true);
+
+    for (I16 symbol = 0; symbol < 257; ++symbol)
+    {
+        auto& code = huffmanCodes[symbol];
+        I16 node = 0;
+        for (I32 bit = code.length - 1; bit >= 0; --bit)
+        {
+            auto side = (code.bits >> bit) & 1;
+            if (bit == 0)
+            {
+                tree[node][side] = ~symbol;
+                break;
+            }
+
+            if (tree[node][side] == 0)
+            {
+                tree[node][side] = (I16)tree.size();
+                tree.push_back(Arr<I16, 2>{ 0, 0 });
+                depth.push_back(depth[node] + 1);
+                allOnes.push_back(allOnes[node] && side == 1);
+            }
+            node = tree[node][side];
+        }
+    }
+
+    HuffmanDecoderTable table = {};
+    for (U32 state = 0; state < tree.size(); ++state)
+    {
+        table.accepting[state] = allOnes[state] && depth[state] <= 7;
+
+        for (U32 nibble = 0; nibble < 16; ++nibble)
+        {
+            auto& transition = table.transitions[state][nibble];
+            I16 node = (I16)state;
+            for (I32 bit = 3; bit >= 0; --bit)
+            {
+                auto child = tree[node][(nibble >> bit) & 1];
+                if (child >= 0)
+                {
+                    node = child;
+                    continue;
+                }
+
+                if (~child == 256)
+                {
+                    transition.flags |= huffmanFails;
+                    break;
+                }
+                transition.flags |= huffmanEmits;
+                transition.symbol = (U8)~child;
+                node = 0;
+            }
+            transition.next = (U8)node;
+        }
+    }
+
+    return table;
+}
+
+
+static auto HuffmanDecode(const U8* data, Size length, Str& out) -> B
+{
+    static const auto table = BuildHuffmanDecoderTable();
+
+    U8 state = 0;
+    for (Size i = 0; i < length; ++i)
+    {
+        for (auto nibble : { data[i] >> 4, data[i] & 15 })
+        {
+            auto& transition = table.transitions[state][nibble];
+            if (transition.flags & huffmanFails)
+            {
+                return false;
+            }
+            if (transition.flags & huffmanEmits)
+            {
+                out.push_back((C)transition.symbol);
+            }
+            state = transition.next;
+        }
+    }
+
+    return table.accepting[state];
+}
+
+
+static auto HuffmanLength(StrView s) -> Size
+{
+    Size bits = 0;
+    for (U8 symbol : s)
+    {
+        bits += huffmanCodes[symbol].length;
+    }
+    return (bits + 7) / 8;
+}
+
+
+static auto HuffmanEncode(StrView s, Str& out) -> void
+{
+    // Only the low bits are ever taken, older ones shift out.
+    U64 pending = 0;
+    U32 count = 0;
+    for (U8 symbol : s)
+    {
+        auto& code = huffmanCodes[symbol];
+        pending = (pending << code.length) | code.bits;
+        count += code.length;
+        while (count >= 8)
+        {
+            count -= 8;
+            out.push_back((C)(pending >> count));
+        }
+    }
+
+    if (count > 0)
+    {
+        out.push_back((C)((pending << (8 - count)) | (0xff >> count)));
+    }
+}
+
+
+static auto EncodeInteger(U64 value, U32 prefixBits, U8 flags, Str& out) -> void
+{
+    U64 limit = (1u << prefixBits) - 1;
+    if (value < limit)
+    {
+        out.push_back((C)(flags | value));
+        return;
+    }
+
+    out.push_back((C)(flags | limit));
+    value -= limit;
+    while (value >= 128)
+    {
+        out.push_back((C)((value & 127) | 128));
+        value >>= 7;
+    }
+    out.push_back((C)value);
+}
+
+
+static auto DecodeInteger(const U8*& p, const U8* end, U32 prefixBits, U64& value) -> B
+{
+    if (p == end)
+    {
+        return false;
+    }
+
+    U64 limit = (1u << prefixBits) - 1;
+    value = *p++ & limit;
+    if (value < limit)
+    {
+        return true;
+    }
+
+    // Nothing we accept needs more than four continuation bytes.
+    for (U32 shift = 0; shift <= 28; shift += 7)
+    {
+        if (p == end)
+        {
+            return false;
+        }
+        auto byte = *p++;
+        value += (U64)(byte & 127) << shift;
+        if ((byte & 128) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+static auto EncodeString(StrView s, Str& out) -> void
+{
+    auto huffmanLength = HuffmanLength(s);
+    if (huffmanLength < s.size())
+    {
+        EncodeInteger(huffmanLength, 7, 0x80, out);
+        HuffmanEncode(s, out);
+    }
+    else
+    {
+        EncodeInteger(s.size(), 7, 0, out);
+        out.append(s);
+    }
+}
+
+
+static auto DecodeString(const U8*& p, const U8* end, Str& out) -> B
+{
+    if (p == end)
+    {
+        return false;
+    }
+
+    auto huffman = (*p & 0x80) != 0;
+    U64 length = 0;
+    if (!DecodeInteger(p, end, 7, length) || length > (U64)(end - p))
+    {
+        return false;
+    }
+
+    out.clear();
+    auto ok = true;
+    if (huffman)
+    {
+        ok = HuffmanDecode(p, length, out);
+    }
+    else
+    {
+        out.assign((CStr)p, length);
+    }
+    p += length;
+
+    return ok;
+}
+
+
+HpackTable::HpackTable() :
+    size(0),
+    maxSize(defaultTableSize)
+{
+}
+
+
+auto
+HpackTable::SetMaxSize(U32 newMaxSize) -> void
+{
+    maxSize = newMaxSize;
+    Evict(maxSize);
+}
+
+
+auto
+HpackTable::GetMaxSize() const -> U32
+{
+    return maxSize;
+}
+
+
+auto
+HpackTable::Insert(StrView name, StrView value) -> void
+{
+    auto entrySize = (U32)(name.size() + value.size() + 32);
+    if (entrySize > maxSize)
+    {
+        entries.clear();
+        size = 0;
+        return;
+    }
+
+    // Copied first, the name may refer to an entry about to be evicted.
+    HeaderField field = { Str(name), Str(value) };
+    Evict(maxSize - entrySize);
+    entries.push_front(std::move(field));
+    size += entrySize;
+}
+
+
+auto
+HpackTable::Get(U64 index) const -> const HeaderField*
+{
+    return (index >= 1 && index <= entries.size())? &entries[index - 1] : nullptr;
+}
+
+
+auto
+HpackTable::GetCount() const -> U32
+{
+    return (U32)entries.size();
+}
+
+
+auto
+HpackTable::Evict(U32 limit) -> void
+{
+    while (size > limit)
+    {
+        auto& oldest = entries.back();
+        size -= (U32)(oldest.name.size() + oldest.value.size() + 32);
+        entries.pop_back();
+    }
+}
+
+
+HpackDecoder::HpackDecoder() :
+    settingsMaxTableSize(defaultTableSize)
+{
+}
+
+
+auto
+HpackDecoder::SetMaxTableSize(U32 size) -> void
+{
+    settingsMaxTableSize = size;
+}
+
+
+auto
+HpackDecoder::Decode(const U8* block, Size length, U32 maxListSize, Vec<HeaderField>& fields) -> B
+{
+    fields.clear();
+
+    auto p = block;
+    auto end = block + length;
+    // RFC 7541 section 4.1 sizes, counted as fields are emitted: indexed
+    // entries of the dynamic table expand a small block into a large list.
+    U64 listSize = 0;
+
+    while (p < end)
+    {
+        auto byte = *p;
+
+        if ((byte & 0xe0) == 0x20)
+        {
+            // Table size updates come before the first field.
+            U64 size = 0;
+            if (!fields.empty() || !DecodeInteger(p, end, 5, size) || size > settingsMaxTableSize)
+            {
+                return false;
+            }
+            table.SetMaxSize((U32)size);
+            continue;
+        }
+
+        auto indexed = (byte & 0x80) != 0;
+        auto incremental = (byte & 0xc0) == 0x40;
+        U64 index = 0;
+        if (!DecodeInteger(p, end, indexed? 7 : incremental? 6 : 4, index))
+        {
+            return false;
+        }
+
+        auto& field = fields.emplace_back();
+        if (index > staticTableCount)
+        {
+            auto entry = table.Get(index - staticTableCount);
+            if (entry == nullptr)
+            {
+                return false;
+            }
+            field.name = entry->name;
+            if (indexed)
+            {
+                field.value = entry->value;
+            }
+        }
+        else if (index > 0)
+        {
+            field.name = staticTable[index - 1].name;
+            if (indexed)
+            {
+                field.value = staticTable[index - 1].value;
+            }
+        }
+        else if (indexed || !DecodeString(p, end, field.name))
+        {
+            return false;
+        }
+
+        if (!indexed && !DecodeString(p, end, field.value))
+        {
+            return false;
+        }
+        listSize += field.name.size() + field.value.size() + 32;
+        if (listSize > maxListSize)
+        {
+            return false;
+        }
+        if (incremental)
+        {
+            table.Insert(field.name, field.value);
+        }
+    }
+
+    return true;
+}
+
+
+HpackEncoder::HpackEncoder() :
+    lowestPendingSize(defaultTableSize),
+    sizeUpdatePending(false)
+{
+}
+
+
+auto
+HpackEncoder::SetMaxTableSize(U32 size) -> void
+{
+    auto newMaxSize = std::min(size, defaultTableSize);
+    if (newMaxSize == table.GetMaxSize())
+    {
+        return;
+    }
+
+    lowestPendingSize = sizeUpdatePending? std::min(lowestPendingSize, newMaxSize) : newMaxSize;
+    sizeUpdatePending = true;
+    table.SetMaxSize(newMaxSize);
+}
+
+
+auto
+HpackEncoder::BeginBlock(Str& block) -> void
+{
+    if (!sizeUpdatePending)
+    {
+        return;
+    }
+
+    if (lowestPendingSize < table.GetMaxSize())
+    {
+        EncodeInteger(lowestPendingSize, 5, 0x20, block);
+    }
+    EncodeInteger(table.GetMaxSize(), 5, 0x20, block);
+    sizeUpdatePending = false;
+}
+
+
+// Values that differ between responses would only push useful entries
+// out of the table.
+static auto IsWorthIndexing(StrView name) -> B
+{
+    return
+        name != "content-length" &&
+        name != "etag" &&
+        name != "last-modified" &&
+        name != "date" &&
+        name != "expires" &&
+        name != "age" &&
+        name != "content-range" &&
+        name != "location";
+}
+
+
+// Sent as never indexed, so intermediaries don't compress them either.
+static auto IsSensitive(StrView name) -> B
+{
+    return name == "set-cookie" || name == "authorization";
+}
+
+
+auto
+HpackEncoder::Encode(StrView name, StrView value, Str& block) -> void
+{
+    U64 nameIndex = 0;
+
+    for (U32 i = 0; i < staticTableCount; ++i)
+    {
+        if (staticTable[i].name != name)
+        {
+            continue;
+        }
+        if (staticTable[i].value == value)
+        {
+            EncodeInteger(i + 1, 7, 0x80, block);
+            return;
+        }
+        nameIndex = (nameIndex == 0)? i + 1 : nameIndex;
+    }
+
+    for (U32 i = 1; i <= table.GetCount(); ++i)
+    {
+        auto entry = table.Get(i);
+        if (entry->name != name)
+        {
+            continue;
+        }
+        if (entry->value == value)
+        {
+            EncodeInteger(staticTableCount + i, 7, 0x80, block);
+            return;
+        }
+        nameIndex = (nameIndex == 0)? staticTableCount + i : nameIndex;
+    }
+
+    auto incremental = false;
+    if (IsSensitive(name))
+    {
+        EncodeInteger(nameIndex, 4, 0x10, block);
+    }
+    else if (IsWorthIndexing(name))
+    {
+        EncodeInteger(nameIndex, 6, 0x40, block);
+        incremental = true;
+    }
+    else
+    {
+        EncodeInteger(nameIndex, 4, 0, block);
+    }
+
+    if (nameIndex == 0)
+    {
+        EncodeString(name, block);
+    }
+    EncodeString(value, block);
+
+    if (incremental)
+    {
+        table.Insert(name, value);
+    }
+}
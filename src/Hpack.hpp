@@ -0,0 +1,98 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+
+
+// Header field as HPACK carries it, names are lowercase.
+struct HeaderField
+{
+    Str name;
+    Str value;
+};
+
+
+// Dynamic table shared by the encoder and decoder sides, entries are
+// counted with the 32 bytes of overhead RFC 7541 assigns them.
+class HpackTable
+{
+public:
+    HpackTable();
+
+    void SetMaxSize(U32 size);
+    U32 GetMaxSize() const;
+
+    void Insert(StrView name, StrView value);
+    // 1 is the newest entry, null past the oldest.
+    const HeaderField* Get(U64 index) const;
+    U32 GetCount() const;
+
+private:
+    // Newest first.
+    Deque<HeaderField> entries;
+    U32 size;
+    U32 maxSize;
+
+    void Evict(U32 limit);
+};
+
+
+// Decompression context of one HTTP/2 connection's requests.
+class HpackDecoder
+{
+public:
+    HpackDecoder();
+
+    // Largest table the peer may switch to, our SETTINGS_HEADER_TABLE_SIZE.
+    void SetMaxTableSize(U32 size);
+
+    // Decodes a complete header block into fields, which are reused between
+    // calls. False is a compression error, or a list past maxListSize bytes
+    // as RFC 7541 section 4.1 counts them, after which the connection's
+    // state is lost and it has to be closed.
+    B Decode(const U8* block, Size length, U32 maxListSize, Vec<HeaderField>& fields);
+
+private:
+    HpackTable table;
+    U32 settingsMaxTableSize;
+};
+
+
+// Compression context of one HTTP/2 connection's responses.
+class HpackEncoder
+{
+public:
+    HpackEncoder();
+
+    // The peer's SETTINGS_HEADER_TABLE_SIZE, the table we use stays within.
+    void SetMaxTableSize(U32 size);
+
+    // Has to start every header block, it carries table size changes.
+    void BeginBlock(Str& block);
+    // Name must be lowercase.
+    void Encode(StrView name, StrView value, Str& block);
+
+private:
+    HpackTable table;
+    // Smallest size the table went through since the last block, and the
+    // size it should end at, both announced at the start of the next one.
+    U32 lowestPendingSize;
+    B sizeUpdatePending;
+};
@@ -0,0 +1,1684 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "Http2.hpp"
+#include "Utils.hpp"
+
+
+static constexpr StrView clientPreface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static constexpr U32 frameHeaderSize = 9;
+static constexpr U32 defaultWindowSize = 65535;
+static constexpr I64 maxWindowSize = 0x7fffffff;
+// Also the largest frame we accept, SETTINGS_MAX_FRAME_SIZE is not raised.
+static constexpr U32 defaultMaxFrameSize = 16384;
+static constexpr U8 defaultUrgency = 3;
+
+// Frame types, RFC 9113 section 6 and RFC 9218 section 7.1.
+static constexpr U8 dataFrame = 0x0;
+static constexpr U8 headersFrame = 0x1;
+static constexpr U8 priorityFrame = 0x2;
+static constexpr U8 rstStreamFrame = 0x3;
+static constexpr U8 settingsFrame = 0x4;
+static constexpr U8 pushPromiseFrame = 0x5;
+static constexpr U8 pingFrame = 0x6;
+static constexpr U8 goAwayFrame = 0x7;
+static constexpr U8 windowUpdateFrame = 0x8;
+static constexpr U8 continuationFrame = 0x9;
+static constexpr U8 priorityUpdateFrame = 0x10;
+
+static constexpr U8 endStreamFlag = 0x1;
+static constexpr U8 ackFlag = 0x1;
+static constexpr U8 endHeadersFlag = 0x4;
+static constexpr U8 paddedFlag = 0x8;
+static constexpr U8 priorityFlag = 0x20;
+
+static constexpr U16 headerTableSizeSetting = 0x1;
+static constexpr U16 enablePushSetting = 0x2;
+static constexpr U16 maxConcurrentStreamsSetting = 0x3;
+static constexpr U16 initialWindowSizeSetting = 0x4;
+static constexpr U16 maxFrameSizeSetting = 0x5;
+static constexpr U16 maxHeaderListSizeSetting = 0x6;
+static constexpr U16 noRfc7540PrioritiesSetting = 0x9;
+
+static constexpr U32 noError = 0x0;
+static constexpr U32 protocolError = 0x1;
+static constexpr U32 internalError = 0x2;
+static constexpr U32 flowControlError = 0x3;
+static constexpr U32 streamClosedError = 0x5;
+static constexpr U32 frameSizeError = 0x6;
+static constexpr U32 refusedStreamError = 0x7;
+static constexpr U32 compressionError = 0x9;
+static constexpr U32 enhanceYourCalmError = 0xb;
+
+
+static auto ReadU32(const U8* p) -> U32
+{
+    return ((U32)p[0] << 24) | ((U32)p[1] << 16) | ((U32)p[2] << 8) | p[3];
+}
+
+
+static auto WriteU32(U8* p, U32 value) -> void
+{
+    p[0] = (U8)(value >> 24);
+    p[1] = (U8)(value >> 16);
+    p[2] = (U8)(value >> 8);
+    p[3] = (U8)value;
+}
+
+
+static auto IsTokenChar(C ch) -> B
+{
+    return
+        (ch >= 'a' && ch <= 'z') ||
+        (ch >= 'A' && ch <= 'Z') ||
+        (ch >= '0' && ch <= '9') ||
+        (ch != 0 && StrView("!#$%&'*+-.^_`|~").find(ch) != StrView::npos);
+}
+
+
+// Field names are lowercase in HTTP/2, RFC 9113 section 8.2.1.
+static auto IsValidFieldName(StrView name) -> B
+{
+    if (name.empty())
+    {
+        return false;
+    }
+    for (auto ch : name)
+    {
+        if (!IsTokenChar(ch) || (ch >= 'A' && ch <= 'Z'))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// The request is rewritten as HTTP/1.1 text, a line break in a value
+// would smuggle in headers of its own.
+static auto IsValidFieldValue(StrView value) -> B
+{
+    for (auto ch : value)
+    {
+        if (ch == '\0' || ch == '\r' || ch == '\n')
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static auto IsValidPath(StrView path) -> B
+{
+    if (path.empty() || (path[0] != '/' && path != "*"))
+    {
+        return false;
+    }
+    for (U8 ch : path)
+    {
+        if (ch <= ' ' || ch == 0x7f)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Meaningful for a single HTTP/1.1 connection only, RFC 9113 section 8.2.2.
+static auto IsConnectionSpecific(StrView name) -> B
+{
+    return
+        name == "connection" ||
+        name == "keep-alive" ||
+        name == "proxy-connection" ||
+        name == "transfer-encoding" ||
+        name == "upgrade";
+}
+
+
+static auto TrimLineEnd(StrView line) -> StrView
+{
+    return (!line.empty() && line.back() == '\r')? line.substr(0, line.size() - 1) : line;
+}
+
+
+static auto Trim(StrView s) -> StrView
+{
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+    {
+        s.remove_prefix(1);
+    }
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+    {
+        s.remove_suffix(1);
+    }
+    return s;
+}
+
+
+// Length of the response head with its blank line, npos while incomplete.
+// Lines may end in a bare LF, like mg_http_reply writes the last one.
+static auto HeadLength(StrView s) -> Size
+{
+    for (auto lineEnd = s.find('\n'); lineEnd != StrView::npos; lineEnd = s.find('\n', lineEnd + 1))
+    {
+        auto next = s.substr(lineEnd + 1, 2);
+        if (next.substr(0, 1) == "\n")
+        {
+            return lineEnd + 2;
+        }
+        if (next == "\r\n")
+        {
+            return lineEnd + 3;
+        }
+    }
+    return StrView::npos;
+}
+
+
+static auto ParseDecimal(StrView s, U64& value) -> B
+{
+    value = 0;
+    if (s.empty() || s.size() > 18)
+    {
+        return false;
+    }
+    for (auto ch : s)
+    {
+        if (ch < '0' || ch > '9')
+        {
+            return false;
+        }
+        value = value * 10 + (U64)(ch - '0');
+    }
+    return true;
+}
+
+
+// Priority field value of RFC 9218, e.g. "u=1, i". Unknown members and
+// malformed values leave the defaults.
+static auto ParsePriority(StrView value, U8& urgency, B& incremental) -> void
+{
+    while (!value.empty())
+    {
+        auto comma = value.find(',');
+        auto member = Trim(value.substr(0, comma));
+        value = (comma == StrView::npos)? StrView() : value.substr(comma + 1);
+
+        if (member.size() == 3 && member[0] == 'u' && member[1] == '=' && member[2] >= '0' && member[2] <= '7')
+        {
+            urgency = (U8)(member[2] - '0');
+        }
+        else if (member == "i" || member == "i=?1")
+        {
+            incremental = true;
+        }
+        else if (member == "i=?0")
+        {
+            incremental = false;
+        }
+    }
+}
+
+
+Http2Session::Http2Session(Http2Gateway* gateway, mg_connection* c, U64 nowMs) :
+    gateway(gateway),
+    c(c),
+    httpHandler(c->pfn),
+    headerBlockStream(0),
+    headerBlockEndsStream(false),
+    headerBlockWeight(0),
+    lastStreamId(0),
+    sendWindow(defaultWindowSize),
+    receiveWindow(defaultWindowSize),
+    receiveCredit(0),
+    peerInitialWindowSize(defaultWindowSize),
+    peerMaxFrameSize(defaultMaxFrameSize),
+    prefaceReceived(false),
+    goingAway(false),
+    failed(false),
+    lastActivityMs(nowMs)
+{
+    // The connection carries frames from here on, mongoose's HTTP/1
+    // parser only runs on the streams.
+    c->pfn = nullptr;
+    c->pfn_data = nullptr;
+
+    auto& options = gateway->options;
+    const Pair<U16, U32> settings[] =
+    {
+        { maxConcurrentStreamsSetting, options.maxConcurrentStreams },
+        { initialWindowSizeSetting, options.streamWindowSize },
+        { maxHeaderListSizeSetting, options.maxHeaderListSize },
+        // Priorities come from the priority header and PRIORITY_UPDATE.
+        { noRfc7540PrioritiesSetting, 1 }
+    };
+
+    U8 payload[sizeof(settings) / sizeof(settings[0]) * 6];
+    auto p = payload;
+    for (auto& [id, value] : settings)
+    {
+        p[0] = (U8)(id >> 8);
+        p[1] = (U8)id;
+        WriteU32(p + 2, value);
+        p += 6;
+    }
+    SendFrame(settingsFrame, 0, 0, payload, sizeof(payload));
+
+    if (options.connectionWindowSize > defaultWindowSize)
+    {
+        SendWindowUpdate(0, options.connectionWindowSize - defaultWindowSize);
+        receiveWindow = options.connectionWindowSize;
+    }
+}
+
+
+Http2Session::~Http2Session()
+{
+    for (auto stream : streams)
+    {
+        if (!stream->closed)
+        {
+            CloseStream(stream, noError);
+        }
+        delete stream;
+    }
+}
+
+
+auto
+Http2Session::OnRead(U64 nowMs) -> void
+{
+    if (failed)
+    {
+        c->recv.len = 0;
+        return;
+    }
+
+    lastActivityMs = nowMs;
+
+    auto buffer = c->recv.buf;
+    auto length = c->recv.len;
+    Size offset = 0;
+
+    if (!prefaceReceived)
+    {
+        auto n = std::min(length, clientPreface.size());
+        if (memcmp(buffer, clientPreface.data(), n) != 0)
+        {
+            Fail(protocolError);
+            c->recv.len = 0;
+            return;
+        }
+        if (n < clientPreface.size())
+        {
+            return;
+        }
+        offset = clientPreface.size();
+        prefaceReceived = true;
+    }
+
+    while (!failed && length - offset >= frameHeaderSize)
+    {
+        auto header = buffer + offset;
+        auto frameLength = ((U32)header[0] << 16) | ((U32)header[1] << 8) | header[2];
+        if (frameLength > defaultMaxFrameSize)
+        {
+            Fail(frameSizeError);
+            break;
+        }
+        if (length - offset - frameHeaderSize < frameLength)
+        {
+            break;
+        }
+
+        OnFrame(
+                 header[3],
+                 header[4],
+                 ReadU32(header + 5) & 0x7fffffff,
+                 header + frameHeaderSize,
+                 frameLength
+               );
+        offset += frameHeaderSize + frameLength;
+    }
+
+    if (failed)
+    {
+        c->recv.len = 0;
+        return;
+    }
+
+    mg_iobuf_del(&c->recv, 0, offset);
+    GiveConnectionCredit();
+    Pump();
+}
+
+
+auto
+Http2Session::OnPoll(U64 nowMs) -> void
+{
+    for (auto stream : streams)
+    {
+        if (!stream->closed)
+        {
+            mg_call(stream->c, MG_EV_POLL, &nowMs);
+            GiveCredit(stream);
+        }
+    }
+    Pump();
+
+    if (failed || !streams.empty())
+    {
+        return;
+    }
+
+    if (!goingAway && nowMs - lastActivityMs >= gateway->idleTimeoutMs)
+    {
+        Shutdown();
+    }
+    if (goingAway)
+    {
+        c->is_draining = 1;
+    }
+}
+
+
+auto
+Http2Session::Shutdown() -> void
+{
+    if (goingAway || failed)
+    {
+        return;
+    }
+
+    goingAway = true;
+    U8 payload[8];
+    WriteU32(payload, lastStreamId);
+    WriteU32(payload + 4, noError);
+    SendFrame(goAwayFrame, 0, 0, payload, sizeof(payload));
+
+    if (streams.empty())
+    {
+        c->is_draining = 1;
+    }
+}
+
+
+auto
+Http2Session::GetStreamCount() const -> U32
+{
+    return (U32)streams.size();
+}
+
+
+auto
+Http2Session::OnFrame(U8 type, U8 flags, U32 streamId, const U8* payload, U32 length) -> void
+{
+    // Nothing may come between the frames of a header block.
+    if (headerBlockStream != 0 && type != continuationFrame)
+    {
+        Fail(protocolError);
+        return;
+    }
+
+    if (type == dataFrame)
+    {
+        OnData(flags, streamId, payload, length);
+    }
+    else if (type == headersFrame)
+    {
+        OnHeaders(flags, streamId, payload, length);
+    }
+    else if (type == continuationFrame)
+    {
+        if (headerBlockStream == 0 || streamId != headerBlockStream)
+        {
+            Fail(protocolError);
+            return;
+        }
+        if (headerBlock.size() + length > gateway->options.maxHeaderListSize)
+        {
+            Fail(enhanceYourCalmError);
+            return;
+        }
+        headerBlock.append((CStr)payload, length);
+        if (flags & endHeadersFlag)
+        {
+            OnHeaderBlock();
+        }
+    }
+    else if (type == priorityFrame)
+    {
+        // RFC 7540 reprioritization is not used, see the settings.
+        if (streamId == 0)
+        {
+            Fail(protocolError);
+        }
+    }
+    else if (type == rstStreamFrame)
+    {
+        if (streamId == 0 || streamId > lastStreamId)
+        {
+            Fail(protocolError);
+            return;
+        }
+        if (length != 4)
+        {
+            Fail(frameSizeError);
+            return;
+        }
+        auto stream = Find(streamId);
+        if (stream != nullptr)
+        {
+            // The client already knows, nothing is sent back.
+            stream->remoteClosed = true;
+            CloseStream(stream, noError);
+        }
+    }
+    else if (type == settingsFrame)
+    {
+        OnSettings(flags, streamId, payload, length);
+    }
+    else if (type == pushPromiseFrame)
+    {
+        Fail(protocolError);
+    }
+    else if (type == pingFrame)
+    {
+        if (streamId != 0)
+        {
+            Fail(protocolError);
+            return;
+        }
+        if (length != 8)
+        {
+            Fail(frameSizeError);
+            return;
+        }
+        if ((flags & ackFlag) == 0)
+        {
+            SendFrame(pingFrame, ackFlag, 0, payload, length);
+        }
+    }
+    else if (type == goAwayFrame)
+    {
+        if (streamId != 0)
+        {
+            Fail(protocolError);
+            return;
+        }
+        Shutdown();
+    }
+    else if (type == windowUpdateFrame)
+    {
+        OnWindowUpdate(streamId, payload, length);
+    }
+    else if (type == priorityUpdateFrame)
+    {
+        if (streamId != 0)
+        {
+            Fail(protocolError);
+            return;
+        }
+        OnPriorityUpdate(payload, length);
+    }
+    // Unknown frame types are ignored.
+}
+
+
+auto
+Http2Session::OnData(U8 flags, U32 streamId, const U8* payload, U32 length) -> void
+{
+    if (streamId == 0)
+    {
+        Fail(protocolError);
+        return;
+    }
+
+    // Padding counts against the windows too.
+    auto data = payload;
+    auto dataLength = length;
+    if (flags & paddedFlag)
+    {
+        if (length == 0 || payload[0] >= length)
+        {
+            Fail(protocolError);
+            return;
+        }
+        data = payload + 1;
+        dataLength = length - 1 - payload[0];
+    }
+
+    receiveWindow -= length;
+    receiveCredit += length;
+    if (receiveWindow < 0)
+    {
+        Fail(flowControlError);
+        return;
+    }
+
+    auto stream = Find(streamId);
+    if (stream == nullptr)
+    {
+        // Data in flight for a stream closed on our side is dropped.
+        if (streamId > lastStreamId)
+        {
+            Fail(protocolError);
+        }
+        return;
+    }
+
+    if (stream->remoteClosed)
+    {
+        CloseStream(stream, streamClosedError);
+        return;
+    }
+
+    stream->receiveWindow -= length;
+    stream->receiveCredit += length;
+    stream->receivedLength += dataLength;
+    if (stream->receiveWindow < 0)
+    {
+        CloseStream(stream, flowControlError);
+        return;
+    }
+
+    auto endStream = (flags & endStreamFlag) != 0;
+    auto declared = stream->declaredLength;
+    if (
+         declared >= 0 &&
+         (
+           stream->receivedLength > (U64)declared ||
+           (endStream && stream->receivedLength != (U64)declared)
+         )
+       )
+    {
+        // Anything past the declared length would be parsed as another
+        // request on the stream's connection.
+        CloseStream(stream, protocolError);
+        return;
+    }
+
+    auto sc = stream->c;
+    auto before = sc->recv.len;
+    if (stream->chunkedRequest && dataLength > 0)
+    {
+        C size[24];
+        auto n = snprintf(size, sizeof(size), "%x\r\n", dataLength);
+        mg_iobuf_add(&sc->recv, sc->recv.len, size, n);
+        mg_iobuf_add(&sc->recv, sc->recv.len, data, dataLength);
+        mg_iobuf_add(&sc->recv, sc->recv.len, "\r\n", 2);
+    }
+    else
+    {
+        mg_iobuf_add(&sc->recv, sc->recv.len, data, dataLength);
+    }
+
+    if (endStream)
+    {
+        stream->remoteClosed = true;
+        if (stream->chunkedRequest)
+        {
+            mg_iobuf_add(&sc->recv, sc->recv.len, "0\r\n\r\n", 5);
+        }
+    }
+
+    long n = (long)(sc->recv.len - before);
+    if (n > 0)
+    {
+        mg_call(sc, MG_EV_READ, &n);
+    }
+    GiveCredit(stream);
+}
+
+
+auto
+Http2Session::OnHeaders(U8 flags, U32 streamId, const U8* payload, U32 length) -> void
+{
+    if (streamId == 0 || (streamId & 1) == 0)
+    {
+        Fail(protocolError);
+        return;
+    }
+
+    if (flags & paddedFlag)
+    {
+        if (length == 0 || payload[0] >= length)
+        {
+            Fail(protocolError);
+            return;
+        }
+        length -= 1 + payload[0];
+        payload += 1;
+    }
+
+    headerBlockWeight = 0;
+    if (flags & priorityFlag)
+    {
+        if (length < 5)
+        {
+            Fail(frameSizeError);
+            return;
+        }
+        headerBlockWeight = (U32)payload[4] + 1;
+        payload += 5;
+        length -= 5;
+    }
+
+    if (length > gateway->options.maxHeaderListSize)
+    {
+        Fail(enhanceYourCalmError);
+        return;
+    }
+
+    headerBlock.assign((CStr)payload, length);
+    headerBlockStream = streamId;
+    headerBlockEndsStream = (flags & endStreamFlag) != 0;
+    if (flags & endHeadersFlag)
+    {
+        OnHeaderBlock();
+    }
+}
+
+
+auto
+Http2Session::OnHeaderBlock() -> void
+{
+    auto streamId = headerBlockStream;
+    auto endStream = headerBlockEndsStream;
+    headerBlockStream = 0;
+
+    // Decoded even for streams that are refused, the table is shared. The
+    // list size is enforced while decoding, before the fields are expanded.
+    auto maxListSize = gateway->options.maxHeaderListSize;
+    if (!decoder.Decode((const U8*)headerBlock.data(), headerBlock.size(), maxListSize, fields))
+    {
+        Fail(compressionError);
+        return;
+    }
+
+    auto stream = Find(streamId);
+    if (stream != nullptr)
+    {
+        // Trailers, their fields are not passed on.
+        if (stream->remoteClosed || !endStream)
+        {
+            CloseStream(stream, stream->remoteClosed? streamClosedError : protocolError);
+            return;
+        }
+        if (stream->declaredLength >= 0 && stream->receivedLength != (U64)stream->declaredLength)
+        {
+            CloseStream(stream, protocolError);
+            return;
+        }
+
+        stream->remoteClosed = true;
+        if (stream->chunkedRequest)
+        {
+            auto sc = stream->c;
+            mg_iobuf_add(&sc->recv, sc->recv.len, "0\r\n\r\n", 5);
+            long n = 5;
+            mg_call(sc, MG_EV_READ, &n);
+        }
+        return;
+    }
+
+    if (streamId <= lastStreamId)
+    {
+        SendRstStream(streamId, streamClosedError);
+        return;
+    }
+    lastStreamId = streamId;
+
+    // Past the GOAWAY, the client retries it on a new connection.
+    if (goingAway)
+    {
+        return;
+    }
+
+    U32 openCount = 0;
+    for (auto open : streams)
+    {
+        openCount += !open->closed;
+    }
+    if (openCount >= gateway->options.maxConcurrentStreams)
+    {
+        SendRstStream(streamId, refusedStreamError);
+        return;
+    }
+
+    OpenStream(streamId, endStream);
+}
+
+
+auto
+Http2Session::TranslateRequest(Http2Stream* stream, B endStream, Str& request) -> B
+{
+    StrView method;
+    StrView scheme;
+    StrView authority;
+    StrView path;
+    Str cookie;
+    Str headers;
+    auto hasHost = false;
+    auto regularSeen = false;
+
+    for (auto& field : fields)
+    {
+        StrView name = field.name;
+        StrView value = field.value;
+
+        if (!IsValidFieldValue(value))
+        {
+            return false;
+        }
+
+        if (!name.empty() && name[0] == ':')
+        {
+            // Pseudo-headers come first and once each.
+            auto target =
+                (name == ":method")? &method :
+                (name == ":scheme")? &scheme :
+                (name == ":authority")? &authority :
+                (name == ":path")? &path : nullptr;
+            if (regularSeen || target == nullptr || !target->empty())
+            {
+                return false;
+            }
+            *target = value;
+            continue;
+        }
+
+        regularSeen = true;
+        if (!IsValidFieldName(name) || IsConnectionSpecific(name) || (name == "te" && value != "trailers"))
+        {
+            return false;
+        }
+
+        if (name == "cookie")
+        {
+            // Split into one field per crumb, RFC 9113 section 8.2.3.
+            cookie += cookie.empty()? "" : "; ";
+            cookie += value;
+            continue;
+        }
+
+        if (name == "content-length")
+        {
+            U64 declared = 0;
+            if (stream->declaredLength >= 0 || !ParseDecimal(value, declared))
+            {
+                return false;
+            }
+            stream->declaredLength = (I64)declared;
+        }
+        else if (name == "priority")
+        {
+            ParsePriority(value, stream->urgency, stream->incremental);
+        }
+        hasHost = hasHost || name == "host";
+
+        headers += name;
+        headers += ": ";
+        headers += value;
+        headers += "\r\n";
+    }
+
+    if (scheme.empty() || !IsValidPath(path))
+    {
+        return false;
+    }
+    if (method.empty() || !std::all_of(method.begin(), method.end(), IsTokenChar))
+    {
+        return false;
+    }
+    if (!authority.empty() && (authority.find_first_of(" \t") != StrView::npos))
+    {
+        return false;
+    }
+    if (endStream && stream->declaredLength > 0)
+    {
+        return false;
+    }
+
+    request.assign(method);
+    request += ' ';
+    request += path;
+    request += " HTTP/1.1\r\n";
+    if (!hasHost && !authority.empty())
+    {
+        request += "Host: ";
+        request += authority;
+        request += "\r\n";
+    }
+    request += headers;
+    if (!cookie.empty())
+    {
+        request += "Cookie: " + cookie + "\r\n";
+    }
+
+    if (stream->declaredLength < 0)
+    {
+        if (!endStream)
+        {
+            // DATA frames are passed on as chunks as they arrive.
+            request += "Transfer-Encoding: chunked\r\n";
+            stream->chunkedRequest = true;
+        }
+        else if (method == "POST" || method == "PUT")
+        {
+            // mongoose would wait for the connection to close.
+            request += "Content-Length: 0\r\n";
+        }
+    }
+    request += "\r\n";
+
+    stream->headRequest = method == "HEAD";
+    return true;
+}
+
+
+auto
+Http2Session::OpenStream(U32 streamId, B endStream) -> void
+{
+    auto stream = new Http2Stream();
+    stream->id = streamId;
+    stream->c = nullptr;
+    stream->sendWindow = peerInitialWindowSize;
+    stream->receiveWindow = gateway->options.streamWindowSize;
+    stream->receiveCredit = 0;
+    stream->declaredLength = -1;
+    stream->receivedLength = 0;
+    stream->urgency = defaultUrgency;
+    stream->incremental = false;
+    stream->remoteClosed = endStream;
+    stream->chunkedRequest = false;
+    stream->headRequest = false;
+    stream->closed = false;
+    stream->framing = ResponseFraming::Head;
+    stream->chunkPart = ChunkPart::Size;
+    stream->remaining = 0;
+
+    if (headerBlockWeight != 0)
+    {
+        // Clients that don't send the priority header, weights from 256
+        // down to 1 map onto urgencies 0 to 7.
+        stream->urgency = (U8)((256 - headerBlockWeight) * 8 / 256);
+    }
+
+    Str request;
+    if (!TranslateRequest(stream, endStream, request))
+    {
+        // Malformed, RFC 9113 section 8.1.1.
+        delete stream;
+        SendRstStream(streamId, protocolError);
+        return;
+    }
+
+    auto sc = mg_alloc_conn(c->mgr);
+    if (sc == nullptr)
+    {
+        delete stream;
+        SendRstStream(streamId, refusedStreamError);
+        return;
+    }
+
+    // Never polled by mongoose, the session delivers its events.
+    sc->fd = (void*)(Size)MG_INVALID_SOCKET;
+    sc->loc = c->loc;
+    sc->rem = c->rem;
+    sc->is_accepted = 1;
+    sc->is_tls = c->is_tls;
+    sc->fn = c->fn;
+    sc->pfn = httpHandler;
+    // Files are read a frame at a time.
+    mg_iobuf_resize(&sc->send, defaultMaxFrameSize);
+
+    if (!gateway->admitter(sc))
+    {
+        mg_iobuf_free(&sc->send);
+        mg_free_conn(sc);
+        delete stream;
+        SendRstStream(streamId, refusedStreamError);
+        return;
+    }
+
+    stream->c = sc;
+    streams.push_back(stream);
+
+    mg_iobuf_add(&sc->recv, 0, request.data(), request.size());
+    long n = (long)request.size();
+    mg_call(sc, MG_EV_READ, &n);
+}
+
+
+auto
+Http2Session::OnSettings(U8 flags, U32 streamId, const U8* payload, U32 length) -> void
+{
+    if (streamId != 0)
+    {
+        Fail(protocolError);
+        return;
+    }
+    if (flags & ackFlag)
+    {
+        if (length != 0)
+        {
+            Fail(frameSizeError);
+        }
+        return;
+    }
+    if (length % 6 != 0)
+    {
+        Fail(frameSizeError);
+        return;
+    }
+
+    for (U32 offset = 0; offset < length; offset += 6)
+    {
+        auto id = (U16)((payload[offset] << 8) | payload[offset + 1]);
+        auto value = ReadU32(payload + offset + 2);
+
+        if (id == headerTableSizeSetting)
+        {
+            encoder.SetMaxTableSize(value);
+        }
+        else if (id == enablePushSetting && value > 1)
+        {
+            Fail(protocolError);
+            return;
+        }
+        else if (id == initialWindowSizeSetting)
+        {
+            if (value > maxWindowSize)
+            {
+                Fail(flowControlError);
+                return;
+            }
+            // Applies to open streams too, windows may go negative.
+            auto delta = (I64)value - (I64)peerInitialWindowSize;
+            for (auto stream : streams)
+            {
+                stream->sendWindow += delta;
+                if (stream->sendWindow > maxWindowSize)
+                {
+                    Fail(flowControlError);
+                    return;
+                }
+            }
+            peerInitialWindowSize = value;
+        }
+        else if (id == maxFrameSizeSetting)
+        {
+            if (value < defaultMaxFrameSize || value > 0xffffff)
+            {
+                Fail(protocolError);
+                return;
+            }
+            peerMaxFrameSize = value;
+        }
+        // Others don't concern a server that does not push.
+    }
+
+    SendFrame(settingsFrame, ackFlag, 0, nullptr, 0);
+}
+
+
+auto
+Http2Session::OnWindowUpdate(U32 streamId, const U8* payload, U32 length) -> void
+{
+    if (length != 4)
+    {
+        Fail(frameSizeError);
+        return;
+    }
+
+    auto increment = ReadU32(payload) & 0x7fffffff;
+    if (streamId == 0)
+    {
+        sendWindow += increment;
+        if (increment == 0 || sendWindow > maxWindowSize)
+        {
+            Fail(increment == 0? protocolError : flowControlError);
+        }
+        return;
+    }
+
+    if (streamId > lastStreamId)
+    {
+        Fail(protocolError);
+        return;
+    }
+
+    auto stream = Find(streamId);
+    if (stream == nullptr)
+    {
+        return;
+    }
+
+    stream->sendWindow += increment;
+    if (increment == 0 || stream->sendWindow > maxWindowSize)
+    {
+        CloseStream(stream, increment == 0? protocolError : flowControlError);
+    }
+}
+
+
+auto
+Http2Session::OnPriorityUpdate(const U8* payload, U32 length) -> void
+{
+    if (length < 4)
+    {
+        Fail(frameSizeError);
+        return;
+    }
+
+    // Updates for streams not open yet are not kept.
+    auto stream = Find(ReadU32(payload) & 0x7fffffff);
+    if (stream != nullptr)
+    {
+        stream->urgency = defaultUrgency;
+        stream->incremental = false;
+        ParsePriority(StrView((CStr)payload + 4, length - 4), stream->urgency, stream->incremental);
+    }
+}
+
+
+auto
+Http2Session::Pump() -> void
+{
+    if (failed || c->is_closing)
+    {
+        return;
+    }
+
+    if (streams.empty())
+    {
+        return;
+    }
+
+    // Most urgent first. Within an urgency, non-incremental responses go
+    // out whole in request order, incremental ones share what is left a
+    // frame at a time.
+    Vec<Http2Stream*> order(streams.begin(), streams.end());
+    std::stable_sort(
+                      order.begin(),
+                      order.end(),
+                      [](Http2Stream* a, Http2Stream* b) { return a->urgency < b->urgency; }
+                    );
+
+    for (Size start = 0; start < order.size();)
+    {
+        auto end = start;
+        while (end < order.size() && order[end]->urgency == order[start]->urgency)
+        {
+            end++;
+        }
+
+        for (auto i = start; i < end; ++i)
+        {
+            if (!order[i]->incremental && !order[i]->closed)
+            {
+                PumpStream(order[i], UINT32_MAX);
+            }
+        }
+
+        for (auto progress = true; progress;)
+        {
+            progress = false;
+            for (auto i = start; i < end; ++i)
+            {
+                if (order[i]->incremental && !order[i]->closed)
+                {
+                    progress = PumpStream(order[i], 1) || progress;
+                }
+            }
+        }
+
+        start = end;
+    }
+
+    Sweep();
+
+    if (goingAway && streams.empty())
+    {
+        c->is_draining = 1;
+    }
+}
+
+
+auto
+Http2Session::PumpStream(Http2Stream* stream, U32 frameLimit) -> B
+{
+    auto sc = stream->c;
+    auto framedData = false;
+    auto refilled = false;
+
+    for (;;)
+    {
+        auto consumed = FrameResponse(stream, frameLimit, framedData);
+        if (stream->closed || frameLimit == 0)
+        {
+            break;
+        }
+        // Blocked by flow control, or the handler had nothing more so far.
+        if (consumed == 0 && (sc->send.len > 0 || refilled))
+        {
+            break;
+        }
+
+        // Room in the send buffer lets file and proxied responses refill it.
+        refilled = consumed == 0;
+        long n = (long)consumed;
+        mg_call(sc, MG_EV_WRITE, &n);
+    }
+
+    if (stream->closed)
+    {
+        return framedData;
+    }
+
+    if (stream->framing == ResponseFraming::Done)
+    {
+        CloseStream(stream, noError);
+    }
+    else if (sc->is_closing || (sc->is_draining && sc->send.len == 0))
+    {
+        if (stream->framing == ResponseFraming::UntilClose)
+        {
+            SendFrame(dataFrame, endStreamFlag, stream->id, nullptr, 0);
+            CloseStream(stream, noError);
+        }
+        else
+        {
+            // Timed out, or the response could not be completed.
+            CloseStream(stream, internalError);
+        }
+    }
+
+    return framedData;
+}
+
+
+auto
+Http2Session::FrameResponse(Http2Stream* stream, U32& frameLimit, B& framedData) -> Size
+{
+    auto sc = stream->c;
+    Size offset = 0;
+
+    while (stream->framing != ResponseFraming::Done)
+    {
+        auto pending = StrView((CStr)sc->send.buf + offset, sc->send.len - offset);
+
+        if (stream->framing == ResponseFraming::Head)
+        {
+            auto length = HeadLength(pending);
+            if (length == StrView::npos)
+            {
+                break;
+            }
+            if (!EncodeResponseHead(stream, pending.substr(0, length)))
+            {
+                CloseStream(stream, internalError);
+                return 0;
+            }
+            offset += length;
+            continue;
+        }
+
+        if (stream->framing == ResponseFraming::Chunked && stream->chunkPart != ChunkPart::Data)
+        {
+            if (stream->chunkPart == ChunkPart::Size)
+            {
+                auto lineEnd = pending.find("\r\n");
+                if (lineEnd == StrView::npos)
+                {
+                    break;
+                }
+                auto size = strtoull(Str(pending.substr(0, lineEnd)).c_str(), nullptr, 16);
+                stream->remaining = size;
+                stream->chunkPart = (size == 0)? ChunkPart::Trailers : ChunkPart::Data;
+                offset += lineEnd + 2;
+            }
+            else if (stream->chunkPart == ChunkPart::DataEnd)
+            {
+                if (pending.size() < 2)
+                {
+                    break;
+                }
+                stream->chunkPart = ChunkPart::Size;
+                offset += 2;
+            }
+            else
+            {
+                // Trailers are not passed on.
+                auto end = (pending.substr(0, 2) == "\r\n")? 0 : pending.find("\r\n\r\n");
+                if (end == StrView::npos)
+                {
+                    break;
+                }
+                offset += (end == 0)? 2 : end + 4;
+                SendFrame(dataFrame, endStreamFlag, stream->id, nullptr, 0);
+                stream->framing = ResponseFraming::Done;
+            }
+            continue;
+        }
+
+        auto available = (U64)pending.size();
+        if (stream->framing != ResponseFraming::UntilClose)
+        {
+            available = std::min(available, stream->remaining);
+        }
+        auto window = std::min(stream->sendWindow, sendWindow);
+        if (available == 0 || window <= 0 || frameLimit == 0 || c->send.len >= gateway->options.maxBufferedBytes)
+        {
+            break;
+        }
+
+        auto n = (U32)std::min({ available, (U64)window, (U64)peerMaxFrameSize });
+        auto last = stream->framing == ResponseFraming::Length && n == stream->remaining;
+        SendFrame(dataFrame, last? endStreamFlag : 0, stream->id, pending.data(), n);
+
+        stream->sendWindow -= n;
+        sendWindow -= n;
+        stream->remaining -= n;
+        offset += n;
+        frameLimit--;
+        framedData = true;
+
+        if (last)
+        {
+            stream->framing = ResponseFraming::Done;
+        }
+        else if (stream->framing == ResponseFraming::Chunked && stream->remaining == 0)
+        {
+            stream->chunkPart = ChunkPart::DataEnd;
+        }
+    }
+
+    mg_iobuf_del(&sc->send, 0, offset);
+    return offset;
+}
+
+
+auto
+Http2Session::EncodeResponseHead(Http2Stream* stream, StrView head) -> B
+{
+    auto lineEnd = head.find('\n');
+    auto statusLine = TrimLineEnd(head.substr(0, lineEnd));
+    auto space = statusLine.find(' ');
+    U64 status = 0;
+    if (
+         statusLine.substr(0, 5) != "HTTP/" ||
+         space == StrView::npos ||
+         !ParseDecimal(statusLine.substr(space + 1, 3), status) ||
+         status < 100 || status > 999 ||
+         status == 101
+       )
+    {
+        return false;
+    }
+
+    C statusText[4];
+    snprintf(statusText, sizeof(statusText), "%03u", (U32)status);
+
+    block.clear();
+    encoder.BeginBlock(block);
+    encoder.Encode(":status", StrView(statusText, 3), block);
+
+    I64 contentLength = -1;
+    auto chunked = false;
+    Str name;
+
+    for (auto position = lineEnd + 1; position < head.size();)
+    {
+        auto end = head.find('\n', position);
+        auto line = TrimLineEnd(head.substr(position, end - position));
+        if (line.empty() || end == StrView::npos)
+        {
+            break;
+        }
+        position = end + 1;
+
+        auto colon = line.find(':');
+        if (colon == StrView::npos)
+        {
+            continue;
+        }
+
+        auto rawName = Trim(line.substr(0, colon));
+        auto value = Trim(line.substr(colon + 1));
+        name.assign(rawName);
+        for (auto& ch : name)
+        {
+            ch = (ch >= 'A' && ch <= 'Z')? ch - 'A' + 'a' : ch;
+        }
+
+        if (name == "transfer-encoding")
+        {
+            chunked = chunked || Str(value).find("chunked") != Str::npos;
+        }
+        if (IsConnectionSpecific(name))
+        {
+            continue;
+        }
+        if (name == "content-length")
+        {
+            U64 length = 0;
+            contentLength = ParseDecimal(value, length)? (I64)length : contentLength;
+        }
+
+        encoder.Encode(name, value, block);
+    }
+
+    // Interim responses, e.g. 100 Continue, the final one follows.
+    if (status < 200)
+    {
+        SendHeaderBlock(stream->id, false);
+        return true;
+    }
+
+    if (stream->headRequest || status == 204 || status == 304)
+    {
+        stream->framing = ResponseFraming::Done;
+    }
+    else if (chunked)
+    {
+        stream->framing = ResponseFraming::Chunked;
+        stream->chunkPart = ChunkPart::Size;
+    }
+    else if (contentLength >= 0)
+    {
+        stream->framing = (contentLength == 0)? ResponseFraming::Done : ResponseFraming::Length;
+        stream->remaining = (U64)contentLength;
+    }
+    else
+    {
+        stream->framing = ResponseFraming::UntilClose;
+    }
+
+    SendHeaderBlock(stream->id, stream->framing == ResponseFraming::Done);
+    return true;
+}
+
+
+auto
+Http2Session::CloseStream(Http2Stream* stream, U32 error) -> void
+{
+    if (stream->closed)
+    {
+        return;
+    }
+
+    // A complete response ends the stream even if the request did not,
+    // RFC 9113 section 8.1.
+    if (error != noError || !stream->remoteClosed)
+    {
+        SendRstStream(stream->id, error);
+    }
+
+    stream->closed = true;
+    auto sc = stream->c;
+    stream->c = nullptr;
+
+    mg_call(sc, MG_EV_CLOSE, nullptr);
+    mg_iobuf_free(&sc->recv);
+    mg_iobuf_free(&sc->send);
+    mg_free_conn(sc);
+}
+
+
+auto
+Http2Session::Sweep() -> void
+{
+    auto end = std::remove_if(
+                               streams.begin(),
+                               streams.end(),
+                               [](Http2Stream* stream)
+                               {
+                                   if (stream->closed)
+                                   {
+                                       delete stream;
+                                       return true;
+                                   }
+                                   return false;
+                               }
+                             );
+    streams.erase(end, streams.end());
+}
+
+
+auto
+Http2Session::Find(U32 streamId) const -> Http2Stream*
+{
+    for (auto stream : streams)
+    {
+        if (stream->id == streamId && !stream->closed)
+        {
+            return stream;
+        }
+    }
+    return nullptr;
+}
+
+
+auto
+Http2Session::GiveCredit(Http2Stream* stream) -> void
+{
+    // Held back while a proxied upstream can't take more of the body.
+    auto threshold = gateway->options.streamWindowSize / 2;
+    if (
+         stream->closed ||
+         stream->remoteClosed ||
+         stream->c->is_full ||
+         stream->receiveCredit < threshold
+       )
+    {
+        return;
+    }
+
+    SendWindowUpdate(stream->id, stream->receiveCredit);
+    stream->receiveWindow += stream->receiveCredit;
+    stream->receiveCredit = 0;
+}
+
+
+auto
+Http2Session::GiveConnectionCredit() -> void
+{
+    if (receiveCredit < gateway->options.connectionWindowSize / 2)
+    {
+        return;
+    }
+
+    SendWindowUpdate(0, receiveCredit);
+    receiveWindow += receiveCredit;
+    receiveCredit = 0;
+}
+
+
+auto
+Http2Session::SendFrame(U8 type, U8 flags, U32 streamId, const void* payload, U32 length) -> void
+{
+    U8 header[frameHeaderSize] =
+    {
+        (U8)(length >> 16), (U8)(length >> 8), (U8)length, type, flags
+    };
+    WriteU32(header + 5, streamId);
+
+    mg_send(c, header, sizeof(header));
+    if (length > 0)
+    {
+        mg_send(c, payload, length);
+    }
+}
+
+
+auto
+Http2Session::SendHeaderBlock(U32 streamId, B endStream) -> void
+{
+    Size offset = 0;
+    auto first = true;
+    do
+    {
+        auto n = (U32)std::min(block.size() - offset, (Size)peerMaxFrameSize);
+        auto last = offset + n == block.size();
+        U8 flags = (last? endHeadersFlag : 0) | ((first && endStream)? endStreamFlag : 0);
+
+        SendFrame(first? headersFrame : continuationFrame, flags, streamId, block.data() + offset, n);
+        offset += n;
+        first = false;
+    }
+    while (offset < block.size());
+}
+
+
+auto
+Http2Session::SendWindowUpdate(U32 streamId, U32 increment) -> void
+{
+    U8 payload[4];
+    WriteU32(payload, increment);
+    SendFrame(windowUpdateFrame, 0, streamId, payload, sizeof(payload));
+}
+
+
+auto
+Http2Session::SendRstStream(U32 streamId, U32 error) -> void
+{
+    U8 payload[4];
+    WriteU32(payload, error);
+    SendFrame(rstStreamFrame, 0, streamId, payload, sizeof(payload));
+}
+
+
+auto
+Http2Session::Fail(U32 error) -> void
+{
+    if (failed)
+    {
+        return;
+    }
+
+    failed = true;
+    U8 payload[8];
+    WriteU32(payload, lastStreamId);
+    WriteU32(payload + 4, error);
+    SendFrame(goAwayFrame, 0, 0, payload, sizeof(payload));
+    c->is_draining = 1;
+}
+
+
+Http2Gateway::Http2Gateway() :
+    idleTimeoutMs(60000),
+    admitter(nullptr)
+{
+}
+
+
+auto
+Http2Gateway::SetOptions(const Http2Options& newOptions) -> void
+{
+    options = newOptions;
+    options.streamWindowSize = std::max(options.streamWindowSize, defaultWindowSize);
+    options.connectionWindowSize = std::max(options.connectionWindowSize, defaultWindowSize);
+}
+
+
+auto
+Http2Gateway::GetOptions() const -> const Http2Options&
+{
+    return options;
+}
+
+
+auto
+Http2Gateway::Start(U32 newIdleTimeoutMs, Http2StreamAdmitter newAdmitter) -> void
+{
+    idleTimeoutMs = newIdleTimeoutMs;
+    admitter = newAdmitter;
+}
+
+
+auto
+Http2Gateway::Open(mg_connection* c) -> Http2Session*
+{
+    auto session = new Http2Session(this, c, mg_millis());
+    sessions.push_back(session);
+    return session;
+}
+
+
+auto
+Http2Gateway::OnEvent(Http2Session* session, I ev, void* evData) -> void
+{
+    if (ev == MG_EV_READ)
+    {
+        session->OnRead(mg_millis());
+    }
+    else if (ev == MG_EV_WRITE)
+    {
+        session->Pump();
+    }
+    else if (ev == MG_EV_POLL)
+    {
+        session->OnPoll(*(U64*)evData);
+    }
+    else if (ev == MG_EV_CLOSE)
+    {
+        sessions.erase(std::find(sessions.begin(), sessions.end(), session));
+        delete session;
+    }
+}
+
+
+auto
+Http2Gateway::Shutdown(Http2Session* session) -> void
+{
+    session->Shutdown();
+}
+
+
+auto
+Http2Gateway::Update() -> void
+{
+    for (auto session : sessions)
+    {
+        session->Pump();
+    }
+}
+
+
+auto
+Http2Gateway::GetSessionCount() const -> U32
+{
+    return (U32)sessions.size();
+}
+
+
+auto
+Http2Gateway::GetStreamCount() const -> U32
+{
+    U32 count = 0;
+    for (auto session : sessions)
+    {
+        count += session->GetStreamCount();
+    }
+    return count;
+}
@@ -0,0 +1,209 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+#include "Hpack.hpp"
+
+#include "mongoose/mongoose.h"
+
+
+struct Http2Options
+{
+    // Offered with ALPN on the HTTPS listener, next to HTTP/1.1.
+    B enabled = true;
+    U32 maxConcurrentStreams = 100;
+    // Receive windows we advertise, at least 65535. Request bodies are
+    // still bounded by the connection limits.
+    U32 streamWindowSize = 1 << 20;
+    U32 connectionWindowSize = 16 << 20;
+    // Response data is not framed while the connection's send buffer
+    // holds more than this.
+    U32 maxBufferedBytes = 256 * 1024;
+    // Decoded size of a request's header list, per RFC 7541 accounting.
+    U32 maxHeaderListSize = 64 * 1024;
+};
+
+
+// Sets up a stream's connection like an accepted one, false refuses the
+// stream.
+using Http2StreamAdmitter = B(*)(mg_connection* stream);
+
+
+enum class ResponseFraming : U8
+{
+    // Status line and headers are not complete yet.
+    Head,
+    Length,
+    Chunked,
+    // No length, the body ends when the handler closes the stream.
+    UntilClose,
+    Done
+};
+
+
+enum class ChunkPart : U8
+{
+    Size,
+    Data,
+    DataEnd,
+    Trailers
+};
+
+
+// One request and its response. The stream's connection is not backed by
+// a socket: the request is written to its receive buffer as HTTP/1.1, and
+// the HTTP/1.1 response the handlers write to its send buffer is turned
+// into frames, so handlers run unchanged.
+struct Http2Stream
+{
+    U32 id;
+    mg_connection* c;
+    I64 sendWindow;
+    I64 receiveWindow;
+    // Received and not yet given back with WINDOW_UPDATE.
+    U32 receiveCredit;
+    // Content-Length of the request, -1 without one.
+    I64 declaredLength;
+    U64 receivedLength;
+    // RFC 9218 priority, lower urgency goes first.
+    U8 urgency;
+    B incremental;
+    B remoteClosed;
+    B chunkedRequest;
+    B headRequest;
+    B closed;
+    ResponseFraming framing;
+    ChunkPart chunkPart;
+    // Body bytes left for Length, or of the current chunk.
+    U64 remaining;
+};
+
+
+class Http2Gateway;
+
+
+// Frames, flow control and header compression of one HTTP/2 connection.
+class Http2Session
+{
+public:
+    Http2Session(Http2Gateway* gateway, mg_connection* c, U64 nowMs);
+    ~Http2Session();
+
+    void OnRead(U64 nowMs);
+    void OnPoll(U64 nowMs);
+    // Frames what the streams' handlers wrote, by priority and as far as
+    // the flow control windows allow.
+    void Pump();
+    // Sends GOAWAY, takes no new streams and closes once the open ones
+    // are done.
+    void Shutdown();
+
+    U32 GetStreamCount() const;
+
+private:
+    Http2Gateway* gateway;
+    mg_connection* c;
+    // mongoose's HTTP/1 protocol handler, run on the streams instead.
+    mg_event_handler_t httpHandler;
+    HpackDecoder decoder;
+    HpackEncoder encoder;
+    Vec<HeaderField> fields;
+    // Stream id order.
+    Vec<Http2Stream*> streams;
+
+    // HEADERS and CONTINUATION payloads until END_HEADERS.
+    Str headerBlock;
+    U32 headerBlockStream;
+    B headerBlockEndsStream;
+    // RFC 7540 weight of the HEADERS frame, 0 without one.
+    U32 headerBlockWeight;
+
+    U32 lastStreamId;
+    I64 sendWindow;
+    I64 receiveWindow;
+    U32 receiveCredit;
+    U32 peerInitialWindowSize;
+    U32 peerMaxFrameSize;
+    B prefaceReceived;
+    B goingAway;
+    B failed;
+    U64 lastActivityMs;
+
+    Str block;
+
+    void OnFrame(U8 type, U8 flags, U32 streamId, const U8* payload, U32 length);
+    void OnData(U8 flags, U32 streamId, const U8* payload, U32 length);
+    void OnHeaders(U8 flags, U32 streamId, const U8* payload, U32 length);
+    void OnHeaderBlock();
+    void OnSettings(U8 flags, U32 streamId, const U8* payload, U32 length);
+    void OnWindowUpdate(U32 streamId, const U8* payload, U32 length);
+    void OnPriorityUpdate(const U8* payload, U32 length);
+    void OpenStream(U32 streamId, B endStream);
+    B TranslateRequest(Http2Stream* stream, B endStream, Str& request);
+
+    B PumpStream(Http2Stream* stream, U32 frameLimit);
+    Size FrameResponse(Http2Stream* stream, U32& frameLimit, B& framedData);
+    B EncodeResponseHead(Http2Stream* stream, StrView head);
+    void CloseStream(Http2Stream* stream, U32 error);
+    void Sweep();
+    Http2Stream* Find(U32 streamId) const;
+    void GiveCredit(Http2Stream* stream);
+    void GiveConnectionCredit();
+
+    void SendFrame(U8 type, U8 flags, U32 streamId, const void* payload, U32 length);
+    void SendHeaderBlock(U32 streamId, B endStream);
+    void SendWindowUpdate(U32 streamId, U32 increment);
+    void SendRstStream(U32 streamId, U32 error);
+    void Fail(U32 error);
+};
+
+
+// Runs HTTP/2 connections negotiated on the HTTPS listener.
+class Http2Gateway
+{
+public:
+    Http2Gateway();
+
+    void SetOptions(const Http2Options& newOptions);
+    const Http2Options& GetOptions() const;
+    void Start(U32 idleTimeoutMs, Http2StreamAdmitter admitter);
+
+    // Takes over a connection whose TLS handshake picked h2.
+    Http2Session* Open(mg_connection* c);
+    // Events of the session's connection, the session is gone after
+    // MG_EV_CLOSE.
+    void OnEvent(Http2Session* session, I ev, void* evData);
+    void Shutdown(Http2Session* session);
+
+    // Called once per event loop iteration, frames responses written
+    // outside the sessions' own events, e.g. by proxied upstreams.
+    void Update();
+
+    U32 GetSessionCount() const;
+    U32 GetStreamCount() const;
+
+private:
+    friend class Http2Session;
+
+    Http2Options options;
+    U32 idleTimeoutMs;
+    Http2StreamAdmitter admitter;
+    Vec<Http2Session*> sessions;
+};
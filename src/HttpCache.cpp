@@ -0,0 +1,209 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "HttpCache.hpp"
+#include "HeaderCache.hpp"
+#include "HttpParser.hpp"
+
+#include <mbedtls/sha256.h>
+
+
+static constexpr StrView immutableCacheControl = "public, max-age=31536000, immutable";
+
+
+static auto IsHexHash(StrView segment) -> B
+{
+    static constexpr Size minLength = 6;
+    static constexpr Size maxLength = 64;
+    if (segment.size() < minLength || segment.size() > maxLength)
+    {
+        return false;
+    }
+
+    // Both digits and letters, so words and dates are not taken for one.
+    B hasDigit = false;
+    B hasLetter = false;
+    for (auto c : segment)
+    {
+        if (c >= '0' && c <= '9')
+        {
+            hasDigit = true;
+        }
+        else if ((c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'))
+        {
+            hasLetter = true;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return hasDigit && hasLetter;
+}
+
+
+auto
+IsFingerprinted(StrView path) -> B
+{
+    auto name = path.substr(path.find_last_of('/') + 1);
+    auto extension = name.find_last_of('.');
+    if (extension == StrView::npos)
+    {
+        return false;
+    }
+    name = name.substr(0, extension);
+
+    // Segments after the first, the name itself is never the hash.
+    auto start = name.find_first_of(".-");
+    while (start != StrView::npos)
+    {
+        auto end = name.find_first_of(".-", start + 1);
+        auto segment = name.substr(start + 1, (end == StrView::npos)? StrView::npos : end - start - 1);
+        if (IsHexHash(segment))
+        {
+            return true;
+        }
+        start = end;
+    }
+
+    return false;
+}
+
+
+auto
+ContentTag(const U8* data, Size size) -> Str
+{
+    static constexpr CStr digits = "0123456789abcdef";
+    static constexpr Size tagBytes = 16;
+
+    U8 hash[32];
+    mbedtls_sha256_ret(data, size, hash, 0);
+
+    Str tag(tagBytes * 2 + 2, '"');
+    for (Size i = 0; i < tagBytes; ++i)
+    {
+        tag[1 + 2 * i] = digits[hash[i] >> 4];
+        tag[2 + 2 * i] = digits[hash[i] & 15];
+    }
+
+    return tag;
+}
+
+
+// Weak comparison, as If-None-Match uses, ignores the W/ prefixes.
+static auto MatchesAny(StrView tags, StrView etag) -> B
+{
+    if (etag.starts_with("W/"))
+    {
+        etag.remove_prefix(2);
+    }
+
+    while (!tags.empty())
+    {
+        auto end = tags.find(',');
+        auto tag = tags.substr(0, end);
+        tags = (end == StrView::npos)? StrView() : tags.substr(end + 1);
+
+        while (!tag.empty() && (tag.front() == ' ' || tag.front() == '\t'))
+        {
+            tag.remove_prefix(1);
+        }
+        while (!tag.empty() && (tag.back() == ' ' || tag.back() == '\t'))
+        {
+            tag.remove_suffix(1);
+        }
+        if (tag.starts_with("W/"))
+        {
+            tag.remove_prefix(2);
+        }
+
+        if (tag == "*" || tag == etag)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+auto
+IsNotModified(mg_http_message* hm, StrView etag, time_t modified) -> B
+{
+    if (mg_vcasecmp(&hm->method, "GET") != 0 && mg_vcasecmp(&hm->method, "HEAD") != 0)
+    {
+        return false;
+    }
+
+    auto ifNoneMatch = FindHeader(hm, KnownHeader::IfNoneMatch);
+    if (ifNoneMatch != nullptr)
+    {
+        return MatchesAny(StrView(ifNoneMatch->ptr, ifNoneMatch->len), etag);
+    }
+
+    auto ifModifiedSince = FindHeader(hm, KnownHeader::IfModifiedSince);
+    time_t since;
+    if (
+         ifModifiedSince == nullptr ||
+         modified <= 0 ||
+         !ParseHttpDate(StrView(ifModifiedSince->ptr, ifModifiedSince->len), &since)
+       )
+    {
+        return false;
+    }
+
+    // A date from the future is not one the server sent.
+    return modified <= since && since <= time(nullptr);
+}
+
+
+auto
+CacheRules::Add(StrView pattern, const CachePolicy& policy) -> void
+{
+    Rule rule;
+    rule.pattern = pattern;
+    if (!policy.cacheControl.empty())
+    {
+        rule.header = "Cache-Control: " + policy.cacheControl + "\r\n";
+    }
+    rule.immutableFingerprinted = policy.immutableFingerprinted;
+
+    rules.push_back(std::move(rule));
+}
+
+
+auto
+CacheRules::GetHeader(StrView path) const -> StrView
+{
+    static const Str immutableHeader = "Cache-Control: " + Str(immutableCacheControl) + "\r\n";
+
+    for (auto& rule : rules)
+    {
+        if (mg_match(mg_str_n(path.data(), path.size()), mg_str_n(rule.pattern.data(), rule.pattern.size()), nullptr))
+        {
+            if (rule.immutableFingerprinted && IsFingerprinted(path))
+            {
+                return immutableHeader;
+            }
+            return rule.header;
+        }
+    }
+
+    return {};
+}
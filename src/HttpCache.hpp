@@ -0,0 +1,70 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+
+#include "mongoose/mongoose.h"
+
+#include <ctime>
+
+
+struct CachePolicy
+{
+    // Cache-Control value, none when empty.
+    Str cacheControl;
+    // Names carrying a content hash, `app.3f9a1c.wasm`, are cached for a
+    // year as immutable instead.
+    B immutableFingerprinted = true;
+};
+
+
+// Whether the file name has a hex content hash of 6 to 64 digits between
+// its name and extension, `app.3f9a1c.wasm` or `main-0a1b2c3d.js`.
+B IsFingerprinted(StrView path);
+
+// Strong ETag of the contents, the first 128 bits of their SHA-256 in hex,
+// quoted. cmake/PackAssets.cmake computes the same.
+Str ContentTag(const U8* data, Size size);
+
+// Whether a GET or HEAD request can be answered with 304 Not Modified for
+// a representation with this tag and modification time. If-None-Match is
+// looked at when present, If-Modified-Since otherwise.
+B IsNotModified(mg_http_message* hm, StrView etag, time_t modified);
+
+
+// The cache policies of a serve dir, rendered as Cache-Control lines when
+// added.
+class CacheRules
+{
+public:
+    void Add(StrView pattern, const CachePolicy& policy);
+    // The line for a request path, empty when it gets none.
+    StrView GetHeader(StrView path) const;
+
+private:
+    struct Rule
+    {
+        Str pattern;
+        Str header;
+        B immutableFingerprinted;
+    };
+
+    Vec<Rule> rules;
+};
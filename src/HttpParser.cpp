@@ -0,0 +1,420 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "HttpParser.hpp"
+
+#include <bit>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+static constexpr U8 noHeader = 0xFF;
+static constexpr U32 knownHeaderCount = (U32)KnownHeader::Count;
+
+static constexpr StrView knownHeaderNames[knownHeaderCount] =
+{
+    "Host",
+    "Cookie",
+    "Accept-Encoding",
+    "Range",
+    "If-Range",
+    "If-None-Match",
+    "If-Modified-Since",
+    "Content-Length",
+    "Content-Type",
+    "Connection",
+    "Upgrade",
+    "Expect"
+};
+
+
+// Length and first letter tell the known headers apart, checked below.
+static constexpr auto HeaderSlot(StrView name) -> U32
+{
+    return (U32)(name.size() ^ ((U8)name[0] | 0x20)) & 15;
+}
+
+
+struct HeaderSlots
+{
+    U8 headers[16];
+};
+
+
+static constexpr auto MakeHeaderSlots() -> HeaderSlots
+{
+    HeaderSlots slots = {};
+    for (auto& header : slots.headers)
+    {
+        header = noHeader;
+    }
+    for (U32 i = 0; i < knownHeaderCount; ++i)
+    {
+        auto& header = slots.headers[HeaderSlot(knownHeaderNames[i])];
+        header = (header == noHeader)? (U8)i : 0xFE;
+    }
+    return slots;
+}
+
+
+static constexpr HeaderSlots headerSlots = MakeHeaderSlots();
+
+static constexpr auto SlotsArePerfect() -> B
+{
+    for (auto header : headerSlots.headers)
+    {
+        if (header == 0xFE)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(SlotsArePerfect(), "Two known headers share a slot, change HeaderSlot");
+
+
+// Positions in the headers array of the message parsed last.
+struct HeaderIndex
+{
+    const mg_http_message* message;
+    CStr head;
+    U8 positions[knownHeaderCount];
+};
+
+static thread_local HeaderIndex headerIndex = {};
+
+
+static auto EqualsIgnoringCase(CStr a, StrView b) -> B
+{
+    for (Size i = 0; i < b.size(); ++i)
+    {
+        if ((a[i] | 0x20) != (b[i] | 0x20))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Stops at the first empty name, like mg_http_get_header.
+static auto IndexHeaders(const mg_http_message* hm) -> void
+{
+    memset(headerIndex.positions, noHeader, sizeof(headerIndex.positions));
+    headerIndex.message = hm;
+    headerIndex.head = hm->head.ptr;
+
+    for (U32 i = 0; i < MG_MAX_HTTP_HEADERS && hm->headers[i].name.len > 0; ++i)
+    {
+        auto& name = hm->headers[i].name;
+        auto header = headerSlots.headers[HeaderSlot(StrView(name.ptr, name.len))];
+        if (header == noHeader)
+        {
+            continue;
+        }
+
+        auto& known = knownHeaderNames[header];
+        if (
+             name.len == known.size() &&
+             headerIndex.positions[header] == noHeader &&
+             EqualsIgnoringCase(name.ptr, known)
+           )
+        {
+            headerIndex.positions[header] = (U8)i;
+        }
+    }
+}
+
+
+auto
+FindHeader(mg_http_message* hm, KnownHeader header) -> mg_str*
+{
+    if (headerIndex.message != hm || headerIndex.head != hm->head.ptr)
+    {
+        return mg_http_get_header(hm, knownHeaderNames[(U32)header].data());
+    }
+
+    auto position = headerIndex.positions[(U32)header];
+    return (position == noHeader)? nullptr : &hm->headers[position].value;
+}
+
+
+// buf[i] is a newline.
+static inline auto EndsHeaderBlock(const U8* buf, Size i) -> B
+{
+    return
+        (i > 0 && buf[i - 1] == '\n') ||
+        (i > 3 && buf[i - 1] == '\r' && buf[i - 2] == '\n');
+}
+
+
+// Masks of the newlines and of the bytes no header block may contain,
+// control characters other than CR.
+#if defined(__AVX2__)
+static constexpr Size blockSize = 32;
+
+static inline auto ScanBlock(const U8* bytes, U32* newlines, U32* invalid) -> void
+{
+    auto block = _mm256_loadu_si256((const __m256i*)bytes);
+    auto lastControl = _mm256_set1_epi8(0x1F);
+    auto control = _mm256_cmpeq_epi8(_mm256_max_epu8(block, lastControl), lastControl);
+    auto returns = (U32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('\r')));
+    *newlines = (U32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('\n')));
+    *invalid = (U32)_mm256_movemask_epi8(control) & ~(*newlines | returns);
+}
+#elif defined(__SSE2__)
+static constexpr Size blockSize = 16;
+
+static inline auto ScanBlock(const U8* bytes, U32* newlines, U32* invalid) -> void
+{
+    auto block = _mm_loadu_si128((const __m128i*)bytes);
+    auto lastControl = _mm_set1_epi8(0x1F);
+    auto control = _mm_cmpeq_epi8(_mm_max_epu8(block, lastControl), lastControl);
+    auto returns = (U32)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('\r')));
+    *newlines = (U32)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('\n')));
+    *invalid = (U32)_mm_movemask_epi8(control) & ~(*newlines | returns);
+}
+#endif
+
+
+auto
+FindHeaderEnd(const U8* buf, Size len, Size from) -> I32
+{
+    auto i = from;
+
+#if defined(__AVX2__) || defined(__SSE2__)
+    // Most blocks have no newline and are passed over whole.
+    for (; i + blockSize <= len; i += blockSize)
+    {
+        U32 newlines, invalid;
+        ScanBlock(buf + i, &newlines, &invalid);
+        for (auto interesting = newlines | invalid; interesting != 0; interesting &= interesting - 1)
+        {
+            auto bit = (U32)std::countr_zero(interesting);
+            if ((invalid >> bit) & 1)
+            {
+                return -1;
+            }
+            if (EndsHeaderBlock(buf, i + bit))
+            {
+                return (I32)(i + bit + 1);
+            }
+        }
+    }
+#endif
+
+    for (; i < len; ++i)
+    {
+        auto byte = buf[i];
+        if (byte < ' ' && byte != '\n' && byte != '\r')
+        {
+            return -1;
+        }
+        if (byte == '\n' && EndsHeaderBlock(buf, i))
+        {
+            return (I32)(i + 1);
+        }
+    }
+
+    return 0;
+}
+
+
+// mongoose's skip(): the value runs to a newline or a delimiter, the
+// delimiters after it are skipped.
+template <typename IsDelimiter>
+static inline auto Skip(CStr s, CStr end, IsDelimiter isDelimiter, mg_str* value) -> CStr
+{
+    value->ptr = s;
+    while (s < end && *s != '\n' && !isDelimiter(*s))
+    {
+        s++;
+    }
+    value->len = (Size)(s - value->ptr);
+    while (s < end && isDelimiter(*s))
+    {
+        s++;
+    }
+    return s;
+}
+
+
+static auto ParseHeaders(CStr s, CStr end, mg_http_header* headers) -> void
+{
+    auto isLineEnd = [](C c) { return c == '\r' || c == '\n'; };
+    auto endsName = [](C c) { return c == ':' || c == ' ' || c == '\r' || c == '\n'; };
+
+    for (U32 i = 0; i < MG_MAX_HTTP_HEADERS; ++i)
+    {
+        mg_str line, name, value;
+
+        // The line end through memchr, which is vectorized.
+        auto newline = (CStr)memchr(s, '\n', (Size)(end - s));
+        line.ptr = s;
+        line.len = (Size)((newline? newline : end) - s);
+        auto lineEnd = line.ptr + line.len;
+        while (lineEnd < end && *lineEnd == '\n')
+        {
+            lineEnd++;
+        }
+
+        s = Skip(s, lineEnd, endsName, &name);
+        s = Skip(s, lineEnd, isLineEnd, &value);
+        // A line without a colon leaves its slot empty, like mongoose.
+        if (name.len == line.len)
+        {
+            continue;
+        }
+        while (value.len > 0 && value.ptr[value.len - 1] == ' ')
+        {
+            value.len--;
+        }
+        if (name.len == 0)
+        {
+            break;
+        }
+        headers[i].name = name;
+        headers[i].value = value;
+    }
+}
+
+
+auto
+ParseHttpMessage(CStr s, Size len, Size from, mg_http_message* hm) -> I32
+{
+    auto requestLength = FindHeaderEnd((const U8*)s, len, from);
+    auto end = (s == nullptr)? nullptr : s + requestLength;
+
+    memset(hm, 0, sizeof(*hm));
+    headerIndex.message = nullptr;
+    if (requestLength <= 0)
+    {
+        return requestLength;
+    }
+
+    hm->message.ptr = hm->head.ptr = s;
+    hm->body.ptr = end;
+    hm->head.len = (Size)requestLength;
+    hm->chunk.ptr = end;
+    hm->message.len = hm->body.len = (Size)~0;
+
+    auto isSpace = [](C c) { return c == ' '; };
+    auto isLineEnd = [](C c) { return c == '\r' || c == '\n'; };
+    s = Skip(s, end, isSpace, &hm->method);
+    s = Skip(s, end, isSpace, &hm->uri);
+    s = Skip(s, end, isLineEnd, &hm->proto);
+
+    if (hm->method.len == 0 || hm->uri.len == 0)
+    {
+        return -1;
+    }
+
+    auto query = (CStr)memchr(hm->uri.ptr, '?', hm->uri.len);
+    if (query != nullptr)
+    {
+        hm->query.ptr = query + 1;
+        hm->query.len = (Size)(hm->uri.ptr + hm->uri.len - (query + 1));
+        hm->uri.len = (Size)(query - hm->uri.ptr);
+    }
+
+    ParseHeaders(s, end, hm->headers);
+    IndexHeaders(hm);
+
+    auto contentLength = FindHeader(hm, KnownHeader::ContentLength);
+    if (contentLength != nullptr)
+    {
+        hm->body.len = (Size)mg_to64(*contentLength);
+        hm->message.len = (Size)requestLength + hm->body.len;
+    }
+
+    // Without a length only PUT and POST requests have a body, a response's
+    // runs to the close unless it is a 204.
+    auto isResponse = hm->method.len >= 5 && mg_ncasecmp(hm->method.ptr, "HTTP/", 5) == 0;
+    if (
+         hm->body.len == (Size)~0 &&
+         !isResponse &&
+         mg_vcasecmp(&hm->method, "PUT") != 0 &&
+         mg_vcasecmp(&hm->method, "POST") != 0
+       )
+    {
+        hm->body.len = 0;
+        hm->message.len = (Size)requestLength;
+    }
+    if (hm->body.len == (Size)~0 && isResponse && mg_vcasecmp(&hm->uri, "204") == 0)
+    {
+        hm->body.len = 0;
+        hm->message.len = (Size)requestLength;
+    }
+
+    return requestLength;
+}
+
+
+HttpParser::HttpParser() :
+    lastConnection(nullptr),
+    lastBuffer(nullptr),
+    lastLength(0),
+    lastResult(0),
+    lastMessage{}
+{
+}
+
+
+auto
+HttpParser::Parse(mg_connection* c, U32* scanned, mg_http_message* hm) -> I32
+{
+    if (c == lastConnection && c->recv.buf == lastBuffer && c->recv.len == lastLength)
+    {
+        *hm = lastMessage;
+        IndexHeaders(hm);
+        Forget();
+        return lastResult;
+    }
+
+    if (*scanned > c->recv.len)
+    {
+        *scanned = 0;
+    }
+
+    auto result = ParseHttpMessage((CStr)c->recv.buf, c->recv.len, *scanned, hm);
+    *scanned = (result == 0)? (U32)c->recv.len : 0;
+
+    if (result > 0)
+    {
+        lastConnection = c;
+        lastBuffer = c->recv.buf;
+        lastLength = c->recv.len;
+        lastResult = result;
+        lastMessage = *hm;
+    }
+
+    return result;
+}
+
+
+auto
+HttpParser::Forget() -> void
+{
+    lastConnection = nullptr;
+}
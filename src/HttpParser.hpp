@@ -0,0 +1,81 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+
+#include "mongoose/mongoose.h"
+
+
+// Headers the server looks at on most requests, found without a scan of
+// the header array.
+enum class KnownHeader : U8
+{
+    Host,
+    Cookie,
+    AcceptEncoding,
+    Range,
+    IfRange,
+    IfNoneMatch,
+    IfModifiedSince,
+    ContentLength,
+    ContentType,
+    Connection,
+    Upgrade,
+    Expect,
+    Count
+};
+
+
+// Length of the header block at the start of buf, searched from `from`, the
+// bytes before it having been searched already. Zero while incomplete, -1
+// for bytes a header block can not contain. Same result as
+// mg_http_get_request_len.
+I32 FindHeaderEnd(const U8* buf, Size len, Size from);
+
+// Same result as mg_http_parse, and indexes the known headers of hm.
+I32 ParseHttpMessage(CStr buf, Size len, Size from, mg_http_message* hm);
+
+// The header's value, null when the request does not have it. O(1) for
+// the message parsed last, mg_http_get_header for others.
+mg_str* FindHeader(mg_http_message* hm, KnownHeader header);
+
+
+// Parses requests at the start of connections' receive buffers. A search for
+// the end of the header block resumes where the previous read left it, and
+// a complete parse is kept so that the parsers running on the same read
+// event share it.
+class HttpParser
+{
+public:
+    HttpParser();
+
+    // scanned is the connection's progress through an incomplete header
+    // block, zero for a new request.
+    I32 Parse(mg_connection* c, U32* scanned, mg_http_message* hm);
+    // Drops the kept parse, called whenever the receive buffer may change.
+    void Forget();
+
+private:
+    mg_connection* lastConnection;
+    const U8* lastBuffer;
+    Size lastLength;
+    I32 lastResult;
+    mg_http_message lastMessage;
+};
@@ -0,0 +1,123 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "LoadShedder.hpp"
+#include "Utils.hpp"
+
+
+LoadShedder::LoadShedder() :
+    iterationStartUs(0),
+    lagUs(0),
+    lastIterationEndUs(0),
+    windowStartUs(0),
+    windowPeakUs(0),
+    lastPeakUs(0),
+    shedCount(0)
+{
+}
+
+
+auto
+LoadShedder::SetOptions(const LoadSheddingOptions& newOptions) -> void
+{
+    options = newOptions;
+}
+
+
+auto
+LoadShedder::GetOptions() const -> const LoadSheddingOptions&
+{
+    return options;
+}
+
+
+auto
+LoadShedder::BeginIteration(U64 nowUs) -> void
+{
+    iterationStartUs = nowUs;
+}
+
+
+auto
+LoadShedder::EndIteration(U64 nowUs, U64 waitUs) -> void
+{
+    if (iterationStartUs == 0)
+    {
+        return;
+    }
+
+    // Handlers run inside the poll, io_uring completions even within the
+    // wait, so only the time blocked is left out.
+    auto iterationLagUs = nowUs - iterationStartUs;
+    iterationLagUs -= std::min(iterationLagUs, waitUs);
+    iterationStartUs = 0;
+
+    // Decaying maximum: a slow iteration counts right away and fades out
+    // over lagDecayUs of wall time, however many idle iterations follow.
+    auto elapsedUs = std::min(nowUs - lastIterationEndUs, lagDecayUs);
+    lastIterationEndUs = nowUs;
+    lagUs -= lagUs * elapsedUs / lagDecayUs;
+    lagUs = std::max(lagUs, iterationLagUs);
+
+    windowPeakUs = std::max(windowPeakUs, iterationLagUs);
+    if (nowUs - windowStartUs >= peakWindowUs)
+    {
+        lastPeakUs = windowPeakUs;
+        windowPeakUs = 0;
+        windowStartUs = nowUs;
+    }
+}
+
+
+auto
+LoadShedder::ShouldShed(RoutePriority priority, U32 queueDepth) -> B
+{
+    if (!options.enabled || priority == RoutePriority::High)
+    {
+        return false;
+    }
+
+    auto factor = (priority == RoutePriority::Low)? 1 : 2;
+    auto shed =
+        lagUs > (U64)options.maxLoopLagMs * 1000 * factor ||
+        queueDepth > options.maxQueueDepth * factor;
+
+    shedCount += shed;
+    return shed;
+}
+
+
+auto
+LoadShedder::GetLoopLagUs() const -> U64
+{
+    return lagUs;
+}
+
+
+auto
+LoadShedder::GetPeakLoopLagUs() const -> U64
+{
+    return std::max(lastPeakUs, windowPeakUs);
+}
+
+
+auto
+LoadShedder::GetShedCount() const -> U64
+{
+    return shedCount;
+}
@@ -0,0 +1,77 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+
+
+enum class RoutePriority : U8
+{
+    // Shed as soon as a threshold is exceeded.
+    Low,
+    // Shed only when a threshold is exceeded twice over.
+    Normal,
+    // Never shed, same as static assets.
+    High
+};
+
+
+struct LoadSheddingOptions
+{
+    B enabled = false;
+    U32 maxLoopLagMs = 100;
+    U32 maxQueueDepth = 1024;
+    U32 retryAfterS = 1;
+};
+
+
+// Loop lag is the time the reactor spends processing the events of one
+// poll iteration: anything that becomes ready meanwhile waits at least that
+// long before the next poll picks it up.
+class LoadShedder
+{
+public:
+    LoadShedder();
+
+    void SetOptions(const LoadSheddingOptions& newOptions);
+    const LoadSheddingOptions& GetOptions() const;
+
+    // Around mg_mgr_poll(), waitUs is the time it blocked for events.
+    void BeginIteration(U64 nowUs);
+    void EndIteration(U64 nowUs, U64 waitUs);
+
+    B ShouldShed(RoutePriority priority, U32 queueDepth);
+
+    U64 GetLoopLagUs() const;
+    U64 GetPeakLoopLagUs() const;
+    U64 GetShedCount() const;
+
+private:
+    static constexpr U64 peakWindowUs = 1000000;
+    static constexpr U64 lagDecayUs = 250000;
+
+    LoadSheddingOptions options;
+    U64 iterationStartUs;
+    U64 lagUs;
+    U64 lastIterationEndUs;
+    U64 windowStartUs;
+    U64 windowPeakUs;
+    U64 lastPeakUs;
+    U64 shedCount;
+};
@@ -24,15 +24,97 @@
 
 int main(int argc, char** argv)
 {
-    auto certPath = DOCUMENT_ROOT"/min-server.org/fullchain.pem";
-    auto privKeyPath = DOCUMENT_ROOT"/min-server.org/privkey.pem";
+    Str certPath = DOCUMENT_ROOT"/min-server.org/fullchain.pem";
+    Str privKeyPath = DOCUMENT_ROOT"/min-server.org/privkey.pem";
     Str address = "0.0.0.0";
-
-    Server::Init(address.c_str(), certPath, privKeyPath);
+    ListenOptions listenOptions;
+    CpuPlacementOptions cpuPlacement;
+    ServeDirOptions dirOptions;
+    AccessLogOptions accessLog;
+    Str routingFile;
+    Vec<Pair<Str, ServeDirOptions>> serveDirs;
 
     for (auto i = 1; i < argc; ++i)
     {
-        Server::AddServeDir(argv[i]);
+        StrView arg = argv[i];
+        CStr value = (i + 1 < argc)? argv[i + 1] : "";
+
+        if (arg == "--address")
+        {
+            address = value;
+        }
+        else if (arg == "--http-port")
+        {
+            listenOptions.httpPort = U16(std::atoi(value));
+        }
+        else if (arg == "--https-port")
+        {
+            listenOptions.httpsPort = U16(std::atoi(value));
+        }
+        else if (arg == "--cert")
+        {
+            certPath = value;
+        }
+        else if (arg == "--key")
+        {
+            privKeyPath = value;
+        }
+        else if (arg == "--host")
+        {
+            listenOptions.canonicalHost = value;
+        }
+        else if (arg == "--hsts")
+        {
+            listenOptions.hstsMaxAgeS = U32(std::atoi(value));
+        }
+        else if (arg == "--cache-control")
+        {
+            dirOptions.cachePolicy.cacheControl = value;
+        }
+        else if (arg == "--access-log")
+        {
+            accessLog.directory = value;
+        }
+        else if (arg == "--routing-file")
+        {
+            routingFile = value;
+        }
+        else if (arg == "--cpu")
+        {
+            cpuPlacement.reactorCpu = std::atoi(value);
+        }
+        else if (arg == "--wasm")
+        {
+            dirOptions.wasm = true;
+            continue;
+        }
+        else if (arg == "--no-redirect")
+        {
+            listenOptions.redirectToHttps = false;
+            continue;
+        }
+        else
+        {
+            serveDirs.emplace_back(arg, dirOptions);
+            continue;
+        }
+
+        // Options with a value.
+        ++i;
+    }
+
+    Server::Init(address.c_str(), certPath.c_str(), privKeyPath.c_str());
+    Server::SetListenOptions(listenOptions);
+    Server::SetCpuPlacement(cpuPlacement);
+    Server::SetAccessLog(accessLog);
+
+    for (auto& [dir, options] : serveDirs)
+    {
+        Server::AddServeDir(dir.c_str(), options);
+    }
+    if (!routingFile.empty())
+    {
+        Server::SetRoutingFile(routingFile.c_str());
     }
 
     Server::Run();
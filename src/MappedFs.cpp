@@ -0,0 +1,478 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "MappedFs.hpp"
+#include "HttpCache.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <csetjmp>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+struct FileMapping
+{
+    Str path;
+    const U8* data;
+    U64 size;
+    dev_t device;
+    ino_t inode;
+    timespec modified;
+    U32 references;
+    U64 lastUse;
+    // No longer in the table, unmapped with the last reference.
+    B retired;
+    // Worked out on first use.
+    Str etag;
+};
+
+
+struct MappedFile
+{
+    FileMapping* mapping;
+    Size position;
+};
+
+
+static MappedFsOptions options;
+static UMap<Str, FileMapping*> mappings;
+// Closed files, reused by the next opens.
+static Vec<MappedFile*> spareFiles;
+static U64 mappedBytes = 0;
+static U64 idleBytes = 0;
+static U64 useCounter = 0;
+
+// Set while a read copies from a mapping.
+static thread_local sigjmp_buf* readFault = nullptr;
+
+
+static auto OnBusError(I, siginfo_t*, void*) -> void
+{
+    if (readFault != nullptr)
+    {
+        siglongjmp(*readFault, 1);
+    }
+
+    // Not from a mapping, the fault repeats with the default action.
+    signal(SIGBUS, SIG_DFL);
+}
+
+
+// SA_NODEFER leaves SIGBUS unblocked after the jump, so the jump does not
+// have to restore the signal mask.
+static auto InstallBusErrorHandler() -> void
+{
+    static B installed = false;
+    if (installed)
+    {
+        return;
+    }
+    installed = true;
+
+    struct sigaction action = {};
+    action.sa_sigaction = OnBusError;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGBUS, &action, nullptr);
+}
+
+
+// The key is reused, so finding a mapping does not allocate.
+static auto Find(CStr path) -> UMap<Str, FileMapping*>::iterator
+{
+    static Str key;
+    key.assign(path);
+    return mappings.find(key);
+}
+
+
+static auto Unmap(FileMapping* mapping) -> void
+{
+    if (mapping->data != nullptr)
+    {
+        munmap((void*)mapping->data, mapping->size);
+    }
+    mappedBytes -= mapping->size;
+    delete mapping;
+}
+
+
+static auto Retire(FileMapping* mapping) -> void
+{
+    mappings.erase(mapping->path);
+    if (mapping->references == 0)
+    {
+        idleBytes -= mapping->size;
+        Unmap(mapping);
+    }
+    else
+    {
+        mapping->retired = true;
+    }
+}
+
+
+static auto TrimIdle() -> void
+{
+    while (idleBytes > options.maxIdleBytes)
+    {
+        FileMapping* oldest = nullptr;
+        for (auto& [path, mapping] : mappings)
+        {
+            if (mapping->references == 0 && (oldest == nullptr || mapping->lastUse < oldest->lastUse))
+            {
+                oldest = mapping;
+            }
+        }
+        if (oldest == nullptr)
+        {
+            return;
+        }
+        Retire(oldest);
+    }
+}
+
+
+static auto Matches(const FileMapping& mapping, const struct stat& info) -> B
+{
+    return
+        mapping.device == info.st_dev &&
+        mapping.inode == info.st_ino &&
+        mapping.size == (U64)info.st_size &&
+        mapping.modified.tv_sec == info.st_mtim.tv_sec &&
+        mapping.modified.tv_nsec == info.st_mtim.tv_nsec;
+}
+
+
+static auto Map(CStr path) -> FileMapping*
+{
+    auto fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return nullptr;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode))
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    // Empty files have nothing to map.
+    void* data = nullptr;
+    if (info.st_size > 0)
+    {
+        data = mmap(nullptr, (Size)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            close(fd);
+            return nullptr;
+        }
+        madvise(data, (Size)info.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    auto mapping = new FileMapping
+    {
+        path,
+        (const U8*)data,
+        (U64)info.st_size,
+        info.st_dev,
+        info.st_ino,
+        info.st_mtim,
+        0,
+        0,
+        false,
+        Str()
+    };
+    mappedBytes += mapping->size;
+    idleBytes += mapping->size;
+    mappings.emplace(mapping->path, mapping);
+
+    return mapping;
+}
+
+
+// While a response holds the mapping, it describes what is being sent, so
+// the stat mongoose makes after opening is answered from it.
+static auto MappedStat(CStr path, size_t* size, time_t* mtime) -> int
+{
+    auto position = Find(path);
+    if (position != mappings.end() && position->second->references > 0)
+    {
+        auto mapping = position->second;
+        if (size != nullptr)
+        {
+            *size = mapping->size;
+        }
+        if (mtime != nullptr)
+        {
+            *mtime = mapping->modified.tv_sec;
+        }
+        return MG_FS_READ;
+    }
+
+    return mg_fs_posix.st(path, size, mtime);
+}
+
+
+// Hashed under the same guard as reads, a file truncated meanwhile gets
+// the tag of its modification time and size.
+static auto Tag(FileMapping* mapping) -> const Str&
+{
+    if (!mapping->etag.empty())
+    {
+        return mapping->etag;
+    }
+
+    if (mapping->size <= options.maxHashedSize)
+    {
+        sigjmp_buf fault;
+        if (sigsetjmp(fault, 0) == 0)
+        {
+            readFault = &fault;
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+            mapping->etag = ContentTag(mapping->data, mapping->size);
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+        }
+        readFault = nullptr;
+    }
+
+    if (mapping->etag.empty())
+    {
+        // Same format as mongoose's mg_http_etag.
+        mapping->etag = "\"" + std::to_string((U64)mapping->modified.tv_sec) + "." + std::to_string(mapping->size) + "\"";
+    }
+
+    return mapping->etag;
+}
+
+
+// Like MappedStat, for the file mongoose has open.
+static auto MappedTag(CStr path, C* buffer, size_t length) -> bool
+{
+    auto position = Find(path);
+    if (position == mappings.end() || position->second->references == 0)
+    {
+        return false;
+    }
+
+    auto& etag = Tag(position->second);
+    if (etag.size() >= length)
+    {
+        return false;
+    }
+    memcpy(buffer, etag.c_str(), etag.size() + 1);
+
+    return true;
+}
+
+
+static auto MappedList(CStr path, void (*fn)(CStr, void*), void* userData) -> void
+{
+    mg_fs_posix.ls(path, fn, userData);
+}
+
+
+static auto MappedOpen(CStr path, int flags) -> void*
+{
+    if ((flags & MG_FS_WRITE) != 0)
+    {
+        return nullptr;
+    }
+
+    struct stat info;
+    if (stat(path, &info) != 0 || !S_ISREG(info.st_mode))
+    {
+        return nullptr;
+    }
+
+    FileMapping* mapping = nullptr;
+    auto position = Find(path);
+    if (position != mappings.end())
+    {
+        mapping = position->second;
+        if (!Matches(*mapping, info))
+        {
+            Retire(mapping);
+            mapping = nullptr;
+        }
+    }
+
+    if (mapping == nullptr)
+    {
+        InstallBusErrorHandler();
+        mapping = Map(path);
+        if (mapping == nullptr)
+        {
+            return nullptr;
+        }
+    }
+
+    if (mapping->references++ == 0)
+    {
+        idleBytes -= mapping->size;
+    }
+
+    if (spareFiles.empty())
+    {
+        return new MappedFile{ mapping, 0 };
+    }
+
+    auto file = spareFiles.back();
+    spareFiles.pop_back();
+    *file = { mapping, 0 };
+    return file;
+}
+
+
+static auto MappedClose(void* fd) -> void
+{
+    auto file = (MappedFile*)fd;
+    auto mapping = file->mapping;
+    spareFiles.push_back(file);
+
+    if (--mapping->references > 0)
+    {
+        return;
+    }
+
+    if (mapping->retired)
+    {
+        Unmap(mapping);
+        return;
+    }
+
+    mapping->lastUse = ++useCounter;
+    idleBytes += mapping->size;
+    TrimIdle();
+}
+
+
+static auto MappedRead(void* fd, void* buffer, size_t length) -> size_t
+{
+    auto file = (MappedFile*)fd;
+    auto mapping = file->mapping;
+    length = std::min<Size>(length, mapping->size - file->position);
+    if (length == 0)
+    {
+        return 0;
+    }
+
+    sigjmp_buf fault;
+    if (sigsetjmp(fault, 0) != 0)
+    {
+        // Truncated on disk, the pages past the new end are gone.
+        readFault = nullptr;
+        if (!mapping->retired)
+        {
+            Retire(mapping);
+        }
+        file->position = mapping->size;
+        return 0;
+    }
+
+    // The fences keep the copy between the stores the handler looks at.
+    readFault = &fault;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    memcpy(buffer, mapping->data + file->position, length);
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    readFault = nullptr;
+    file->position += length;
+
+    return length;
+}
+
+
+static auto MappedWrite(void*, const void*, size_t) -> size_t
+{
+    return 0;
+}
+
+
+static auto MappedSeek(void* fd, size_t offset) -> size_t
+{
+    auto file = (MappedFile*)fd;
+    file->position = std::min<Size>(offset, file->mapping->size);
+
+    return file->position;
+}
+
+
+static auto MappedRename(CStr, CStr) -> bool
+{
+    return false;
+}
+
+
+static auto MappedRemove(CStr) -> bool
+{
+    return false;
+}
+
+
+mg_fs mappedFs =
+{
+    MappedStat,
+    MappedList,
+    MappedOpen,
+    MappedClose,
+    MappedRead,
+    MappedWrite,
+    MappedSeek,
+    MappedRename,
+    MappedRemove,
+    MappedRemove,
+    MappedTag
+};
+
+
+auto
+SetMappedFsOptions(const MappedFsOptions& newOptions) -> void
+{
+    options = newOptions;
+    TrimIdle();
+}
+
+
+auto
+GetMappedFileInfo(void* fd) -> MappedFileInfo
+{
+    auto mapping = ((MappedFile*)fd)->mapping;
+    return { mapping->size, mapping->modified.tv_sec, Tag(mapping) };
+}
+
+
+auto
+GetMappedFileCount() -> U64
+{
+    return mappings.size();
+}
+
+
+auto
+GetMappedBytes() -> U64
+{
+    return mappedBytes;
+}
@@ -0,0 +1,60 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+
+#include "mongoose/mongoose.h"
+
+#include <ctime>
+
+
+struct MappedFsOptions
+{
+    // Mappings no response is using stay for the next request up to this
+    // many bytes, the least recently used are unmapped past it.
+    U64 maxIdleBytes = 256 * 1024 * 1024;
+    // Files up to this size get an ETag of their contents, hashed once per
+    // mapping. Larger ones get mongoose's of modification time and size.
+    U64 maxHashedSize = 4 * 1024 * 1024;
+};
+
+
+struct MappedFileInfo
+{
+    U64 size;
+    time_t modified;
+    // Quoted, valid while the file is open.
+    StrView etag;
+};
+
+
+// Read only mongoose file system that maps each file once and serves every
+// connection from the same mapping, so a response costs no read syscalls
+// past the open. A mapping is checked against the file on every open and
+// replaced when the file changed. A file truncated in place while being
+// sent ends that response early instead of raising SIGBUS.
+// Runs on the reactor thread.
+extern mg_fs mappedFs;
+
+void SetMappedFsOptions(const MappedFsOptions& options);
+// Of a file opened with mappedFs.
+MappedFileInfo GetMappedFileInfo(void* fd);
+U64 GetMappedFileCount();
+U64 GetMappedBytes();
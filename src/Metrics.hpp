@@ -0,0 +1,100 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+#include "Utils.hpp"
+
+
+struct ServerMetrics
+{
+    U64 activeConnections = 0;
+    U64 queueDepth = 0;
+    U64 rejectedConnections = 0;
+    U64 timedOutConnections = 0;
+    U64 oversizedRequests = 0;
+    U64 rateLimitedRequests = 0;
+    U64 loopLagUs = 0;
+    U64 peakLoopLagUs = 0;
+    U64 shedRequests = 0;
+    U64 certificateReloads = 0;
+    U64 routingUpdates = 0;
+    U64 webSocketConnections = 0;
+    U64 publishedMessages = 0;
+    U64 evictedSubscribers = 0;
+    U64 eventStreams = 0;
+    U64 broadcastEvents = 0;
+    U64 proxiedRequests = 0;
+    U64 upstreamFailures = 0;
+    U64 runningCommands = 0;
+    U64 queuedCommands = 0;
+    U64 failedCommands = 0;
+    U64 mappedFiles = 0;
+    U64 mappedBytes = 0;
+    U64 http2Connections = 0;
+    U64 http2Streams = 0;
+    U64 poolReservedBytes = 0;
+    U64 poolUsedBytes = 0;
+    U64 poolHits = 0;
+    U64 poolMisses = 0;
+    U64 remoteCpuConnections = 0;
+    U64 accessLogRecords = 0;
+    U64 accessLogDropped = 0;
+
+    Str ToJSON() const
+    {
+        Vec<JSONValue<U64>> values =
+        {
+            { "activeConnections", activeConnections },
+            { "queueDepth", queueDepth },
+            { "rejectedConnections", rejectedConnections },
+            { "timedOutConnections", timedOutConnections },
+            { "oversizedRequests", oversizedRequests },
+            { "rateLimitedRequests", rateLimitedRequests },
+            { "loopLagUs", loopLagUs },
+            { "peakLoopLagUs", peakLoopLagUs },
+            { "shedRequests", shedRequests },
+            { "certificateReloads", certificateReloads },
+            { "routingUpdates", routingUpdates },
+            { "webSocketConnections", webSocketConnections },
+            { "publishedMessages", publishedMessages },
+            { "evictedSubscribers", evictedSubscribers },
+            { "eventStreams", eventStreams },
+            { "broadcastEvents", broadcastEvents },
+            { "proxiedRequests", proxiedRequests },
+            { "upstreamFailures", upstreamFailures },
+            { "runningCommands", runningCommands },
+            { "queuedCommands", queuedCommands },
+            { "failedCommands", failedCommands },
+            { "mappedFiles", mappedFiles },
+            { "mappedBytes", mappedBytes },
+            { "http2Connections", http2Connections },
+            { "http2Streams", http2Streams },
+            { "poolReservedBytes", poolReservedBytes },
+            { "poolUsedBytes", poolUsedBytes },
+            { "poolHits", poolHits },
+            { "poolMisses", poolMisses },
+            { "remoteCpuConnections", remoteCpuConnections },
+            { "accessLogRecords", accessLogRecords },
+            { "accessLogDropped", accessLogDropped }
+        };
+
+        return ::ToJSON(values);
+    }
+};
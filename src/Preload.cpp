@@ -0,0 +1,265 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "Preload.hpp"
+#include "Assets.hpp"
+#include "Utils.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <sys/stat.h>
+
+
+static auto ReadAsset(StrView path, B embedded, Str* contents) -> B
+{
+    auto asset = embedded? FindEmbeddedAsset(path) : nullptr;
+    if (asset != nullptr)
+    {
+        contents->assign((CStr)asset->identity.data, asset->identity.size);
+        return true;
+    }
+
+    std::ifstream file(Str(DOCUMENT_ROOT) + Str(path), std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+    contents->assign(std::istreambuf_iterator<C>(file), std::istreambuf_iterator<C>());
+
+    return true;
+}
+
+
+static auto Exists(StrView path, B embedded) -> B
+{
+    if (embedded && FindEmbeddedAsset(path) != nullptr)
+    {
+        return true;
+    }
+
+    struct stat info;
+    return stat((Str(DOCUMENT_ROOT) + Str(path)).c_str(), &info) == 0 && S_ISREG(info.st_mode);
+}
+
+
+// Relative references are resolved against dir, as emscripten's
+// locateFile does against the script's directory.
+static auto Resolve(StrView dir, StrView reference) -> Str
+{
+    if (reference.starts_with('/'))
+    {
+        return Str(reference);
+    }
+    while (reference.starts_with("./"))
+    {
+        reference.remove_prefix(2);
+    }
+    if (dir.ends_with('/'))
+    {
+        dir.remove_suffix(1);
+    }
+
+    return Str(dir) + "/" + Str(reference);
+}
+
+
+static auto ListScripts(StrView dir, B embedded) -> Vec<Str>
+{
+    Vec<Str> scripts;
+    auto base = dir.ends_with('/')? dir.substr(0, dir.size() - 1) : dir;
+
+    if (embedded)
+    {
+        struct Listing
+        {
+            StrView base;
+            Vec<Str>* scripts;
+        } listing = { base, &scripts };
+
+        Str directory(dir);
+        embeddedFs.ls(
+                       directory.c_str(),
+                       [](CStr name, void* userData)
+                       {
+                           auto listing = (Listing*)userData;
+                           auto path = Str(listing->base) + "/" + name;
+                           if (path.ends_with(".js") && FindEmbeddedAsset(path) != nullptr)
+                           {
+                               listing->scripts->push_back(std::move(path));
+                           }
+                       },
+                       &listing
+                     );
+    }
+
+    std::error_code error;
+    for (auto& entry : std::filesystem::directory_iterator(Str(DOCUMENT_ROOT) + Str(dir), error))
+    {
+        auto name = entry.path().filename().string();
+        if (name.ends_with(".js") && entry.is_regular_file(error))
+        {
+            scripts.push_back(Str(base) + "/" + name);
+        }
+    }
+
+    std::sort(scripts.begin(), scripts.end());
+    scripts.erase(std::unique(scripts.begin(), scripts.end()), scripts.end());
+
+    return scripts;
+}
+
+
+// Quoted literals naming a .wasm or .data file, wasmBinaryFile,
+// locateFile("app.wasm") or the file packager's REMOTE_PACKAGE_BASE.
+static auto FindLoadedFiles(StrView script, StrView dir, Vec<Str>* paths) -> void
+{
+    static constexpr Size maxLiteralLength = 256;
+
+    auto isPathChar = [](C c)
+    {
+        return
+            (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+            c == '.' || c == '_' || c == '-' || c == '/';
+    };
+
+    for (Size position = 0; position < script.size(); ++position)
+    {
+        auto quote = script[position];
+        if (quote != '"' && quote != '\'' && quote != '`')
+        {
+            continue;
+        }
+
+        auto end = position + 1;
+        while (end < script.size() && end - position <= maxLiteralLength && isPathChar(script[end]))
+        {
+            ++end;
+        }
+        if (end >= script.size() || script[end] != quote)
+        {
+            continue;
+        }
+
+        auto literal = script.substr(position + 1, end - position - 1);
+        if (literal.ends_with(".wasm") || literal.ends_with(".data"))
+        {
+            paths->push_back(Resolve(dir, literal));
+        }
+        position = end;
+    }
+}
+
+
+auto
+FindPreloads(StrView dir, StrView manifest, B embedded) -> Vec<Str>
+{
+    Vec<Str> candidates;
+    Str contents;
+
+    if (!manifest.empty())
+    {
+        if (!ReadAsset(manifest, embedded, &contents))
+        {
+            LogErr("Cannot read the preload manifest ", manifest);
+            return {};
+        }
+
+        StrView lines = contents;
+        while (!lines.empty())
+        {
+            auto end = lines.find('\n');
+            auto line = lines.substr(0, end);
+            lines = (end == StrView::npos)? StrView() : lines.substr(end + 1);
+
+            auto first = line.find_first_not_of(" \t\r");
+            auto last = line.find_last_not_of(" \t\r");
+            if (first == StrView::npos || line[first] == '#')
+            {
+                continue;
+            }
+            candidates.push_back(Resolve(dir, line.substr(first, last - first + 1)));
+        }
+    }
+    else
+    {
+        for (auto& script : ListScripts(dir, embedded))
+        {
+            if (ReadAsset(script, embedded, &contents))
+            {
+                FindLoadedFiles(contents, dir, &candidates);
+            }
+        }
+    }
+
+    Vec<Str> paths;
+    for (auto& path : candidates)
+    {
+        if (std::find(paths.begin(), paths.end(), path) == paths.end() && Exists(path, embedded))
+        {
+            paths.push_back(path);
+        }
+    }
+
+    return paths;
+}
+
+
+// The destination the browser fetches the file as, a preload is only used
+// when it matches.
+static auto Destination(StrView path) -> StrView
+{
+    if (path.ends_with(".js") || path.ends_with(".mjs"))
+    {
+        return "script";
+    }
+    if (path.ends_with(".css"))
+    {
+        return "style";
+    }
+    if (path.ends_with(".woff2") || path.ends_with(".woff") || path.ends_with(".ttf") || path.ends_with(".otf"))
+    {
+        return "font; crossorigin";
+    }
+
+    // Emscripten fetches .wasm and .data in cors mode.
+    return "fetch; crossorigin";
+}
+
+
+auto
+RenderPreloadLinks(const Vec<Str>& paths) -> Str
+{
+    if (paths.empty())
+    {
+        return {};
+    }
+
+    Str links = "Link: ";
+    for (auto& path : paths)
+    {
+        if (&path != &paths.front())
+        {
+            links += ", ";
+        }
+        links += "<" + path + ">; rel=preload; as=" + Str(Destination(path));
+    }
+    links += "\r\n";
+
+    return links;
+}
@@ -0,0 +1,33 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+
+
+// Request paths of what an emscripten build under dir loads. Read from the
+// manifest when given, one request path per line and `#` comments,
+// otherwise from the string literals naming `.wasm` and `.data` files in
+// the `.js` files directly in dir. Paths that do not exist are dropped.
+// Files are looked up among the embedded assets first when embedded is set,
+// then under the document root.
+Vec<Str> FindPreloads(StrView dir, StrView manifest, B embedded);
+
+// A Link header line preloading the paths, empty for none.
+Str RenderPreloadLinks(const Vec<Str>& paths);
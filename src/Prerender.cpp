@@ -0,0 +1,247 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "Prerender.hpp"
+#include "HttpCache.hpp"
+#include "HttpParser.hpp"
+#include "Utils.hpp"
+
+#include <fstream>
+#include <iterator>
+#include <sys/stat.h>
+
+
+static auto ReadFile(const Str& path, Str* contents) -> B
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+
+    contents->assign(std::istreambuf_iterator<C>(file), std::istreambuf_iterator<C>());
+    return !file.bad();
+}
+
+
+static auto ModifiedNs(const struct stat& info) -> I64
+{
+    return (I64)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+}
+
+
+PrerenderedPage::PrerenderedPage() :
+    status(200),
+    device(0),
+    inode(0),
+    size(0),
+    modifiedNs(0),
+    loaded(false)
+{
+}
+
+
+auto
+PrerenderedPage::Init(U32 pageStatus, const Vec<Str>& files) -> void
+{
+    status = pageStatus;
+    candidates = files;
+    Refresh();
+}
+
+
+auto
+PrerenderedPage::Refresh() -> void
+{
+    for (auto& file : candidates)
+    {
+        struct stat info;
+        if (stat(file.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+        {
+            continue;
+        }
+
+        auto unchanged =
+            loaded &&
+            path == file &&
+            device == (U64)info.st_dev &&
+            inode == (U64)info.st_ino &&
+            size == (U64)info.st_size &&
+            modifiedNs == ModifiedNs(info);
+        if (!unchanged)
+        {
+            Load(file);
+        }
+        return;
+    }
+
+    loaded = false;
+}
+
+
+auto
+PrerenderedPage::Load(const Str& file) -> void
+{
+    struct stat info;
+    Str contents;
+    if (stat(file.c_str(), &info) != 0 || !ReadFile(file, &contents))
+    {
+        loaded = false;
+        return;
+    }
+
+    path = file;
+    device = info.st_dev;
+    inode = info.st_ino;
+    size = info.st_size;
+    modifiedNs = ModifiedNs(info);
+
+    // Variants older than the page were not made from this version.
+    auto variantIsCurrent = [&](const Str& variant)
+    {
+        struct stat variantInfo;
+        return stat(variant.c_str(), &variantInfo) == 0 && ModifiedNs(variantInfo) >= modifiedNs;
+    };
+    auto hasBrotli = variantIsCurrent(file + ".br");
+    auto hasGzip = variantIsCurrent(file + ".gz");
+    auto hasVariants = hasBrotli || hasGzip;
+
+    identity.body = std::move(contents);
+    LoadVariant(&identity, file, nullptr, hasVariants);
+    if (!hasBrotli || !LoadVariant(&brotli, file + ".br", "br", hasVariants))
+    {
+        brotli = PrerenderedResponse();
+    }
+    if (!hasGzip || !LoadVariant(&gzip, file + ".gz", "gzip", hasVariants))
+    {
+        gzip = PrerenderedResponse();
+    }
+
+    loaded = true;
+    Log("Prerendered ", file, (hasVariants? " with compressed variants" : ""));
+}
+
+
+// Reads the body unless encoding is null, in which case it is already set.
+auto
+PrerenderedPage::LoadVariant(
+                              PrerenderedResponse* response,
+                              const Str& file,
+                              CStr encoding,
+                              B hasVariants
+                            ) -> B
+{
+    if (encoding != nullptr && !ReadFile(file, &response->body))
+    {
+        return false;
+    }
+
+    struct stat info;
+    if (stat(file.c_str(), &info) != 0)
+    {
+        return false;
+    }
+
+    response->etag = ContentTag((const U8*)response->body.data(), response->body.size());
+    response->modified = info.st_mtime;
+
+    Str common = "Etag: " + response->etag + "\r\n";
+    C lastModified[httpDateLength + 1];
+    if (FormatHttpDate(response->modified, lastModified))
+    {
+        common += Str("Last-Modified: ") + lastModified + "\r\n";
+    }
+    if (encoding != nullptr)
+    {
+        common += Str("Content-Encoding: ") + encoding + "\r\n";
+    }
+    if (hasVariants)
+    {
+        common += "Vary: Accept-Encoding\r\n";
+    }
+
+    response->head =
+        Str(StatusLine(status)) +
+        "Content-Type: text/html; charset=utf-8\r\n" +
+        common +
+        "Content-Length: " + std::to_string(response->body.size()) + "\r\n";
+    // Without Content-Length, see ContentLengthLine.
+    response->notModifiedHead =
+        Str(StatusLine(304)) +
+        common;
+
+    return true;
+}
+
+
+auto
+PrerenderedPage::IsLoaded() const -> B
+{
+    return loaded;
+}
+
+
+auto
+PrerenderedPage::Serve(
+                        mg_connection* c,
+                        mg_http_message* hm,
+                        std::initializer_list<StrView> extraHeaders
+                      ) const -> B
+{
+    if (!loaded || FindHeader(hm, KnownHeader::Range) != nullptr)
+    {
+        return false;
+    }
+
+    auto acceptEncoding = FindHeader(hm, KnownHeader::AcceptEncoding);
+    StrView accepted = acceptEncoding? StrView(acceptEncoding->ptr, acceptEncoding->len) : StrView();
+    auto response = &identity;
+    if (!brotli.head.empty() && AcceptsEncoding(accepted, "br"))
+    {
+        response = &brotli;
+    }
+    else if (!gzip.head.empty() && AcceptsEncoding(accepted, "gzip"))
+    {
+        response = &gzip;
+    }
+
+    auto notModified = status == 200 && IsNotModified(hm, response->etag, response->modified);
+
+    static constexpr Size maxPieces = 8;
+    if (extraHeaders.size() > maxPieces - 3)
+    {
+        return false;
+    }
+
+    Arr<StrView, maxPieces> pieces;
+    Size count = 0;
+    pieces[count++] = notModified? response->notModifiedHead : response->head;
+    for (auto headers : extraHeaders)
+    {
+        pieces[count++] = headers;
+    }
+    pieces[count++] = "\r\n";
+    if (!notModified && mg_vcasecmp(&hm->method, "HEAD") != 0)
+    {
+        pieces[count++] = response->body;
+    }
+    SendPieces(c, pieces.data(), count);
+    c->is_resp = 0;
+
+    return true;
+}
@@ -0,0 +1,74 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+#include "HeaderCache.hpp"
+
+#include "mongoose/mongoose.h"
+
+#include <initializer_list>
+
+
+struct PrerenderedResponse
+{
+    // Status line and headers up to the request specific ones.
+    Str head;
+    Str notModifiedHead;
+    Str body;
+    Str etag;
+    time_t modified;
+};
+
+
+// An HTML page on disk rendered into complete responses, identity and the
+// `.br` and `.gz` files next to it, so serving it is a copy into the send
+// buffer. The first of the candidate files that exists is used, Refresh
+// picks up changes.
+class PrerenderedPage
+{
+public:
+    PrerenderedPage();
+
+    void Init(U32 status, const Vec<Str>& candidates);
+    void Refresh();
+    B IsLoaded() const;
+
+    // False, with nothing written, when the page is not loaded or for a
+    // Range request, which is left to the file serving. The extra header
+    // lines are copied after the page's own, at most five pieces.
+    B Serve(mg_connection* c, mg_http_message* hm, std::initializer_list<StrView> extraHeaders) const;
+
+private:
+    U32 status;
+    Vec<Str> candidates;
+    // Of the file loaded, to notice when it changes.
+    Str path;
+    U64 device;
+    U64 inode;
+    U64 size;
+    I64 modifiedNs;
+    B loaded;
+    PrerenderedResponse identity;
+    PrerenderedResponse brotli;
+    PrerenderedResponse gzip;
+
+    void Load(const Str& file);
+    B LoadVariant(PrerenderedResponse* response, const Str& file, CStr encoding, B hasVariants);
+};
@@ -0,0 +1,1244 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "Proxy.hpp"
+#include "ConnectionTracker.hpp"
+#include "SendQueue.hpp"
+#include "Utils.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <strings.h>
+
+
+using State = ProxyExchange::State;
+using ChunkState = ProxyExchange::ChunkState;
+
+
+static auto NameIs(StrView name, StrView expected) -> B
+{
+    return
+        name.size() == expected.size() &&
+        strncasecmp(name.data(), expected.data(), name.size()) == 0;
+}
+
+
+// Headers that only apply to one connection and are not forwarded.
+static auto IsHopByHop(StrView name) -> B
+{
+    return
+        NameIs(name, "Connection") ||
+        NameIs(name, "Keep-Alive") ||
+        NameIs(name, "Proxy-Connection") ||
+        NameIs(name, "TE") ||
+        NameIs(name, "Trailer") ||
+        NameIs(name, "Transfer-Encoding") ||
+        NameIs(name, "Upgrade");
+}
+
+
+// Whether a comma separated header value lists the token.
+static auto HasToken(StrView value, StrView token) -> B
+{
+    while (!value.empty())
+    {
+        auto end = value.find(',');
+        auto item = value.substr(0, end);
+        value.remove_prefix(end == StrView::npos ? value.size() : end + 1);
+
+        while (!item.empty() && item.front() == ' ')
+        {
+            item.remove_prefix(1);
+        }
+        while (!item.empty() && item.back() == ' ')
+        {
+            item.remove_suffix(1);
+        }
+        if (NameIs(item, token))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+// Calls fn with the name and value of every header of a head, the start
+// line is skipped. Not limited to MG_MAX_HTTP_HEADERS like mg_http_parse.
+template <typename Fn>
+static auto ForEachHeader(StrView head, Fn fn) -> void
+{
+    auto end = head.find('\n');
+    head.remove_prefix(end == StrView::npos ? head.size() : end + 1);
+
+    while (!head.empty())
+    {
+        end = head.find('\n');
+        auto line = head.substr(0, end);
+        head.remove_prefix(end == StrView::npos ? head.size() : end + 1);
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.remove_suffix(1);
+        }
+
+        auto colon = line.find(':');
+        if (colon == StrView::npos)
+        {
+            continue;
+        }
+
+        auto value = line.substr(colon + 1);
+        while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+        {
+            value.remove_prefix(1);
+        }
+        fn(line.substr(0, colon), value);
+    }
+}
+
+
+// The error status for a request whose body cannot be passed on as it
+// was framed, zero if it can. mongoose only dechunks a single
+// Transfer-Encoding of exactly chunked, other codings would be framed by
+// Content-Length. With both headers the upstream would get both, which
+// RFC 9112 section 6.3 leaves an intermediary no way to forward safely.
+static auto CheckRequestFraming(StrView head) -> U32
+{
+    U32 encodings = 0;
+    B chunked = false;
+    B hasLength = false;
+    ForEachHeader(head, [&](StrView name, StrView value)
+    {
+        if (NameIs(name, "Content-Length"))
+        {
+            hasLength = true;
+        }
+        else if (NameIs(name, "Transfer-Encoding"))
+        {
+            while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+            {
+                value.remove_suffix(1);
+            }
+            encodings++;
+            chunked = NameIs(value, "chunked");
+        }
+    });
+
+    if (encodings == 0)
+    {
+        return 0;
+    }
+    if (hasLength)
+    {
+        return 400;
+    }
+    return (encodings == 1 && chunked)? 0 : 501;
+}
+
+
+// Status code of a response head, zero if it is not one.
+static auto ParseStatus(StrView head) -> U32
+{
+    if (head.substr(0, 5) != "HTTP/")
+    {
+        return 0;
+    }
+
+    auto space = head.find(' ');
+    U32 status = 0;
+    if (space == StrView::npos)
+    {
+        return 0;
+    }
+    std::from_chars(head.data() + space + 1, head.data() + head.size(), status);
+
+    return status;
+}
+
+
+static auto ReplyError(mg_connection* c, U32 code, const Str& headers) -> void
+{
+    auto reason =
+        (code == 400)? "Bad Request" :
+        (code == 501)? "Not Implemented" :
+        (code == 504)? "Gateway Timeout" : "Bad Gateway";
+
+    // mongoose has no reason phrase for these codes.
+    mg_printf(
+               c,
+               "HTTP/1.1 %u %s\r\n"
+               "Content-Length: 0\r\n"
+               "%s\r\n",
+               code,
+               reason,
+               headers.c_str()
+             );
+    c->is_resp = 0;
+}
+
+
+ReverseProxy::ReverseProxy() :
+    mgr(nullptr),
+    requestCount(0),
+    failureCount(0)
+{
+}
+
+
+auto
+ReverseProxy::AddRoute(const Vec<Str>& upstreams, const ProxyOptions& options) -> ProxyRoute*
+{
+    auto route = std::make_unique<ProxyRoute>();
+    route->proxy = this;
+    route->options = options;
+    route->nextUpstream = 0;
+
+    for (auto& spec : upstreams)
+    {
+        StrView host = spec;
+        if (host.substr(0, 7) == "http://")
+        {
+            host.remove_prefix(7);
+        }
+        else if (host.find("://") != StrView::npos)
+        {
+            LogErr("Proxy: only http:// upstreams are supported, skipping ", spec);
+            continue;
+        }
+        host = host.substr(0, host.find('/'));
+
+        auto colon = host.rfind(':');
+        auto name = Str(host.substr(0, colon));
+        auto port = (colon == StrView::npos)? Str("80") : Str(host.substr(colon + 1));
+
+        // Resolved once, mongoose would otherwise ask its DNS server on
+        // every connect.
+        addrinfo hints = {};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* result = nullptr;
+        if (getaddrinfo(name.c_str(), port.c_str(), &hints, &result) != 0)
+        {
+            LogErr("Proxy: can't resolve upstream ", spec);
+            continue;
+        }
+
+        C address[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &((sockaddr_in*)result->ai_addr)->sin_addr, address, sizeof(address));
+        freeaddrinfo(result);
+
+        auto upstream = std::make_unique<Upstream>();
+        upstream->route = route.get();
+        upstream->url = Str("tcp://") + address + ":" + port;
+        upstream->host = Str(host);
+        upstream->outstanding = 0;
+        upstream->failures = 0;
+        upstream->healthy = true;
+        upstream->healthCheck = nullptr;
+        route->upstreams.push_back(std::move(upstream));
+    }
+
+    if (route->upstreams.empty())
+    {
+        return nullptr;
+    }
+
+    routes.push_back(std::move(route));
+    return routes.back().get();
+}
+
+
+auto
+ReverseProxy::Start(mg_mgr* manager) -> void
+{
+    mgr = manager;
+
+    for (auto& route : routes)
+    {
+        auto& options = route->options;
+        if (!options.healthCheckPath.empty() && options.healthCheckIntervalMs != 0)
+        {
+            mg_timer_add(
+                          mgr,
+                          options.healthCheckIntervalMs,
+                          MG_TIMER_REPEAT,
+                          ReverseProxy::OnHealthCheckTimer,
+                          route.get()
+                        );
+        }
+    }
+}
+
+
+auto
+ReverseProxy::Pick(ProxyRoute* route, Upstream* exclude) -> Upstream*
+{
+    auto& upstreams = route->upstreams;
+    auto count = (U32)upstreams.size();
+    Upstream* best = nullptr;
+
+    // Least outstanding requests among the healthy ones. When none is
+    // healthy all of them are tried rather than failing every request.
+    for (U32 i = 0; i < count; ++i)
+    {
+        auto upstream = upstreams[(route->nextUpstream + i) % count].get();
+        if (upstream == exclude)
+        {
+            continue;
+        }
+        if (
+             best == nullptr ||
+             (upstream->healthy && !best->healthy) ||
+             (upstream->healthy == best->healthy && upstream->outstanding < best->outstanding)
+           )
+        {
+            best = upstream;
+        }
+    }
+    route->nextUpstream = (route->nextUpstream + 1) % count;
+
+    return best;
+}
+
+
+auto
+ReverseProxy::Begin(
+                     ProxyRoute* route,
+                     mg_connection* client,
+                     mg_http_message* hm
+                   ) -> ProxyExchange*
+{
+    auto& options = route->options;
+
+    auto framingError = CheckRequestFraming(StrView(hm->head.ptr, hm->head.len));
+    if (framingError != 0)
+    {
+        // Where the body ends is unclear, the connection cannot be reused.
+        ((ConnectionRecord*)client->fn_data)->closeAfterResponse = true;
+        ReplyError(client, framingError, "Connection: close\r\n");
+        return nullptr;
+    }
+
+    auto upstream = Pick(route);
+
+    auto exchange = new ProxyExchange();
+    exchange->upstream = upstream;
+    exchange->client = client;
+    exchange->connection = nullptr;
+    exchange->deadlineMs = 0;
+    exchange->bodyBytesSent = 0;
+    exchange->remaining = 0;
+    exchange->trailerLineLength = 0;
+    exchange->attempts = 0;
+    exchange->state = State::Head;
+    exchange->chunkState = ChunkState::Size;
+    exchange->headRequest = mg_vcmp(&hm->method, "HEAD") == 0;
+    exchange->requestDone = false;
+    exchange->bodyPending = true;
+    exchange->connected = false;
+    exchange->reused = false;
+    exchange->keepAlive = false;
+
+    // Bodies without a length, chunked or delimited by the close, go to
+    // the upstream chunked.
+    auto contentLength = mg_http_get_header(hm, "Content-Length");
+    auto transferEncoding = mg_http_get_header(hm, "Transfer-Encoding");
+    exchange->chunkedRequest =
+        transferEncoding != nullptr ||
+        (contentLength == nullptr && hm->body.len == (Size)~0);
+
+    auto& head = exchange->requestHead;
+    head.reserve(hm->head.len + 128);
+
+    // The request target, query included.
+    auto targetEnd = hm->query.len > 0? hm->query.ptr + hm->query.len : hm->uri.ptr + hm->uri.len;
+    head.append(hm->method.ptr, hm->method.len);
+    head += ' ';
+    head.append(hm->uri.ptr, targetEnd - hm->uri.ptr);
+    head += " HTTP/1.1\r\n";
+
+    Str forwardedFor;
+    B hasHost = false;
+    ForEachHeader(StrView(hm->head.ptr, hm->head.len), [&](StrView name, StrView value)
+    {
+        // The client already got its 100 Continue. A chunked body has no
+        // length, whatever the client declared.
+        if (IsHopByHop(name) || NameIs(name, "Expect"))
+        {
+            return;
+        }
+        if (exchange->chunkedRequest && NameIs(name, "Content-Length"))
+        {
+            return;
+        }
+        if (NameIs(name, "Host"))
+        {
+            hasHost = true;
+            if (!options.preserveHost)
+            {
+                return;
+            }
+        }
+        if (NameIs(name, "X-Forwarded-For"))
+        {
+            forwardedFor = Str(value) + ", ";
+            return;
+        }
+
+        head.append(name);
+        head += ": ";
+        head.append(value);
+        head += "\r\n";
+    });
+
+    exchange->addHost = !options.preserveHost || !hasHost;
+
+    C ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client->rem.ip, ip, sizeof(ip));
+    head += "X-Forwarded-For: " + forwardedFor + ip + "\r\n";
+    head += client->is_tls? "X-Forwarded-Proto: https\r\n" : "X-Forwarded-Proto: http\r\n";
+    if (exchange->chunkedRequest)
+    {
+        head += "Transfer-Encoding: chunked\r\n";
+    }
+
+    if (!Connect(exchange, true))
+    {
+        failureCount++;
+        // The body is left unread, see Server::DiscardBody.
+        ((ConnectionRecord*)client->fn_data)->closeAfterResponse = true;
+        ReplyError(client, 502, "Connection: close\r\n");
+        delete exchange;
+        return nullptr;
+    }
+
+    requestCount++;
+    ((ConnectionRecord*)client->fn_data)->proxyExchange = exchange;
+
+    return exchange;
+}
+
+
+auto
+ReverseProxy::Connect(ProxyExchange* exchange, B allowReuse) -> B
+{
+    auto upstream = exchange->upstream;
+    auto& options = upstream->route->options;
+    mg_connection* c = nullptr;
+
+    while (allowReuse && c == nullptr && !upstream->idle.empty())
+    {
+        c = upstream->idle.back();
+        upstream->idle.pop_back();
+        if (c->is_closing || c->is_draining)
+        {
+            c = nullptr;
+        }
+    }
+
+    exchange->reused = c != nullptr;
+    exchange->connected = exchange->reused;
+    if (c != nullptr)
+    {
+        c->fn = ReverseProxy::OnUpstreamEvent;
+        c->fn_data = exchange;
+        exchange->deadlineMs = mg_millis() + options.readTimeoutMs;
+    }
+    else
+    {
+        c = mg_connect(mgr, upstream->url.c_str(), ReverseProxy::OnUpstreamEvent, exchange);
+        if (c == nullptr)
+        {
+            return false;
+        }
+        exchange->deadlineMs = mg_millis() + options.connectTimeoutMs;
+    }
+
+    exchange->connection = c;
+    upstream->outstanding++;
+
+    // Queued until the connection is established.
+    mg_send(c, exchange->requestHead.data(), exchange->requestHead.size());
+    if (exchange->addHost)
+    {
+        mg_printf(c, "Host: %s\r\n", upstream->host.c_str());
+    }
+    mg_send(c, "\r\n", 2);
+    if (exchange->requestDone && exchange->chunkedRequest)
+    {
+        mg_send(c, "0\r\n\r\n", 5);
+    }
+
+    return true;
+}
+
+
+auto
+ReverseProxy::Failover(ProxyExchange* exchange) -> B
+{
+    auto failed = exchange->upstream;
+    auto route = failed->route;
+
+    // Only a request that never reached the upstream can be moved, and
+    // every upstream is tried once.
+    if (
+         exchange->connected ||
+         exchange->bodyBytesSent > 0 ||
+         exchange->attempts + 1 >= route->upstreams.size()
+       )
+    {
+        return false;
+    }
+
+    CountFailure(failed);
+    DropConnection(exchange);
+    exchange->attempts++;
+    exchange->upstream = Pick(route, failed);
+
+    return Connect(exchange, true);
+}
+
+
+auto
+ReverseProxy::ForwardBody(ProxyExchange* exchange, StrView chunk) -> B
+{
+    // Failed, or the upstream answered before reading the whole body.
+    if (exchange->connection == nullptr || exchange->client == nullptr)
+    {
+        return false;
+    }
+
+    auto c = exchange->connection;
+    auto& options = exchange->upstream->route->options;
+
+    if (exchange->chunkedRequest)
+    {
+        C size[24];
+        auto length = snprintf(size, sizeof(size), "%zx\r\n", chunk.size());
+        mg_send(c, size, length);
+        mg_send(c, chunk.data(), chunk.size());
+        mg_send(c, "\r\n", 2);
+    }
+    else
+    {
+        SendDirect(c, chunk, nullptr);
+    }
+
+    exchange->bodyBytesSent += chunk.size();
+    exchange->deadlineMs = mg_millis() + options.readTimeoutMs;
+
+    // Resumed from the upstream's write events.
+    if (c->send.len > options.maxBufferedBytes)
+    {
+        exchange->client->is_full = 1;
+    }
+
+    return true;
+}
+
+
+auto
+ReverseProxy::EndRequest(ProxyExchange* exchange, const Str& responseHeaders) -> void
+{
+    exchange->bodyPending = false;
+    exchange->requestDone = true;
+    exchange->responseHeaders = responseHeaders;
+
+    if (exchange->client == nullptr)
+    {
+        Release(exchange);
+        return;
+    }
+
+    if (exchange->chunkedRequest)
+    {
+        mg_send(exchange->connection, "0\r\n\r\n", 5);
+    }
+
+    // Pipelined requests are not parsed until the response is complete.
+    exchange->client->is_resp = 1;
+}
+
+
+auto
+ReverseProxy::AbortRequest(ProxyExchange* exchange) -> void
+{
+    // Half a request is on the upstream connection, it can't be reused.
+    exchange->bodyPending = false;
+    DropConnection(exchange);
+    DetachClient(exchange, false);
+    Release(exchange);
+}
+
+
+auto
+ReverseProxy::OnClientWrite(ProxyExchange* exchange) -> void
+{
+    auto c = exchange->connection;
+    auto& options = exchange->upstream->route->options;
+
+    if (c != nullptr && c->is_full && exchange->client->send.len <= options.maxBufferedBytes)
+    {
+        c->is_full = 0;
+    }
+}
+
+
+auto
+ReverseProxy::OnClientClose(ProxyExchange* exchange) -> void
+{
+    DropConnection(exchange);
+    DetachClient(exchange, false);
+    Release(exchange);
+}
+
+
+auto
+ReverseProxy::OnResponseData(ProxyExchange* exchange) -> void
+{
+    auto c = exchange->connection;
+    auto& options = exchange->upstream->route->options;
+
+    while (c->recv.len > 0 && exchange->state != State::Done)
+    {
+        StrView data((CStr)c->recv.buf, c->recv.len);
+
+        if (exchange->state == State::Head)
+        {
+            auto headLength = mg_http_get_request_len(c->recv.buf, c->recv.len);
+            if (headLength < 0 || (headLength == 0 && c->recv.len > maxResponseHeadSize))
+            {
+                Fail(exchange, 502);
+                return;
+            }
+            if (headLength == 0)
+            {
+                return;
+            }
+
+            if (!StartResponse(exchange, data.substr(0, headLength)))
+            {
+                Fail(exchange, 502);
+                return;
+            }
+            mg_iobuf_del(&c->recv, 0, headLength);
+            continue;
+        }
+
+        auto length = data.size();
+        if (exchange->state == State::Length)
+        {
+            length = std::min<U64>(length, exchange->remaining);
+            exchange->remaining -= length;
+            if (exchange->remaining == 0)
+            {
+                exchange->state = State::Done;
+            }
+        }
+        else if (exchange->state == State::Chunked)
+        {
+            length = ScanChunked(exchange, data);
+        }
+
+        // Framing included, chunked responses go out as they came in.
+        if (exchange->client != nullptr)
+        {
+            auto record = (ConnectionRecord*)exchange->client->fn_data;
+            SendDirect(exchange->client, data.substr(0, length), &record->bytesWritten);
+        }
+        mg_iobuf_del(&c->recv, 0, length);
+    }
+
+    if (exchange->state == State::Done)
+    {
+        // Whatever follows the response was not asked for.
+        if (c->recv.len > 0)
+        {
+            exchange->keepAlive = false;
+        }
+        CompleteResponse(exchange);
+    }
+    else if (
+              exchange->client != nullptr &&
+              exchange->client->send.len > options.maxBufferedBytes
+            )
+    {
+        // Resumed from the client's write events.
+        c->is_full = 1;
+    }
+}
+
+
+auto
+ReverseProxy::StartResponse(ProxyExchange* exchange, StrView head) -> B
+{
+    auto status = ParseStatus(head);
+    if (status < 100 || status > 999)
+    {
+        return false;
+    }
+    // Interim responses are dropped, the client already got its 100
+    // Continue and upgrades are not forwarded.
+    if (status < 200)
+    {
+        return true;
+    }
+
+    auto client = exchange->client;
+    if (client == nullptr)
+    {
+        return false;
+    }
+    auto record = (ConnectionRecord*)client->fn_data;
+    // The head may go straight to the socket, past where the access log
+    // looks for it.
+    record->access.status = U16(status);
+
+    auto lineEnd = head.find('\r');
+    exchange->keepAlive = head.substr(0, 8) == "HTTP/1.1";
+
+    Str response;
+    response.reserve(head.size() + exchange->responseHeaders.size() + 64);
+    response += "HTTP/1.1";
+    response.append(head.substr(8, lineEnd - 8));
+    response += "\r\n";
+
+    B chunked = false;
+    B hasLength = false;
+    U64 length = 0;
+    ForEachHeader(head, [&](StrView name, StrView value)
+    {
+        if (NameIs(name, "Connection"))
+        {
+            if (HasToken(value, "close"))
+            {
+                exchange->keepAlive = false;
+            }
+            else if (HasToken(value, "keep-alive"))
+            {
+                exchange->keepAlive = true;
+            }
+            return;
+        }
+        if (NameIs(name, "Transfer-Encoding"))
+        {
+            chunked = HasToken(value, "chunked");
+            return;
+        }
+        if (IsHopByHop(name))
+        {
+            return;
+        }
+        if (NameIs(name, "Content-Length"))
+        {
+            auto parsed = std::from_chars(value.data(), value.data() + value.size(), length);
+            hasLength = parsed.ec == std::errc();
+        }
+
+        response.append(name);
+        response += ": ";
+        response.append(value);
+        response += "\r\n";
+    });
+
+    if (exchange->headRequest || status == 204 || status == 304)
+    {
+        exchange->state = State::Done;
+    }
+    else if (chunked)
+    {
+        response += "Transfer-Encoding: chunked\r\n";
+        exchange->state = State::Chunked;
+        exchange->chunkState = ChunkState::Size;
+        exchange->remaining = 0;
+    }
+    else if (hasLength)
+    {
+        exchange->state = (length > 0)? State::Length : State::Done;
+        exchange->remaining = length;
+    }
+    else
+    {
+        // The body ends with the upstream connection, so does the
+        // client's.
+        exchange->state = State::UntilClose;
+        exchange->keepAlive = false;
+        record->closeAfterResponse = true;
+    }
+
+    // The rest of an unfinished request body would be taken for the next
+    // request.
+    if (!exchange->requestDone)
+    {
+        record->closeAfterResponse = true;
+    }
+
+    response += exchange->responseHeaders;
+    if (
+         record->closeAfterResponse &&
+         exchange->responseHeaders.find("Connection: close") == Str::npos
+       )
+    {
+        response += "Connection: close\r\n";
+    }
+    response += "\r\n";
+
+    SendDirect(client, response, &record->bytesWritten);
+    Str().swap(exchange->requestHead);
+
+    return true;
+}
+
+
+auto
+ReverseProxy::ScanChunked(ProxyExchange* exchange, StrView data) -> Size
+{
+    Size i = 0;
+
+    // Only finds where the body ends, the bytes are passed on unchanged.
+    while (i < data.size() && exchange->state != State::Done)
+    {
+        auto c = data[i];
+
+        if (exchange->chunkState == ChunkState::Data)
+        {
+            auto n = std::min<U64>(exchange->remaining, data.size() - i);
+            i += n;
+            exchange->remaining -= n;
+            if (exchange->remaining == 0)
+            {
+                exchange->chunkState = ChunkState::DataEnd;
+            }
+            continue;
+        }
+
+        i++;
+        if (exchange->chunkState == ChunkState::Size || exchange->chunkState == ChunkState::Extension)
+        {
+            if (c == '\n')
+            {
+                exchange->chunkState =
+                    (exchange->remaining > 0)? ChunkState::Data : ChunkState::Trailer;
+                exchange->trailerLineLength = 0;
+            }
+            else if (exchange->chunkState == ChunkState::Size && isxdigit((U8)c))
+            {
+                auto digit = (c <= '9')? c - '0' : (c | 0x20) - 'a' + 10;
+                exchange->remaining = exchange->remaining * 16 + digit;
+            }
+            else
+            {
+                exchange->chunkState = ChunkState::Extension;
+            }
+        }
+        else if (exchange->chunkState == ChunkState::DataEnd)
+        {
+            if (c == '\n')
+            {
+                exchange->chunkState = ChunkState::Size;
+            }
+        }
+        else if (exchange->chunkState == ChunkState::Trailer)
+        {
+            if (c == '\n')
+            {
+                if (exchange->trailerLineLength == 0)
+                {
+                    exchange->state = State::Done;
+                }
+                exchange->trailerLineLength = 0;
+            }
+            else if (c != '\r')
+            {
+                exchange->trailerLineLength++;
+            }
+        }
+    }
+
+    return i;
+}
+
+
+auto
+ReverseProxy::CompleteResponse(ProxyExchange* exchange) -> void
+{
+    auto upstream = exchange->upstream;
+    upstream->failures = 0;
+    if (!upstream->healthy)
+    {
+        ReportHealth(upstream, true);
+    }
+
+    if (exchange->keepAlive && exchange->requestDone)
+    {
+        RecycleConnection(exchange);
+    }
+    else
+    {
+        DropConnection(exchange);
+    }
+
+    DetachClient(exchange, true);
+    Release(exchange);
+}
+
+
+auto
+ReverseProxy::Fail(ProxyExchange* exchange, U32 code) -> void
+{
+    CountFailure(exchange->upstream);
+    DropConnection(exchange);
+
+    auto client = exchange->client;
+    if (client != nullptr)
+    {
+        if (exchange->state == State::Head)
+        {
+            auto headers = exchange->responseHeaders;
+            if (exchange->bodyPending)
+            {
+                ((ConnectionRecord*)client->fn_data)->closeAfterResponse = true;
+                headers += "Connection: close\r\n";
+            }
+            ReplyError(client, code, headers);
+        }
+        else
+        {
+            // Part of the response is out, only the close tells the client
+            // that it is incomplete.
+            client->is_draining = 1;
+        }
+    }
+
+    DetachClient(exchange, true);
+    Release(exchange);
+}
+
+
+auto
+ReverseProxy::CountFailure(Upstream* upstream) -> void
+{
+    failureCount++;
+    upstream->failures++;
+    if (upstream->healthy && upstream->failures >= upstream->route->options.maxFails)
+    {
+        ReportHealth(upstream, false);
+    }
+}
+
+
+auto
+ReverseProxy::RecycleConnection(ProxyExchange* exchange) -> void
+{
+    auto c = exchange->connection;
+    auto upstream = exchange->upstream;
+
+    exchange->connection = nullptr;
+    upstream->outstanding--;
+
+    if (upstream->idle.size() >= upstream->route->options.maxIdleConnections)
+    {
+        c->fn_data = nullptr;
+        c->is_closing = 1;
+        return;
+    }
+
+    c->is_full = 0;
+    c->fn = ReverseProxy::OnIdleEvent;
+    c->fn_data = upstream;
+    upstream->idle.push_back(c);
+}
+
+
+auto
+ReverseProxy::DropConnection(ProxyExchange* exchange) -> void
+{
+    auto c = exchange->connection;
+    if (c == nullptr)
+    {
+        return;
+    }
+
+    c->fn_data = nullptr;
+    c->is_closing = 1;
+    exchange->connection = nullptr;
+    exchange->upstream->outstanding--;
+}
+
+
+auto
+ReverseProxy::DetachClient(ProxyExchange* exchange, B resume) -> void
+{
+    auto client = exchange->client;
+    if (client == nullptr)
+    {
+        return;
+    }
+
+    exchange->client = nullptr;
+    ((ConnectionRecord*)client->fn_data)->proxyExchange = nullptr;
+    client->is_full = 0;
+
+    // While the body is still coming in, the server's body stream ends
+    // the request.
+    if (!resume || exchange->bodyPending)
+    {
+        return;
+    }
+
+    client->is_resp = 0;
+
+    // A pipelined request sitting in the receive buffer gets no read event
+    // of its own.
+    if (client->recv.len > 0 && !client->is_draining && !client->is_closing)
+    {
+        long n = 0;
+        mg_call(client, MG_EV_READ, &n);
+    }
+}
+
+
+auto
+ReverseProxy::Release(ProxyExchange* exchange) -> void
+{
+    if (
+         exchange->client == nullptr &&
+         exchange->connection == nullptr &&
+         !exchange->bodyPending
+       )
+    {
+        delete exchange;
+    }
+}
+
+
+auto
+ReverseProxy::ReportHealth(Upstream* upstream, B healthy) -> void
+{
+    if (healthy)
+    {
+        upstream->failures = 0;
+        if (!upstream->healthy)
+        {
+            Log("Proxy: upstream ", upstream->host, " is up");
+        }
+    }
+    else if (upstream->healthy)
+    {
+        LogErr("Proxy: upstream ", upstream->host, " is down");
+    }
+
+    upstream->healthy = healthy;
+}
+
+
+auto
+ReverseProxy::OnUpstreamEvent(mg_connection* c, I ev, void* evData, void* exchangePtr) -> void
+{
+    auto exchange = (ProxyExchange*)exchangePtr;
+    if (exchange == nullptr)
+    {
+        return;
+    }
+
+    auto upstream = exchange->upstream;
+    auto proxy = upstream->route->proxy;
+    auto& options = upstream->route->options;
+
+    if (ev == MG_EV_CONNECT)
+    {
+        exchange->connected = true;
+        exchange->deadlineMs = mg_millis() + options.readTimeoutMs;
+    }
+    else if (ev == MG_EV_READ)
+    {
+        exchange->deadlineMs = mg_millis() + options.readTimeoutMs;
+        proxy->OnResponseData(exchange);
+    }
+    else if (ev == MG_EV_WRITE)
+    {
+        exchange->deadlineMs = mg_millis() + options.readTimeoutMs;
+
+        auto client = exchange->client;
+        if (client != nullptr && client->is_full && c->send.len <= options.maxBufferedBytes)
+        {
+            client->is_full = 0;
+        }
+    }
+    else if (ev == MG_EV_POLL)
+    {
+        auto nowMs = *(U64*)evData;
+
+        // Waiting for more of the body from the client is not on the
+        // upstream.
+        if (!exchange->requestDone && c->send.len == 0 && !c->is_connecting)
+        {
+            exchange->deadlineMs = nowMs + options.readTimeoutMs;
+        }
+        else if (nowMs > exchange->deadlineMs && !proxy->Failover(exchange))
+        {
+            proxy->Fail(exchange, 504);
+        }
+    }
+    else if (ev == MG_EV_CLOSE)
+    {
+        if (exchange->state == State::UntilClose)
+        {
+            exchange->connection = nullptr;
+            upstream->outstanding--;
+            proxy->CompleteResponse(exchange);
+            return;
+        }
+
+        // An idle connection the upstream closed just as it was reused.
+        // Nothing of the request is lost, so it is sent again.
+        if (exchange->reused && exchange->state == State::Head && exchange->bodyBytesSent == 0)
+        {
+            exchange->connection = nullptr;
+            upstream->outstanding--;
+            if (proxy->Connect(exchange, false))
+            {
+                return;
+            }
+        }
+
+        if (!proxy->Failover(exchange))
+        {
+            proxy->Fail(exchange, 502);
+        }
+    }
+}
+
+
+auto
+ReverseProxy::OnIdleEvent(mg_connection* c, I ev, void*, void* upstreamPtr) -> void
+{
+    auto upstream = (Upstream*)upstreamPtr;
+    if (upstream == nullptr)
+    {
+        return;
+    }
+
+    if (ev == MG_EV_READ)
+    {
+        // Nothing is expected between requests.
+        c->recv.len = 0;
+        c->is_closing = 1;
+    }
+    else if (ev == MG_EV_CLOSE)
+    {
+        auto& idle = upstream->idle;
+        auto it = std::find(idle.begin(), idle.end(), c);
+        if (it != idle.end())
+        {
+            idle.erase(it);
+        }
+    }
+}
+
+
+auto
+ReverseProxy::OnHealthCheckEvent(mg_connection* c, I ev, void*, void* upstreamPtr) -> void
+{
+    auto upstream = (Upstream*)upstreamPtr;
+    if (upstream == nullptr)
+    {
+        return;
+    }
+
+    auto proxy = upstream->route->proxy;
+
+    if (ev == MG_EV_READ)
+    {
+        auto headLength = mg_http_get_request_len(c->recv.buf, c->recv.len);
+        if (headLength == 0)
+        {
+            return;
+        }
+
+        auto status = ParseStatus(StrView((CStr)c->recv.buf, c->recv.len));
+        c->fn_data = nullptr;
+        c->is_closing = 1;
+        upstream->healthCheck = nullptr;
+        proxy->ReportHealth(upstream, headLength > 0 && status >= 200 && status < 400);
+    }
+    else if (ev == MG_EV_CLOSE)
+    {
+        upstream->healthCheck = nullptr;
+        proxy->ReportHealth(upstream, false);
+    }
+}
+
+
+auto
+ReverseProxy::OnHealthCheckTimer(void* routePtr) -> void
+{
+    auto route = (ProxyRoute*)routePtr;
+    auto proxy = route->proxy;
+    auto& options = route->options;
+
+    for (auto& upstream : route->upstreams)
+    {
+        // No answer within the interval counts as a failed check.
+        if (upstream->healthCheck != nullptr)
+        {
+            upstream->healthCheck->fn_data = nullptr;
+            upstream->healthCheck->is_closing = 1;
+            upstream->healthCheck = nullptr;
+            proxy->ReportHealth(upstream.get(), false);
+        }
+
+        auto c = mg_connect(
+                             proxy->mgr,
+                             upstream->url.c_str(),
+                             ReverseProxy::OnHealthCheckEvent,
+                             upstream.get()
+                           );
+        if (c == nullptr)
+        {
+            continue;
+        }
+
+        upstream->healthCheck = c;
+        mg_printf(
+                   c,
+                   "GET %s HTTP/1.1\r\n"
+                   "Host: %s\r\n"
+                   "Connection: close\r\n\r\n",
+                   options.healthCheckPath.c_str(),
+                   upstream->host.c_str()
+                 );
+    }
+}
+
+
+auto
+ReverseProxy::GetRequestCount() const -> U64
+{
+    return requestCount;
+}
+
+
+auto
+ReverseProxy::GetFailureCount() const -> U64
+{
+    return failureCount;
+}
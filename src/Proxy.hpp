@@ -0,0 +1,183 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+
+#include "mongoose/mongoose.h"
+
+
+struct ProxyOptions
+{
+    U32 connectTimeoutMs = 2000;
+    // Time without progress while sending the request or reading the
+    // response.
+    U32 readTimeoutMs = 30000;
+    // Keep-alive connections left open per upstream between requests.
+    U32 maxIdleConnections = 32;
+    // Sent as a GET to every upstream each interval, off when empty.
+    Str healthCheckPath = "/";
+    U32 healthCheckIntervalMs = 5000;
+    // Consecutive failed requests that take an upstream out of rotation
+    // until a health check passes.
+    U32 maxFails = 3;
+    // Bytes buffered for the slower side before reading from the other
+    // one pauses, in both directions.
+    U32 maxBufferedBytes = 256 * 1024;
+    U64 maxBodySize = U64(4) << 30;
+    // Forward the client's Host header, otherwise the upstream's is sent.
+    B preserveHost = true;
+};
+
+
+struct ProxyRoute;
+class ReverseProxy;
+
+
+struct Upstream
+{
+    ProxyRoute* route;
+    // mongoose URL with the address resolved when the route was added.
+    Str url;
+    // As configured, host and port.
+    Str host;
+    // Keep-alive connections, the most recently used last.
+    Vec<mg_connection*> idle;
+    U32 outstanding;
+    U32 failures;
+    B healthy;
+    mg_connection* healthCheck;
+};
+
+
+struct ProxyRoute
+{
+    ReverseProxy* proxy;
+    ProxyOptions options;
+    Vec<UniquePtr<Upstream>> upstreams;
+    // Rotates the starting point so ties are spread out.
+    U32 nextUpstream;
+};
+
+
+// One request forwarded to an upstream. Lives until the client side, the
+// upstream side and the request body stream are all done with it.
+struct ProxyExchange
+{
+    enum class State : U8
+    {
+        Head,
+        Length,
+        Chunked,
+        UntilClose,
+        Done
+    };
+
+    enum class ChunkState : U8
+    {
+        Size,
+        Extension,
+        Data,
+        DataEnd,
+        Trailer
+    };
+
+    Upstream* upstream;
+    mg_connection* client;
+    mg_connection* connection;
+    // Kept until the response starts, to send again on another
+    // connection. Ends before the blank line, the Host header is added
+    // per upstream unless the client's is kept.
+    Str requestHead;
+    // Added to the response head, e.g. HSTS and Connection: close.
+    Str responseHeaders;
+    U64 deadlineMs;
+    U64 bodyBytesSent;
+    // Body bytes left, or bytes left of the current chunk.
+    U64 remaining;
+    U32 trailerLineLength;
+    U32 attempts;
+    State state;
+    ChunkState chunkState;
+    B headRequest;
+    B chunkedRequest;
+    B requestDone;
+    // The server's body stream still refers to the exchange.
+    B bodyPending;
+    B addHost;
+    B connected;
+    B reused;
+    B keepAlive;
+};
+
+
+// Reverse proxy over pools of keep-alive connections to HTTP upstreams,
+// on the server's event loop. Bodies are passed through as they arrive in
+// both directions, reading from one side pauses while the other is behind.
+class ReverseProxy
+{
+public:
+    ReverseProxy();
+
+    // Returns null when no upstream could be resolved.
+    ProxyRoute* AddRoute(const Vec<Str>& upstreams, const ProxyOptions& options);
+    void Start(mg_mgr* mgr);
+
+    // Picks an upstream and sends the request head, null when there is no
+    // upstream to send it to.
+    ProxyExchange* Begin(ProxyRoute* route, mg_connection* client, mg_http_message* hm);
+    // Returns false when the exchange failed and the client got a reply.
+    B ForwardBody(ProxyExchange* exchange, StrView chunk);
+    void EndRequest(ProxyExchange* exchange, const Str& responseHeaders);
+    void AbortRequest(ProxyExchange* exchange);
+
+    void OnClientWrite(ProxyExchange* exchange);
+    void OnClientClose(ProxyExchange* exchange);
+
+    U64 GetRequestCount() const;
+    U64 GetFailureCount() const;
+
+private:
+    static constexpr U32 maxResponseHeadSize = 64 * 1024;
+
+    mg_mgr* mgr;
+    Vec<UniquePtr<ProxyRoute>> routes;
+    U64 requestCount;
+    U64 failureCount;
+
+    Upstream* Pick(ProxyRoute* route, Upstream* exclude = nullptr);
+    B Connect(ProxyExchange* exchange, B allowReuse);
+    B Failover(ProxyExchange* exchange);
+    void OnResponseData(ProxyExchange* exchange);
+    B StartResponse(ProxyExchange* exchange, StrView head);
+    Size ScanChunked(ProxyExchange* exchange, StrView data);
+    void CompleteResponse(ProxyExchange* exchange);
+    void Fail(ProxyExchange* exchange, U32 code);
+    void CountFailure(Upstream* upstream);
+    void RecycleConnection(ProxyExchange* exchange);
+    void DropConnection(ProxyExchange* exchange);
+    void DetachClient(ProxyExchange* exchange, B resume);
+    void Release(ProxyExchange* exchange);
+    void ReportHealth(Upstream* upstream, B healthy);
+
+    static void OnUpstreamEvent(mg_connection* c, I ev, void* evData, void* exchange);
+    static void OnIdleEvent(mg_connection* c, I ev, void* evData, void* upstream);
+    static void OnHealthCheckEvent(mg_connection* c, I ev, void* evData, void* upstream);
+    static void OnHealthCheckTimer(void* route);
+};
@@ -0,0 +1,205 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "RateLimiter.hpp"
+#include "Utils.hpp"
+
+#include <cmath>
+
+
+RateLimiter::RateLimiter() :
+    headMask(0),
+    limitedCount(0)
+{
+}
+
+
+auto
+RateLimiter::SetCapacity(U32 buckets) -> void
+{
+    auto perShard = std::max(buckets / shardCount, 1u);
+    auto headCount = std::bit_ceil(perShard);
+    headMask = headCount - 1;
+
+    for (auto& shard : shards)
+    {
+        shard.heads.assign(headCount, none);
+        shard.buckets.assign(perShard, Bucket());
+        shard.used = 0;
+        shard.lruHead = none;
+        shard.lruTail = none;
+    }
+}
+
+
+auto
+RateLimiter::IsEnabled() const -> B
+{
+    return !shards[0].buckets.empty();
+}
+
+
+auto
+RateLimiter::Hash(const RateLimitKey& key) -> U64
+{
+    return MixHash(((U64)key.ip << 32 | key.policy) ^ MixHash(key.aux));
+}
+
+
+auto
+RateLimiter::LruUnlink(Shard& shard, U32 index) -> void
+{
+    auto& bucket = shard.buckets[index];
+
+    if (bucket.lruPrev != none)
+    {
+        shard.buckets[bucket.lruPrev].lruNext = bucket.lruNext;
+    }
+    else
+    {
+        shard.lruHead = bucket.lruNext;
+    }
+
+    if (bucket.lruNext != none)
+    {
+        shard.buckets[bucket.lruNext].lruPrev = bucket.lruPrev;
+    }
+    else
+    {
+        shard.lruTail = bucket.lruPrev;
+    }
+}
+
+
+auto
+RateLimiter::LruPushFront(Shard& shard, U32 index) -> void
+{
+    auto& bucket = shard.buckets[index];
+    bucket.lruPrev = none;
+    bucket.lruNext = shard.lruHead;
+
+    if (shard.lruHead != none)
+    {
+        shard.buckets[shard.lruHead].lruPrev = index;
+    }
+    shard.lruHead = index;
+
+    if (shard.lruTail == none)
+    {
+        shard.lruTail = index;
+    }
+}
+
+
+auto
+RateLimiter::Acquire(Shard& shard, U32 head) -> U32
+{
+    U32 index;
+
+    if (shard.used < shard.buckets.size())
+    {
+        index = shard.used++;
+    }
+    else
+    {
+        // Recycle the coldest bucket.
+        index = shard.lruTail;
+        LruUnlink(shard, index);
+
+        auto oldHead = (Hash(shard.buckets[index].key) >> 32) & headMask;
+        auto link = &shard.heads[oldHead];
+        while (*link != index)
+        {
+            link = &shard.buckets[*link].chainNext;
+        }
+        *link = shard.buckets[index].chainNext;
+    }
+
+    shard.buckets[index].chainNext = shard.heads[head];
+    shard.heads[head] = index;
+    return index;
+}
+
+
+auto
+RateLimiter::Consume(
+                      const RateLimitKey& key,
+                      const RateLimitPolicy& policy,
+                      U64 nowMs,
+                      U32& retryAfterS
+                    ) -> B
+{
+    auto hash = Hash(key);
+    auto& shard = shards[hash % shardCount];
+    auto head = (hash >> 32) & headMask;
+
+    auto index = shard.heads[head];
+    while (index != none)
+    {
+        auto& candidate = shard.buckets[index].key;
+        if (
+             candidate.ip == key.ip &&
+             candidate.policy == key.policy &&
+             candidate.aux == key.aux
+           )
+        {
+            break;
+        }
+        index = shard.buckets[index].chainNext;
+    }
+
+    if (index == none)
+    {
+        index = Acquire(shard, head);
+        auto& bucket = shard.buckets[index];
+        bucket.key = key;
+        bucket.tokens = (F32)policy.burst;
+        bucket.lastRefillMs = nowMs;
+    }
+    else
+    {
+        LruUnlink(shard, index);
+        auto& bucket = shard.buckets[index];
+        auto elapsedS = (F32)(nowMs - bucket.lastRefillMs) / 1000.0f;
+        bucket.tokens = std::min(
+                                  (F32)policy.burst,
+                                  bucket.tokens + elapsedS * policy.requestsPerSecond
+                                );
+        bucket.lastRefillMs = nowMs;
+    }
+    LruPushFront(shard, index);
+
+    auto& bucket = shard.buckets[index];
+    if (bucket.tokens >= 1.0f)
+    {
+        bucket.tokens -= 1.0f;
+        return true;
+    }
+
+    retryAfterS = (policy.requestsPerSecond > 0.0f)?
+        (U32)std::ceil((1.0f - bucket.tokens) / policy.requestsPerSecond) : 60;
+    limitedCount++;
+    return false;
+}
+
+
+auto
+RateLimiter::GetLimitedCount() const -> U64
+{
+    return limitedCount;
+}
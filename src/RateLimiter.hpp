@@ -0,0 +1,99 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+
+
+struct RateLimitPolicy
+{
+    F32 requestsPerSecond = 10.0f;
+    U32 burst = 20;
+    // Separate budget for every distinct URI matched by the route pattern.
+    B perURI = false;
+    // When set and sent by the client, the cookie value joins the IP in the
+    // key, so clients behind one NAT don't share a budget.
+    Str cookieName;
+};
+
+
+struct RateLimitKey
+{
+    U32 ip;
+    U32 policy;
+    U64 aux;
+};
+
+
+// Token buckets in a fixed number of sharded, chained hash tables. All
+// storage is allocated up front; once a shard is full the least recently
+// used bucket is recycled. Only the event loop consumes tokens, so the
+// shards are not locked.
+class RateLimiter
+{
+public:
+    static constexpr U32 shardCount = 16;
+
+    RateLimiter();
+
+    void SetCapacity(U32 buckets);
+    B IsEnabled() const;
+
+    // Returns false when the request has to be rejected, in which case
+    // retryAfterS is set to the seconds until a token is available.
+    B Consume(
+               const RateLimitKey& key,
+               const RateLimitPolicy& policy,
+               U64 nowMs,
+               U32& retryAfterS
+             );
+
+    U64 GetLimitedCount() const;
+
+private:
+    static constexpr U32 none = ~0u;
+
+    struct Bucket
+    {
+        RateLimitKey key;
+        F32 tokens;
+        U64 lastRefillMs;
+        U32 chainNext;
+        U32 lruPrev;
+        U32 lruNext;
+    };
+
+    struct Shard
+    {
+        Vec<U32> heads;
+        Vec<Bucket> buckets;
+        U32 used = 0;
+        U32 lruHead = none;
+        U32 lruTail = none;
+    };
+
+    Arr<Shard, shardCount> shards;
+    U32 headMask;
+    Atomic<U64> limitedCount;
+
+    static U64 Hash(const RateLimitKey& key);
+    static void LruUnlink(Shard& shard, U32 index);
+    static void LruPushFront(Shard& shard, U32 index);
+    U32 Acquire(Shard& shard, U32 head);
+};
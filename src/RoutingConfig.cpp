@@ -0,0 +1,241 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "RoutingConfig.hpp"
+#include "Utils.hpp"
+
+#include <fstream>
+#include <iterator>
+
+
+static auto Trim(StrView text) -> StrView
+{
+    static constexpr StrView space = " \t\r";
+
+    auto begin = text.find_first_not_of(space);
+    if (begin == StrView::npos)
+    {
+        return StrView();
+    }
+    auto end = text.find_last_not_of(space);
+
+    return text.substr(begin, end - begin + 1);
+}
+
+
+// Splits off the first word of text.
+static auto NextWord(StrView* text) -> StrView
+{
+    auto end = text->find_first_of(" \t");
+    auto word = text->substr(0, end);
+    *text = (end == StrView::npos)? StrView() : Trim(text->substr(end));
+
+    return word;
+}
+
+
+auto
+ParseRoutingConfig(StrView text, RoutingConfig* config, Str* error) -> B
+{
+    while (!text.empty())
+    {
+        auto lineEnd = text.find('\n');
+        auto line = Trim(text.substr(0, lineEnd));
+        text = (lineEnd == StrView::npos)? StrView() : text.substr(lineEnd + 1);
+
+        if (line.empty() || line.starts_with('#'))
+        {
+            continue;
+        }
+
+        auto rest = line;
+        auto directive = NextWord(&rest);
+        auto argument = NextWord(&rest);
+        if (!argument.starts_with('/'))
+        {
+            *error = Str(line);
+            return false;
+        }
+
+        if (directive == "serve" && (rest.empty() || rest == "wasm"))
+        {
+            config->serveDirs.push_back({ Str(argument), Str(), !rest.empty() });
+        }
+        else if (directive == "cache-control" && !rest.empty())
+        {
+            auto dir = std::find_if(
+                                     config->serveDirs.begin(),
+                                     config->serveDirs.end(),
+                                     [argument](const RoutingConfig::Dir& dir) { return dir.dir == argument; }
+                                   );
+            if (dir == config->serveDirs.end())
+            {
+                *error = Str(line);
+                return false;
+            }
+            dir->cacheControl = rest;
+        }
+        else if (directive == "disable" && rest.empty())
+        {
+            config->disabled.emplace_back(argument);
+        }
+        else
+        {
+            *error = Str(line);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+RoutingWatcher::RoutingWatcher() :
+    stamp(0),
+    reloadCount(0),
+    watching(false)
+{
+}
+
+
+RoutingWatcher::~RoutingWatcher()
+{
+    Stop();
+}
+
+
+auto
+RoutingWatcher::FileStamp(const Str& path) -> I64
+{
+    std::error_code ec;
+    auto time = std::filesystem::last_write_time(path, ec);
+    auto size = std::filesystem::file_size(path, ec);
+
+    if (ec)
+    {
+        return 0;
+    }
+
+    return time.time_since_epoch().count() ^ (I64)size;
+}
+
+
+auto
+RoutingWatcher::Load() -> B
+{
+    stamp = FileStamp(path);
+
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        LogErr("Routing: cannot read ", path);
+        return false;
+    }
+    Str text(std::istreambuf_iterator<C>(file), {});
+
+    RoutingConfig config;
+    Str error;
+    if (!ParseRoutingConfig(text, &config, &error))
+    {
+        LogErr("Routing: ", path, " not applied, cannot parse \"", error, "\"");
+        return false;
+    }
+
+    onChange(config);
+    reloadCount++;
+    return true;
+}
+
+
+auto
+RoutingWatcher::Start(
+                       const Str& configPath,
+                       U32 intervalMs,
+                       const ChangeHandler& handler,
+                       const CpuPlacement* placement
+                     ) -> B
+{
+    Stop();
+
+    path = configPath;
+    onChange = handler;
+    if (!Load())
+    {
+        return false;
+    }
+
+    if (intervalMs != 0)
+    {
+        watching = true;
+        watcher = Thread([this, intervalMs]() { Watch(intervalMs); });
+        placement->PlaceThread(watcher);
+    }
+
+    return true;
+}
+
+
+auto
+RoutingWatcher::Stop() -> void
+{
+    {
+        LockGuard<Mutex> lock(watcherMutex);
+        if (!watching)
+        {
+            return;
+        }
+        watching = false;
+    }
+
+    watcherWake.notify_all();
+    watcher.join();
+}
+
+
+auto
+RoutingWatcher::Watch(U32 intervalMs) -> void
+{
+    while (true)
+    {
+        {
+            UniqueLock<Mutex> lock(watcherMutex);
+            watcherWake.wait_for(
+                                  lock,
+                                  std::chrono::milliseconds(intervalMs),
+                                  [this]() { return !watching; }
+                                );
+            if (!watching)
+            {
+                return;
+            }
+        }
+
+        // A failed attempt is not repeated until the file changes again.
+        if (FileStamp(path) != stamp)
+        {
+            Load();
+        }
+    }
+}
+
+
+auto
+RoutingWatcher::GetReloadCount() const -> U64
+{
+    return reloadCount;
+}
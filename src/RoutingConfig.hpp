@@ -0,0 +1,87 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+#include "CpuPlacement.hpp"
+
+
+// Routing that can change while the server runs, kept in a file. One
+// directive per line, lines starting with `#` are comments:
+//
+//   serve /docs
+//   serve /app wasm
+//   cache-control /docs public, max-age=600
+//   disable /api/legacy/*
+//
+// Serve dirs are added next to the ones the program added. Disabled
+// patterns are handler, streaming route and serve dir patterns (`/docs/*`
+// for the dir above) whose requests are then not found.
+struct RoutingConfig
+{
+    struct Dir
+    {
+        Str dir;
+        Str cacheControl;
+        B wasm;
+    };
+
+    Vec<Dir> serveDirs;
+    Vec<Str> disabled;
+};
+
+// False with the offending line in error, config is then incomplete.
+B ParseRoutingConfig(StrView text, RoutingConfig* config, Str* error);
+
+
+// Reads the file again whenever it changes, on a thread of its own, and
+// hands what it read to the handler there. A file that does not parse is
+// logged and skipped until it changes again.
+class RoutingWatcher
+{
+public:
+    using ChangeHandler = Func<void(const RoutingConfig&)>;
+
+    RoutingWatcher();
+    ~RoutingWatcher();
+
+    // Reads the file once on the calling thread before watching it, false
+    // when that fails. The watcher thread is moved off the reactor's CPU by
+    // placement.
+    B Start(const Str& path, U32 intervalMs, const ChangeHandler& handler, const CpuPlacement* placement);
+    void Stop();
+
+    U64 GetReloadCount() const;
+
+private:
+    Str path;
+    ChangeHandler onChange;
+    I64 stamp;
+    Atomic<U64> reloadCount;
+
+    Thread watcher;
+    Mutex watcherMutex;
+    ConditionVariable watcherWake;
+    B watching;
+
+    B Load();
+    void Watch(U32 intervalMs);
+
+    static I64 FileStamp(const Str& path);
+};
@@ -0,0 +1,138 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "SendQueue.hpp"
+#include "ConnectionTracker.hpp"
+
+
+auto
+SendDirect(mg_connection* c, StrView data, U64* bytesWritten) -> void
+{
+    if (!c->is_tls && !c->is_connecting && !c->is_resolving && c->send.len == 0)
+    {
+        auto n = mg_io_send(c, data.data(), data.size());
+        if (n == MG_IO_WAIT)
+        {
+            n = 0;
+        }
+        else if (n < 0)
+        {
+            c->is_closing = 1;
+            return;
+        }
+        if (bytesWritten != nullptr)
+        {
+            *bytesWritten += U64(n);
+        }
+        data.remove_prefix(n);
+    }
+
+    if (!data.empty())
+    {
+        mg_send(c, data.data(), data.size());
+    }
+}
+
+
+SendQueue::SendQueue() :
+    queuedBytes(0),
+    evicted(false),
+    closeWhenDrained(false)
+{
+}
+
+
+auto
+SendQueue::Push(
+                 mg_connection* c,
+                 const SharedBuffer& buffer,
+                 const SendQueueLimits& limits
+               ) -> B
+{
+    if (evicted || closeWhenDrained)
+    {
+        return true;
+    }
+
+    auto backlog = queuedBytes + c->send.len + buffer->size();
+    if (backlog > limits.maxQueuedBytes || buffers.size() >= limits.maxQueuedFrames)
+    {
+        // A goodbye message would only queue behind everything else, so
+        // the slow consumer is dropped without one.
+        evicted = true;
+        c->is_closing = 1;
+        return false;
+    }
+
+    buffers.push_back(buffer);
+    queuedBytes += buffer->size();
+    Drain(c);
+
+    return true;
+}
+
+
+auto
+SendQueue::Drain(mg_connection* c) -> void
+{
+    auto record = (ConnectionRecord*)c->fn_data;
+
+    while (!buffers.empty() && !c->is_closing)
+    {
+        // Without TLS written straight from the shared buffer while
+        // nothing else is pending, a partially written tail is finished by
+        // mongoose from the send buffer, in order.
+        auto sendLimit = c->is_tls? tlsSendWatermark : 1;
+        if (c->send.len >= sendLimit)
+        {
+            break;
+        }
+
+        auto& buffer = buffers.front();
+        SendDirect(c, *buffer, &record->bytesWritten);
+        queuedBytes -= buffer->size();
+        buffers.pop_front();
+    }
+
+    if (closeWhenDrained && buffers.empty())
+    {
+        c->is_draining = 1;
+    }
+}
+
+
+auto
+SendQueue::CloseWhenDrained(mg_connection* c) -> void
+{
+    closeWhenDrained = true;
+    Drain(c);
+}
+
+
+auto
+SendQueue::IsEmpty() const -> B
+{
+    return buffers.empty();
+}
+
+
+auto
+SendQueue::IsClosing() const -> B
+{
+    return evicted || closeWhenDrained;
+}
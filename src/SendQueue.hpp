@@ -0,0 +1,73 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+
+#include "mongoose/mongoose.h"
+
+
+// Encoded message shared by every connection it is queued on, so a
+// broadcast holds the payload once.
+using SharedBuffer = SharedPtr<const Str>;
+
+
+struct SendQueueLimits
+{
+    // Bytes queued for a connection, its send buffer included, beyond
+    // which it is considered a slow consumer and closed.
+    U64 maxQueuedBytes = 1 << 20;
+    U32 maxQueuedFrames = 1024;
+};
+
+
+// Writes straight to the socket while nothing is pending, only what does
+// not fit is copied into the send buffer. mongoose reports the bytes it
+// sends itself with MG_EV_WRITE, the direct ones are added to bytesWritten
+// when given.
+void SendDirect(mg_connection* c, StrView data, U64* bytesWritten);
+
+
+// Per connection queue of shared buffers for long lived streams.
+class SendQueue
+{
+public:
+    SendQueue();
+
+    // Returns false when the connection got evicted by this push.
+    B Push(mg_connection* c, const SharedBuffer& buffer, const SendQueueLimits& limits);
+    // Moves queued buffers to the socket, on write and poll events. The
+    // connection is an accepted one, its fn_data the ConnectionRecord.
+    void Drain(mg_connection* c);
+    // Drains what is queued, then closes. Later pushes are ignored.
+    void CloseWhenDrained(mg_connection* c);
+
+    B IsEmpty() const;
+    B IsClosing() const;
+
+private:
+    // Buffers are moved into a TLS connection's send buffer up to this
+    // size, they are encrypted per connection anyway.
+    static constexpr U64 tlsSendWatermark = 64 * 1024;
+
+    Deque<SharedBuffer> buffers;
+    U64 queuedBytes;
+    B evicted;
+    B closeWhenDrained;
+};
@@ -17,16 +17,26 @@
 
 
 #include "Server.hpp"
+#include "Assets.hpp"
+#include "ByteRanges.hpp"
+#include "MappedFs.hpp"
+#include "Prerender.hpp"
+#include "Preload.hpp"
 #include "Utils.hpp"
+#include <algorithm>
+#include <charconv>
 #include <filesystem>
 
+
+static constexpr StrView jsonContentType = "Content-Type: application/json\r\n";
+
 ConnectionState::ConnectionState()
 {
 }
 
 
 ConnectionState::ConnectionState(MgConnection* c, MgHttpMessage* httpMsg, I ev) :
-    c(c), httpMsg(httpMsg), ev(ev), sessionStore(nullptr)
+    c(c), httpMsg(httpMsg), ev(ev), sessionStore(nullptr), requestData(nullptr)
 {
 }
 
@@ -34,7 +44,17 @@ ConnectionState::ConnectionState(MgConnection* c, MgHttpMessage* httpMsg, I ev)
 
 void ConnectionState::AddHeader(const C* name, const C* value)
 {
-    responseHeaders += Str(name) + ": " + value + "\r\n";
+    responseHeaders.append(name).append(": ").append(value).append("\r\n");
+}
+
+
+auto
+ConnectionState::GetHeaderBlock(StrView extra) const -> CStr
+{
+    static Str block;
+    block.assign(Server::headerCache.GetDate());
+    block.append(connectionHeaders).append(routeHeaders).append(contentTypeHeader).append(responseHeaders).append(extra);
+    return block.c_str();
 }
 
 
@@ -46,13 +66,43 @@ void ConnectionState::AddToBody(const C* contents)
 
 void ConnectionState::Reply(U32 code)
 {
-    mg_http_reply(c, I(code), responseHeaders.c_str(), responseBody.c_str());
+    C length[20];
+    auto lengthEnd = std::to_chars(length, length + sizeof(length), responseBody.size()).ptr;
+
+    SendPieces(
+                c,
+                {
+                  StatusLine(code),
+                  Server::headerCache.GetDate(),
+                  connectionHeaders,
+                  routeHeaders,
+                  contentTypeHeader,
+                  responseHeaders,
+                  "Content-Length: ",
+                  StrView(length, lengthEnd - length),
+                  "\r\n\r\n",
+                  responseBody
+                }
+              );
+    c->is_resp = 0;
+}
+
+
+void ConnectionState::OpenEventStream(CStr channel)
+{
+    Server::OpenEventStream(this, channel);
+}
+
+
+void ConnectionState::RunCommand(const Vec<Str>& args, StrView input, const CommandHandler& handler)
+{
+    Server::RunCommand(this, args, input, handler);
 }
 
 
 void ConnectionState::SetResponseToJSON()
 {
-    AddHeader("Content-Type", "application/json");
+    contentTypeHeader = jsonContentType;
 }
 
 
@@ -86,7 +136,7 @@ ConnectionState::IsSecure() const -> B
 auto
 ConnectionState::GetCookieValue(CStr valueName) -> Str
 {
-    auto cookie = mg_http_get_header(httpMsg, "Cookie");
+    auto cookie = FindHeader(httpMsg, KnownHeader::Cookie);
     Str value;
 
     if (cookie != nullptr)
@@ -130,135 +180,2050 @@ ConnectionState::SetCookieValue(
 }
 
 
-UMap<Str, Func<void(ConnectionState*)>> Server::endpoints;
+UMap<Str, Server::Endpoint> Server::endpoints;
 Str Server::certPath;
 Str Server::privKeyPath;
-Vec<Str> Server::servedDirs;
+Vec<ServedDir> Server::servedDirs;
+Vec<ServedDir> Server::configuredDirs;
+Vec<Str> Server::disabledRoutes;
+Vec<Str> Server::configuredDisabledRoutes;
+B Server::routingPublished = false;
+Mutex Server::routingMutex;
+RoutingWatcher Server::routingWatcher;
+Server::RoutingTable* Server::routing = nullptr;
+Atomic<Server::RoutingTable*> Server::pendingRouting = nullptr;
+U64 Server::routingUpdates = 0;
+ConnectionTracker Server::connections;
+RateLimiter Server::rateLimiter;
+Vec<Pair<Str, RateLimitPolicy>> Server::rateLimits;
+LoadShedder Server::loadShedder;
+TLSConfig Server::tlsConfig;
+PubSub Server::pubSub;
+Vec<UniquePtr<WebSocketHandler>> Server::webSocketHandlers;
+EventBroker Server::eventBroker;
+Vec<UniquePtr<StreamingRoute>> Server::streamingRoutes;
+ReverseProxy Server::reverseProxy;
+CommandRunner Server::commandRunner;
+Upgrader Server::upgrader;
+Http2Gateway Server::http2;
+BufferPool Server::bufferPool;
+CpuPlacement Server::cpuPlacement;
+U32 Server::certReloadIntervalMs = 5000;
+B Server::serveEmbeddedAssets = true;
+PrerenderedPage Server::landingPage;
+PrerenderedPage Server::notFoundPage;
+U32 Server::pageRefreshIntervalMs = 1000;
+HeaderCache Server::headerCache;
+Vec<Pair<Str, Str>> Server::routeHeaders;
+AccessLog Server::accessLog;
 
-Str Server::httpAddress;
-Str Server::httpsAddress;
+Str Server::address;
+ListenOptions Server::listenOptions;
+Str Server::redirectHead;
+Str Server::redirectTail;
 mg_mgr Server::mgr;
 
 
 void Server::Init(CStr addr, CStr certPath, CStr privKeyPath)
 {
-    httpAddress = Str("http://") + addr + ":80";
-    httpsAddress = Str("https://") + addr + ":443";
+    address = addr;
     mg_log_set(MG_LL_DEBUG);
+    // Before anything is allocated, blocks go back where they came from.
+    mg_set_allocator(Server::AcquireBuffer, Server::ReleaseBuffer);
     mg_mgr_init(&mgr);
 
-    certPath = certPath;
-    privKeyPath = privKeyPath;
+    Server::certPath = certPath;
+    Server::privKeyPath = privKeyPath;
+
+    // The main page is a route like any other, it can be disabled and is
+    // matched from the routing table. All three paths log as "/".
+    auto mainPageRoute = accessLog.AddRoute("/");
+    for (auto pattern : { "/", "/index.html", "/main_page.html" })
+    {
+        endpoints.emplace(pattern, Endpoint{ Server::ServeMainPage, RoutePriority::High, mainPageRoute });
+    }
+}
+
+
+auto
+Server::SetListenOptions(const ListenOptions& options) -> void
+{
+    listenOptions = options;
+}
+
+
+auto
+Server::SetCertificateReloadInterval(U32 intervalMs) -> void
+{
+    certReloadIntervalMs = intervalMs;
+}
+
+
+auto
+Server::SetConnectionLimits(const ConnectionLimits& limits) -> void
+{
+    connections.SetLimits(limits);
 }
 
 
-void Server::ServeFile(ConnectionState* cs, const C* pathOverride)
+auto
+Server::SetRateLimit(CStr routePattern, const RateLimitPolicy& policy) -> void
 {
-    MgHttpServeOpts opts = 
+    static constexpr U32 defaultCapacity = 1 << 16;
+
+    if (!rateLimiter.IsEnabled())
     {
-        .extra_headers = cs->responseHeaders.c_str()
-    };
-    Str path = Str(DOCUMENT_ROOT) + (pathOverride? pathOverride : FirstWord(cs->httpMsg->uri.ptr));
-    mg_http_serve_file(cs->c, cs->httpMsg, path.c_str(), &opts);
+        rateLimiter.SetCapacity(defaultCapacity);
+    }
+    rateLimits.emplace_back(Str(routePattern), policy);
 }
 
 
-void Server::HttpListener(MgConnection* c, int ev, void* evData, void* fnData)
+auto
+Server::SetRateLimiterCapacity(U32 buckets) -> void
+{
+    rateLimiter.SetCapacity(buckets);
+}
+
+
+// Lets the page use SharedArrayBuffer, which emscripten's threads need.
+static constexpr StrView crossOriginIsolation =
+    "Cross-Origin-Opener-Policy: same-origin\r\n"
+    "Cross-Origin-Embedder-Policy: require-corp\r\n";
+
+// Types mongoose does not know, as cmake/PackAssets.cmake has them.
+static constexpr CStr extraMimeTypes =
+    "mjs=text/javascript; charset=utf-8,"
+    "map=application/json,"
+    "xml=application/xml,"
+    "avif=image/avif,"
+    "woff2=font/woff2,"
+    "otf=font/otf,"
+    "webm=video/webm,"
+    "data=application/octet-stream";
+
+
+void Server::ServeFile(ConnectionState* cs, const C* pathOverride, StrView cacheControl, StrView extraHeaders)
 {
-    if(ev == MG_EV_ACCEPT && fnData != nullptr)
+    // Written in one go, larger ones and ranges are streamed.
+    static constexpr U64 maxInlineSize = 256 * 1024;
+
+    auto c = cs->c;
+    auto hm = cs->httpMsg;
+
+    if (serveEmbeddedAssets)
     {
-        mg_tls_opts opts =
-            {
-                .cert = certPath.c_str(),
-                .certkey = privKeyPath.c_str()
-            };
-        mg_tls_init(c, &opts);
+        auto& uri = hm->uri;
+        auto asset = FindEmbeddedAsset(pathOverride? StrView(pathOverride) : StrView(uri.ptr, uri.len));
+        if (asset != nullptr)
+        {
+            ServeEmbeddedAsset(cs, asset, cacheControl, extraHeaders);
+            return;
+        }
     }
-    else if (ev == MG_EV_HTTP_MSG)
+
+    auto uri = hm->uri.ptr;
+    auto name = pathOverride? StrView(pathOverride) : StrView(uri, strcspn(uri, " \t\n\v\f\r"));
+
+    // On the stack, a path that does not fit could not be opened anyway.
+    C path[MG_PATH_MAX];
+    auto length = snprintf(path, sizeof(path), "%s%.*s", DOCUMENT_ROOT, (I)name.size(), name.data());
+    if (length < 0 || (Size)length >= sizeof(path))
     {
-        MgHttpMessage* hm = (MgHttpMessage*)evData;
-        ConnectionState cs(c, hm, ev);
-        
+        mg_http_reply(c, 404, cs->GetHeaderBlock(), "Not found\n");
+        return;
+    }
+
+    // Missing files are left to mongoose, which also looks for path.gz.
+    // The policy is for that file, a 404 is not cached by it.
+    auto fd = mappedFs.op(path, MG_FS_READ);
+    if (fd == nullptr)
+    {
+        C gzipPath[MG_PATH_MAX + 3];
+        snprintf(gzipPath, sizeof(gzipPath), "%s.gz", path);
+        auto gzipped = mappedFs.st(gzipPath, nullptr, nullptr) != 0;
+
+        static Str fileHeaders;
+        fileHeaders.assign(gzipped? cacheControl : StrView()).append(extraHeaders);
+
+        MgHttpServeOpts opts =
+        {
+            .root_dir = DOCUMENT_ROOT,
+            .ssi_pattern = nullptr,
+            .extra_headers = cs->GetHeaderBlock(fileHeaders),
+            .mime_types = extraMimeTypes,
+            .page404 = nullptr,
+            .fs = &mappedFs
+        };
+        mg_http_serve_file(c, hm, path, &opts);
+        return;
+    }
+
+    auto info = GetMappedFileInfo(fd);
+    C lastModified[httpDateLength + 1];
+    auto hasLastModified = FormatHttpDate(info.modified, lastModified);
+    auto notModified = IsNotModified(hm, info.etag, info.modified);
+
+    auto contentType = mg_http_content_type(mg_str_n(path, length), extraMimeTypes);
+
+    if (!notModified && (FindHeader(hm, KnownHeader::Range) != nullptr || info.size > maxInlineSize))
+    {
+        static Str fileHeaders;
+        fileHeaders.assign("Etag: ").append(info.etag).append("\r\n");
+        if (hasLastModified)
+        {
+            fileHeaders.append("Last-Modified: ").append(lastModified, httpDateLength).append("\r\n");
+        }
+        fileHeaders.append(cacheControl).append(extraHeaders);
+
+        if (ServeFileBody(
+                           cs,
+                           &mappedFs,
+                           fd,
+                           info.size,
+                           maxInlineSize,
+                           StrView(contentType.ptr, contentType.len),
+                           info.etag,
+                           info.modified,
+                           fileHeaders
+                         ))
+        {
+            return;
+        }
+    }
+
+    auto withBody = !notModified && mg_vcasecmp(&hm->method, "HEAD") != 0;
+    C contentLength[contentLengthLineSize];
+
+    auto sent = SendPieces(
+                            c,
+                            {
+                              StatusLine(notModified? 304 : 200),
+                              headerCache.GetDate(),
+                              "Content-Type: ",
+                              StrView(contentType.ptr, contentType.len),
+                              "\r\nEtag: ",
+                              info.etag,
+                              "\r\nAccept-Ranges: bytes\r\n",
+                              hasLastModified? "Last-Modified: " : "",
+                              hasLastModified? StrView(lastModified, httpDateLength) : StrView(),
+                              hasLastModified? "\r\n" : "",
+                              cacheControl,
+                              extraHeaders,
+                              cs->connectionHeaders,
+                              cs->routeHeaders,
+                              cs->responseHeaders,
+                              ContentLengthLine(notModified, info.size, contentLength),
+                              "\r\n"
+                            },
+                            withBody? info.size : 0
+                          );
+
+    if (sent && withBody)
+    {
+        auto read = mappedFs.rd(fd, c->send.buf + c->send.len, info.size);
+        c->send.len += read;
+        // Truncated on disk meanwhile, the response can not be completed.
+        if (read < info.size)
+        {
+            c->is_draining = 1;
+        }
+    }
+    mappedFs.cl(fd);
+    c->is_resp = 0;
+}
+
+
+auto
+Server::ServeEmbeddedAsset(
+                            ConnectionState* cs,
+                            const EmbeddedAsset* asset,
+                            StrView cacheControl,
+                            StrView extraHeaders
+                          ) -> void
+{
+    // Written in one go, larger ones and ranges are streamed.
+    static constexpr U64 maxInlineSize = 256 * 1024;
+
+    auto c = cs->c;
+    auto hm = cs->httpMsg;
+
+    C lastModified[httpDateLength + 1];
+    auto hasLastModified = FormatHttpDate((time_t)asset->mtime, lastModified);
+
+    auto acceptEncoding = FindHeader(hm, KnownHeader::AcceptEncoding);
+    CStr contentEncoding = nullptr;
+    auto& representation = SelectRepresentation(
+                                                  *asset,
+                                                  acceptEncoding?
+                                                      StrView(acceptEncoding->ptr, acceptEncoding->len) :
+                                                      StrView(),
+                                                  &contentEncoding
+                                                );
+    auto notModified = IsNotModified(hm, representation.etag, (time_t)asset->mtime);
+
+    auto hasVariants = asset->brotli.data != nullptr || asset->gzip.data != nullptr;
+
+    // Ranges are of the identity, whatever the client would accept.
+    if (!notModified && (FindHeader(hm, KnownHeader::Range) != nullptr || asset->identity.size > maxInlineSize))
+    {
+        static Str fileHeaders;
+        fileHeaders.assign("Etag: ").append(asset->identity.etag).append("\r\n");
+        if (hasLastModified)
+        {
+            fileHeaders.append("Last-Modified: ").append(lastModified, httpDateLength).append("\r\n");
+        }
+        fileHeaders.append(cacheControl).append(extraHeaders);
+        if (hasVariants)
+        {
+            fileHeaders.append("Vary: Accept-Encoding\r\n");
+        }
+
+        auto fd = embeddedFs.op(asset->path, MG_FS_READ);
         if (
-             mg_http_match_uri(hm, "/") ||
-             mg_http_match_uri(hm, "/index.html") ||
-             mg_http_match_uri(hm, "/main_page.html")
+             fd != nullptr &&
+             ServeFileBody(
+                            cs,
+                            &embeddedFs,
+                            fd,
+                            asset->identity.size,
+                            maxInlineSize,
+                            asset->mimeType,
+                            asset->identity.etag,
+                            (time_t)asset->mtime,
+                            fileHeaders
+                          )
            )
         {
-            auto mainPage =
-                FileExists(DOCUMENT_ROOT"/main_page.html")?
-                "/main_page.html" : "/index.html";
-            ServeFile(&cs, mainPage);
+            return;
         }
-        else
+        if (fd != nullptr)
         {
-            B endpointMatched = false;
-            for (auto& endpoint : endpoints)
-            {
-                if (mg_http_match_uri(hm, endpoint.first.c_str()))
-                {
-                    endpoint.second(&cs);
-                    endpointMatched = true;
-                }
-            }
+            embeddedFs.cl(fd);
+        }
+    }
 
-            for (auto& dir : servedDirs)
-            {
-                auto servedDirURI = (dir == "/") ? Str("/*") : dir + "/*";
-                if (mg_http_match_uri(hm, servedDirURI.c_str()))
+    auto withBody = !notModified && mg_vcasecmp(&hm->method, "HEAD") != 0;
+    C contentLength[contentLengthLineSize];
+
+    SendPieces(
+                c,
                 {
-                    ServeFile(&cs);
-                    endpointMatched = true;
+                  StatusLine(notModified? 304 : 200),
+                  headerCache.GetDate(),
+                  "Content-Type: ",
+                  asset->mimeType,
+                  "\r\nEtag: ",
+                  representation.etag,
+                  "\r\nAccept-Ranges: bytes\r\n",
+                  hasLastModified? "Last-Modified: " : "",
+                  hasLastModified? StrView(lastModified, httpDateLength) : StrView(),
+                  hasLastModified? "\r\n" : "",
+                  cacheControl,
+                  extraHeaders,
+                  contentEncoding? "Content-Encoding: " : "",
+                  contentEncoding? contentEncoding : "",
+                  contentEncoding? "\r\n" : "",
+                  hasVariants? "Vary: Accept-Encoding\r\n" : "",
+                  cs->connectionHeaders,
+                  cs->routeHeaders,
+                  cs->contentTypeHeader,
+                  cs->responseHeaders,
+                  ContentLengthLine(notModified, representation.size, contentLength),
+                  "\r\n",
+                  withBody? StrView((CStr)representation.data, representation.size) : StrView()
                 }
-            }
+              );
+    c->is_resp = 0;
+}
 
-            if (!endpointMatched)
-            {
-                ServeFile(&cs, "/not_found.html");
-            }
+
+auto
+Server::ServeFileBody(
+                       ConnectionState* cs,
+                       mg_fs* fs,
+                       void* fd,
+                       U64 size,
+                       U64 maxInlineSize,
+                       StrView contentType,
+                       StrView etag,
+                       time_t modified,
+                       StrView headers
+                     ) -> B
+{
+    auto c = cs->c;
+    auto hm = cs->httpMsg;
+
+    // Without a body the head is the same as for a file written in one go.
+    if (mg_vcasecmp(&hm->method, "HEAD") == 0)
+    {
+        return false;
+    }
+
+    Vec<ByteRange> ranges;
+    auto result = RangeResult::Whole;
+    auto range = FindHeader(hm, KnownHeader::Range);
+    if (range != nullptr && mg_vcasecmp(&hm->method, "GET") == 0)
+    {
+        // A changed representation is sent whole instead of in pieces that
+        // would not fit what the client already has.
+        auto ifRange = FindHeader(hm, KnownHeader::IfRange);
+        if (ifRange == nullptr || IfRangeMatches(StrView(ifRange->ptr, ifRange->len), etag, modified))
+        {
+            result = ParseRanges(StrView(range->ptr, range->len), size, &ranges);
+        }
+    }
+
+    C sizeText[20];
+    auto sizeEnd = std::to_chars(sizeText, sizeText + sizeof(sizeText), size).ptr;
+
+    if (result == RangeResult::Unsatisfiable)
+    {
+        fs->cl(fd);
+        SendPieces(
+                    c,
+                    {
+                      StatusLine(416),
+                      headerCache.GetDate(),
+                      "Content-Range: bytes */",
+                      StrView(sizeText, sizeEnd - sizeText),
+                      "\r\n",
+                      headers,
+                      cs->connectionHeaders,
+                      cs->routeHeaders,
+                      cs->responseHeaders,
+                      "Content-Length: 0\r\n\r\n"
+                    }
+                  );
+        c->is_resp = 0;
+        return true;
+    }
+
+    if (result == RangeResult::Whole)
+    {
+        if (size <= maxInlineSize)
+        {
+            return false;
         }
+        ranges.push_back({ 0, size - 1 });
+    }
+
+    // Only a single range is described in the head, several in their parts.
+    C contentRange[80];
+    auto contentRangeLength = 0;
+    if (result == RangeResult::Partial && ranges.size() == 1)
+    {
+        contentRangeLength = snprintf(
+                                       contentRange,
+                                       sizeof(contentRange),
+                                       "Content-Range: bytes %llu-%llu/%llu\r\n",
+                                       (unsigned long long)ranges.front().first,
+                                       (unsigned long long)ranges.front().last,
+                                       (unsigned long long)size
+                                     );
+    }
+
+    auto body = new FileBody(fs, fd, size, contentType, std::move(ranges));
+
+    C bodyLength[20];
+    auto bodyLengthEnd = std::to_chars(bodyLength, bodyLength + sizeof(bodyLength), body->GetLength()).ptr;
+
+    auto sent = SendPieces(
+                            c,
+                            {
+                              StatusLine(result == RangeResult::Partial? 206 : 200),
+                              headerCache.GetDate(),
+                              "Content-Type: ",
+                              body->IsMultipart()? StrView(body->GetMultipartType()) : contentType,
+                              "\r\nAccept-Ranges: bytes\r\n",
+                              StrView(contentRange, contentRangeLength),
+                              headers,
+                              cs->connectionHeaders,
+                              cs->routeHeaders,
+                              cs->responseHeaders,
+                              "Content-Length: ",
+                              StrView(bodyLength, bodyLengthEnd - bodyLength),
+                              "\r\n\r\n"
+                            }
+                          );
+    if (!sent)
+    {
+        delete body;
+        c->is_resp = 0;
+        return true;
     }
-    (void)fnData;
+
+    FileBody::Send(c, body);
+    return true;
 }
 
+auto
+Server::RejectConnection(MgConnection* c, B isTLS) -> void
+{
+    static constexpr StrView response =
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Retry-After: 1\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n\r\n";
+
+    c->fn_data = nullptr;
 
-B Server::TLSIsPossible()
+    if (isTLS)
+    {
+        c->is_closing = 1;
+    }
+    else
+    {
+        mg_send(c, response.data(), response.size());
+        c->is_draining = 1;
+    }
+}
+
+
+auto
+Server::ReplyRetryLater(ConnectionState* cs, U32 code, U32 retryAfterS) -> void
 {
-    return FileExists(certPath) && FileExists(privKeyPath);
+    C retryAfter[20];
+    auto retryAfterEnd = std::to_chars(retryAfter, retryAfter + sizeof(retryAfter), retryAfterS).ptr;
+
+    // Written directly, the handler is never invoked.
+    SendPieces(
+                cs->c,
+                {
+                  StatusLine(code),
+                  headerCache.GetDate(),
+                  "Retry-After: ",
+                  StrView(retryAfter, retryAfterEnd - retryAfter),
+                  "\r\nContent-Length: 0\r\n",
+                  cs->connectionHeaders,
+                  cs->routeHeaders,
+                  cs->responseHeaders,
+                  "\r\n"
+                }
+              );
+    cs->c->is_resp = 0;
 }
 
+
 auto
-Server::AddServeDir(CStr dir) -> void
+Server::ListenURL(CStr scheme, U16 port) -> Str
 {
-    servedDirs.emplace_back(dir);
+    auto host = (address.find(':') != Str::npos)? "[" + address + "]" : address;
+    return Str(scheme) + "://" + host + ":" + std::to_string(port);
 }
 
 
 auto
-Server::AddHandler(CStr endpointRegex, ConnectionHandler handler) -> void
+Server::Listen(CStr scheme, U16 port, void* fnData) -> void
 {
-    endpoints.emplace(Str(endpointRegex), handler);
+    // A socket handed over by the process being replaced is already
+    // listening, binding again would fail.
+    auto fd = upgrader.TakeInheritedListener(port);
+    auto listener = (fd != -1)?
+        mg_http_listen_fd(&mgr, fd, Server::HttpListener, fnData) :
+        mg_http_listen(&mgr, ListenURL(scheme, port).c_str(), Server::HttpListener, fnData);
+
+    connections.AddListener(listener);
 }
 
 
-void Server::Run()
+auto
+Server::PrepareRedirect() -> void
 {
-    if (TLSIsPossible())
+    auto& options = listenOptions;
+
+    // Everything but the host and the path is rendered once, the reply is
+    // then appended to the send buffer piece by piece with no formatting.
+    redirectHead =
+        "Content-Length: 0\r\n"
+        "Location: https://" + options.canonicalHost;
+
+    redirectTail.clear();
+    if (options.canonicalHost.empty() && options.httpsPort != 443)
     {
-        mg_http_listen(&mgr, httpsAddress.c_str(), Server::HttpListener, (void*) certPath.data());
+        redirectTail = ":" + std::to_string(options.httpsPort);
     }
-    else
+    else if (options.httpsPort != 443)
     {
-        mg_http_listen(&mgr, httpAddress.c_str(), Server::HttpListener, nullptr);
+        redirectHead += ":" + std::to_string(options.httpsPort);
     }
 
-    while (true)
+    Str hsts;
+    if (options.hstsMaxAgeS != 0)
     {
-        mg_mgr_poll(&mgr, 16);
+        hsts = "max-age=" + std::to_string(options.hstsMaxAgeS);
+        if (options.hstsIncludeSubdomains)
+        {
+            hsts += "; includeSubDomains";
+        }
     }
+    headerCache.SetHsts(hsts);
 }
 
-void Server::Clean()
+
+auto
+Server::ShouldRedirectToHttps(MgConnection* c, MgHttpMessage* hm) -> B
 {
-    mg_mgr_free(&mgr);
+    return
+        !c->is_tls &&
+        listenOptions.redirectToHttps &&
+        tlsConfig.IsEnabled() &&
+        !mg_http_match_uri(hm, "/.well-known/acme-challenge/*");
+}
+
+
+auto
+Server::AddResponseHeaders(ConnectionState* cs, ConnectionRecord* record) -> void
+{
+    cs->connectionHeaders = headerCache.GetConnectionHeaders(cs->c->is_tls, record->closeAfterResponse);
+
+    for (auto& [pattern, headers] : routeHeaders)
+    {
+        if (mg_http_match_uri(cs->httpMsg, pattern.c_str()))
+        {
+            cs->routeHeaders = headers;
+            break;
+        }
+    }
+}
+
+
+auto
+Server::RedirectToHttps(ConnectionState* cs, B close) -> void
+{
+    static constexpr StrView keepAliveEnd = "\r\n\r\n";
+    static constexpr StrView closeEnd = "\r\nConnection: close\r\n\r\n";
+
+    auto c = cs->c;
+    auto hm = cs->httpMsg;
+
+    SendPieces(c, { StatusLine(308), headerCache.GetDate(), redirectHead });
+    if (listenOptions.canonicalHost.empty())
+    {
+        auto host = FindHeader(hm, KnownHeader::Host);
+        if (host != nullptr)
+        {
+            // Drop the plain HTTP port, brackets of IPv6 literals stay.
+            auto length = host->len;
+            auto colon = StrView(host->ptr, length).rfind(':');
+            if (colon != StrView::npos && host->ptr[length - 1] != ']')
+            {
+                length = colon;
+            }
+            mg_send(c, host->ptr, length);
+        }
+        else
+        {
+            mg_send(c, address.data(), address.size());
+        }
+        mg_send(c, redirectTail.data(), redirectTail.size());
+    }
+
+    // The request target, query included.
+    auto targetEnd = hm->query.len > 0? hm->query.ptr + hm->query.len : hm->uri.ptr + hm->uri.len;
+    mg_send(c, hm->uri.ptr, targetEnd - hm->uri.ptr);
+
+    auto end = close? closeEnd : keepAliveEnd;
+    mg_send(c, end.data(), end.size());
+    c->is_resp = 0;
+}
+
+
+auto
+Server::RateLimitAllows(ConnectionState* cs) -> B
+{
+    auto hm = cs->httpMsg;
+
+    for (U32 i = 0; i < rateLimits.size(); ++i)
+    {
+        auto& [pattern, policy] = rateLimits[i];
+        if (!mg_http_match_uri(hm, pattern.c_str()))
+        {
+            continue;
+        }
+
+        RateLimitKey key = { cs->GetRemoteIPv4Address(), i, 0 };
+        if (policy.perURI)
+        {
+            key.aux = HashBytes(hm->uri.ptr, hm->uri.len);
+        }
+        if (!policy.cookieName.empty())
+        {
+            auto cookie = FindHeader(hm, KnownHeader::Cookie);
+            if (cookie != nullptr)
+            {
+                auto name = mg_str_n(policy.cookieName.data(), policy.cookieName.size());
+                auto value = mg_http_get_header_var(*cookie, name);
+                key.aux ^= MixHash(HashBytes(value.ptr, value.len));
+            }
+        }
+
+        U32 retryAfterS = 0;
+        if (!rateLimiter.Consume(key, policy, mg_millis(), retryAfterS))
+        {
+            ReplyRetryLater(cs, 429, retryAfterS);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+void Server::HttpListener(MgConnection* c, int ev, void* evData, void* fnData)
+{
+    if (ev == MG_EV_ACCEPT)
+    {
+        auto record = connections.Admit(c, mg_millis());
+        if (record == nullptr)
+        {
+            RejectConnection(c, fnData != nullptr);
+            return;
+        }
+        c->fn_data = record;
+        cpuPlacement.OnAccept((I32)(Size)c->fd);
+
+        if (fnData != nullptr)
+        {
+            record->tlsCredentials = tlsConfig.Attach(c);
+            if (record->tlsCredentials == nullptr)
+            {
+                c->is_closing = 1;
+            }
+        }
+        return;
+    }
+
+    // Listener events and connections turned away on accept.
+    if (!c->is_accepted || fnData == nullptr || ev == MG_EV_OPEN)
+    {
+        return;
+    }
+
+    auto record = (ConnectionRecord*)fnData;
+    connections.ForgetParse();
+
+    if (ev == MG_EV_WRITE)
+    {
+        record->bytesWritten += *(long*)evData;
+    }
+    // Before the upgraded protocols take over, and before a close releases
+    // the record.
+    TrackAccess(record, ev);
+
+    if (record->webSocket != nullptr)
+    {
+        OnWebSocketEvent(record, ev, evData);
+        return;
+    }
+    if (record->eventStream != nullptr)
+    {
+        OnEventStreamEvent(record, ev);
+        return;
+    }
+    if (record->http2 != nullptr)
+    {
+        OnHttp2Event(record, ev, evData);
+        return;
+    }
+
+    if (ev == MG_EV_READ)
+    {
+        // The first bytes after a handshake that picked h2 are the client's
+        // connection preface.
+        if (record->requestsServed == 0 && c->is_tls && TLSConfig::GetAlpnProtocol(c) == "h2")
+        {
+            connections.OnUpgrade(record);
+            record->http2 = http2.Open(c);
+            OnHttp2Event(record, ev, evData);
+            return;
+        }
+        connections.OnRead(record, mg_millis());
+    }
+    else if (ev == MG_EV_WRITE)
+    {
+        connections.OnWrite(record, mg_millis());
+        if (record->proxyExchange != nullptr)
+        {
+            reverseProxy.OnClientWrite(record->proxyExchange);
+        }
+    }
+    else if (ev == MG_EV_POLL)
+    {
+        connections.OnPoll(record, *(U64*)evData);
+    }
+    else if (ev == MG_EV_CLOSE)
+    {
+        if (record->bodyStream != nullptr)
+        {
+            AbortBody(record);
+        }
+        if (record->proxyExchange != nullptr)
+        {
+            reverseProxy.OnClientClose(record->proxyExchange);
+        }
+        if (record->command != nullptr)
+        {
+            commandRunner.Forget(record->command);
+        }
+        ReleaseConnection(record);
+        return;
+    }
+    else if (ev == MG_EV_HTTP_CHUNK)
+    {
+        OnBodyChunk(record, (MgHttpMessage*)evData);
+    }
+    else if (ev == MG_EV_HTTP_MSG)
+    {
+        MgHttpMessage* hm = (MgHttpMessage*)evData;
+        if (record->bodyStream != nullptr)
+        {
+            FinishBody(record, hm);
+        }
+        else
+        {
+            connections.OnRequest(record, mg_millis());
+            BeginAccess(record, hm, 0);
+            HandleRequest(record, hm);
+        }
+    }
+
+    // Sees the head of a response written right away before it is sent,
+    // and ends the record of one the event completed.
+    TrackAccess(record, ev);
+}
+
+
+auto
+Server::HandleRequest(ConnectionRecord* record, MgHttpMessage* hm) -> void
+{
+    auto c = record->c;
+    ConnectionState cs(c, hm, MG_EV_HTTP_MSG);
+
+    if (ShouldRedirectToHttps(c, hm))
+    {
+        RedirectToHttps(&cs, record->closeAfterResponse);
+        return;
+    }
+
+    AddResponseHeaders(&cs, record);
+
+    if (!RateLimitAllows(&cs))
+    {
+        return;
+    }
+
+    auto responseStart = record->bytesWritten + c->send.len;
+    B endpointMatched = false;
+    for (auto& [pattern, endpoint] : routing->endpoints)
+    {
+        if (mg_http_match_uri(hm, pattern.c_str()))
+        {
+            if (!endpointMatched)
+            {
+                record->access.route = endpoint->accessRoute;
+            }
+            endpointMatched = true;
+
+            auto queueDepth = connections.GetInFlightCount();
+            if (loadShedder.ShouldShed(endpoint->priority, queueDepth))
+            {
+                auto retryAfterS = loadShedder.GetOptions().retryAfterS;
+                ReplyRetryLater(&cs, 503, retryAfterS);
+                return;
+            }
+
+            endpoint->handler(&cs);
+        }
+    }
+
+    // An endpoint on a served dir's path may add headers for the file. One
+    // that answered itself, like the main page under a dir served at "/", is
+    // not followed by the file.
+    auto answered = record->bytesWritten + c->send.len != responseStart;
+    for (auto& dir : routing->servedDirs)
+    {
+        if (!answered && mg_http_match_uri(hm, dir.pattern.c_str()))
+        {
+            if (!endpointMatched)
+            {
+                record->access.route = dir.accessRoute;
+            }
+            ServeFile(&cs, nullptr, dir.cacheRules.GetHeader(StrView(hm->uri.ptr, hm->uri.len)), dir.headers);
+            endpointMatched = true;
+        }
+    }
+
+    if (!endpointMatched)
+    {
+        auto embedded = serveEmbeddedAssets && FindEmbeddedAsset("/not_found.html") != nullptr;
+        if (embedded || !notFoundPage.Serve(c, hm, { headerCache.GetDate(), cs.connectionHeaders, cs.routeHeaders, cs.responseHeaders }))
+        {
+            ServeFile(&cs, "/not_found.html");
+        }
+    }
+}
+
+
+auto
+Server::BeginAccess(ConnectionRecord* record, MgHttpMessage* hm, U16 route) -> void
+{
+    if (!accessLog.IsEnabled())
+    {
+        return;
+    }
+
+    // A pipelined request, the previous response is complete in the send
+    // buffer.
+    if (record->access.startNs != 0)
+    {
+        FinishAccess(record);
+    }
+
+    auto& access = record->access;
+    access.startNs = GetHighResTimeNS();
+    access.path = accessLog.InternPath(StrView(hm->uri.ptr, hm->uri.len));
+    access.responseStart = record->bytesWritten + record->c->send.len;
+    access.interimLength = 0;
+    access.route = route;
+    access.status = 0;
+    access.method = (U8)ParseAccessMethod(StrView(hm->method.ptr, hm->method.len));
+    access.dispatched = record->bodyStream == nullptr;
+}
+
+
+auto
+Server::TrackAccess(ConnectionRecord* record, I ev) -> void
+{
+    auto& access = record->access;
+    if (access.startNs == 0)
+    {
+        return;
+    }
+
+    // The status line is read from the send buffer, skipping 1xx heads,
+    // while it is still there.
+    auto c = record->c;
+    auto position = access.responseStart + access.interimLength;
+    while (access.status == 0 && position >= record->bytesWritten && position - record->bytesWritten <= c->send.len)
+    {
+        auto pending = StrView((CStr)c->send.buf, c->send.len).substr(position - record->bytesWritten);
+        if (pending.size() < 12 || !pending.starts_with("HTTP/"))
+        {
+            break;
+        }
+        auto status = U16(std::atoi(pending.data() + 9));
+        if (status >= 200 || status < 100 || status == 101)
+        {
+            access.status = status;
+            break;
+        }
+        auto headEnd = pending.find("\r\n\r\n");
+        if (headEnd == StrView::npos)
+        {
+            break;
+        }
+        access.interimLength += U32(headEnd + 4);
+        position += headEnd + 4;
+    }
+
+    // Done as soon as the tracker would see it done, or once the
+    // connection was handed to another protocol.
+    auto phase = record->phase;
+    if (
+         ev == MG_EV_CLOSE ||
+         phase == ConnectionPhase::Upgraded ||
+         (access.dispatched && (phase != ConnectionPhase::Responding || !c->is_resp))
+       )
+    {
+        FinishAccess(record);
+    }
+}
+
+
+auto
+Server::FinishAccess(ConnectionRecord* record) -> void
+{
+    auto& access = record->access;
+    auto c = record->c;
+    auto queued = record->bytesWritten + c->send.len;
+    auto interimEnd = access.responseStart + access.interimLength;
+
+    AccessRecord entry;
+    entry.timeMs = accessLog.ToUnixMs(access.startNs);
+    entry.bytes = (queued > interimEnd)? queued - interimEnd : 0;
+    entry.path = access.path;
+    entry.ip = mg_ntohl(c->rem.ip);
+    entry.latencyUs = U32(std::min<U64>((GetHighResTimeNS() - access.startNs) / 1000, ~U32(0)));
+    entry.port = mg_ntohs(c->rem.port);
+    entry.route = access.route;
+    entry.status = access.status;
+    entry.method = access.method;
+    entry.flags = (c->is_tls? accessTLS : 0) | (c->fd == (void*)(Size)MG_INVALID_SOCKET? accessHttp2 : 0);
+
+    accessLog.Append(entry);
+    access.startNs = 0;
+}
+
+
+auto
+Server::ReleaseConnection(ConnectionRecord* record) -> void
+{
+    auto c = record->c;
+
+    TLSConfig::Detach(record->tlsCredentials);
+    connections.Release(record);
+    // mongoose's own handler still sees MG_EV_CLOSE after us and may
+    // deliver a request that was only delimited by the close, which must
+    // not reach the released record.
+    c->fn_data = nullptr;
+}
+
+
+auto
+Server::UpgradeToWebSocket(ConnectionState* cs, const WebSocketHandler* handler) -> void
+{
+    auto c = cs->c;
+    auto record = (ConnectionRecord*)c->fn_data;
+
+    mg_ws_upgrade(c, cs->httpMsg, nullptr);
+    if (!c->is_websocket)
+    {
+        return;
+    }
+
+    connections.OnUpgrade(record);
+    record->webSocket = new WebSocketConnection(c, handler, &pubSub);
+    if (handler->onOpen)
+    {
+        handler->onOpen(record->webSocket);
+    }
+}
+
+
+auto
+Server::OnWebSocketEvent(ConnectionRecord* record, I ev, void* evData) -> void
+{
+    auto ws = record->webSocket;
+
+    if (ev == MG_EV_WS_MSG)
+    {
+        auto msg = (mg_ws_message*)evData;
+        auto binary = (msg->flags & 15) == WEBSOCKET_OP_BINARY;
+        if (ws->handler->onMessage)
+        {
+            ws->handler->onMessage(ws, StrView(msg->data.ptr, msg->data.len), binary);
+        }
+    }
+    else if (ev == MG_EV_WRITE || ev == MG_EV_POLL)
+    {
+        ws->sendQueue.Drain(record->c);
+    }
+    else if (ev == MG_EV_CLOSE)
+    {
+        if (ws->handler->onClose)
+        {
+            ws->handler->onClose(ws);
+        }
+        pubSub.UnsubscribeAll(ws);
+        delete ws;
+        record->webSocket = nullptr;
+        ReleaseConnection(record);
+    }
+}
+
+
+auto
+Server::OpenEventStream(ConnectionState* cs, CStr channel) -> void
+{
+    auto c = cs->c;
+    auto record = (ConnectionRecord*)c->fn_data;
+
+    // No length and no chunking, the body ends when the connection does.
+    // is_resp stays set, so mongoose does not parse anything after the
+    // request as another one.
+    SendPieces(
+                c,
+                {
+                  StatusLine(200),
+                  headerCache.GetDate(),
+                  "Content-Type: text/event-stream\r\n"
+                  "Cache-Control: no-cache\r\n"
+                  "X-Accel-Buffering: no\r\n",
+                  cs->connectionHeaders,
+                  cs->routeHeaders,
+                  cs->responseHeaders,
+                  "\r\n"
+                }
+              );
+
+    auto lastEventId = mg_http_get_header(cs->httpMsg, "Last-Event-ID");
+    auto lastId = lastEventId? StrView(lastEventId->ptr, lastEventId->len) : StrView();
+
+    connections.OnUpgrade(record);
+    record->eventStream = eventBroker.Open(c, channel, lastId);
+}
+
+
+auto
+Server::OnEventStreamEvent(ConnectionRecord* record, I ev) -> void
+{
+    auto stream = record->eventStream;
+
+    if (ev == MG_EV_READ)
+    {
+        // Nothing is expected from the client past the request.
+        record->c->recv.len = 0;
+    }
+    else if (ev == MG_EV_WRITE || ev == MG_EV_POLL)
+    {
+        stream->sendQueue.Drain(record->c);
+    }
+    else if (ev == MG_EV_CLOSE)
+    {
+        eventBroker.Close(stream);
+        record->eventStream = nullptr;
+        ReleaseConnection(record);
+    }
+}
+
+
+auto
+Server::RunCommand(
+                    ConnectionState* cs,
+                    const Vec<Str>& args,
+                    StrView input,
+                    const CommandHandler& handler
+                  ) -> void
+{
+    auto record = (ConnectionRecord*)cs->c->fn_data;
+
+    ConnectionState state = *cs;
+    state.httpMsg = nullptr;
+
+    auto callback = [record, state, handler](const CommandResult& result) mutable
+    {
+        // Not set yet when the command failed right away, the reply then
+        // goes out on the way back from the request's handler.
+        auto deferred = record->command != nullptr;
+        record->command = nullptr;
+        handler(&state, result);
+
+        // A pipelined request sitting in the receive buffer gets no read
+        // event of its own.
+        auto c = state.c;
+        if (deferred && !c->is_resp && c->recv.len > 0 && !c->is_draining && !c->is_closing)
+        {
+            long n = 0;
+            mg_call(c, MG_EV_READ, &n);
+        }
+    };
+
+    record->command = commandRunner.Run(args, input, callback);
+}
+
+
+auto
+Server::AdmitStream(MgConnection* c) -> B
+{
+    auto record = connections.Admit(c, mg_millis());
+    if (record == nullptr)
+    {
+        return false;
+    }
+
+    c->fn_data = record;
+    return true;
+}
+
+
+auto
+Server::OnHttp2Event(ConnectionRecord* record, I ev, void* evData) -> void
+{
+    auto session = record->http2;
+
+    if (ev == MG_EV_POLL && record->closeAfterResponse)
+    {
+        http2.Shutdown(session);
+    }
+
+    http2.OnEvent(session, ev, evData);
+
+    if (ev == MG_EV_CLOSE)
+    {
+        record->http2 = nullptr;
+        ReleaseConnection(record);
+    }
+}
+
+
+auto
+Server::ResolveBodyLimit(MgHttpMessage* hm) -> U64
+{
+    for (auto route : routing->streamingRoutes)
+    {
+        if (mg_http_match_uri(hm, route->pattern.c_str()))
+        {
+            return route->maxBodySize;
+        }
+    }
+
+    return connections.GetLimits().maxRequestBodySize;
+}
+
+
+auto
+Server::OnBodyChunk(ConnectionRecord* record, MgHttpMessage* hm) -> void
+{
+    auto c = record->c;
+
+    // Refused, the rest of the body is thrown away.
+    if (c->is_draining)
+    {
+        return;
+    }
+
+    auto stream = record->bodyStream;
+    if (stream == nullptr)
+    {
+        const StreamingRoute* route = nullptr;
+        for (auto candidate : routing->streamingRoutes)
+        {
+            if (mg_http_match_uri(hm, candidate->pattern.c_str()))
+            {
+                route = candidate;
+                break;
+            }
+        }
+        // Buffered until MG_EV_HTTP_MSG as usual.
+        if (route == nullptr)
+        {
+            return;
+        }
+
+        stream = new BodyStream{ ConnectionState(c, hm, MG_EV_HTTP_CHUNK), route, 0 };
+        record->bodyStream = stream;
+        // Timed from the header block, the body is part of the request.
+        BeginAccess(record, hm, route->accessRoute);
+        auto cs = &stream->cs;
+        // Until FinishBody sets the response's own, a reply refuses the
+        // body, which is left unread, and the connection closes after it.
+        cs->connectionHeaders = headerCache.GetConnectionHeaders(c->is_tls, true);
+
+        if (ShouldRedirectToHttps(c, hm))
+        {
+            RedirectToHttps(cs, true);
+            DiscardBody(record);
+            return;
+        }
+        if (!RateLimitAllows(cs))
+        {
+            DiscardBody(record);
+            return;
+        }
+        if (loadShedder.ShouldShed(route->priority, connections.GetInFlightCount()))
+        {
+            auto retryAfterS = loadShedder.GetOptions().retryAfterS;
+            ReplyRetryLater(cs, 503, retryAfterS);
+            DiscardBody(record);
+            return;
+        }
+        if (route->handler.onBegin && !route->handler.onBegin(cs))
+        {
+            DiscardBody(record);
+            return;
+        }
+    }
+
+    auto cs = &stream->cs;
+    cs->httpMsg = hm;
+
+    if (hm->chunk.len == 0)
+    {
+        // End of the body. When nothing was deleted, i.e. the body was
+        // empty, mongoose goes on to deliver MG_EV_HTTP_MSG, finish there.
+        if (stream->received > 0)
+        {
+            FinishBody(record, hm);
+        }
+        return;
+    }
+
+    // Chunked bodies have no length to check up front.
+    stream->received += hm->chunk.len;
+    if (stream->received > record->maxBodySize)
+    {
+        connections.RejectBody(record);
+        AbortBody(record);
+        return;
+    }
+
+    auto& handler = stream->route->handler;
+    auto proceed = !handler.onChunk || handler.onChunk(cs, StrView(hm->chunk.ptr, hm->chunk.len));
+    if (!proceed)
+    {
+        DiscardBody(record);
+        return;
+    }
+
+    // Keeps the receive buffer at one chunk however large the body is.
+    mg_http_delete_chunk(c, hm);
+}
+
+
+auto
+Server::FinishBody(ConnectionRecord* record, MgHttpMessage* hm) -> void
+{
+    auto stream = record->bodyStream;
+    auto cs = &stream->cs;
+    cs->httpMsg = hm;
+
+    connections.OnRequest(record, mg_millis());
+    record->access.dispatched = true;
+    AddResponseHeaders(cs, record);
+
+    if (stream->route->handler.onEnd)
+    {
+        stream->route->handler.onEnd(cs);
+    }
+
+    record->bodyStream = nullptr;
+    delete stream;
+}
+
+
+auto
+Server::AbortBody(ConnectionRecord* record) -> void
+{
+    auto stream = record->bodyStream;
+
+    if (stream->route->handler.onAbort)
+    {
+        stream->route->handler.onAbort(&stream->cs);
+    }
+
+    record->bodyStream = nullptr;
+    delete stream;
+}
+
+
+auto
+Server::DiscardBody(ConnectionRecord* record) -> void
+{
+    // Whatever was replied goes out, then the connection closes since the
+    // unread body is still in the way of the next request.
+    auto c = record->c;
+    record->closeAfterResponse = true;
+    c->recv.len = 0;
+    c->is_draining = 1;
+
+    AbortBody(record);
+}
+
+
+B Server::TLSIsPossible()
+{
+    return FileExists(certPath) && FileExists(privKeyPath);
+}
+
+auto
+Server::ServeMainPage(ConnectionState* cs) -> void
+{
+    auto c = cs->c;
+    auto hm = cs->httpMsg;
+
+    // Interim responses are for HTTP/1.1 clients, the HTTP/2 streams are
+    // rewritten as such.
+    auto& earlyHints = routing->earlyHints;
+    if (!earlyHints.empty() && mg_vcasecmp(&hm->method, "GET") == 0 && mg_vcmp(&hm->proto, "HTTP/1.1") == 0)
+    {
+        SendPieces(c, { earlyHints });
+    }
+
+    auto embedded =
+        serveEmbeddedAssets &&
+        (FindEmbeddedAsset("/main_page.html") != nullptr || FindEmbeddedAsset("/index.html") != nullptr);
+    if (
+         embedded ||
+         !landingPage.Serve(
+                             c,
+                             hm,
+                             {
+                               headerCache.GetDate(),
+                               cs->connectionHeaders,
+                               cs->routeHeaders,
+                               routing->mainPageHeaders,
+                               cs->responseHeaders
+                             }
+                           )
+       )
+    {
+        auto hasMainPage =
+            (serveEmbeddedAssets && FindEmbeddedAsset("/main_page.html") != nullptr) ||
+            FileExists(DOCUMENT_ROOT"/main_page.html");
+        auto mainPage =
+            hasMainPage?
+            "/main_page.html" : "/index.html";
+        ServeFile(cs, mainPage, StrView(), routing->mainPageHeaders);
+    }
+}
+
+
+// The preloads are found while the table is built, the hints and the main
+// page's Link header are then copied as they are.
+auto
+Server::PrepareEarlyHints(RoutingTable* table) -> void
+{
+    Vec<Str> preloads;
+    auto wasm = false;
+    for (auto& dir : table->servedDirs)
+    {
+        if (!dir.wasm)
+        {
+            continue;
+        }
+        wasm = true;
+
+        for (auto& path : FindPreloads(dir.dir, dir.preloadManifest, serveEmbeddedAssets))
+        {
+            if (std::find(preloads.begin(), preloads.end(), path) == preloads.end())
+            {
+                preloads.push_back(std::move(path));
+            }
+        }
+    }
+    if (!wasm)
+    {
+        return;
+    }
+
+    auto links = RenderPreloadLinks(preloads);
+    table->mainPageHeaders = Str(crossOriginIsolation) + links;
+    if (!links.empty())
+    {
+        table->earlyHints = Str(StatusLine(103)) + links + "\r\n";
+        Log("Early hints for the main page: ", preloads.size(), " preloads");
+    }
+}
+
+
+auto
+Server::MakeServedDir(CStr dir, const ServeDirOptions& options) -> ServedDir
+{
+    ServedDir served;
+    served.dir = dir;
+    served.pattern = (StrView(dir) == "/")? Str("/*") : Str(dir) + "/*";
+    for (auto& [pattern, policy] : options.cachePolicies)
+    {
+        served.cacheRules.Add(pattern, policy);
+    }
+    served.cacheRules.Add("#", options.cachePolicy);
+    if (options.wasm)
+    {
+        served.headers = crossOriginIsolation;
+    }
+    served.wasm = options.wasm;
+    served.preloadManifest = options.preloadManifest;
+    served.accessRoute = accessLog.AddRoute(served.pattern);
+
+    return served;
+}
+
+
+auto
+Server::AddServeDir(CStr dir, const ServeDirOptions& options) -> void
+{
+    auto served = MakeServedDir(dir, options);
+
+    LockGuard<Mutex> lock(routingMutex);
+    servedDirs.push_back(std::move(served));
+    PublishRouting();
+}
+
+
+auto
+Server::RemoveServeDir(CStr dir) -> void
+{
+    LockGuard<Mutex> lock(routingMutex);
+    std::erase_if(servedDirs, [dir](const ServedDir& served) { return served.dir == dir; });
+    PublishRouting();
+}
+
+
+auto
+Server::SetRouteEnabled(CStr endpointRegex, B enabled) -> void
+{
+    LockGuard<Mutex> lock(routingMutex);
+    std::erase(disabledRoutes, endpointRegex);
+    if (!enabled)
+    {
+        disabledRoutes.emplace_back(endpointRegex);
+    }
+    PublishRouting();
+}
+
+
+auto
+Server::SetRoutingFile(CStr path, U32 checkIntervalMs) -> B
+{
+    return routingWatcher.Start(path, checkIntervalMs, Server::ApplyRoutingConfig, &cpuPlacement);
+}
+
+
+// On the watcher's thread, what the file had before is replaced.
+auto
+Server::ApplyRoutingConfig(const RoutingConfig& config) -> void
+{
+    Vec<ServedDir> dirs;
+    for (auto& dir : config.serveDirs)
+    {
+        ServeDirOptions options;
+        options.cachePolicy.cacheControl = dir.cacheControl;
+        options.wasm = dir.wasm;
+        dirs.push_back(MakeServedDir(dir.dir.c_str(), options));
+    }
+
+    LockGuard<Mutex> lock(routingMutex);
+    configuredDirs = std::move(dirs);
+    configuredDisabledRoutes = config.disabled;
+    PublishRouting();
+}
+
+
+// With routingMutex held.
+auto
+Server::IsRouteEnabled(StrView pattern) -> B
+{
+    auto disabled = [pattern](const Vec<Str>& patterns)
+    {
+        return std::find(patterns.begin(), patterns.end(), pattern) != patterns.end();
+    };
+
+    return !disabled(disabledRoutes) && !disabled(configuredDisabledRoutes);
+}
+
+
+// With routingMutex held.
+auto
+Server::BuildRouting() -> UniquePtr<RoutingTable>
+{
+    auto table = std::make_unique<RoutingTable>();
+
+    for (auto& [pattern, endpoint] : endpoints)
+    {
+        if (IsRouteEnabled(pattern))
+        {
+            table->endpoints.emplace_back(pattern, &endpoint);
+        }
+    }
+    for (auto& route : streamingRoutes)
+    {
+        if (IsRouteEnabled(route->pattern))
+        {
+            table->streamingRoutes.push_back(route.get());
+        }
+    }
+
+    // A dir the program and the file both serve is served once.
+    for (auto dirs : { &servedDirs, &configuredDirs })
+    {
+        for (auto& dir : *dirs)
+        {
+            auto served = std::find_if(
+                                        table->servedDirs.begin(),
+                                        table->servedDirs.end(),
+                                        [&dir](const ServedDir& other) { return other.pattern == dir.pattern; }
+                                      );
+            if (served == table->servedDirs.end() && IsRouteEnabled(dir.pattern))
+            {
+                table->servedDirs.push_back(dir);
+            }
+        }
+    }
+
+    PrepareEarlyHints(table.get());
+    return table;
+}
+
+
+// With routingMutex held, so tables are published in the order of the
+// changes they include. Until Run() puts up the first one there is nothing
+// to publish.
+auto
+Server::PublishRouting() -> void
+{
+    if (!routingPublished)
+    {
+        return;
+    }
+
+    // If the event loop has not picked up the previous one yet, replace it.
+    delete pendingRouting.exchange(BuildRouting().release(), std::memory_order_acq_rel);
+}
+
+
+// Between two polls, once per iteration.
+auto
+Server::UpdateRouting() -> void
+{
+    if (pendingRouting.load(std::memory_order_relaxed) == nullptr)
+    {
+        return;
+    }
+
+    // Requests hold on to the table only within the event they are handled
+    // in, the old one can go right away.
+    delete routing;
+    routing = pendingRouting.exchange(nullptr, std::memory_order_acq_rel);
+    routingUpdates++;
+}
+
+
+auto
+Server::AddHandler(
+                    CStr endpointRegex,
+                    ConnectionHandler handler,
+                    RoutePriority priority
+                  ) -> void
+{
+    LockGuard<Mutex> lock(routingMutex);
+    auto [endpoint, added] = endpoints.emplace(Str(endpointRegex), Endpoint{ handler, priority, 0 });
+    if (added)
+    {
+        endpoint->second.accessRoute = accessLog.AddRoute(endpointRegex);
+        PublishRouting();
+    }
+}
+
+
+auto
+Server::AddStreamingHandler(
+                             CStr endpointRegex,
+                             const BodyHandler& handler,
+                             U64 maxBodySize,
+                             RoutePriority priority
+                           ) -> void
+{
+    auto route = std::make_unique<StreamingRoute>();
+    route->pattern = endpointRegex;
+    route->handler = handler;
+    route->maxBodySize = maxBodySize;
+    route->priority = priority;
+    route->accessRoute = accessLog.AddRoute(endpointRegex);
+    {
+        LockGuard<Mutex> lock(routingMutex);
+        streamingRoutes.push_back(std::move(route));
+        PublishRouting();
+    }
+
+    connections.SetBodyLimitResolver(Server::ResolveBodyLimit);
+}
+
+
+auto
+Server::AddUploadHandler(
+                          CStr endpointRegex,
+                          UploadHandler handler,
+                          const UploadOptions& options,
+                          RoutePriority priority
+                        ) -> void
+{
+    // Outlives the route's lambdas, sinks keep a reference to it.
+    auto uploadOptions = std::make_shared<const UploadOptions>(options);
+
+    BodyHandler bodyHandler;
+    bodyHandler.onBegin = [uploadOptions](ConnectionState* cs)
+    {
+        auto sink = new UploadSink(*uploadOptions);
+        cs->requestData = sink;
+
+        auto contentType = FindHeader(cs->httpMsg, KnownHeader::ContentType);
+        auto type = contentType? StrView(contentType->ptr, contentType->len) : StrView();
+        if (sink->Begin(type) != Err::Ok)
+        {
+            mg_http_reply(cs->c, 400, cs->GetHeaderBlock(), "Bad upload\n");
+            return false;
+        }
+        return true;
+    };
+    bodyHandler.onChunk = [](ConnectionState* cs, StrView chunk)
+    {
+        auto sink = (UploadSink*)cs->requestData;
+        auto err = sink->Write(chunk);
+        if (err != Err::Ok)
+        {
+            auto code = (err == Err::IOError)? 500 : 400;
+            mg_http_reply(cs->c, code, cs->GetHeaderBlock(), "Upload failed\n");
+            return false;
+        }
+        return true;
+    };
+    bodyHandler.onEnd = [handler](ConnectionState* cs)
+    {
+        auto sink = (UploadSink*)cs->requestData;
+        if (sink->Finish() != Err::Ok)
+        {
+            mg_http_reply(cs->c, 400, cs->GetHeaderBlock(), "Bad upload\n");
+        }
+        else
+        {
+            handler(cs, sink->GetUpload());
+        }
+        delete sink;
+        cs->requestData = nullptr;
+    };
+    bodyHandler.onAbort = [](ConnectionState* cs)
+    {
+        delete (UploadSink*)cs->requestData;
+        cs->requestData = nullptr;
+    };
+
+    AddStreamingHandler(endpointRegex, bodyHandler, options.maxBodySize, priority);
+}
+
+
+auto
+Server::AddProxyRoute(
+                       CStr endpointRegex,
+                       const Vec<Str>& upstreams,
+                       const ProxyOptions& options,
+                       RoutePriority priority
+                     ) -> void
+{
+    auto route = reverseProxy.AddRoute(upstreams, options);
+    if (route == nullptr)
+    {
+        LogErr("Proxy route ", endpointRegex, " has no usable upstream");
+        return;
+    }
+
+    // Every request on the route is a streamed one, bodies go to the
+    // upstream as they arrive.
+    BodyHandler bodyHandler;
+    bodyHandler.onBegin = [route](ConnectionState* cs)
+    {
+        cs->requestData = reverseProxy.Begin(route, cs->c, cs->httpMsg);
+        return cs->requestData != nullptr;
+    };
+    bodyHandler.onChunk = [](ConnectionState* cs, StrView chunk)
+    {
+        return reverseProxy.ForwardBody((ProxyExchange*)cs->requestData, chunk);
+    };
+    bodyHandler.onEnd = [](ConnectionState* cs)
+    {
+        // The upstream's Date is passed on.
+        auto headers = Str(cs->connectionHeaders).append(cs->routeHeaders).append(cs->responseHeaders);
+        reverseProxy.EndRequest((ProxyExchange*)cs->requestData, headers);
+    };
+    bodyHandler.onAbort = [](ConnectionState* cs)
+    {
+        if (cs->requestData != nullptr)
+        {
+            reverseProxy.AbortRequest((ProxyExchange*)cs->requestData);
+        }
+    };
+
+    AddStreamingHandler(endpointRegex, bodyHandler, options.maxBodySize, priority);
+}
+
+
+auto
+Server::AddWebSocketHandler(
+                             CStr endpointRegex,
+                             const WebSocketHandler& handler,
+                             RoutePriority priority
+                           ) -> void
+{
+    // Owned here so connections can keep a stable pointer to it.
+    webSocketHandlers.push_back(std::make_unique<WebSocketHandler>(handler));
+    auto wsHandler = webSocketHandlers.back().get();
+
+    auto upgrade = [wsHandler](ConnectionState* cs)
+    {
+        UpgradeToWebSocket(cs, wsHandler);
+    };
+
+    AddHandler(endpointRegex, upgrade, priority);
+}
+
+
+auto
+Server::AddRouteHeaders(CStr endpointRegex, const Vec<Pair<Str, Str>>& headers) -> void
+{
+    Str rendered;
+    for (auto& [name, value] : headers)
+    {
+        rendered += name + ": " + value + "\r\n";
+    }
+    routeHeaders.emplace_back(endpointRegex, rendered);
+}
+
+
+auto
+Server::SetWebSocketLimits(const WebSocketLimits& limits) -> void
+{
+    pubSub.SetLimits(limits);
+}
+
+
+auto
+Server::Publish(CStr topic, StrView payload, B binary) -> U32
+{
+    return pubSub.Publish(topic, payload, binary);
+}
+
+
+auto
+Server::SetEventStreamOptions(const EventStreamOptions& options) -> void
+{
+    eventBroker.SetOptions(options);
+}
+
+
+auto
+Server::Broadcast(CStr channel, StrView data, CStr event) -> U32
+{
+    return eventBroker.Broadcast(channel, data, event);
+}
+
+
+auto
+Server::SetCommandOptions(const CommandOptions& options) -> void
+{
+    commandRunner.SetOptions(options);
+}
+
+
+auto
+Server::SetServeEmbeddedAssets(B serve) -> void
+{
+    serveEmbeddedAssets = serve;
+}
+
+
+auto
+Server::SetFileMappingOptions(const MappedFsOptions& options) -> void
+{
+    SetMappedFsOptions(options);
+}
+
+
+auto
+Server::SetAccessLog(const AccessLogOptions& options) -> void
+{
+    accessLog.SetOptions(options);
+}
+
+
+auto
+Server::ParseRequest(MgConnection* c, CStr buf, Size len, MgHttpMessage* hm) -> I
+{
+    // Accepted by a listener of this server and not turned away.
+    if (c->fn == Server::HttpListener && c->fn_data != nullptr)
+    {
+        return connections.ParseRequest((ConnectionRecord*)c->fn_data, hm);
+    }
+
+    return mg_http_parse(buf, len, hm);
+}
+
+
+auto
+Server::AcquireBuffer(Size size) -> void*
+{
+    return bufferPool.Acquire(size);
+}
+
+
+auto
+Server::ReleaseBuffer(void* block, Size size) -> void
+{
+    bufferPool.Release(block, size);
+}
+
+
+auto
+Server::SetPageRefreshInterval(U32 intervalMs) -> void
+{
+    pageRefreshIntervalMs = intervalMs;
+}
+
+
+auto
+Server::OnRefreshPages(void*) -> void
+{
+    landingPage.Refresh();
+    notFoundPage.Refresh();
+}
+
+
+auto
+Server::SetUpgradeOptions(const UpgradeOptions& options) -> void
+{
+    upgrader.SetOptions(options);
+}
+
+
+auto
+Server::SetHttp2Options(const Http2Options& options) -> void
+{
+    http2.SetOptions(options);
+}
+
+
+auto
+Server::SetBufferPoolOptions(const BufferPoolOptions& options) -> void
+{
+    bufferPool.SetOptions(options);
+}
+
+
+auto
+Server::SetCpuPlacement(const CpuPlacementOptions& options) -> void
+{
+    cpuPlacement.SetOptions(options);
+}
+
+
+auto
+Server::SetLoadShedding(const LoadSheddingOptions& options) -> void
+{
+    loadShedder.SetOptions(options);
+}
+
+
+auto
+Server::GetMetrics() -> ServerMetrics
+{
+    ServerMetrics metrics;
+
+    metrics.activeConnections = connections.GetActiveCount();
+    metrics.queueDepth = connections.GetInFlightCount();
+    metrics.rejectedConnections = connections.GetRejectedCount();
+    metrics.timedOutConnections = connections.GetTimedOutCount();
+    metrics.oversizedRequests = connections.GetOversizedCount();
+    metrics.rateLimitedRequests = rateLimiter.GetLimitedCount();
+    metrics.loopLagUs = loadShedder.GetLoopLagUs();
+    metrics.peakLoopLagUs = loadShedder.GetPeakLoopLagUs();
+    metrics.shedRequests = loadShedder.GetShedCount();
+    metrics.certificateReloads = tlsConfig.GetReloadCount();
+    metrics.routingUpdates = routingUpdates;
+    // Upgraded connections are WebSockets, event streams or HTTP/2.
+    metrics.webSocketConnections =
+        connections.GetPhaseCount(ConnectionPhase::Upgraded) -
+        eventBroker.GetStreamCount() -
+        http2.GetSessionCount();
+    metrics.publishedMessages = pubSub.GetPublishedCount();
+    metrics.evictedSubscribers = pubSub.GetEvictedCount() + eventBroker.GetEvictedCount();
+    metrics.eventStreams = eventBroker.GetStreamCount();
+    metrics.broadcastEvents = eventBroker.GetEventCount();
+    metrics.proxiedRequests = reverseProxy.GetRequestCount();
+    metrics.upstreamFailures = reverseProxy.GetFailureCount();
+    metrics.runningCommands = commandRunner.GetRunningCount();
+    metrics.queuedCommands = commandRunner.GetQueuedCount();
+    metrics.failedCommands = commandRunner.GetFailedCount();
+    metrics.mappedFiles = GetMappedFileCount();
+    metrics.mappedBytes = GetMappedBytes();
+    metrics.http2Connections = http2.GetSessionCount();
+    metrics.http2Streams = http2.GetStreamCount();
+    metrics.poolReservedBytes = bufferPool.GetReservedBytes();
+    metrics.poolUsedBytes = bufferPool.GetUsedBytes();
+    metrics.poolHits = bufferPool.GetHitCount();
+    metrics.poolMisses = bufferPool.GetMissCount();
+    metrics.remoteCpuConnections = cpuPlacement.GetRemoteCpuCount();
+    metrics.accessLogRecords = accessLog.GetWrittenCount();
+    metrics.accessLogDropped = accessLog.GetDroppedCount();
+
+    return metrics;
+}
+
+
+auto
+Server::AddMetricsEndpoint(CStr endpoint) -> void
+{
+    auto handler = [](ConnectionState* cs)
+    {
+        cs->SetResponseToJSON();
+        cs->AddToBody(GetMetrics().ToJSON().c_str());
+        cs->Reply();
+    };
+
+    AddHandler(endpoint, handler, RoutePriority::High);
+}
+
+
+void Server::Run()
+{
+    auto& options = listenOptions;
+
+    cpuPlacement.Apply();
+    upgrader.Start(&mgr, &connections);
+    mg_http_set_parser(Server::ParseRequest);
+    tlsConfig.OfferHttp2(http2.GetOptions().enabled);
+
+    if (
+         options.httpsPort != 0 &&
+         TLSIsPossible() &&
+         tlsConfig.Load(certPath, privKeyPath) == Err::Ok
+       )
+    {
+        Listen("https", options.httpsPort, &tlsConfig);
+        tlsConfig.StartWatching(certReloadIntervalMs, &cpuPlacement);
+    }
+
+    if (options.httpPort != 0)
+    {
+        Listen("http", options.httpPort, nullptr);
+    }
+
+    upgrader.ReportReady();
+
+    PrepareRedirect();
+    // Built once the embedded assets are settled, for the early hints.
+    {
+        LockGuard<Mutex> lock(routingMutex);
+        routing = BuildRouting().release();
+        routingPublished = true;
+    }
+    landingPage.Init(200, { DOCUMENT_ROOT"/main_page.html", DOCUMENT_ROOT"/index.html" });
+    notFoundPage.Init(404, { DOCUMENT_ROOT"/not_found.html" });
+    if (pageRefreshIntervalMs != 0)
+    {
+        mg_timer_add(&mgr, pageRefreshIntervalMs, MG_TIMER_REPEAT, Server::OnRefreshPages, nullptr);
+    }
+    reverseProxy.Start(&mgr);
+    accessLog.Start(&mgr, &cpuPlacement);
+    commandRunner.Start(&mgr, &cpuPlacement);
+    http2.Start(connections.GetLimits().idleTimeoutMs, Server::AdmitStream);
+    auto heartbeatMs = eventBroker.GetOptions().heartbeatMs;
+    if (heartbeatMs != 0)
+    {
+        mg_timer_add(&mgr, heartbeatMs, MG_TIMER_REPEAT, EventBroker::OnHeartbeat, &eventBroker);
+    }
+
+    while (upgrader.Update(mg_millis()))
+    {
+        loadShedder.BeginIteration(GetHighResTimeNS() / 1000);
+        mg_mgr_poll(&mgr, 16);
+        loadShedder.EndIteration(GetHighResTimeNS() / 1000, mgr.wait_us);
+        connections.ExpireIdle(mg_millis());
+        tlsConfig.Update();
+        UpdateRouting();
+        commandRunner.Update(mg_millis());
+        http2.Update();
+        headerCache.Update(time(nullptr));
+    }
+}
+
+void Server::Clean()
+{
+    tlsConfig.StopWatching();
+    routingWatcher.Stop();
+    commandRunner.Stop();
+    accessLog.Stop();
+    mg_mgr_free(&mgr);
+
+    delete pendingRouting.exchange(nullptr, std::memory_order_acq_rel);
+    delete routing;
+    routing = nullptr;
 }
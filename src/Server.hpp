@@ -20,6 +20,27 @@
 
 
 #include "Types.hpp"
+#include "ConnectionTracker.hpp"
+#include "RateLimiter.hpp"
+#include "LoadShedder.hpp"
+#include "Metrics.hpp"
+#include "TLSConfig.hpp"
+#include "WebSocket.hpp"
+#include "EventStream.hpp"
+#include "Upload.hpp"
+#include "Proxy.hpp"
+#include "Command.hpp"
+#include "Upgrade.hpp"
+#include "Assets.hpp"
+#include "MappedFs.hpp"
+#include "Prerender.hpp"
+#include "Http2.hpp"
+#include "BufferPool.hpp"
+#include "CpuPlacement.hpp"
+#include "HeaderCache.hpp"
+#include "HttpCache.hpp"
+#include "AccessLog.hpp"
+#include "RoutingConfig.hpp"
 
 #include "mongoose/mongoose.h"
 
@@ -32,19 +53,45 @@ using MgHttpMessage = mg_http_message;
 using MgHttpServeOpts = mg_http_serve_opts;
 
 
+struct ConnectionState;
+
+// Called with the state of the request that ran the command, headers
+// included. The request message is gone by then.
+using CommandHandler = Func<void(ConnectionState*, const CommandResult&)>;
+
+
 struct ConnectionState
 {
     MgConnection* c;
     MgHttpMessage* httpMsg;
     I ev;
     SessionStore* sessionStore;
+    // Free for the handler's use across the events of one request.
+    void* requestData;
+    // Rendered lines from the header cache, written ahead of
+    // responseHeaders: Strict-Transport-Security and Connection: close as
+    // the connection needs them, the route's header set and the content
+    // type set with SetResponseToJSON.
+    StrView connectionHeaders;
+    StrView routeHeaders;
+    StrView contentTypeHeader;
     Str responseHeaders;
     Str responseBody;
 
     void AddHeader(CStr name, CStr value);
+    // Date and every header line above in one string, for the mongoose
+    // calls that take extra headers, followed by extra. Valid until the
+    // next call.
+    CStr GetHeaderBlock(StrView extra = StrView()) const;
     void AddToBody(CStr contents);
     void SetResponseToJSON();
     void Reply(U32 code = 200);
+    // Answers with a text/event-stream that stays open and receives the
+    // events broadcast on the channel.
+    void OpenEventStream(CStr channel);
+    // Runs the command off the event loop and leaves the response to the
+    // handler, which is not called if the client goes away first.
+    void RunCommand(const Vec<Str>& args, StrView input, const CommandHandler& handler);
 
     ConnectionState();
     ConnectionState(MgConnection* c, MgHttpMessage* hm, I ev);
@@ -67,29 +114,300 @@ struct ConnectionState
 };
 
 
+struct ListenOptions
+{
+    // Zero disables the listener.
+    U16 httpPort = 80;
+    U16 httpsPort = 443;
+    // With TLS enabled, plain HTTP requests get a 308 to the HTTPS origin.
+    B redirectToHttps = true;
+    // Host for the redirect target, the request's Host header if empty.
+    Str canonicalHost;
+    // Strict-Transport-Security on TLS responses, off when zero.
+    U32 hstsMaxAgeS = 0;
+    B hstsIncludeSubdomains = false;
+};
+
+
+// Handler for a request body that is consumed as it arrives instead of
+// being buffered whole.
+struct BodyHandler
+{
+    // Header block is in, no body yet. Return false to refuse the body,
+    // after replying.
+    Func<B(ConnectionState*)> onBegin;
+    // Return false to stop reading the body, after replying.
+    Func<B(ConnectionState*, StrView chunk)> onChunk;
+    // The whole body went through onChunk, time to reply.
+    Func<void(ConnectionState*)> onEnd;
+    // Called instead of onEnd when the body is not complete, for cleanup.
+    Func<void(ConnectionState*)> onAbort;
+};
+
+
+struct StreamingRoute
+{
+    Str pattern;
+    BodyHandler handler;
+    U64 maxBodySize;
+    RoutePriority priority;
+    U16 accessRoute;
+};
+
+
+struct BodyStream
+{
+    ConnectionState cs;
+    const StreamingRoute* route;
+    U64 received;
+};
+
+
+struct ServeDirOptions
+{
+    CachePolicy cachePolicy;
+    // Globs over the request path, mg_match syntax where `#` also spans
+    // slashes. The first that matches replaces cachePolicy.
+    Vec<Pair<Str, CachePolicy>> cachePolicies;
+    // For emscripten builds: the dir's files and the main page are sent
+    // cross-origin isolated, as SharedArrayBuffer needs, and the main page
+    // preloads the files the build loads, with 103 Early Hints.
+    B wasm = false;
+    // Request path of a file listing the request paths to preload, one per
+    // line. Without it the dir's .js files are searched for the .wasm and
+    // .data files they load.
+    Str preloadManifest;
+};
+
+
+struct ServedDir
+{
+    Str dir;
+    // Glob of the request paths under the dir.
+    Str pattern;
+    CacheRules cacheRules;
+    // Header lines for every file of the dir.
+    Str headers;
+    B wasm;
+    Str preloadManifest;
+    U16 accessRoute;
+};
+
+
 class Server
 {
+    friend struct ConnectionState;
+
 public:
     using ConnectionHandler = Func<void(ConnectionState*)>;
 
+    using UploadHandler = Func<void(ConnectionState*, const Upload&)>;
+
+    struct Endpoint
+    {
+        ConnectionHandler handler;
+        RoutePriority priority;
+        U16 accessRoute;
+    };
+
 private:
-    static Str httpAddress;
-    static Str httpsAddress;
+    // What requests are matched against, never changed once published.
+    // Changes build a new table and the event loop swaps it in between two
+    // polls, when no request refers to the old one any more.
+    struct RoutingTable
+    {
+        Vec<Pair<Str, const Endpoint*>> endpoints;
+        Vec<const StreamingRoute*> streamingRoutes;
+        Vec<ServedDir> servedDirs;
+        // Of the main page, with wasm dirs among servedDirs.
+        Str mainPageHeaders;
+        Str earlyHints;
+    };
+
+    static Str address;
+    static ListenOptions listenOptions;
+    static Str redirectHead;
+    static Str redirectTail;
     static mg_mgr mgr;
 
     static Str certPath;
     static Str privKeyPath;
-    static UMap<Str, ConnectionHandler> endpoints;
-    static Vec<Str> servedDirs;
+    // What the routing tables are built from, guarded by routingMutex.
+    // Handlers and streaming routes stay registered, the tables point to
+    // them.
+    static UMap<Str, Endpoint> endpoints;
+    static Vec<ServedDir> servedDirs;
+    static Vec<UniquePtr<StreamingRoute>> streamingRoutes;
+    static Vec<ServedDir> configuredDirs;
+    static Vec<Str> disabledRoutes;
+    static Vec<Str> configuredDisabledRoutes;
+    static B routingPublished;
+    static Mutex routingMutex;
+    static RoutingWatcher routingWatcher;
+    // Event loop side.
+    static RoutingTable* routing;
+    static Atomic<RoutingTable*> pendingRouting;
+    static U64 routingUpdates;
+    static ConnectionTracker connections;
+    static RateLimiter rateLimiter;
+    static Vec<Pair<Str, RateLimitPolicy>> rateLimits;
+    static LoadShedder loadShedder;
+    static TLSConfig tlsConfig;
+    static PubSub pubSub;
+    static Vec<UniquePtr<WebSocketHandler>> webSocketHandlers;
+    static EventBroker eventBroker;
+    static ReverseProxy reverseProxy;
+    static CommandRunner commandRunner;
+    static Upgrader upgrader;
+    static Http2Gateway http2;
+    static BufferPool bufferPool;
+    static CpuPlacement cpuPlacement;
+    static U32 certReloadIntervalMs;
+    static B serveEmbeddedAssets;
+    static PrerenderedPage landingPage;
+    static PrerenderedPage notFoundPage;
+    static U32 pageRefreshIntervalMs;
+    static HeaderCache headerCache;
+    static Vec<Pair<Str, Str>> routeHeaders;
+    static AccessLog accessLog;
 
    
     static B TLSIsPossible();
-    static void ServeFile(ConnectionState* cs, const C* pathOverride = nullptr);
+    static void ServeFile(
+                           ConnectionState* cs,
+                           const C* pathOverride = nullptr,
+                           StrView cacheControl = StrView(),
+                           StrView extraHeaders = StrView()
+                         );
+    static void ServeEmbeddedAsset(
+                                    ConnectionState* cs,
+                                    const EmbeddedAsset* asset,
+                                    StrView cacheControl,
+                                    StrView extraHeaders
+                                  );
+    static B ServeFileBody(
+                            ConnectionState* cs,
+                            mg_fs* fs,
+                            void* fd,
+                            U64 size,
+                            U64 maxInlineSize,
+                            StrView contentType,
+                            StrView etag,
+                            time_t modified,
+                            StrView headers
+                          );
+    static void ServeMainPage(ConnectionState* cs);
+    static void HandleRequest(ConnectionRecord* record, MgHttpMessage* hm);
+    static void PrepareEarlyHints(RoutingTable* table);
+    static ServedDir MakeServedDir(CStr dir, const ServeDirOptions& options);
+    static B IsRouteEnabled(StrView pattern);
+    static UniquePtr<RoutingTable> BuildRouting();
+    static void PublishRouting();
+    static void UpdateRouting();
+    static void ApplyRoutingConfig(const RoutingConfig& config);
+    static void RejectConnection(MgConnection* c, B isTLS);
+    static void ReleaseConnection(ConnectionRecord* record);
+    static B RateLimitAllows(ConnectionState* cs);
+    static Str ListenURL(CStr scheme, U16 port);
+    static void Listen(CStr scheme, U16 port, void* fnData);
+    static void PrepareRedirect();
+    static B ShouldRedirectToHttps(MgConnection* c, MgHttpMessage* hm);
+    static void RedirectToHttps(ConnectionState* cs, B close);
+    static void AddResponseHeaders(ConnectionState* cs, ConnectionRecord* record);
+    static void UpgradeToWebSocket(ConnectionState* cs, const WebSocketHandler* handler);
+    static void OnWebSocketEvent(ConnectionRecord* record, I ev, void* evData);
+    static void OpenEventStream(ConnectionState* cs, CStr channel);
+    static void OnEventStreamEvent(ConnectionRecord* record, I ev);
+    static B AdmitStream(MgConnection* c);
+    static void OnHttp2Event(ConnectionRecord* record, I ev, void* evData);
+    static U64 ResolveBodyLimit(MgHttpMessage* hm);
+    static void OnBodyChunk(ConnectionRecord* record, MgHttpMessage* hm);
+    static void FinishBody(ConnectionRecord* record, MgHttpMessage* hm);
+    static void AbortBody(ConnectionRecord* record);
+    static void DiscardBody(ConnectionRecord* record);
+    static void RunCommand(
+                            ConnectionState* cs,
+                            const Vec<Str>& args,
+                            StrView input,
+                            const CommandHandler& handler
+                          );
+    static void OnRefreshPages(void*);
+    static I ParseRequest(MgConnection* c, CStr buf, Size len, MgHttpMessage* hm);
+    static void* AcquireBuffer(Size size);
+    static void ReleaseBuffer(void* block, Size size);
+    static void ReplyRetryLater(ConnectionState* cs, U32 code, U32 retryAfterS);
+    static void BeginAccess(ConnectionRecord* record, MgHttpMessage* hm, U16 route);
+    static void TrackAccess(ConnectionRecord* record, I ev);
+    static void FinishAccess(ConnectionRecord* record);
 
 public:
     static void Init(CStr addr, CStr certPath, CStr privKeyPath);
-    static void AddHandler(CStr endpointRegex, ConnectionHandler handler);
-    static void AddServeDir(CStr dir);
+    static void SetListenOptions(const ListenOptions& options);
+    static void SetCertificateReloadInterval(U32 intervalMs);
+    static void SetConnectionLimits(const ConnectionLimits& limits);
+    static void SetRateLimit(CStr routePattern, const RateLimitPolicy& policy);
+    static void SetRateLimiterCapacity(U32 buckets);
+    static void SetLoadShedding(const LoadSheddingOptions& options);
+    static void AddHandler(
+                            CStr endpointRegex,
+                            ConnectionHandler handler,
+                            RoutePriority priority = RoutePriority::Normal
+                          );
+    static void AddStreamingHandler(
+                                     CStr endpointRegex,
+                                     const BodyHandler& handler,
+                                     U64 maxBodySize,
+                                     RoutePriority priority = RoutePriority::Normal
+                                   );
+    static void AddUploadHandler(
+                                  CStr endpointRegex,
+                                  UploadHandler handler,
+                                  const UploadOptions& options = UploadOptions(),
+                                  RoutePriority priority = RoutePriority::Normal
+                                );
+    static void AddProxyRoute(
+                               CStr endpointRegex,
+                               const Vec<Str>& upstreams,
+                               const ProxyOptions& options = ProxyOptions(),
+                               RoutePriority priority = RoutePriority::Normal
+                             );
+    static void AddWebSocketHandler(
+                                     CStr endpointRegex,
+                                     const WebSocketHandler& handler,
+                                     RoutePriority priority = RoutePriority::Normal
+                                   );
+    static void SetWebSocketLimits(const WebSocketLimits& limits);
+    // Header lines added to the responses of the requests the pattern
+    // matches, rendered once. The first matching set is used.
+    static void AddRouteHeaders(CStr endpointRegex, const Vec<Pair<Str, Str>>& headers);
+    static U32 Publish(CStr topic, StrView payload, B binary = false);
+    static void SetEventStreamOptions(const EventStreamOptions& options);
+    static void SetCommandOptions(const CommandOptions& options);
+    static void SetUpgradeOptions(const UpgradeOptions& options);
+    static void SetHttp2Options(const Http2Options& options);
+    static void SetBufferPoolOptions(const BufferPoolOptions& options);
+    static void SetCpuPlacement(const CpuPlacementOptions& options);
+    // Files packed into the binary with ASSET_DIR are looked up before the
+    // document root, on by default.
+    static void SetServeEmbeddedAssets(B serve);
+    static void SetFileMappingOptions(const MappedFsOptions& options);
+    // Writes a binary record per request, see tools/AccessLogQuery.cpp.
+    static void SetAccessLog(const AccessLogOptions& options);
+    // How often the prerendered main and not found pages are checked for
+    // changes on disk, zero keeps what was loaded at startup.
+    static void SetPageRefreshInterval(U32 intervalMs);
+    static U32 Broadcast(CStr channel, StrView data, CStr event = nullptr);
+    static void AddMetricsEndpoint(CStr endpoint);
+    static ServerMetrics GetMetrics();
+    // The routing calls below may also be made while the server runs, from
+    // any thread. Requests already being answered are not affected.
+    static void AddServeDir(CStr dir, const ServeDirOptions& options = ServeDirOptions());
+    static void RemoveServeDir(CStr dir);
+    // Leaves a handler, streaming route or serve dir pattern unmatched.
+    static void SetRouteEnabled(CStr endpointRegex, B enabled);
+    // Serve dirs and disabled routes read from the file, and read again
+    // when it changes, see RoutingConfig.hpp.
+    static B SetRoutingFile(CStr path, U32 checkIntervalMs = 1000);
     static void HttpListener(MgConnection* c, I ev, void* evData, void* fnData);
     static void Run();
     static void Clean();
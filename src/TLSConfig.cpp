@@ -0,0 +1,416 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "TLSConfig.hpp"
+#include "Utils.hpp"
+
+#include <mbedtls/error.h>
+#include <mbedtls/net_sockets.h>
+
+
+// Most preferred first, clients without ALPN get HTTP/1.1.
+static CStr http2Protocols[] = { "h2", "http/1.1", nullptr };
+static CStr http1Protocols[] = { "http/1.1", nullptr };
+
+
+static I32 TLSRandom(void*, U8* buffer, Size size)
+{
+    RandomBytes(buffer, (U32)size);
+    return 0;
+}
+
+
+static I32 TLSSend(void* ctx, const U8* buffer, Size size)
+{
+    auto n = mg_io_send((mg_connection*)ctx, buffer, size);
+
+    if (n == MG_IO_WAIT)
+    {
+        return MBEDTLS_ERR_SSL_WANT_WRITE;
+    }
+    if (n == MG_IO_RESET)
+    {
+        return MBEDTLS_ERR_NET_CONN_RESET;
+    }
+    if (n == MG_IO_ERR)
+    {
+        return MBEDTLS_ERR_NET_SEND_FAILED;
+    }
+    return (I32)n;
+}
+
+
+static I32 TLSRecv(void* ctx, U8* buffer, Size size)
+{
+    auto n = mg_io_recv((mg_connection*)ctx, buffer, size);
+
+    if (n == MG_IO_WAIT)
+    {
+        return MBEDTLS_ERR_SSL_WANT_READ;
+    }
+    if (n == MG_IO_RESET)
+    {
+        return MBEDTLS_ERR_NET_CONN_RESET;
+    }
+    if (n == MG_IO_ERR)
+    {
+        return MBEDTLS_ERR_NET_RECV_FAILED;
+    }
+    return (I32)n;
+}
+
+
+TLSCredentials::TLSCredentials() :
+    certStamp(0),
+    keyStamp(0),
+    connections(0)
+{
+    mbedtls_x509_crt_init(&cert);
+    mbedtls_pk_init(&key);
+    mbedtls_ssl_config_init(&conf);
+}
+
+
+TLSCredentials::~TLSCredentials()
+{
+    mbedtls_ssl_config_free(&conf);
+    mbedtls_pk_free(&key);
+    mbedtls_x509_crt_free(&cert);
+}
+
+
+TLSConfig::TLSConfig() :
+    current(nullptr),
+    pending(nullptr),
+    reloadCount(0),
+    http2Offered(false),
+    watching(false)
+{
+    mbedtls_ssl_cache_init(&sessionCache);
+}
+
+
+TLSConfig::~TLSConfig()
+{
+    StopWatching();
+
+    delete pending.exchange(nullptr);
+    delete current;
+    for (auto credentials : retired)
+    {
+        delete credentials;
+    }
+
+    mbedtls_ssl_cache_free(&sessionCache);
+}
+
+
+auto
+TLSConfig::FileStamp(const Str& path) -> I64
+{
+    std::error_code ec;
+    auto time = std::filesystem::last_write_time(path, ec);
+    auto size = std::filesystem::file_size(path, ec);
+
+    if (ec)
+    {
+        return 0;
+    }
+
+    return time.time_since_epoch().count() ^ (I64)size;
+}
+
+
+auto
+TLSConfig::Build(Err& err) -> UniquePtr<TLSCredentials>
+{
+    auto credentials = std::make_unique<TLSCredentials>();
+    credentials->certStamp = FileStamp(certPath);
+    credentials->keyStamp = FileStamp(keyPath);
+    err = Err::Ok;
+
+    C message[128];
+    I32 rc = 0;
+
+    if ((rc = mbedtls_x509_crt_parse_file(&credentials->cert, certPath.c_str())) != 0)
+    {
+        mbedtls_strerror(rc, message, sizeof(message));
+        LogErr("TLS: can't parse ", certPath, ": ", message);
+        err = Err::Corruption;
+        return nullptr;
+    }
+
+    if ((rc = mbedtls_pk_parse_keyfile(&credentials->key, keyPath.c_str(), nullptr)) != 0)
+    {
+        mbedtls_strerror(rc, message, sizeof(message));
+        LogErr("TLS: can't parse ", keyPath, ": ", message);
+        err = Err::Corruption;
+        return nullptr;
+    }
+
+    // Renewals write the two files separately, don't pair a new
+    // certificate with the old key.
+    if (mbedtls_pk_check_pair(&credentials->cert.pk, &credentials->key) != 0)
+    {
+        LogErr("TLS: ", certPath, " does not match ", keyPath);
+        err = Err::InvalidArgument;
+        return nullptr;
+    }
+
+    auto conf = &credentials->conf;
+    rc = mbedtls_ssl_config_defaults(
+                                      conf,
+                                      MBEDTLS_SSL_IS_SERVER,
+                                      MBEDTLS_SSL_TRANSPORT_STREAM,
+                                      MBEDTLS_SSL_PRESET_DEFAULT
+                                    );
+    if (rc == 0)
+    {
+        mbedtls_ssl_conf_rng(conf, TLSRandom, nullptr);
+        mbedtls_ssl_conf_authmode(conf, MBEDTLS_SSL_VERIFY_NONE);
+        mbedtls_ssl_conf_session_cache(
+                                        conf,
+                                        &sessionCache,
+                                        mbedtls_ssl_cache_get,
+                                        mbedtls_ssl_cache_set
+                                      );
+        rc = mbedtls_ssl_conf_alpn_protocols(conf, http2Offered? http2Protocols : http1Protocols);
+    }
+    if (rc == 0)
+    {
+        rc = mbedtls_ssl_conf_own_cert(conf, &credentials->cert, &credentials->key);
+    }
+
+    if (rc != 0)
+    {
+        mbedtls_strerror(rc, message, sizeof(message));
+        LogErr("TLS: config failed: ", message);
+        err = Err::Fail;
+        return nullptr;
+    }
+
+    return credentials;
+}
+
+
+auto
+TLSConfig::OfferHttp2(B offer) -> void
+{
+    http2Offered = offer;
+}
+
+
+auto
+TLSConfig::Load(const Str& certPath, const Str& keyPath) -> Err
+{
+    this->certPath = certPath;
+    this->keyPath = keyPath;
+
+    Err err;
+    auto credentials = Build(err);
+    if (err != Err::Ok)
+    {
+        return err;
+    }
+
+    if (current != nullptr)
+    {
+        retired.push_back(current);
+    }
+    current = credentials.release();
+
+    return Err::Ok;
+}
+
+
+auto
+TLSConfig::IsEnabled() const -> B
+{
+    return current != nullptr;
+}
+
+
+auto
+TLSConfig::StartWatching(U32 intervalMs, const CpuPlacement* placement) -> void
+{
+    if (watching || current == nullptr)
+    {
+        return;
+    }
+
+    watching = true;
+    watcher = Thread([this, intervalMs]() { Watch(intervalMs); });
+    placement->PlaceThread(watcher);
+}
+
+
+auto
+TLSConfig::StopWatching() -> void
+{
+    {
+        LockGuard<Mutex> lock(watcherMutex);
+        if (!watching)
+        {
+            return;
+        }
+        watching = false;
+    }
+
+    watcherWake.notify_all();
+    watcher.join();
+}
+
+
+auto
+TLSConfig::Watch(U32 intervalMs) -> void
+{
+    auto certStamp = current->certStamp;
+    auto keyStamp = current->keyStamp;
+
+    while (true)
+    {
+        {
+            UniqueLock<Mutex> lock(watcherMutex);
+            watcherWake.wait_for(
+                                  lock,
+                                  std::chrono::milliseconds(intervalMs),
+                                  [this]() { return !watching; }
+                                );
+            if (!watching)
+            {
+                return;
+            }
+        }
+
+        auto newCertStamp = FileStamp(certPath);
+        auto newKeyStamp = FileStamp(keyPath);
+        if (newCertStamp == certStamp && newKeyStamp == keyStamp)
+        {
+            continue;
+        }
+
+        // A failed attempt is not repeated until one of the files changes
+        // again, the renewal finishing writes them anyway.
+        certStamp = newCertStamp;
+        keyStamp = newKeyStamp;
+
+        Err err;
+        auto credentials = Build(err);
+        if (err != Err::Ok)
+        {
+            continue;
+        }
+
+        Log("TLS: reloaded ", certPath);
+
+        // If the reactor has not picked up the previous one yet, replace it.
+        delete pending.exchange(credentials.release(), std::memory_order_acq_rel);
+    }
+}
+
+
+auto
+TLSConfig::Update() -> void
+{
+    auto fresh = pending.exchange(nullptr, std::memory_order_acq_rel);
+    if (fresh != nullptr)
+    {
+        retired.push_back(current);
+        current = fresh;
+        reloadCount++;
+    }
+
+    // Connections release their credentials on MG_EV_CLOSE, before
+    // mongoose frees their SSL context, so only reclaim out here.
+    std::erase_if(retired, [](TLSCredentials* credentials)
+    {
+        if (credentials->connections == 0)
+        {
+            delete credentials;
+            return true;
+        }
+        return false;
+    });
+}
+
+
+auto
+TLSConfig::Attach(mg_connection* c) -> TLSCredentials*
+{
+    // Same layout mg_tls_init() produces, so mg_tls_free() can release it.
+    // Only the SSL context is per connection, the config is shared.
+    auto tls = (mg_tls*)mg_alloc(sizeof(mg_tls));
+    if (tls == nullptr)
+    {
+        mg_error(c, "TLS OOM");
+        return nullptr;
+    }
+
+    mbedtls_ssl_init(&tls->ssl);
+    mbedtls_ssl_config_init(&tls->conf);
+    mbedtls_x509_crt_init(&tls->ca);
+    mbedtls_x509_crt_init(&tls->cert);
+    mbedtls_pk_init(&tls->pk);
+    c->tls = tls;
+
+    auto rc = mbedtls_ssl_setup(&tls->ssl, &current->conf);
+    if (rc != 0)
+    {
+        mg_error(c, "TLS setup %#x", -rc);
+        mg_tls_free(c);
+        return nullptr;
+    }
+
+    mbedtls_ssl_set_bio(&tls->ssl, c, TLSSend, TLSRecv, nullptr);
+    c->is_tls = 1;
+    c->is_tls_hs = 1;
+
+    current->connections++;
+    return current;
+}
+
+
+auto
+TLSConfig::Detach(TLSCredentials* credentials) -> void
+{
+    if (credentials != nullptr)
+    {
+        credentials->connections--;
+    }
+}
+
+
+auto
+TLSConfig::GetAlpnProtocol(mg_connection* c) -> StrView
+{
+    auto tls = (mg_tls*)c->tls;
+    if (tls == nullptr || c->is_tls_hs)
+    {
+        return StrView();
+    }
+
+    auto protocol = mbedtls_ssl_get_alpn_protocol(&tls->ssl);
+    return (protocol == nullptr)? StrView() : StrView(protocol);
+}
+
+
+auto
+TLSConfig::GetReloadCount() const -> U64
+{
+    return reloadCount;
+}
@@ -0,0 +1,96 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+#include "Error.hpp"
+#include "CpuPlacement.hpp"
+
+#include "mongoose/mongoose.h"
+
+#include <mbedtls/ssl_cache.h>
+
+
+// Parsed certificate chain, key and the mbedtls config built from them.
+// Shared read-only by every connection accepted while it is current.
+struct TLSCredentials
+{
+    mbedtls_x509_crt cert;
+    mbedtls_pk_context key;
+    mbedtls_ssl_config conf;
+    I64 certStamp;
+    I64 keyStamp;
+    // Only touched on the reactor thread.
+    U32 connections;
+
+    TLSCredentials();
+    ~TLSCredentials();
+};
+
+
+// Owns the current credentials and swaps in new ones when the certificate
+// or key change on disk. Parsing happens on a watcher thread, the reactor
+// only picks up the finished result in Update(). Connections keep the
+// credentials they were accepted with until they close.
+class TLSConfig
+{
+public:
+    TLSConfig();
+    ~TLSConfig();
+
+    // Before Load, adds h2 to the protocols offered with ALPN.
+    void OfferHttp2(B offer);
+    Err Load(const Str& certPath, const Str& keyPath);
+    B IsEnabled() const;
+
+    // The watcher thread is moved off the reactor's CPU by placement.
+    void StartWatching(U32 intervalMs, const CpuPlacement* placement);
+    void StopWatching();
+
+    // Reactor side, once per event loop iteration.
+    void Update();
+
+    TLSCredentials* Attach(mg_connection* c);
+    static void Detach(TLSCredentials* credentials);
+    // Protocol picked with ALPN once the handshake is done, empty without.
+    static StrView GetAlpnProtocol(mg_connection* c);
+
+    U64 GetReloadCount() const;
+
+private:
+    Str certPath;
+    Str keyPath;
+    mbedtls_ssl_cache_context sessionCache;
+
+    TLSCredentials* current;
+    Vec<TLSCredentials*> retired;
+    Atomic<TLSCredentials*> pending;
+    U64 reloadCount;
+    B http2Offered;
+
+    Thread watcher;
+    Mutex watcherMutex;
+    ConditionVariable watcherWake;
+    B watching;
+
+    UniquePtr<TLSCredentials> Build(Err& err);
+    void Watch(U32 intervalMs);
+
+    static I64 FileStamp(const Str& path);
+};
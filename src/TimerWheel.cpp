@@ -0,0 +1,171 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "TimerWheel.hpp"
+
+
+TimerWheel::TimerWheel(U64 granularityMs) :
+    granularityMs(granularityMs), currentTick(0)
+{
+    for (auto& slot : slots)
+    {
+        slot.prev = &slot;
+        slot.next = &slot;
+    }
+}
+
+
+auto
+TimerWheel::Link(TimerWheelNode* node, U64 tick) -> void
+{
+    auto& slot = slots[tick % slotCount];
+    node->scheduledTick = tick;
+    node->prev = slot.prev;
+    node->next = &slot;
+    slot.prev->next = node;
+    slot.prev = node;
+}
+
+
+auto
+TimerWheel::Unlink(TimerWheelNode* node) -> void
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = nullptr;
+    node->next = nullptr;
+}
+
+
+auto
+TimerWheel::Schedule(TimerWheelNode* node, U64 deadlineMs) -> void
+{
+    auto tick = std::max(deadlineMs / granularityMs, currentTick);
+    node->deadlineMs = deadlineMs;
+
+    if (node->IsScheduled())
+    {
+        // Later deadlines are picked up when the current slot is scanned.
+        if (tick >= node->scheduledTick)
+        {
+            return;
+        }
+        Unlink(node);
+    }
+
+    Link(node, tick);
+}
+
+
+auto
+TimerWheel::Cancel(TimerWheelNode* node) -> void
+{
+    if (node->IsScheduled())
+    {
+        Unlink(node);
+    }
+}
+
+
+auto
+TimerWheel::Advance(U64 nowMs, ExpireCallback onExpired, void* userData) -> void
+{
+    auto nowTick = nowMs / granularityMs;
+
+    if (currentTick == 0)
+    {
+        currentTick = nowTick;
+    }
+
+    if (nowTick - currentTick >= slotCount)
+    {
+        SweepAll(nowMs, onExpired, userData);
+        return;
+    }
+
+    // Only fully elapsed ticks are scanned, so every node found in a slot
+    // either expired or was pushed forward and has to be relinked.
+    while (currentTick < nowTick)
+    {
+        auto& slot = slots[currentTick % slotCount];
+        auto node = slot.next;
+        slot.prev = &slot;
+        slot.next = &slot;
+        currentTick++;
+
+        while (node != &slot)
+        {
+            auto next = node->next;
+            node->prev = nullptr;
+            node->next = nullptr;
+
+            if (node->deadlineMs <= nowMs)
+            {
+                onExpired(node, userData);
+            }
+            else
+            {
+                Link(node, std::max(node->deadlineMs / granularityMs, currentTick));
+            }
+
+            node = next;
+        }
+    }
+}
+
+
+auto
+TimerWheel::SweepAll(U64 nowMs, ExpireCallback onExpired, void* userData) -> void
+{
+    // After a stall of a revolution or more every slot is due. All nodes
+    // are gathered first and the wheel moved to now, so the ones that are
+    // not due yet are linked ahead of it rather than behind, where they
+    // would wait for another revolution.
+    TimerWheelNode due;
+    due.prev = &due;
+    due.next = &due;
+    for (auto& slot : slots)
+    {
+        if (slot.next != &slot)
+        {
+            slot.next->prev = due.prev;
+            due.prev->next = slot.next;
+            slot.prev->next = &due;
+            due.prev = slot.prev;
+            slot.prev = &slot;
+            slot.next = &slot;
+        }
+    }
+    currentTick = nowMs / granularityMs;
+
+    // Taken one at a time, a callback may cancel nodes still in the list.
+    while (due.next != &due)
+    {
+        auto node = due.next;
+        Unlink(node);
+
+        if (node->deadlineMs <= nowMs)
+        {
+            onExpired(node, userData);
+        }
+        else
+        {
+            Link(node, std::max(node->deadlineMs / granularityMs, currentTick));
+        }
+    }
+}
@@ -0,0 +1,60 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+
+
+// Intrusive node. Embed (or inherit) it in whatever needs a deadline.
+struct TimerWheelNode
+{
+    TimerWheelNode* prev = nullptr;
+    TimerWheelNode* next = nullptr;
+    U64 deadlineMs = 0;
+    U64 scheduledTick = 0;
+
+    B IsScheduled() const { return prev != nullptr; }
+};
+
+
+// Hashed timer wheel scanned once per event loop iteration. Extending a
+// deadline only stores the new value, the node is moved lazily when its
+// current slot comes up, so refreshing timeouts on every read is O(1).
+class TimerWheel
+{
+public:
+    using ExpireCallback = void(*)(TimerWheelNode*, void*);
+
+    static constexpr U32 slotCount = 1024;
+
+    TimerWheel(U64 granularityMs = 100);
+
+    void Schedule(TimerWheelNode* node, U64 deadlineMs);
+    void Cancel(TimerWheelNode* node);
+    void Advance(U64 nowMs, ExpireCallback onExpired, void* userData);
+
+private:
+    U64 granularityMs;
+    U64 currentTick;
+    Arr<TimerWheelNode, slotCount> slots;
+
+    void Link(TimerWheelNode* node, U64 tick);
+    static void Unlink(TimerWheelNode* node);
+    void SweepAll(U64 nowMs, ExpireCallback onExpired, void* userData);
+};
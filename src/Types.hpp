@@ -23,6 +23,7 @@
 #include <string>
 #include <string_view>
 #include <vector>
+#include <deque>
 #include <unordered_map>
 #include <unordered_set>
 #include <tuple>
@@ -32,6 +33,9 @@
 #include <functional>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <condition_variable>
 
 
 using Str = std::string;
@@ -78,6 +82,9 @@ using Pair = std::pair<T, U>;
 template <typename T>
 using Vec = std::vector<T>;
 
+template <typename T>
+using Deque = std::deque<T>;
+
 template <typename T, U32 N>
 using Arr = std::array<T, N>;
 
@@ -90,5 +97,19 @@ using USet = std::unordered_set<K, H>;
 using Thread = std::thread;
 using Mutex = std::mutex;
 
+using ConditionVariable = std::condition_variable;
+
+template <typename T>
+using Atomic = std::atomic<T>;
+
+template <typename T>
+using UniquePtr = std::unique_ptr<T>;
+
+template <typename T>
+using SharedPtr = std::shared_ptr<T>;
+
+template <typename T>
+using LockGuard = std::lock_guard<T>;
+
 template <typename T>
-using LockGuard = std::lock_guard<T>;
\ No newline at end of file
+using UniqueLock = std::unique_lock<T>;
\ No newline at end of file
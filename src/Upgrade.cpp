@@ -0,0 +1,356 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "Upgrade.hpp"
+#include "ConnectionTracker.hpp"
+#include "Utils.hpp"
+
+#include <csignal>
+#include <cstdlib>
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <spawn.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+
+static constexpr CStr listenFdsVariable = "MIN_SERVER_LISTEN_FDS";
+static constexpr CStr readyFdVariable = "MIN_SERVER_READY_FD";
+
+static Atomic<B> upgradeRequested(false);
+
+
+static auto LocalPort(I32 fd) -> U16
+{
+    sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    if (getsockname(fd, (sockaddr*)&address, &length) != 0)
+    {
+        return 0;
+    }
+
+    if (address.ss_family == AF_INET6)
+    {
+        return ntohs(((sockaddr_in6*)&address)->sin6_port);
+    }
+    return ntohs(((sockaddr_in*)&address)->sin_port);
+}
+
+
+// Arguments this process was started with, to start the new build the
+// same way.
+static auto OwnCommandLine() -> Vec<Str>
+{
+    std::ifstream file("/proc/self/cmdline", std::ios::binary);
+    Str contents((std::istreambuf_iterator<C>(file)), std::istreambuf_iterator<C>());
+
+    Vec<Str> args;
+    for (Size start = 0; start < contents.size();)
+    {
+        auto end = contents.find('\0', start);
+        end = (end == Str::npos)? contents.size() : end;
+        args.emplace_back(contents, start, end - start);
+        start = end + 1;
+    }
+
+    return args;
+}
+
+
+Upgrader::Upgrader() :
+    mgr(nullptr),
+    connections(nullptr),
+    readyFd(-1),
+    state(UpgradeState::Serving),
+    child(-1),
+    readyChannel(nullptr),
+    childReady(false),
+    deadlineMs(0)
+{
+}
+
+
+auto
+Upgrader::SetOptions(const UpgradeOptions& newOptions) -> void
+{
+    options = newOptions;
+}
+
+
+auto
+Upgrader::Start(mg_mgr* manager, ConnectionTracker* tracker) -> void
+{
+    mgr = manager;
+    connections = tracker;
+
+    // Not passed on to commands or to the next upgrade.
+    auto listenFds = getenv(listenFdsVariable);
+    while (listenFds != nullptr && *listenFds != 0)
+    {
+        C* end = nullptr;
+        inheritedListeners.push_back((I32)std::strtol(listenFds, &end, 10));
+        listenFds = (*end == ',')? end + 1 : nullptr;
+    }
+    unsetenv(listenFdsVariable);
+
+    auto readyFdValue = getenv(readyFdVariable);
+    if (readyFdValue != nullptr)
+    {
+        readyFd = std::atoi(readyFdValue);
+        unsetenv(readyFdVariable);
+    }
+
+    // No SA_RESTART, the signal wakes the event loop up.
+    struct sigaction action = {};
+    action.sa_handler = Upgrader::OnSignal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR2, &action, nullptr);
+}
+
+
+auto
+Upgrader::TakeInheritedListener(U16 port) -> I32
+{
+    for (auto& fd : inheritedListeners)
+    {
+        if (fd != -1 && LocalPort(fd) == port)
+        {
+            auto taken = fd;
+            fd = -1;
+            return taken;
+        }
+    }
+
+    return -1;
+}
+
+
+auto
+Upgrader::ReportReady() -> void
+{
+    for (auto fd : inheritedListeners)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+    }
+    inheritedListeners.clear();
+
+    if (readyFd != -1)
+    {
+        Log("Took over the listeners of the previous process");
+        if (write(readyFd, "R", 1) != 1)
+        {
+            LogErr("Cannot notify the previous process, errno ", errno);
+        }
+        close(readyFd);
+        readyFd = -1;
+    }
+}
+
+
+auto
+Upgrader::Update(U64 nowMs) -> B
+{
+    if (state == UpgradeState::Serving)
+    {
+        if (upgradeRequested.exchange(false))
+        {
+            Spawn(nowMs);
+        }
+        return true;
+    }
+
+    // Requests while an upgrade is under way are dropped.
+    upgradeRequested = false;
+
+    if (state == UpgradeState::Starting)
+    {
+        if (childReady)
+        {
+            CloseReadyChannel();
+            connections->Drain();
+            state = UpgradeState::Draining;
+            deadlineMs = nowMs + options.drainTimeoutMs;
+            Log("Upgraded to process ", child, ", draining");
+        }
+        else if (readyChannel == nullptr)
+        {
+            Abandon("the new process exited before listening");
+        }
+        else if (nowMs >= deadlineMs)
+        {
+            Abandon("the new process did not start listening in time");
+        }
+    }
+    else if (state == UpgradeState::Draining)
+    {
+        if (connections->GetActiveCount() == 0 || nowMs >= deadlineMs)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+auto
+Upgrader::Spawn(U64 nowMs) -> void
+{
+    auto args = options.args.empty()? OwnCommandLine() : options.args;
+    if (args.empty())
+    {
+        LogErr("Upgrade failed: no command line");
+        return;
+    }
+
+    // [0] stays here, [1] goes to the new process.
+    I32 readyPair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, readyPair) != 0)
+    {
+        LogErr("Upgrade failed: socketpair ", errno);
+        return;
+    }
+
+    // Passed under the same numbers, dup2 onto itself clears close-on-exec.
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+
+    Str listenFds;
+    for (auto listener : connections->GetListeners())
+    {
+        auto fd = (I32)(Size)listener->fd;
+        posix_spawn_file_actions_adddup2(&actions, fd, fd);
+        listenFds += (listenFds.empty()? "" : ",") + std::to_string(fd);
+    }
+    posix_spawn_file_actions_adddup2(&actions, readyPair[1], readyPair[1]);
+
+    Vec<Str> environment;
+    for (auto variable = environ; *variable != nullptr; ++variable)
+    {
+        environment.emplace_back(*variable);
+    }
+    environment.push_back(Str(listenFdsVariable) + "=" + listenFds);
+    environment.push_back(Str(readyFdVariable) + "=" + std::to_string(readyPair[1]));
+
+    Vec<C*> argv;
+    for (auto& arg : args)
+    {
+        argv.push_back(arg.data());
+    }
+    argv.push_back(nullptr);
+
+    Vec<C*> envp;
+    for (auto& variable : environment)
+    {
+        envp.push_back(variable.data());
+    }
+    envp.push_back(nullptr);
+
+    pid_t pid = -1;
+    auto err = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), envp.data());
+    posix_spawn_file_actions_destroy(&actions);
+    close(readyPair[1]);
+
+    if (err != 0)
+    {
+        close(readyPair[0]);
+        LogErr("Upgrade failed: cannot start ", args[0], ", error ", err);
+        return;
+    }
+
+    fcntl(readyPair[0], F_SETFL, fcntl(readyPair[0], F_GETFL, 0) | O_NONBLOCK);
+    readyChannel = mg_wrapfd(mgr, readyPair[0], Upgrader::OnReadyEvent, this);
+    if (readyChannel == nullptr)
+    {
+        close(readyPair[0]);
+    }
+
+    child = pid;
+    childReady = false;
+    state = UpgradeState::Starting;
+    deadlineMs = nowMs + options.readyTimeoutMs;
+    Log("Upgrading, started process ", child);
+}
+
+
+auto
+Upgrader::Abandon(CStr reason) -> void
+{
+    LogErr("Upgrade abandoned, ", reason);
+
+    // It may already be accepting on the shared listeners.
+    CloseReadyChannel();
+    kill(child, SIGKILL);
+    waitpid(child, nullptr, 0);
+
+    child = -1;
+    state = UpgradeState::Serving;
+}
+
+
+auto
+Upgrader::CloseReadyChannel() -> void
+{
+    if (readyChannel != nullptr)
+    {
+        readyChannel->fn_data = nullptr;
+        readyChannel->is_closing = 1;
+        readyChannel = nullptr;
+    }
+}
+
+
+auto
+Upgrader::GetState() const -> UpgradeState
+{
+    return state;
+}
+
+
+auto
+Upgrader::OnSignal(I) -> void
+{
+    upgradeRequested = true;
+}
+
+
+auto
+Upgrader::OnReadyEvent(mg_connection* c, I ev, void*, void* upgraderPtr) -> void
+{
+    auto upgrader = (Upgrader*)upgraderPtr;
+    if (upgrader == nullptr)
+    {
+        return;
+    }
+
+    if (ev == MG_EV_READ)
+    {
+        upgrader->childReady = upgrader->childReady || c->recv.len > 0;
+        c->recv.len = 0;
+    }
+    else if (ev == MG_EV_CLOSE)
+    {
+        upgrader->readyChannel = nullptr;
+    }
+}
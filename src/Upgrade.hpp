@@ -0,0 +1,95 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+
+#include "mongoose/mongoose.h"
+
+
+struct UpgradeOptions
+{
+    // Command line of the new process, this process's own when empty.
+    Vec<Str> args;
+    // Time the new process has to start listening, after that it is
+    // killed and this process keeps serving.
+    U32 readyTimeoutMs = 10000;
+    // Time in-flight requests get before this process exits anyway.
+    U32 drainTimeoutMs = 30000;
+};
+
+
+enum class UpgradeState : U8
+{
+    Serving,
+    // The new process is starting on the inherited listeners.
+    Starting,
+    // Listeners handed over, finishing the requests in flight.
+    Draining
+};
+
+
+class ConnectionTracker;
+
+
+// Replaces the running server with a newly started binary on SIGUSR2.
+// The listening sockets are inherited by the new process, so there is no
+// moment without a listener. Once it reports that it is serving, this
+// process closes its copies, finishes what is in flight and exits.
+class Upgrader
+{
+public:
+    Upgrader();
+
+    void SetOptions(const UpgradeOptions& newOptions);
+    // Picks up what the previous process handed over and installs the
+    // signal handler.
+    void Start(mg_mgr* mgr, ConnectionTracker* connections);
+
+    // Listening socket handed over for the port, -1 when there is none.
+    I32 TakeInheritedListener(U16 port);
+    // Tells the previous process the listeners are up, closes the
+    // inherited sockets that were not taken.
+    void ReportReady();
+
+    // Called once per event loop iteration, returns false once this
+    // process is done serving.
+    B Update(U64 nowMs);
+
+    UpgradeState GetState() const;
+
+private:
+    UpgradeOptions options;
+    mg_mgr* mgr;
+    ConnectionTracker* connections;
+    Vec<I32> inheritedListeners;
+    I32 readyFd;
+    UpgradeState state;
+    I32 child;
+    mg_connection* readyChannel;
+    B childReady;
+    U64 deadlineMs;
+
+    void Spawn(U64 nowMs);
+    void Abandon(CStr reason);
+    void CloseReadyChannel();
+
+    static void OnSignal(I signal);
+    static void OnReadyEvent(mg_connection* c, I ev, void* evData, void* upgrader);
+};
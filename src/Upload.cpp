@@ -0,0 +1,366 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "Upload.hpp"
+#include "Utils.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <strings.h>
+
+
+// Value of a `key=value` or `key="value"` parameter in a header value.
+static auto HeaderParameter(StrView header, StrView key) -> StrView
+{
+    Size position = 0;
+    while ((position = header.find(key, position)) != StrView::npos)
+    {
+        auto atStart = position == 0 || header[position - 1] == ' ' || header[position - 1] == ';';
+        position += key.size();
+        if (!atStart || position >= header.size() || header[position] != '=')
+        {
+            continue;
+        }
+
+        auto value = header.substr(position + 1);
+        if (!value.empty() && value.front() == '"')
+        {
+            value.remove_prefix(1);
+            return value.substr(0, value.find('"'));
+        }
+        return value.substr(0, value.find_first_of("; "));
+    }
+
+    return StrView();
+}
+
+
+MultipartParser::MultipartParser() :
+    state(State::Failed)
+{
+}
+
+
+auto
+MultipartParser::Init(StrView contentType) -> Err
+{
+    auto boundary = HeaderParameter(contentType, "boundary");
+    if (boundary.empty() || boundary.size() > 70)
+    {
+        return Err::InvalidArgument;
+    }
+
+    delimiter = "\r\n--" + Str(boundary);
+    // The first boundary may come without the leading line break.
+    pending = "\r\n";
+    state = State::Preamble;
+
+    return Err::Ok;
+}
+
+
+auto
+MultipartParser::IsComplete() const -> B
+{
+    return state == State::Epilogue;
+}
+
+
+auto
+MultipartParser::ParseHeaders(StrView headers) -> Err
+{
+    MultipartPart part;
+
+    while (!headers.empty())
+    {
+        auto end = headers.find("\r\n");
+        auto line = headers.substr(0, end);
+        headers.remove_prefix(end == StrView::npos ? headers.size() : end + 2);
+
+        auto colon = line.find(':');
+        if (colon == StrView::npos)
+        {
+            continue;
+        }
+
+        auto name = line.substr(0, colon);
+        auto value = line.substr(colon + 1);
+        while (!value.empty() && value.front() == ' ')
+        {
+            value.remove_prefix(1);
+        }
+
+        if (name.size() == 19 && strncasecmp(name.data(), "Content-Disposition", 19) == 0)
+        {
+            part.name = HeaderParameter(value, "name");
+            part.fileName = HeaderParameter(value, "filename");
+        }
+        else if (name.size() == 12 && strncasecmp(name.data(), "Content-Type", 12) == 0)
+        {
+            part.contentType = value;
+        }
+    }
+
+    if (onPartBegin)
+    {
+        onPartBegin(part);
+    }
+
+    return Err::Ok;
+}
+
+
+auto
+MultipartParser::Feed(StrView data) -> Err
+{
+    if (state == State::Failed)
+    {
+        return Err::Corruption;
+    }
+    if (state == State::Epilogue)
+    {
+        return Err::Ok;
+    }
+
+    pending.append(data);
+    StrView view = pending;
+
+    while (true)
+    {
+        if (state == State::Preamble || state == State::Body)
+        {
+            auto found = view.find(delimiter);
+            // Whatever can't be the start of a delimiter is data.
+            auto safe = (found != StrView::npos)? found :
+                (view.size() >= delimiter.size())? view.size() - delimiter.size() + 1 : 0;
+
+            if (state == State::Body && safe > 0 && onPartData)
+            {
+                onPartData(view.substr(0, safe));
+            }
+            view.remove_prefix(safe);
+
+            if (found == StrView::npos)
+            {
+                break;
+            }
+
+            if (state == State::Body && onPartEnd)
+            {
+                onPartEnd();
+            }
+            view.remove_prefix(delimiter.size());
+            state = State::AfterBoundary;
+        }
+        else if (state == State::AfterBoundary)
+        {
+            if (view.size() < 2)
+            {
+                break;
+            }
+            if (view.substr(0, 2) == "--")
+            {
+                state = State::Epilogue;
+                view = StrView();
+                break;
+            }
+            if (view.substr(0, 2) != "\r\n")
+            {
+                state = State::Failed;
+                return Err::Corruption;
+            }
+            view.remove_prefix(2);
+            state = State::Headers;
+        }
+        else if (state == State::Headers)
+        {
+            auto end = view.find("\r\n\r\n");
+            if (end == StrView::npos)
+            {
+                if (view.size() > maxHeaderSize)
+                {
+                    state = State::Failed;
+                    return Err::Corruption;
+                }
+                break;
+            }
+
+            ParseHeaders(view.substr(0, end + 2));
+            view.remove_prefix(end + 4);
+            state = State::Body;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    pending.erase(0, pending.size() - view.size());
+    return Err::Ok;
+}
+
+
+UploadSink::UploadSink(const UploadOptions& options) :
+    options(options),
+    multipart(false),
+    fd(-1),
+    field(nullptr),
+    error(Err::Ok)
+{
+}
+
+
+UploadSink::~UploadSink()
+{
+    CloseFile();
+
+    // Whatever the handler did not move away.
+    for (auto& file : upload.files)
+    {
+        unlink(file.path.c_str());
+    }
+}
+
+
+auto
+UploadSink::Begin(StrView contentType) -> Err
+{
+    multipart =
+        options.parseMultipart &&
+        contentType.substr(0, 19) == "multipart/form-data";
+
+    if (!multipart)
+    {
+        return OpenFile(MultipartPart{ "", "", Str(contentType) });
+    }
+
+    parser.onPartBegin = [this](const MultipartPart& part)
+    {
+        if (part.fileName.empty())
+        {
+            upload.fields.emplace_back(part.name, "");
+            field = &upload.fields.back().second;
+        }
+        else if (error == Err::Ok)
+        {
+            error = OpenFile(part);
+        }
+    };
+    parser.onPartData = [this](StrView data)
+    {
+        if (field != nullptr)
+        {
+            if (field->size() + data.size() > options.maxFieldSize)
+            {
+                error = Err::InvalidArgument;
+                return;
+            }
+            field->append(data);
+        }
+        else if (error == Err::Ok)
+        {
+            error = WriteFile(data);
+        }
+    };
+    parser.onPartEnd = [this]()
+    {
+        field = nullptr;
+        CloseFile();
+    };
+
+    return parser.Init(contentType);
+}
+
+
+auto
+UploadSink::Write(StrView data) -> Err
+{
+    if (!multipart)
+    {
+        return WriteFile(data);
+    }
+
+    auto err = parser.Feed(data);
+    return (err != Err::Ok)? err : error;
+}
+
+
+auto
+UploadSink::Finish() -> Err
+{
+    CloseFile();
+
+    if (multipart && !parser.IsComplete())
+    {
+        return Err::Corruption;
+    }
+    return error;
+}
+
+
+auto
+UploadSink::GetUpload() const -> const Upload&
+{
+    return upload;
+}
+
+
+auto
+UploadSink::OpenFile(const MultipartPart& part) -> Err
+{
+    auto path = options.directory + "/min-server-upload-XXXXXX";
+    fd = mkstemp(path.data());
+    if (fd < 0)
+    {
+        LogErr("Upload: can't create a file in ", options.directory);
+        return Err::IOError;
+    }
+
+    upload.files.push_back({ part.name, part.fileName, part.contentType, path, 0 });
+    return Err::Ok;
+}
+
+
+auto
+UploadSink::WriteFile(StrView data) -> Err
+{
+    while (!data.empty())
+    {
+        auto n = write(fd, data.data(), data.size());
+        if (n < 0)
+        {
+            LogErr("Upload: write to ", upload.files.back().path, " failed");
+            return Err::IOError;
+        }
+        data.remove_prefix(n);
+        upload.files.back().size += n;
+    }
+
+    return Err::Ok;
+}
+
+
+auto
+UploadSink::CloseFile() -> void
+{
+    if (fd >= 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+}
@@ -0,0 +1,127 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+#include "Error.hpp"
+
+
+struct MultipartPart
+{
+    Str name;
+    Str fileName;
+    Str contentType;
+};
+
+
+// Incremental multipart/form-data parser. Only the bytes that may belong to
+// a boundary split across two chunks and a part's header block are held.
+class MultipartParser
+{
+public:
+    Func<void(const MultipartPart&)> onPartBegin;
+    Func<void(StrView)> onPartData;
+    Func<void()> onPartEnd;
+
+    MultipartParser();
+
+    // Takes the boundary from a Content-Type header value.
+    Err Init(StrView contentType);
+    Err Feed(StrView data);
+    B IsComplete() const;
+
+private:
+    static constexpr U32 maxHeaderSize = 8192;
+
+    enum class State : U8
+    {
+        Preamble,
+        AfterBoundary,
+        Headers,
+        Body,
+        Epilogue,
+        Failed
+    };
+
+    State state;
+    // "\r\n--" followed by the boundary.
+    Str delimiter;
+    Str pending;
+
+    Err ParseHeaders(StrView headers);
+};
+
+
+struct UploadOptions
+{
+    Str directory = "/tmp";
+    U64 maxBodySize = U64(4) << 30;
+    // Split multipart/form-data bodies into files and fields, otherwise
+    // the whole body is stored as one file.
+    B parseMultipart = true;
+    // Form fields without a file name are kept in memory up to this size.
+    U32 maxFieldSize = 64 * 1024;
+};
+
+
+struct UploadedFile
+{
+    Str fieldName;
+    Str fileName;
+    Str contentType;
+    // Temporary file, removed after the handler returns unless it was
+    // moved away.
+    Str path;
+    U64 size;
+};
+
+
+struct Upload
+{
+    Vec<UploadedFile> files;
+    Vec<Pair<Str, Str>> fields;
+};
+
+
+// Writes a request body to temporary files as it arrives.
+class UploadSink
+{
+public:
+    UploadSink(const UploadOptions& options);
+    ~UploadSink();
+
+    Err Begin(StrView contentType);
+    Err Write(StrView data);
+    Err Finish();
+
+    const Upload& GetUpload() const;
+
+private:
+    const UploadOptions& options;
+    Upload upload;
+    MultipartParser parser;
+    B multipart;
+    I fd;
+    Str* field;
+    Err error;
+
+    Err OpenFile(const MultipartPart& part);
+    Err WriteFile(StrView data);
+    void CloseFile();
+};
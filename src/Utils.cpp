@@ -17,6 +17,7 @@
 
 
 #include <cctype>
+#include <charconv>
 
 #include "Utils.hpp"
 
@@ -233,3 +234,65 @@ void ToUpper(Str& str)
         symb = toupper(symb);
     }
 }
+
+
+static auto EqualsIgnoringCase(StrView a, StrView b) -> B
+{
+    if (a.size() != b.size())
+    {
+        return false;
+    }
+
+    for (Size i = 0; i < a.size(); ++i)
+    {
+        if (tolower((U8)a[i]) != tolower((U8)b[i]))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+auto
+AcceptsEncoding(StrView acceptEncoding, StrView coding) -> B
+{
+    while (!acceptEncoding.empty())
+    {
+        auto end = acceptEncoding.find(',');
+        auto item = acceptEncoding.substr(0, end);
+        acceptEncoding.remove_prefix(end == StrView::npos ? acceptEncoding.size() : end + 1);
+
+        auto parameters = item.find(';');
+        auto name = item.substr(0, parameters);
+        while (!name.empty() && name.front() == ' ')
+        {
+            name.remove_prefix(1);
+        }
+        while (!name.empty() && name.back() == ' ')
+        {
+            name.remove_suffix(1);
+        }
+        if (!EqualsIgnoringCase(name, coding))
+        {
+            continue;
+        }
+
+        if (parameters == StrView::npos)
+        {
+            return true;
+        }
+        auto q = item.find("q=", parameters);
+        if (q == StrView::npos)
+        {
+            return true;
+        }
+        auto value = item.substr(q + 2);
+        D weight = 1;
+        std::from_chars(value.data(), value.data() + value.size(), weight);
+        return weight > 0;
+    }
+
+    return false;
+}
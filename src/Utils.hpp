@@ -38,7 +38,6 @@
     #include <sys/random.h>
     #include <unistd.h>
     #include <sys/types.h>
-    #include <sys/wait.h>
 #endif
 
 
@@ -109,6 +108,34 @@ inline Str ReadStdin()
 }
 
 
+// FNV-1a, good enough for short keys like URIs and cookie values.
+inline U64 HashBytes(const void* data, Size size, U64 seed = 0xcbf29ce484222325ull)
+{
+    auto bytes = (const U8*)data;
+    auto hash = seed;
+
+    for (Size i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+
+// splitmix64 finalizer, spreads structured keys over all bits.
+inline U64 MixHash(U64 x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+
 inline void RandomBytes(U8* buffer, U32 size)
 {
 #ifdef _WIN32
@@ -125,6 +152,10 @@ B IsValidHexString(const StrView& str);
 
 void ToUpper(Str& str);
 
+// Whether an Accept-Encoding value lists the coding without refusing it
+// with q=0.
+B AcceptsEncoding(StrView acceptEncoding, StrView coding);
+
 template <typename... Ts>
 void Log(Ts... args)
 {
@@ -365,50 +396,26 @@ class Serializable
 };
 
 #ifndef _WIN32
+// Blocks until the command exited, without mongoose so it can be called
+// from any thread. The command writes to the server's stdout and stderr and
+// runs as uid and gid, a server running as root refuses to run it without
+// them. Defined in Command.cpp.
+Err ExecCommandSync(const Vec<Str>& args, StrView stdinContents, I32 uid = -1, I32 gid = -1);
+
 template <Size N>
-Err ExecCommandWithStdinSync(const Arr<CStr, N>& argP, const Str& stdinContents)
+Err ExecCommandWithStdinSync(const Arr<CStr, N>& argP, const Str& stdinContents, I32 uid = -1, I32 gid = -1)
 {
-    int pipefd[2];
-
-    setuid(1000);
-
-    if (pipe(pipefd))
+    Vec<Str> args;
+    for (auto arg : argP)
     {
-        return Err::Fail;
-    }
-
-    auto pid = fork();
-    if (!pid)
-    {
-        // Close writting end to child.
-        close(pipefd[1]);
-        if (dup2(pipefd[0], 0) == -1)
+        if (arg == nullptr)
         {
-            exit(1);
+            break;
         }
-        //auto devNullFd = open("/dev/null", O_WRONLY);
-        //dup2(devNullFd, STDOUT_FILENO);
-        //dup2(devNullFd, STDERR_FILENO);
-        execvp(argP[0], (C* const*)argP.data());
-    }
-    else
-    {
-        close(pipefd[0]);
-        auto written = write(pipefd[1], stdinContents.c_str(), stdinContents.size());
-
-        B writeFailed = false;
-        if(written != stdinContents.size())
-        {
-            writeFailed = true;
-        }
-        close(pipefd[1]);
-
-        I32 status;
-        waitpid(pid, &status, 0);
-        return (status || writeFailed)? Err::Fail : Err::Ok;
+        args.emplace_back(arg);
     }
 
-    return Err::Ok;
+    return ExecCommandSync(args, stdinContents, uid, gid);
 }
 #endif
 
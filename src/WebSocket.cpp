@@ -0,0 +1,257 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "WebSocket.hpp"
+
+
+auto
+EncodeWebSocketFrame(StrView payload, U8 op) -> WebSocketFrame
+{
+    // Server frames are never masked.
+    U8 header[10];
+    Size headerLength = 2;
+    U64 length = payload.size();
+
+    header[0] = 0x80 | op;
+    if (length < 126)
+    {
+        header[1] = (U8)length;
+    }
+    else if (length < 65536)
+    {
+        header[1] = 126;
+        header[2] = (U8)(length >> 8);
+        header[3] = (U8)length;
+        headerLength = 4;
+    }
+    else
+    {
+        header[1] = 127;
+        for (U32 i = 0; i < 8; ++i)
+        {
+            header[2 + i] = (U8)(length >> (56 - 8 * i));
+        }
+        headerLength = 10;
+    }
+
+    auto frame = std::make_shared<Str>();
+    frame->reserve(headerLength + payload.size());
+    frame->append((CStr)header, headerLength);
+    frame->append(payload);
+
+    return frame;
+}
+
+
+WebSocketConnection::WebSocketConnection(
+                                          mg_connection* c,
+                                          const WebSocketHandler* handler,
+                                          PubSub* pubSub
+                                        ) :
+    userData(nullptr),
+    c(c),
+    handler(handler),
+    pubSub(pubSub)
+{
+}
+
+
+auto
+WebSocketConnection::Send(StrView message, B binary) -> void
+{
+    auto op = binary? WEBSOCKET_OP_BINARY : WEBSOCKET_OP_TEXT;
+    pubSub->Enqueue(this, EncodeWebSocketFrame(message, op));
+}
+
+
+auto
+WebSocketConnection::Subscribe(CStr topic) -> void
+{
+    pubSub->Subscribe(this, topic);
+}
+
+
+auto
+WebSocketConnection::Unsubscribe(CStr topic) -> void
+{
+    pubSub->Unsubscribe(this, topic);
+}
+
+
+auto
+WebSocketConnection::Close(U16 code) -> void
+{
+    if (sendQueue.IsClosing())
+    {
+        return;
+    }
+
+    C payload[2] = { C(code >> 8), C(code & 0xff) };
+    pubSub->Enqueue(this, EncodeWebSocketFrame(StrView(payload, 2), WEBSOCKET_OP_CLOSE));
+    sendQueue.CloseWhenDrained(c);
+}
+
+
+auto
+WebSocketConnection::GetRemoteIPv4Address() const -> U32
+{
+    return c->rem.ip;
+}
+
+
+auto
+WebSocketConnection::GetRemotePort() const -> U16
+{
+    return c->rem.port;
+}
+
+
+auto
+WebSocketConnection::IsSecure() const -> B
+{
+    return c->is_tls;
+}
+
+
+PubSub::PubSub() :
+    publishedCount(0),
+    evictedCount(0)
+{
+}
+
+
+auto
+PubSub::SetLimits(const WebSocketLimits& newLimits) -> void
+{
+    limits = newLimits;
+}
+
+
+auto
+PubSub::Subscribe(WebSocketConnection* ws, CStr topic) -> void
+{
+    for (auto& subscription : ws->subscriptions)
+    {
+        if (subscription.topic == topic)
+        {
+            return;
+        }
+    }
+
+    auto& subscribers = topics[topic];
+    subscribers.push_back({ ws, (U32)ws->subscriptions.size() });
+    ws->subscriptions.push_back({ Str(topic), (U32)subscribers.size() - 1 });
+}
+
+
+auto
+PubSub::Unsubscribe(WebSocketConnection* ws, CStr topic) -> void
+{
+    for (U32 i = 0; i < ws->subscriptions.size(); ++i)
+    {
+        if (ws->subscriptions[i].topic == topic)
+        {
+            Remove(ws, i);
+            return;
+        }
+    }
+}
+
+
+auto
+PubSub::UnsubscribeAll(WebSocketConnection* ws) -> void
+{
+    while (!ws->subscriptions.empty())
+    {
+        Remove(ws, (U32)ws->subscriptions.size() - 1);
+    }
+}
+
+
+auto
+PubSub::Remove(WebSocketConnection* ws, U32 subscription) -> void
+{
+    // Both sides are unordered, swap with the last entry and fix up the
+    // back reference of whatever got moved.
+    auto& removed = ws->subscriptions[subscription];
+    auto topic = topics.find(removed.topic);
+    auto& subscribers = topic->second;
+
+    auto& moved = subscribers.back();
+    moved.ws->subscriptions[moved.subscription].index = removed.index;
+    subscribers[removed.index] = moved;
+    subscribers.pop_back();
+    if (subscribers.empty())
+    {
+        topics.erase(topic);
+    }
+
+    auto& last = ws->subscriptions.back();
+    if (&last != &removed)
+    {
+        topics[last.topic][last.index].subscription = subscription;
+        removed = std::move(last);
+    }
+    ws->subscriptions.pop_back();
+}
+
+
+auto
+PubSub::Publish(CStr topic, StrView payload, B binary) -> U32
+{
+    auto it = topics.find(topic);
+    if (it == topics.end())
+    {
+        return 0;
+    }
+
+    auto op = binary? WEBSOCKET_OP_BINARY : WEBSOCKET_OP_TEXT;
+    auto frame = EncodeWebSocketFrame(payload, op);
+    publishedCount++;
+
+    for (auto& subscriber : it->second)
+    {
+        Enqueue(subscriber.ws, frame);
+    }
+
+    return (U32)it->second.size();
+}
+
+
+auto
+PubSub::Enqueue(WebSocketConnection* ws, const WebSocketFrame& frame) -> void
+{
+    if (!ws->sendQueue.Push(ws->c, frame, limits))
+    {
+        evictedCount++;
+    }
+}
+
+
+auto
+PubSub::GetPublishedCount() const -> U64
+{
+    return publishedCount;
+}
+
+
+auto
+PubSub::GetEvictedCount() const -> U64
+{
+    return evictedCount;
+}
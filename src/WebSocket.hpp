@@ -0,0 +1,115 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+#include "SendQueue.hpp"
+
+#include "mongoose/mongoose.h"
+
+
+using WebSocketFrame = SharedBuffer;
+using WebSocketLimits = SendQueueLimits;
+
+WebSocketFrame EncodeWebSocketFrame(StrView payload, U8 op);
+
+
+class PubSub;
+class WebSocketConnection;
+
+
+struct WebSocketHandler
+{
+    Func<void(WebSocketConnection*)> onOpen;
+    Func<void(WebSocketConnection*, StrView message, B binary)> onMessage;
+    Func<void(WebSocketConnection*)> onClose;
+};
+
+
+class WebSocketConnection
+{
+public:
+    WebSocketConnection(mg_connection* c, const WebSocketHandler* handler, PubSub* pubSub);
+
+    void Send(StrView message, B binary = false);
+    void Subscribe(CStr topic);
+    void Unsubscribe(CStr topic);
+    void Close(U16 code = 1000);
+
+    U32 GetRemoteIPv4Address() const;
+    U16 GetRemotePort() const;
+    B IsSecure() const;
+
+    // Free for the handler's use.
+    void* userData;
+
+private:
+    friend class PubSub;
+    friend class Server;
+
+    struct Subscription
+    {
+        Str topic;
+        U32 index;
+    };
+
+    mg_connection* c;
+    const WebSocketHandler* handler;
+    PubSub* pubSub;
+    SendQueue sendQueue;
+    Vec<Subscription> subscriptions;
+};
+
+
+// Topic registry for WebSocket connections. Everything runs on the
+// reactor thread.
+class PubSub
+{
+public:
+    PubSub();
+
+    void SetLimits(const WebSocketLimits& newLimits);
+
+    void Subscribe(WebSocketConnection* ws, CStr topic);
+    void Unsubscribe(WebSocketConnection* ws, CStr topic);
+    void UnsubscribeAll(WebSocketConnection* ws);
+
+    // Returns the number of subscribers the message was queued for.
+    U32 Publish(CStr topic, StrView payload, B binary);
+
+    void Enqueue(WebSocketConnection* ws, const WebSocketFrame& frame);
+
+    U64 GetPublishedCount() const;
+    U64 GetEvictedCount() const;
+
+private:
+    struct Subscriber
+    {
+        WebSocketConnection* ws;
+        // Position in ws->subscriptions, to fix it up on removal.
+        U32 subscription;
+    };
+
+    WebSocketLimits limits;
+    UMap<Str, Vec<Subscriber>> topics;
+    U64 publishedCount;
+    U64 evictedCount;
+
+    void Remove(WebSocketConnection* ws, U32 subscription);
+};
@@ -0,0 +1,398 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// Range requests: parsing, If-Range and the bodies FileBody sends.
+//
+//   min-server-test-byte-ranges [seed] [iterations]
+//
+// Range headers with several, overlapping, suffix, open ended and
+// unsatisfiable ranges resolve to the ranges RFC 9110 gives, malformed ones
+// to the whole representation. If-Range matches strong tags and the exact
+// modification date only. FileBody is run over an in-memory mg_fs on a
+// connection without a socket, and what it writes is compared with the
+// body rendered here: the range itself, or multipart/byteranges parts with
+// their Content-Range lines and the closing boundary, GetLength() bytes in
+// all.
+
+#include "Check.hpp"
+#include "ByteRanges.hpp"
+#include "HeaderCache.hpp"
+
+
+static auto SameRanges(const Vec<ByteRange>& ranges, std::initializer_list<ByteRange> expected) -> B
+{
+    if (ranges.size() != expected.size())
+    {
+        return false;
+    }
+
+    auto range = ranges.begin();
+    for (auto& other : expected)
+    {
+        if (range->first != other.first || range->last != other.last)
+        {
+            return false;
+        }
+        ++range;
+    }
+    return true;
+}
+
+
+static auto CheckParse() -> void
+{
+    struct Case
+    {
+        StrView header;
+        U64 size;
+        RangeResult result;
+        std::initializer_list<ByteRange> ranges;
+    };
+
+    static const Case cases[] =
+    {
+        { "bytes=0-99", 1000, RangeResult::Partial, { { 0, 99 } } },
+        { "Bytes=0-0", 1000, RangeResult::Partial, { { 0, 0 } } },
+        { " bytes= 0-0 , ,5-5 ", 1000, RangeResult::Partial, { { 0, 5 } } },
+        // Several, sorted.
+        { "bytes=500-599,0-99", 1000, RangeResult::Partial, { { 0, 99 }, { 500, 599 } } },
+        { "bytes=0-9,200-209,900-", 1000, RangeResult::Partial, { { 0, 9 }, { 200, 209 }, { 900, 999 } } },
+        // Overlapping, adjacent, and apart by at most the 80 byte gap a
+        // part head costs, coalesced.
+        { "bytes=0-99,50-149", 1000, RangeResult::Partial, { { 0, 149 } } },
+        { "bytes=0-99,100-199", 1000, RangeResult::Partial, { { 0, 199 } } },
+        { "bytes=0-99,180-199", 1000, RangeResult::Partial, { { 0, 199 } } },
+        { "bytes=0-99,181-199", 1000, RangeResult::Partial, { { 0, 99 }, { 181, 199 } } },
+        { "bytes=10-20,0-999", 1000, RangeResult::Partial, { { 0, 999 } } },
+        { "bytes=0-0,0-0,0-0", 1000, RangeResult::Partial, { { 0, 0 } } },
+        // Suffix and open ended ranges, clamped to the size.
+        { "bytes=-100", 1000, RangeResult::Partial, { { 900, 999 } } },
+        { "bytes=-2000", 1000, RangeResult::Partial, { { 0, 999 } } },
+        { "bytes=990-2000", 1000, RangeResult::Partial, { { 990, 999 } } },
+        { "bytes=999-", 1000, RangeResult::Partial, { { 999, 999 } } },
+        // Unsatisfiable, none of them overlaps the representation.
+        { "bytes=1000-1100", 1000, RangeResult::Unsatisfiable, {} },
+        { "bytes=1000-,2000-3000", 1000, RangeResult::Unsatisfiable, {} },
+        { "bytes=-0", 1000, RangeResult::Unsatisfiable, {} },
+        { "bytes=0-", 0, RangeResult::Unsatisfiable, {} },
+        { "bytes=-5", 0, RangeResult::Unsatisfiable, {} },
+        // The satisfiable ones of a list are kept.
+        { "bytes=5000-,0-0", 1000, RangeResult::Partial, { { 0, 0 } } },
+        // Ignored: other units, no ranges, syntax errors and numbers past
+        // 64 bits.
+        { "items=0-1", 1000, RangeResult::Whole, {} },
+        { "bytes=", 1000, RangeResult::Whole, {} },
+        { "bytes=,", 1000, RangeResult::Whole, {} },
+        { "bytes=5", 1000, RangeResult::Whole, {} },
+        { "bytes=5-1", 1000, RangeResult::Whole, {} },
+        { "bytes=a-b", 1000, RangeResult::Whole, {} },
+        { "bytes=--1", 1000, RangeResult::Whole, {} },
+        { "bytes=0-1,x", 1000, RangeResult::Whole, {} },
+        { "bytes=99999999999999999999-", 1000, RangeResult::Whole, {} },
+        { "bytes=0-99999999999999999999", 1000, RangeResult::Whole, {} }
+    };
+
+    for (auto& test : cases)
+    {
+        Vec<ByteRange> ranges;
+        auto result = ParseRanges(test.header, test.size, &ranges);
+        // The ranges are only looked at for a partial response.
+        auto ok = result == test.result && (result != RangeResult::Partial || SameRanges(ranges, test.ranges));
+        if (!ok)
+        {
+            printf("\"%.*s\" of %llu bytes\n", (I)test.header.size(), test.header.data(), (unsigned long long)test.size);
+        }
+        M_CHECK(ok);
+    }
+
+    // More than 64 parts after coalescing is the whole file.
+    for (U32 count : { 64, 65 })
+    {
+        Str header = "bytes=";
+        for (U32 i = 0; i < count; ++i)
+        {
+            header += std::to_string(i * 200) + "-" + std::to_string(i * 200) + ",";
+        }
+        Vec<ByteRange> ranges;
+        auto result = ParseRanges(header, 100000, &ranges);
+        M_CHECK(result == ((count == 64)? RangeResult::Partial : RangeResult::Whole));
+        M_CHECK(count == 65 || ranges.size() == 64);
+    }
+
+    // However many, ranges that coalesce are one part.
+    Str overlapping = "bytes=";
+    for (U32 i = 0; i < 10000; ++i)
+    {
+        overlapping += "0-999,";
+    }
+    Vec<ByteRange> ranges;
+    M_CHECK(ParseRanges(overlapping, 1000, &ranges) == RangeResult::Partial);
+    M_CHECK(SameRanges(ranges, { { 0, 999 } }));
+}
+
+
+static auto CheckIfRange() -> void
+{
+    // Sun, 06 Nov 1994 08:49:37 GMT
+    static constexpr time_t modified = 784111777;
+    static constexpr StrView etag = "\"5d41402abc4b2a76\"";
+
+    M_CHECK(IfRangeMatches("\"5d41402abc4b2a76\"", etag, modified));
+    M_CHECK(IfRangeMatches("  \"5d41402abc4b2a76\" ", etag, modified));
+    M_CHECK(!IfRangeMatches("\"5d41402abc4b2a77\"", etag, modified));
+    M_CHECK(!IfRangeMatches("W/\"5d41402abc4b2a76\"", etag, modified));
+    M_CHECK(!IfRangeMatches("5d41402abc4b2a76", etag, modified));
+    M_CHECK(!IfRangeMatches("", etag, modified));
+
+    // A date names the representation only when it is exactly the
+    // modification time, not one that is merely later.
+    C date[httpDateLength + 1];
+    M_CHECK(FormatHttpDate(modified, date));
+    M_CHECK(StrView(date) == "Sun, 06 Nov 1994 08:49:37 GMT");
+    M_CHECK(IfRangeMatches(date, etag, modified));
+    M_CHECK(!IfRangeMatches(date, etag, modified + 1));
+    M_CHECK(!IfRangeMatches(date, etag, 0));
+    M_CHECK(FormatHttpDate(modified + 3600, date));
+    M_CHECK(!IfRangeMatches(date, etag, modified));
+    M_CHECK(!IfRangeMatches("Sunday, 06-Nov-94 08:49:37 GMT", etag, modified));
+    M_CHECK(!IfRangeMatches("Sun, 06 Nov 1994 08:49:37 XYZ", etag, modified));
+}
+
+
+// mg_fs over a string, enough for FileBody.
+struct MemoryFile
+{
+    const Str* data;
+    Size position;
+};
+
+static const Str* memoryFileData = nullptr;
+
+
+static auto MemoryOpen(const char*, int) -> void*
+{
+    return new MemoryFile{ memoryFileData, 0 };
+}
+
+static auto MemoryClose(void* fd) -> void
+{
+    delete (MemoryFile*)fd;
+}
+
+static auto MemoryRead(void* fd, void* buf, size_t length) -> size_t
+{
+    auto file = (MemoryFile*)fd;
+    auto n = std::min(length, file->data->size() - std::min(file->position, file->data->size()));
+    memcpy(buf, file->data->data() + file->position, n);
+    file->position += n;
+    return n;
+}
+
+static auto MemorySeek(void* fd, size_t offset) -> size_t
+{
+    ((MemoryFile*)fd)->position = offset;
+    return offset;
+}
+
+static mg_fs memoryFs =
+{
+    nullptr,
+    nullptr,
+    MemoryOpen,
+    MemoryClose,
+    MemoryRead,
+    nullptr,
+    MemorySeek,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr
+};
+
+
+// Only allocates the connections, it is never polled.
+static mg_mgr mgr;
+
+
+// What FileBody writes for the ranges of data, taken from the send buffer
+// as a socket would, `drain` bytes per write event. `size` is what the
+// body is told the file has.
+static auto SendBody(const Str& data, U64 size, const Vec<ByteRange>& ranges, Size drain, Str* multipartType, B* draining) -> Str
+{
+    memoryFileData = &data;
+    auto body = new FileBody(&memoryFs, MemoryOpen(nullptr, 0), size, "text/plain", ranges);
+    *multipartType = body->GetMultipartType();
+    auto length = body->GetLength();
+
+    auto c = mg_alloc_conn(&mgr);
+    c->is_resp = 1;
+    FileBody::Send(c, body);
+
+    Str sent;
+    for (U32 events = 0; events < 1000000; ++events)
+    {
+        auto n = std::min<Size>(drain, c->send.len);
+        sent.append((CStr)c->send.buf, n);
+        mg_iobuf_del(&c->send, 0, n);
+        if (c->pfn == nullptr && c->send.len == 0)
+        {
+            break;
+        }
+        if (c->pfn != nullptr)
+        {
+            mg_call(c, MG_EV_WRITE, &n);
+        }
+    }
+
+    M_CHECK(c->is_resp == 0 && c->pfn == nullptr && c->pfn_data == nullptr);
+    *draining = c->is_draining;
+    if (!*draining)
+    {
+        M_CHECK(sent.size() == length);
+    }
+
+    mg_iobuf_free(&c->recv);
+    mg_iobuf_free(&c->send);
+    mg_free_conn(c);
+
+    return sent;
+}
+
+
+// The body as RFC 9110 section 14.6 lays it out.
+static auto ExpectedBody(const Str& data, const Vec<ByteRange>& ranges, StrView multipartType) -> Str
+{
+    if (ranges.size() == 1)
+    {
+        return data.substr(ranges[0].first, ranges[0].last - ranges[0].first + 1);
+    }
+
+    static constexpr StrView prefix = "multipart/byteranges; boundary=";
+    auto boundary = Str(multipartType.substr(prefix.size()));
+
+    Str body;
+    for (auto& range : ranges)
+    {
+        body += "\r\n--" + boundary + "\r\n";
+        body += "Content-Type: text/plain\r\n";
+        body += "Content-Range: bytes " + std::to_string(range.first) + "-" + std::to_string(range.last) + "/";
+        body += std::to_string(data.size()) + "\r\n\r\n";
+        body += data.substr(range.first, range.last - range.first + 1);
+    }
+    body += "\r\n--" + boundary + "--\r\n";
+    return body;
+}
+
+
+static auto CheckBodies(U64 seed, U64 iterations) -> void
+{
+    TestRandom random(seed);
+    Str data(300000, '\0');
+    for (auto& c : data)
+    {
+        c = (C)('a' + random.Below(26));
+    }
+
+    Str multipartType;
+    B draining = false;
+
+    // Two parts, framed by hand.
+    {
+        Str small = data.substr(0, 200);
+        Vec<ByteRange> ranges;
+        M_CHECK(ParseRanges("bytes=0-1,-2", small.size(), &ranges) == RangeResult::Partial);
+        auto sent = SendBody(small, small.size(), ranges, 7, &multipartType, &draining);
+        M_CHECK(multipartType.starts_with("multipart/byteranges; boundary="));
+        auto boundary = multipartType.substr(31);
+        M_CHECK(boundary.size() == 16);
+        M_CHECK(sent ==
+            "\r\n--" + boundary + "\r\nContent-Type: text/plain\r\nContent-Range: bytes 0-1/200\r\n\r\n" +
+            small.substr(0, 2) +
+            "\r\n--" + boundary + "\r\nContent-Type: text/plain\r\nContent-Range: bytes 198-199/200\r\n\r\n" +
+            small.substr(198) +
+            "\r\n--" + boundary + "--\r\n");
+
+        // Boundaries differ between responses.
+        Str next;
+        SendBody(small, small.size(), ranges, 7, &next, &draining);
+        M_CHECK(next != multipartType);
+    }
+
+    // Random range sets over a file larger than the send buffer, drained
+    // in random steps.
+    for (U64 i = 0; i < iterations && checkFailures < 10; ++i)
+    {
+        Str header = "bytes=";
+        auto count = 1 + random.Below(random.OneIn(4)? 80 : 6);
+        for (U32 r = 0; r < count; ++r)
+        {
+            auto first = random.Below((U32)data.size() + 100);
+            auto kind = random.Below(4);
+            if (kind == 0)
+            {
+                header += "-" + std::to_string(1 + random.Below(5000));
+            }
+            else if (kind == 1)
+            {
+                header += std::to_string(first) + "-";
+            }
+            else
+            {
+                header += std::to_string(first) + "-" + std::to_string(first + random.Below(kind == 2? 100 : 20000));
+            }
+            header += ",";
+        }
+
+        Vec<ByteRange> ranges;
+        if (ParseRanges(header, data.size(), &ranges) != RangeResult::Partial)
+        {
+            continue;
+        }
+
+        auto sent = SendBody(data, data.size(), ranges, 1 + random.Below(20000), &multipartType, &draining);
+        auto same = !draining && sent == ExpectedBody(data, ranges, multipartType);
+        if (!same)
+        {
+            printf("seed %llu iteration %llu: \"%s\" was not sent as it should\n", (unsigned long long)seed, (unsigned long long)i, header.c_str());
+        }
+        M_CHECK(same);
+    }
+
+    // A file that shrank since its size was taken ends the connection
+    // rather than the response short.
+    Str shrunk = data.substr(0, 1000);
+    SendBody(shrunk, data.size(), { { 500, 5000 } }, 4096, &multipartType, &draining);
+    M_CHECK(draining);
+}
+
+
+int main(int argc, char** argv)
+{
+    auto seed = (argc > 1)? std::strtoull(argv[1], nullptr, 10) : 1;
+    auto iterations = (argc > 2)? std::strtoull(argv[2], nullptr, 10) : 2000;
+
+    mg_log_set(MG_LL_NONE);
+
+    CheckParse();
+    CheckIfRange();
+    CheckBodies(seed, iterations);
+
+    printf("%llu range sets\n", (unsigned long long)iterations);
+
+    return CheckResult();
+}
@@ -0,0 +1,115 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "Types.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+
+
+// Failed checks are printed and counted, the test programs exit with
+// CheckResult() so ctest sees the failure.
+inline U32 checkFailures = 0;
+
+
+#define M_CHECK(expression) \
+    if (!(expression)) \
+    {\
+        printf("Check failed: %s at %s:%u\n", #expression, __FILE__, __LINE__); \
+        checkFailures++; \
+    }
+
+
+inline I CheckResult()
+{
+    if (checkFailures != 0)
+    {
+        printf("%u checks failed\n", checkFailures);
+        return EXIT_FAILURE;
+    }
+
+    printf("All checks passed\n");
+    return EXIT_SUCCESS;
+}
+
+
+// Deterministic generator for the fuzz loops, a failure reproduces from the
+// seed it prints.
+class TestRandom
+{
+public:
+    explicit TestRandom(U64 seed) :
+        state(seed * 0x9E3779B97F4A7C15ull + 1)
+    {
+    }
+
+    U64 Next()
+    {
+        // splitmix64
+        auto z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    // In [0, bound).
+    U32 Below(U32 bound)
+    {
+        return (U32)(Next() % bound);
+    }
+
+    // True one time in n.
+    B OneIn(U32 n)
+    {
+        return Below(n) == 0;
+    }
+
+private:
+    U64 state;
+};
+
+
+// Printable form of a failing input.
+inline Str Escape(StrView bytes)
+{
+    Str escaped;
+    for (auto c : bytes)
+    {
+        if (c == '\r')
+        {
+            escaped += "\\r";
+        }
+        else if (c == '\n')
+        {
+            escaped += "\\n";
+        }
+        else if ((U8)c < ' ' || (U8)c >= 0x7F)
+        {
+            C hex[8];
+            snprintf(hex, sizeof(hex), "\\x%02X", (U8)c);
+            escaped += hex;
+        }
+        else
+        {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
@@ -0,0 +1,126 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// embeddedFs over a small table in place of the packed one.
+//
+//   min-server-test-embedded-assets
+//
+// Files, their .gz variants, directories and listings resolve as
+// mg_http_serve_dir expects, also where a file's name is a directory's name
+// followed by '-' or '.', which sort before the '/' of its entries.
+
+#include "Check.hpp"
+#include "Assets.hpp"
+
+
+static const U8 bytes[] = "0123456789";
+
+
+static constexpr auto Asset(CStr path, B gzip = false) -> EmbeddedAsset
+{
+    return
+    {
+        path,
+        "text/plain",
+        784111777,
+        { bytes, 10, "\"identity\"" },
+        { nullptr, 0, nullptr },
+        { gzip? bytes : nullptr, gzip? 4u : 0u, gzip? "\"gzip\"" : nullptr }
+    };
+}
+
+
+// Sorted by path as the build sorts them.
+extern const EmbeddedAsset embeddedAssets[] =
+{
+    Asset("/app-old/index.html"),
+    Asset("/app.js", true),
+    Asset("/app/index.html"),
+    Asset("/app/sub/a.css"),
+    Asset("/app/sub/b.css"),
+    Asset("/app0"),
+    Asset("/b.txt")
+};
+
+extern const Size embeddedAssetCount = sizeof(embeddedAssets) / sizeof(embeddedAssets[0]);
+
+
+static auto Stat(CStr path) -> I
+{
+    size_t size = 0;
+    time_t mtime = 0;
+    return embeddedFs.st(path, &size, &mtime);
+}
+
+
+static auto List(CStr path) -> Str
+{
+    Str names;
+    embeddedFs.ls(path, [](CStr name, void* names)
+    {
+        *(Str*)names += Str(name) + " ";
+    }, &names);
+    return names;
+}
+
+
+static auto CheckStat() -> void
+{
+    M_CHECK(Stat("/app.js") == MG_FS_READ);
+    M_CHECK(Stat("/app.js.gz") == MG_FS_READ);
+    M_CHECK(Stat("/app.js.br") == 0);
+    M_CHECK(Stat("/app/index.html") == MG_FS_READ);
+    M_CHECK(Stat("/app0") == MG_FS_READ);
+
+    M_CHECK(Stat("/app") == MG_FS_DIR);
+    M_CHECK(Stat("/app/") == MG_FS_DIR);
+    M_CHECK(Stat("/app/sub") == MG_FS_DIR);
+    M_CHECK(Stat("/app-old") == MG_FS_DIR);
+    M_CHECK(Stat("/") == MG_FS_DIR);
+
+    M_CHECK(Stat("/ap") == 0);
+    M_CHECK(Stat("/app/s") == 0);
+    M_CHECK(Stat("/app/index.htm") == 0);
+    M_CHECK(Stat("/b") == 0);
+    M_CHECK(Stat("/c") == 0);
+
+    size_t size = 0;
+    time_t mtime = 0;
+    M_CHECK(embeddedFs.st("/app.js.gz", &size, &mtime) == MG_FS_READ && size == 4 && mtime == 784111777);
+}
+
+
+static auto CheckList() -> void
+{
+    M_CHECK(List("/app") == "index.html sub ");
+    M_CHECK(List("/app/") == "index.html sub ");
+    M_CHECK(List("/app/sub") == "a.css b.css ");
+    M_CHECK(List("/app-old") == "index.html ");
+    M_CHECK(List("/") == "app-old app.js app app0 b.txt ");
+    M_CHECK(List("/ap") == "");
+    M_CHECK(List("/b.txt") == "");
+}
+
+
+int main()
+{
+    CheckStat();
+    CheckList();
+
+    return CheckResult();
+}
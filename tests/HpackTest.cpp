@@ -0,0 +1,478 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// HPACK regression cases and a round trip fuzz.
+//
+//   min-server-test-hpack [seed] [iterations]
+//
+// The RFC 7541 appendix C examples decode to their fields and leave the
+// dynamic table the RFC shows, malformed Huffman strings, oversized
+// integers and blocks that expand past the list size are refused. Random
+// header lists go through HpackEncoder and HpackDecoder while both sides
+// change the table size, and mutated blocks must decode or fail without
+// touching memory they should not.
+
+#include "Check.hpp"
+#include "Hpack.hpp"
+
+
+static auto FromHex(StrView hex) -> Str
+{
+    Str bytes;
+    U32 digits = 0;
+    U8 byte = 0;
+    for (auto c : hex)
+    {
+        if (c == ' ')
+        {
+            continue;
+        }
+        byte = (U8)(byte << 4 | ((c <= '9')? c - '0' : c - 'a' + 10));
+        if (++digits % 2 == 0)
+        {
+            bytes.push_back((C)byte);
+            byte = 0;
+        }
+    }
+    return bytes;
+}
+
+
+static constexpr U32 maxListSize = 64 * 1024;
+
+
+static auto Decode(HpackDecoder* decoder, StrView block, Vec<HeaderField>& fields, U32 maxListSize = ::maxListSize) -> B
+{
+    return decoder->Decode((const U8*)block.data(), block.size(), maxListSize, fields);
+}
+
+
+static auto SameFields(const Vec<HeaderField>& fields, std::initializer_list<Pair<StrView, StrView>> expected) -> B
+{
+    if (fields.size() != expected.size())
+    {
+        return false;
+    }
+
+    auto field = fields.begin();
+    for (auto& [name, value] : expected)
+    {
+        if (field->name != name || field->value != value)
+        {
+            return false;
+        }
+        ++field;
+    }
+    return true;
+}
+
+
+// The field a one byte indexed representation of the dynamic table entry
+// gives, in a copy so a failure leaves the decoder usable.
+static auto Lookup(const HpackDecoder& decoder, U32 entry) -> Str
+{
+    auto probe = decoder;
+    Vec<HeaderField> fields;
+    C block = (C)(0x80 | (61 + entry));
+    if (!probe.Decode((const U8*)&block, 1, maxListSize, fields))
+    {
+        return "(none)";
+    }
+    return fields[0].name + ": " + fields[0].value;
+}
+
+
+// RFC 7541 C.3 and C.4, requests without and with Huffman coding.
+static auto CheckRequestExamples() -> void
+{
+    static constexpr StrView plain[] =
+    {
+        "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+        "8286 84be 5808 6e6f 2d63 6163 6865",
+        "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65"
+    };
+
+    static constexpr StrView huffman[] =
+    {
+        "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+        "8286 84be 5886 a8eb 1064 9cbf",
+        "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf"
+    };
+
+    for (auto examples : { plain, huffman })
+    {
+        HpackDecoder decoder;
+        Vec<HeaderField> fields;
+
+        M_CHECK(Decode(&decoder, FromHex(examples[0]), fields));
+        M_CHECK(SameFields(fields, {
+            { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" }, { ":authority", "www.example.com" }
+        }));
+        M_CHECK(Lookup(decoder, 1) == ":authority: www.example.com");
+        M_CHECK(Lookup(decoder, 2) == "(none)");
+
+        M_CHECK(Decode(&decoder, FromHex(examples[1]), fields));
+        M_CHECK(SameFields(fields, {
+            { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" }, { ":authority", "www.example.com" },
+            { "cache-control", "no-cache" }
+        }));
+        M_CHECK(Lookup(decoder, 1) == "cache-control: no-cache");
+        M_CHECK(Lookup(decoder, 2) == ":authority: www.example.com");
+
+        M_CHECK(Decode(&decoder, FromHex(examples[2]), fields));
+        M_CHECK(SameFields(fields, {
+            { ":method", "GET" }, { ":scheme", "https" }, { ":path", "/index.html" },
+            { ":authority", "www.example.com" }, { "custom-key", "custom-value" }
+        }));
+        M_CHECK(Lookup(decoder, 1) == "custom-key: custom-value");
+        M_CHECK(Lookup(decoder, 3) == ":authority: www.example.com");
+        M_CHECK(Lookup(decoder, 4) == "(none)");
+    }
+}
+
+
+// RFC 7541 C.5 and C.6, responses through a 256 byte table that evicts
+// entries on the second and third of them.
+static auto CheckResponseExamples() -> void
+{
+    static constexpr StrView plain[] =
+    {
+        "4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3120 474d"
+        "546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+        "4803 3330 37c1 c0bf",
+        "88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3220 474d 54c0 5a04 677a 6970 7738 666f"
+        "6f3d 4153 444a 4b48 514b 425a 584f 5157 454f 5049 5541 5851 5745 4f49 553b 206d 6178 2d61 6765 3d33 3630 303b"
+        "2076 6572 7369 6f6e 3d31"
+    };
+
+    static constexpr StrView huffman[] =
+    {
+        "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6 2d1b ff6e 919d 29ad 1718 63c7"
+        "8f0b 97c8 e9ae 82ae 43d3",
+        "4883 640e ffc1 c0bf",
+        "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab 77ad 94e7 821d d7f2 e6c7 b335"
+        "dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587 3160 65c0 03ed 4ee5 b106 3d50 07"
+    };
+
+    static constexpr StrView date21 = "Mon, 21 Oct 2013 20:13:21 GMT";
+    static constexpr StrView date22 = "Mon, 21 Oct 2013 20:13:22 GMT";
+    static constexpr StrView location = "https://www.example.com";
+    static constexpr StrView cookie = "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1";
+
+    for (auto examples : { plain, huffman })
+    {
+        HpackDecoder decoder;
+        Vec<HeaderField> fields;
+
+        // The examples assume SETTINGS_HEADER_TABLE_SIZE 256, a size update
+        // to it gets the decoder there.
+        M_CHECK(Decode(&decoder, FromHex("3fe1 01") + FromHex(examples[0]), fields));
+        M_CHECK(SameFields(fields, {
+            { ":status", "302" }, { "cache-control", "private" }, { "date", date21 }, { "location", location }
+        }));
+        M_CHECK(Lookup(decoder, 1) == "location: " + Str(location));
+        M_CHECK(Lookup(decoder, 4) == ":status: 302");
+
+        M_CHECK(Decode(&decoder, FromHex(examples[1]), fields));
+        M_CHECK(SameFields(fields, {
+            { ":status", "307" }, { "cache-control", "private" }, { "date", date21 }, { "location", location }
+        }));
+        M_CHECK(Lookup(decoder, 1) == ":status: 307");
+        M_CHECK(Lookup(decoder, 4) == "cache-control: private");
+        M_CHECK(Lookup(decoder, 5) == "(none)");
+
+        M_CHECK(Decode(&decoder, FromHex(examples[2]), fields));
+        M_CHECK(SameFields(fields, {
+            { ":status", "200" }, { "cache-control", "private" }, { "date", date22 }, { "location", location },
+            { "content-encoding", "gzip" }, { "set-cookie", cookie }
+        }));
+        M_CHECK(Lookup(decoder, 1) == "set-cookie: " + Str(cookie));
+        M_CHECK(Lookup(decoder, 2) == "content-encoding: gzip");
+        M_CHECK(Lookup(decoder, 3) == "date: " + Str(date22));
+        M_CHECK(Lookup(decoder, 4) == "(none)");
+    }
+}
+
+
+static auto CheckTable() -> void
+{
+    // Names long enough to live outside the strings, so a read of an
+    // evicted one is caught.
+    static constexpr StrView a = "x-first-long-header";
+    static constexpr StrView b = "x-second-long-header";
+    static constexpr StrView c = "x-third-long-header";
+
+    HpackTable table;
+    table.SetMaxSize(120);
+
+    // 32 + 19 or 20 + 1 each, the third insert evicts the first.
+    table.Insert(a, "1");
+    table.Insert(b, "2");
+    M_CHECK(table.GetCount() == 2);
+    table.Insert(c, "3");
+    M_CHECK(table.GetCount() == 2);
+    M_CHECK(table.Get(1)->name == c && table.Get(2)->name == b);
+    M_CHECK(table.Get(3) == nullptr && table.Get(0) == nullptr);
+
+    // The name of the entry being evicted, still readable while the new one
+    // is made.
+    auto oldest = table.Get(2);
+    table.Insert(oldest->name, Str(60, 'x'));
+    M_CHECK(table.GetCount() == 1);
+    M_CHECK(table.Get(1)->name == b && table.Get(1)->value.size() == 60);
+
+    // Larger than the whole table, which is emptied.
+    table.Insert("big", Str(100, 'x'));
+    M_CHECK(table.GetCount() == 0);
+
+    table.Insert(a, "1");
+    table.SetMaxSize(0);
+    M_CHECK(table.GetCount() == 0);
+    table.Insert(a, "1");
+    M_CHECK(table.GetCount() == 0);
+}
+
+
+static auto CheckMalformed() -> void
+{
+    struct Case
+    {
+        StrView hex;
+        B ok;
+    };
+
+    static const Case cases[] =
+    {
+        // ":path: a", Huffman coded, then with bad padding: zeros, more than
+        // seven bits of ones, and the 30 bit EOS code.
+        { "0481 1f", true },
+        { "0481 18", false },
+        { "0482 1fff", false },
+        { "0484 ffff ffff", false },
+        // Index 0 and indices past both tables.
+        { "80", false },
+        { "be", false },
+        { "ff80 01", false },
+        // Prefix integers: truncated, five continuation bytes that end, and
+        // more continuation bytes than any accepted value needs, even when
+        // they only carry zeros.
+        { "ff", false },
+        { "ff80", false },
+        { "ffff ffff ff7f", false },
+        { "ff80 8080 8080 01", false },
+        { "0f80 8080 8080 8001", false },
+        { "3f80 8080 8000", true },
+        { "3f80 8080 8080 00", false },
+        // String lengths past the block.
+        { "047f ffff ff0f", false },
+        { "0405 6162", false },
+        { "0085 6162 6364 6501 61", true },
+        { "0081", false },
+        // Size updates: above the settings, huge, after a field, and two in a
+        // row before the first field.
+        { "3fe2 1f", false },
+        { "3fff ffff ff0f", false },
+        { "8220", false },
+        { "203f e11f 82", true }
+    };
+
+    for (auto& test : cases)
+    {
+        HpackDecoder decoder;
+        Vec<HeaderField> fields;
+        auto ok = Decode(&decoder, FromHex(test.hex), fields);
+        if (ok != test.ok)
+        {
+            printf("\"%.*s\" decoded to %u\n", (I)test.hex.size(), test.hex.data(), ok);
+        }
+        M_CHECK(ok == test.ok);
+    }
+
+    // The size the settings allow is the limit.
+    HpackDecoder decoder;
+    Vec<HeaderField> fields;
+    decoder.SetMaxTableSize(100);
+    M_CHECK(!Decode(&decoder, FromHex("3f46"), fields));
+    M_CHECK(Decode(&decoder, FromHex("3f45"), fields));
+}
+
+
+// A block of one byte references to a large table entry is refused once
+// the list it expands to passes the limit, not after it is decoded.
+static auto CheckListSize() -> void
+{
+    HpackDecoder decoder;
+    Vec<HeaderField> fields;
+
+    // 4000 bytes inserted under the name x, then referenced as entry 62.
+    auto insert = FromHex("4001 787f a11e") + Str(4000, 'v');
+    M_CHECK(Decode(&decoder, insert, fields));
+    M_CHECK(fields.size() == 1 && fields[0].value.size() == 4000);
+
+    // 60000 references would be 240 MB of fields.
+    auto copy = decoder;
+    M_CHECK(!Decode(&copy, Str(60000, (C)0xbe), fields));
+    M_CHECK(fields.size() <= maxListSize / 4033 + 1);
+
+    // The limit is inclusive: 16 copies are 16 * 4033 bytes.
+    copy = decoder;
+    M_CHECK(Decode(&copy, Str(16, (C)0xbe), fields, 16 * 4033));
+    M_CHECK(fields.size() == 16);
+    copy = decoder;
+    M_CHECK(!Decode(&copy, Str(16, (C)0xbe), fields, 16 * 4033 - 1));
+
+    // Literals count the same way.
+    M_CHECK(!Decode(&decoder, FromHex("0001 787f a11e") + Str(4000, 'v'), fields, 4032));
+}
+
+
+static constexpr StrView names[] =
+{
+    ":status",
+    "content-type",
+    "cache-control",
+    "etag",
+    "set-cookie",
+    "authorization",
+    "content-length",
+    "x-request-id",
+    "x-trace"
+};
+
+
+static auto RandomValue(TestRandom* random) -> Str
+{
+    static constexpr StrView common[] = { "200", "text/html", "no-cache", "gzip", "" };
+    if (random->OneIn(3))
+    {
+        return Str(common[random->Below(5)]);
+    }
+
+    Str value(random->Below(random->OneIn(20)? 5000 : 40), ' ');
+    auto binary = random->OneIn(10);
+    for (auto& c : value)
+    {
+        c = binary? (C)random->Below(256) : (C)('!' + random->Below(94));
+    }
+    return value;
+}
+
+
+static auto RandomTableSize(TestRandom* random) -> U32
+{
+    static constexpr U32 sizes[] = { 0, 40, 100, 256, 1000, 4096 };
+    return sizes[random->Below(6)];
+}
+
+
+// A connection's worth of blocks, decoded as encoded, with random
+// mutations tried on copies of the decoder.
+static auto RoundTrip(U64 seed, U64 iteration, TestRandom* random) -> void
+{
+    HpackEncoder encoder;
+    HpackDecoder decoder;
+    Vec<HeaderField> fields;
+
+    auto blockCount = 1 + random->Below(20);
+    for (U32 b = 0; b < blockCount; ++b)
+    {
+        if (random->OneIn(5))
+        {
+            auto size = RandomTableSize(random);
+            decoder.SetMaxTableSize(size);
+            encoder.SetMaxTableSize(size);
+        }
+
+        Vec<HeaderField> sent(random->Below(12));
+        for (auto& field : sent)
+        {
+            field.name = Str(names[random->Below(9)]);
+            field.value = RandomValue(random);
+        }
+
+        Str block;
+        encoder.BeginBlock(block);
+        for (auto& field : sent)
+        {
+            encoder.Encode(field.name, field.value, block);
+        }
+
+        for (U32 m = 0; m < 4; ++m)
+        {
+            auto mutated = block;
+            if (mutated.empty() || random->OneIn(4))
+            {
+                mutated.push_back((C)random->Below(256));
+            }
+            else if (random->OneIn(3))
+            {
+                mutated.resize(random->Below((U32)mutated.size()));
+            }
+            else
+            {
+                mutated[random->Below((U32)mutated.size())] ^= (C)(1 + random->Below(255));
+            }
+
+            auto probe = decoder;
+            Vec<HeaderField> ignored;
+            Decode(&probe, mutated, ignored);
+        }
+
+        auto ok = Decode(&decoder, block, fields);
+        auto same = ok && fields.size() == sent.size();
+        for (Size i = 0; same && i < sent.size(); ++i)
+        {
+            same = fields[i].name == sent[i].name && fields[i].value == sent[i].value;
+        }
+        if (!same)
+        {
+            printf(
+                    "seed %llu iteration %llu block %u: \"%s\" did not round trip\n",
+                    (unsigned long long)seed,
+                    (unsigned long long)iteration,
+                    b,
+                    Escape(block).c_str()
+                  );
+            M_CHECK(same);
+            return;
+        }
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    auto seed = (argc > 1)? std::strtoull(argv[1], nullptr, 10) : 1;
+    auto iterations = (argc > 2)? std::strtoull(argv[2], nullptr, 10) : 5000;
+
+    CheckRequestExamples();
+    CheckResponseExamples();
+    CheckTable();
+    CheckMalformed();
+    CheckListSize();
+
+    TestRandom random(seed);
+    for (U64 i = 0; i < iterations && checkFailures < 10; ++i)
+    {
+        RoundTrip(seed, i, &random);
+    }
+
+    printf("%llu connections\n", (unsigned long long)iterations);
+
+    return CheckResult();
+}
@@ -0,0 +1,501 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// HTTP/2 header block regression cases and a frame fuzz.
+//
+//   min-server-test-http2 [seed] [iterations]
+//
+// Sessions run on connections without sockets: frames are written to the
+// receive buffer and the session's frames read back from the send buffer.
+// Header blocks split over CONTINUATION frames reach the stream handler,
+// CONTINUATION floods end in GOAWAY once the block passes
+// maxHeaderListSize, and frames between the parts of a block are refused.
+// Random and mutated frames, arriving a few bytes at a time, must leave
+// GOAWAY as the last frame of a failed session.
+
+#include "Check.hpp"
+#include "Http2.hpp"
+
+#include <cstring>
+
+
+static constexpr StrView clientPreface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+static constexpr U8 dataFrame = 0x0;
+static constexpr U8 headersFrame = 0x1;
+static constexpr U8 settingsFrame = 0x4;
+static constexpr U8 pingFrame = 0x6;
+static constexpr U8 goAwayFrame = 0x7;
+static constexpr U8 windowUpdateFrame = 0x8;
+static constexpr U8 continuationFrame = 0x9;
+
+static constexpr U8 endStreamFlag = 0x1;
+static constexpr U8 endHeadersFlag = 0x4;
+
+static constexpr U32 protocolError = 0x1;
+static constexpr U32 compressionError = 0x9;
+static constexpr U32 enhanceYourCalmError = 0xb;
+
+
+// Only allocates the streams' connections, it is never polled.
+static mg_mgr mgr;
+
+// What the last stream handler received, as HTTP/1.1.
+static Str lastRequest;
+
+
+static auto OnStreamEvent(mg_connection* c, I ev, void*, void*) -> void
+{
+    if (ev != MG_EV_READ)
+    {
+        return;
+    }
+
+    StrView received((CStr)c->recv.buf, c->recv.len);
+    if (received.find("\r\n\r\n") == StrView::npos)
+    {
+        return;
+    }
+
+    lastRequest.assign(received);
+    c->recv.len = 0;
+    mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok");
+}
+
+
+static auto Admit(mg_connection*) -> B
+{
+    return true;
+}
+
+
+struct Frame
+{
+    U8 type;
+    U8 flags;
+    U32 streamId;
+    Str payload;
+};
+
+
+static auto FrameBytes(U8 type, U8 flags, U32 streamId, StrView payload) -> Str
+{
+    auto length = (U32)payload.size();
+    C header[9] =
+    {
+        (C)(length >> 16), (C)(length >> 8), (C)length, (C)type, (C)flags,
+        (C)(streamId >> 24), (C)(streamId >> 16), (C)(streamId >> 8), (C)streamId
+    };
+    return Str(header, sizeof(header)) + Str(payload);
+}
+
+
+static auto ReadU32(StrView bytes) -> U32
+{
+    auto p = (const U8*)bytes.data();
+    return ((U32)p[0] << 24) | ((U32)p[1] << 16) | ((U32)p[2] << 8) | p[3];
+}
+
+
+// One client connection, preface and SETTINGS already sent.
+class TestConnection
+{
+public:
+    explicit TestConnection(Http2Gateway* gateway) :
+        gateway(gateway),
+        c(mg_alloc_conn(&mgr))
+    {
+        c->fn = OnStreamEvent;
+        session = gateway->Open(c);
+        Receive(Str(clientPreface) + FrameBytes(settingsFrame, 0, 0, ""));
+    }
+
+    ~TestConnection()
+    {
+        gateway->OnEvent(session, MG_EV_CLOSE, nullptr);
+        mg_iobuf_free(&c->recv);
+        mg_iobuf_free(&c->send);
+        mg_free_conn(c);
+    }
+
+    // Bytes from the client, delivered `readSize` at a time, 0 for at once.
+    void Receive(StrView bytes, Size readSize = 0)
+    {
+        for (Size at = 0; at < bytes.size();)
+        {
+            auto n = (readSize == 0)? bytes.size() : std::min(readSize, bytes.size() - at);
+            mg_iobuf_add(&c->recv, c->recv.len, bytes.data() + at, n);
+            gateway->OnEvent(session, MG_EV_READ, nullptr);
+            at += n;
+        }
+    }
+
+    void Send(U8 type, U8 flags, U32 streamId, StrView payload)
+    {
+        Receive(FrameBytes(type, flags, streamId, payload));
+    }
+
+    void Poll()
+    {
+        auto nowMs = (U64)mg_millis();
+        gateway->OnEvent(session, MG_EV_POLL, &nowMs);
+    }
+
+    // The frames sent since the last call, false if they were not well
+    // formed.
+    B TakeFrames(Vec<Frame>& frames)
+    {
+        frames.clear();
+        StrView sent((CStr)c->send.buf, c->send.len);
+        auto ok = true;
+        while (sent.size() >= 9)
+        {
+            auto header = (const U8*)sent.data();
+            auto length = ((U32)header[0] << 16) | ((U32)header[1] << 8) | header[2];
+            if (length > 16384 || sent.size() < 9 + length)
+            {
+                ok = false;
+                break;
+            }
+            frames.push_back({ header[3], header[4], ReadU32(sent.substr(5)) & 0x7fffffff, Str(sent.substr(9, length)) });
+            sent.remove_prefix(9 + length);
+        }
+        c->send.len = 0;
+        return ok && sent.empty();
+    }
+
+    B IsDraining() const
+    {
+        return c->is_draining;
+    }
+
+    Size GetPendingBytes() const
+    {
+        return c->recv.len;
+    }
+
+    U32 GetStreamCount() const
+    {
+        return session->GetStreamCount();
+    }
+
+private:
+    Http2Gateway* gateway;
+    mg_connection* c;
+    Http2Session* session;
+};
+
+
+// The error code of the GOAWAY among the frames, -1 without one.
+static auto GoAwayError(const Vec<Frame>& frames) -> I64
+{
+    for (auto& frame : frames)
+    {
+        if (frame.type == goAwayFrame && frame.payload.size() >= 8)
+        {
+            return ReadU32(StrView(frame.payload).substr(4));
+        }
+    }
+    return -1;
+}
+
+
+static auto RequestBlock(HpackEncoder* encoder, StrView path) -> Str
+{
+    Str block;
+    encoder->BeginBlock(block);
+    encoder->Encode(":method", "GET", block);
+    encoder->Encode(":scheme", "https", block);
+    encoder->Encode(":path", path, block);
+    encoder->Encode(":authority", "example.com", block);
+    encoder->Encode("user-agent", "min-server-test", block);
+    return block;
+}
+
+
+static auto CheckResponse(const Vec<Frame>& frames, U32 streamId) -> B
+{
+    auto headers = false;
+    Str body;
+    auto ended = false;
+    for (auto& frame : frames)
+    {
+        if (frame.streamId != streamId)
+        {
+            continue;
+        }
+        headers = headers || frame.type == headersFrame;
+        if (frame.type == dataFrame)
+        {
+            body += frame.payload;
+            ended = (frame.flags & endStreamFlag) != 0;
+        }
+    }
+    return headers && body == "ok" && ended;
+}
+
+
+static auto CheckHeaderBlocks() -> void
+{
+    Http2Gateway gateway;
+    gateway.Start(60000, Admit);
+    Vec<Frame> frames;
+
+    // In one HEADERS frame.
+    {
+        TestConnection connection(&gateway);
+        HpackEncoder encoder;
+        M_CHECK(connection.TakeFrames(frames));
+
+        connection.Send(headersFrame, endHeadersFlag | endStreamFlag, 1, RequestBlock(&encoder, "/a"));
+        M_CHECK(lastRequest == "GET /a HTTP/1.1\r\nHost: example.com\r\nuser-agent: min-server-test\r\n\r\n");
+        M_CHECK(connection.TakeFrames(frames));
+        M_CHECK(CheckResponse(frames, 1));
+        M_CHECK(GoAwayError(frames) == -1);
+    }
+
+    // Split over CONTINUATION frames a byte or two each, arriving a few
+    // bytes at a time.
+    {
+        TestConnection connection(&gateway);
+        HpackEncoder encoder;
+        auto block = RequestBlock(&encoder, "/split");
+
+        Str bytes = FrameBytes(headersFrame, endStreamFlag, 3, StrView(block).substr(0, 3));
+        for (Size at = 3; at < block.size(); at += 2)
+        {
+            auto last = at + 2 >= block.size();
+            bytes += FrameBytes(continuationFrame, last? endHeadersFlag : 0, 3, StrView(block).substr(at, 2));
+        }
+        connection.Receive(bytes, 5);
+
+        M_CHECK(lastRequest.starts_with("GET /split HTTP/1.1\r\n"));
+        M_CHECK(connection.TakeFrames(frames));
+        M_CHECK(CheckResponse(frames, 3));
+        M_CHECK(GoAwayError(frames) == -1);
+    }
+}
+
+
+static auto CheckContinuationFloods() -> void
+{
+    Http2Gateway gateway;
+    gateway.Start(60000, Admit);
+    Vec<Frame> frames;
+    Str filler(16384, 'x');
+
+    // Full CONTINUATION frames that never end the block, refused once it
+    // passes maxHeaderListSize and not buffered past it.
+    {
+        TestConnection connection(&gateway);
+        connection.Send(headersFrame, 0, 1, filler);
+
+        Str flood;
+        for (U32 i = 0; i < 64; ++i)
+        {
+            flood += FrameBytes(continuationFrame, 0, 1, filler);
+        }
+        connection.Receive(flood, 4096);
+
+        M_CHECK(connection.TakeFrames(frames));
+        M_CHECK(GoAwayError(frames) == enhanceYourCalmError);
+        M_CHECK(frames.back().type == goAwayFrame);
+        M_CHECK(connection.IsDraining());
+        M_CHECK(connection.GetPendingBytes() == 0);
+        M_CHECK(connection.GetStreamCount() == 0);
+    }
+
+    // The limit follows the options.
+    auto options = gateway.GetOptions();
+    options.maxHeaderListSize = 1000;
+    gateway.SetOptions(options);
+    {
+        TestConnection connection(&gateway);
+        connection.Send(headersFrame, 0, 1, Str(600, 'x'));
+        M_CHECK(connection.TakeFrames(frames));
+        M_CHECK(GoAwayError(frames) == -1);
+
+        connection.Send(continuationFrame, endHeadersFlag, 1, Str(600, 'x'));
+        M_CHECK(connection.TakeFrames(frames));
+        M_CHECK(GoAwayError(frames) == enhanceYourCalmError);
+    }
+    {
+        TestConnection connection(&gateway);
+        connection.Send(headersFrame, endHeadersFlag, 1, Str(1001, 'x'));
+        M_CHECK(connection.TakeFrames(frames));
+        M_CHECK(GoAwayError(frames) == enhanceYourCalmError);
+    }
+    options.maxHeaderListSize = Http2Options().maxHeaderListSize;
+    gateway.SetOptions(options);
+
+    // Nothing may come between the frames of a block.
+    {
+        TestConnection connection(&gateway);
+        HpackEncoder encoder;
+        auto block = RequestBlock(&encoder, "/");
+        connection.Send(headersFrame, endStreamFlag, 1, StrView(block).substr(0, 4));
+        connection.Send(pingFrame, 0, 0, Str(8, '\0'));
+        M_CHECK(connection.TakeFrames(frames));
+        M_CHECK(GoAwayError(frames) == protocolError);
+
+        // Not acted on after the GOAWAY.
+        connection.Send(continuationFrame, endHeadersFlag, 1, StrView(block).substr(4));
+        M_CHECK(connection.TakeFrames(frames));
+        M_CHECK(frames.empty());
+        M_CHECK(connection.GetStreamCount() == 0);
+    }
+    {
+        TestConnection connection(&gateway);
+        HpackEncoder encoder;
+        auto block = RequestBlock(&encoder, "/");
+        connection.Send(headersFrame, endStreamFlag, 1, StrView(block).substr(0, 4));
+        connection.Send(continuationFrame, endHeadersFlag, 3, StrView(block).substr(4));
+        M_CHECK(connection.TakeFrames(frames));
+        M_CHECK(GoAwayError(frames) == protocolError);
+    }
+    {
+        TestConnection connection(&gateway);
+        connection.Send(continuationFrame, endHeadersFlag, 1, "\x82");
+        M_CHECK(connection.TakeFrames(frames));
+        M_CHECK(GoAwayError(frames) == protocolError);
+    }
+
+    // A block HPACK can't decode ends the connection, its table is lost.
+    {
+        TestConnection connection(&gateway);
+        connection.Send(headersFrame, endHeadersFlag | endStreamFlag, 1, "\x80");
+        M_CHECK(connection.TakeFrames(frames));
+        M_CHECK(GoAwayError(frames) == compressionError);
+    }
+}
+
+
+static constexpr U8 frameTypes[] =
+{
+    dataFrame, headersFrame, 0x2, 0x3, settingsFrame, 0x5, pingFrame, goAwayFrame, windowUpdateFrame,
+    continuationFrame, 0x10, 0xfa
+};
+
+
+static auto FuzzBytes(TestRandom* random, U32 length) -> Str
+{
+    Str bytes(length, '\0');
+    for (auto& c : bytes)
+    {
+        c = (C)random->Below(256);
+    }
+    return bytes;
+}
+
+
+// Requests split into random CONTINUATION frames among random frames, with
+// some of each mutated.
+static auto Fuzz(U64 seed, U64 iteration, TestRandom* random, Http2Gateway* gateway) -> void
+{
+    TestConnection connection(gateway);
+    HpackEncoder encoder;
+    Vec<Frame> frames;
+    Str bytes;
+    U32 streamId = 1;
+
+    auto count = 1 + random->Below(30);
+    for (U32 i = 0; i < count; ++i)
+    {
+        if (random->OneIn(2))
+        {
+            auto block = RequestBlock(&encoder, random->OneIn(2)? "/" : "/index.html");
+            if (random->OneIn(8))
+            {
+                block[random->Below((U32)block.size())] ^= (C)(1 + random->Below(255));
+            }
+
+            auto end = random->OneIn(2)? endStreamFlag : 0;
+            Size at = std::min<Size>(block.size(), random->Below((U32)block.size() + 1));
+            bytes += FrameBytes(headersFrame, end | (at == block.size()? endHeadersFlag : 0), streamId, block.substr(0, at));
+            while (at < block.size())
+            {
+                auto n = std::min<Size>(block.size() - at, 1 + random->Below(8));
+                auto id = random->OneIn(30)? streamId + 2 : streamId;
+                auto flags = (at + n == block.size())? endHeadersFlag : 0;
+                bytes += FrameBytes(continuationFrame, (U8)flags, id, StrView(block).substr(at, n));
+                at += n;
+            }
+            if (end == 0 && random->OneIn(2))
+            {
+                bytes += FrameBytes(dataFrame, endStreamFlag, streamId, FuzzBytes(random, random->Below(100)));
+            }
+            streamId += random->OneIn(10)? 0 : 2;
+        }
+        else
+        {
+            auto type = frameTypes[random->Below(sizeof(frameTypes))];
+            auto id = random->OneIn(3)? 0 : random->Below(streamId + 2);
+            bytes += FrameBytes(type, (U8)random->Below(256), id, FuzzBytes(random, random->Below(40)));
+        }
+    }
+
+    if (random->OneIn(4))
+    {
+        bytes[random->Below((U32)bytes.size())] ^= (C)(1 + random->Below(255));
+    }
+
+    connection.Receive(bytes, 1 + random->Below(64));
+    connection.Poll();
+
+    auto ok = connection.TakeFrames(frames);
+    for (Size i = 0; ok && i < frames.size(); ++i)
+    {
+        // Nothing follows the GOAWAY of a failed session.
+        auto error = GoAwayError({ frames[i] });
+        ok = error <= 0 || i + 1 == frames.size();
+    }
+    if (!ok)
+    {
+        printf(
+                "seed %llu iteration %llu: \"%s\"\n",
+                (unsigned long long)seed,
+                (unsigned long long)iteration,
+                Escape(bytes).c_str()
+              );
+    }
+    M_CHECK(ok);
+}
+
+
+int main(int argc, char** argv)
+{
+    auto seed = (argc > 1)? std::strtoull(argv[1], nullptr, 10) : 1;
+    auto iterations = (argc > 2)? std::strtoull(argv[2], nullptr, 10) : 20000;
+
+    mg_log_set(MG_LL_NONE);
+
+    CheckHeaderBlocks();
+    CheckContinuationFloods();
+
+    Http2Gateway gateway;
+    gateway.Start(60000, Admit);
+    TestRandom random(seed);
+    for (U64 i = 0; i < iterations && checkFailures < 10; ++i)
+    {
+        Fuzz(seed, i, &random, &gateway);
+    }
+
+    printf("%llu connections\n", (unsigned long long)iterations);
+
+    return CheckResult();
+}
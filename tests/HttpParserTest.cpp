@@ -0,0 +1,411 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// Differential fuzz of the request parser against mongoose's.
+//
+//   min-server-test-http-parser [seed] [iterations]
+//
+// Generated requests, with bare LF line ends, obs-fold lines, more headers
+// than MG_MAX_HTTP_HEADERS and mutated bytes among them, must give the same
+// result and the same message from ParseHttpMessage as from mg_http_parse,
+// whole and fed to HttpParser::Parse a few bytes at a time.
+
+#include "Check.hpp"
+#include "HttpParser.hpp"
+
+#include <cstring>
+
+
+static constexpr StrView knownNames[] =
+{
+    "Host",
+    "Cookie",
+    "Accept-Encoding",
+    "Range",
+    "If-Range",
+    "If-None-Match",
+    "If-Modified-Since",
+    "Content-Length",
+    "Content-Type",
+    "Connection",
+    "Upgrade",
+    "Expect"
+};
+
+static constexpr StrView otherNames[] =
+{
+    "User-Agent",
+    "Accept",
+    "X-Forwarded-For",
+    "Hots",
+    "Rang",
+    "Content-Lengthy",
+    "Cookie2",
+    "If-Match",
+    "Sec-WebSocket-Key",
+    "A"
+};
+
+
+static auto Pick(TestRandom* random, std::initializer_list<StrView> choices) -> StrView
+{
+    return *(choices.begin() + random->Below((U32)choices.size()));
+}
+
+
+static auto RandomCase(TestRandom* random, StrView name) -> Str
+{
+    Str result(name);
+    if (random->OneIn(3))
+    {
+        for (auto& c : result)
+        {
+            if (random->OneIn(2) && ((c | 0x20) >= 'a' && (c | 0x20) <= 'z'))
+            {
+                c ^= 0x20;
+            }
+        }
+    }
+    return result;
+}
+
+
+static auto LineEnd(TestRandom* random) -> StrView
+{
+    // Bare LF is accepted by both, and a lone CR now and then.
+    auto n = random->Below(20);
+    return (n < 14)? "\r\n" : (n < 19)? "\n" : "\r";
+}
+
+
+static auto GenerateRequest(TestRandom* random) -> Str
+{
+    Str request;
+
+    request += Pick(random, { "GET", "POST", "PUT", "HEAD", "DELETE", "get", "HTTP/1.1", "M" });
+    request += Pick(random, { " ", " ", " ", "  ", "" });
+    request += Pick(random, { "/", "/index.html", "/a/b?x=1&y=2", "/?", "*", "/%20?q", "", "/res/app.wasm" });
+    request += Pick(random, { " ", " ", "  ", "" });
+    request += Pick(random, { "HTTP/1.1", "HTTP/1.1", "HTTP/1.0", "", "204 No Content", "HTTP/1.1 " });
+    request += LineEnd(random);
+
+    // Past MG_MAX_HTTP_HEADERS now and then.
+    auto headerCount = random->OneIn(8)? 25 + random->Below(20) : random->Below(12);
+    for (U32 i = 0; i < headerCount; ++i)
+    {
+        auto kind = random->Below(16);
+        if (kind == 0)
+        {
+            // obs-fold, a continuation of the previous value.
+            request += Pick(random, { " folded", "\tfolded", "  more: text" });
+        }
+        else if (kind == 1)
+        {
+            // No colon, or no name.
+            request += Pick(random, { "NoColon", ": value", ":", " : x" });
+        }
+        else
+        {
+            auto name = (kind < 10)?
+                knownNames[random->Below(std::size(knownNames))] :
+                otherNames[random->Below(std::size(otherNames))];
+            request += RandomCase(random, name);
+            request += Pick(random, { ": ", ":", " : ", ":  ", ": " });
+
+            if (name == "Content-Length")
+            {
+                request += Pick(random, { "0", "5", "12", "abc", "-1", "99999999999999999999", "" });
+            }
+            else
+            {
+                request += Pick(random, { "value", "a, b;q=0.5", "", "x:y", "bytes=0-1,5-", "  spaced  ", "\"etag\"" });
+            }
+        }
+        request += LineEnd(random);
+    }
+
+    auto ending = random->Below(10);
+    if (ending < 8)
+    {
+        request += LineEnd(random);
+    }
+    // Incomplete otherwise.
+
+    if (random->OneIn(3))
+    {
+        request += Pick(random, { "body", "GET / HTTP/1.1\r\n\r\n", "\r\n", "hello world" });
+    }
+
+    // Bytes a header block may not contain, and others.
+    auto mutations = random->OneIn(4)? 1 + random->Below(3) : 0;
+    for (U32 i = 0; i < mutations && !request.empty(); ++i)
+    {
+        auto at = random->Below((U32)request.size());
+        auto what = random->Below(4);
+        if (what == 0)
+        {
+            request[at] = (C)random->Below(256);
+        }
+        else if (what == 1)
+        {
+            request[at] = Pick(random, { "\n", "\r", " ", ":", "?", "\t" })[0];
+        }
+        else if (what == 2)
+        {
+            request.insert(request.begin() + at, (C)random->Below(32));
+        }
+        else
+        {
+            request.erase(at, 1);
+        }
+    }
+
+    return request;
+}
+
+
+static auto SameStr(const mg_str& a, const mg_str& b) -> B
+{
+    return a.len == b.len && (a.len == 0 || a.ptr == b.ptr);
+}
+
+
+static auto SameMessage(const mg_http_message& a, const mg_http_message& b) -> B
+{
+    auto same =
+        SameStr(a.method, b.method) &&
+        SameStr(a.uri, b.uri) &&
+        SameStr(a.query, b.query) &&
+        SameStr(a.proto, b.proto) &&
+        SameStr(a.body, b.body) &&
+        SameStr(a.head, b.head) &&
+        SameStr(a.chunk, b.chunk) &&
+        SameStr(a.message, b.message);
+
+    for (U32 i = 0; same && i < MG_MAX_HTTP_HEADERS; ++i)
+    {
+        same = SameStr(a.headers[i].name, b.headers[i].name) && SameStr(a.headers[i].value, b.headers[i].value);
+    }
+
+    return same;
+}
+
+
+// The known header lookup against mg_http_get_header, for the message
+// parsed last.
+static auto SameKnownHeaders(mg_http_message* parsed, mg_http_message* reference) -> B
+{
+    for (U32 i = 0; i < (U32)KnownHeader::Count; ++i)
+    {
+        auto found = FindHeader(parsed, (KnownHeader)i);
+        auto expected = mg_http_get_header(reference, knownNames[i].data());
+        if ((found == nullptr) != (expected == nullptr) || (found != nullptr && !SameStr(*found, *expected)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static auto Report(U64 seed, U64 iteration, StrView what, StrView input) -> void
+{
+    printf(
+            "seed %llu iteration %llu: %.*s\n  \"%s\"\n",
+            (unsigned long long)seed,
+            (unsigned long long)iteration,
+            (I)what.size(),
+            what.data(),
+            Escape(input).c_str()
+          );
+}
+
+
+static auto CheckWhole(U64 seed, U64 iteration, const Str& input) -> B
+{
+    auto buf = input.data();
+    auto len = input.size();
+
+    mg_http_message expected;
+    auto expectedResult = mg_http_parse(buf, len, &expected);
+
+    auto end = FindHeaderEnd((const U8*)buf, len, 0);
+    if (end != mg_http_get_request_len((const unsigned char*)buf, len))
+    {
+        Report(seed, iteration, "FindHeaderEnd differs from mg_http_get_request_len", input);
+        return false;
+    }
+
+    mg_http_message parsed;
+    auto result = ParseHttpMessage(buf, len, 0, &parsed);
+    if (result != expectedResult || !SameMessage(parsed, expected))
+    {
+        Report(seed, iteration, "ParseHttpMessage differs from mg_http_parse", input);
+        return false;
+    }
+    if (result > 0 && !SameKnownHeaders(&parsed, &expected))
+    {
+        Report(seed, iteration, "FindHeader differs from mg_http_get_header", input);
+        return false;
+    }
+
+    return true;
+}
+
+
+// The input arrives in random pieces, as from a socket. Every read parses
+// the receive buffer through the connection's HttpParser, resuming the
+// search for the header block end.
+static auto CheckSplit(U64 seed, U64 iteration, TestRandom* random, const Str& input) -> B
+{
+    HttpParser parser;
+    mg_connection c = {};
+    U32 scanned = 0;
+
+    Size received = 0;
+    while (received < input.size())
+    {
+        received = std::min(input.size(), received + 1 + random->Below(random->OneIn(2)? 4 : 64));
+
+        // A copy the size of what arrived, so reading past it is caught by
+        // the sanitizers.
+        Vec<C> recv(input.begin(), input.begin() + received);
+        c.recv.buf = (unsigned char*)recv.data();
+        c.recv.len = recv.size();
+        c.recv.size = recv.size();
+
+        mg_http_message expected;
+        auto expectedResult = mg_http_parse(recv.data(), recv.size(), &expected);
+
+        mg_http_message parsed;
+        auto result = parser.Parse(&c, &scanned, &parsed);
+        if (result != expectedResult || !SameMessage(parsed, expected))
+        {
+            Report(seed, iteration, "HttpParser::Parse differs from mg_http_parse on a split buffer", input.substr(0, received));
+            return false;
+        }
+
+        // A second parser on the same read event gets the kept parse.
+        if (result > 0)
+        {
+            U32 ignored = 0;
+            mg_http_message again;
+            if (parser.Parse(&c, &ignored, &again) != result || !SameMessage(again, expected))
+            {
+                Report(seed, iteration, "The kept parse differs", input.substr(0, received));
+                return false;
+            }
+            if (!SameKnownHeaders(&again, &expected))
+            {
+                Report(seed, iteration, "FindHeader on the kept parse differs", input.substr(0, received));
+                return false;
+            }
+        }
+
+        parser.Forget();
+        if (result != 0)
+        {
+            break;
+        }
+    }
+
+    return true;
+}
+
+
+static auto CheckCases() -> void
+{
+    struct Case
+    {
+        StrView input;
+        I32 result;
+    };
+
+    static const Case cases[] =
+    {
+        { "GET / HTTP/1.1\r\n\r\n", 18 },
+        { "GET / HTTP/1.1\n\n", 16 },
+        { "GET / HTTP/1.1\r\nHost: a\r\n", 0 },
+        { "GET / HTTP/1.1\r\nHost: a\n folded\r\n\r\n", 35 },
+        { "GET / HTTP/1.1\r\nHo\x01st: a\r\n\r\n", -1 },
+        { "GET / HTTP/1.1\r\nHost: a\x7F\r\n\r\n", 28 },
+        { " / HTTP/1.1\r\n\r\n", -1 },
+        { "\n\n", -1 }
+    };
+
+    for (auto& test : cases)
+    {
+        Str input(test.input);
+        mg_http_message hm;
+        M_CHECK(ParseHttpMessage(input.data(), input.size(), 0, &hm) == test.result);
+        M_CHECK(CheckWhole(0, 0, input));
+    }
+
+    // The headers past MG_MAX_HTTP_HEADERS are dropped, the known ones
+    // before them are found.
+    Str many = "GET / HTTP/1.1\r\nHost: first\r\n";
+    for (U32 i = 0; i < MG_MAX_HTTP_HEADERS + 10; ++i)
+    {
+        many += "X-Header-" + std::to_string(i) + ": " + std::to_string(i) + "\r\n";
+    }
+    many += "Cookie: late\r\n\r\n";
+
+    mg_http_message hm;
+    M_CHECK(ParseHttpMessage(many.data(), many.size(), 0, &hm) == (I32)many.size());
+    auto host = FindHeader(&hm, KnownHeader::Host);
+    M_CHECK(host != nullptr && StrView(host->ptr, host->len) == "first");
+    M_CHECK(FindHeader(&hm, KnownHeader::Cookie) == nullptr);
+    M_CHECK(CheckWhole(0, 0, many));
+
+    // Resuming from any point of an incomplete block gives the same end.
+    Str pipelined = "GET /a HTTP/1.1\r\nHost: x\r\n\r\nGET /b HTTP/1.1\r\n\r\n";
+    for (Size from = 0; from <= 27; ++from)
+    {
+        M_CHECK(FindHeaderEnd((const U8*)pipelined.data(), pipelined.size(), from) == 28);
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    auto seed = (argc > 1)? std::strtoull(argv[1], nullptr, 10) : 1;
+    auto iterations = (argc > 2)? std::strtoull(argv[2], nullptr, 10) : 200000;
+
+    CheckCases();
+
+    TestRandom random(seed);
+    U64 complete = 0;
+    for (U64 i = 0; i < iterations && checkFailures < 10; ++i)
+    {
+        auto input = GenerateRequest(&random);
+
+        M_CHECK(CheckWhole(seed, i, input));
+        M_CHECK(CheckSplit(seed, i, &random, input));
+
+        mg_http_message hm;
+        complete += mg_http_parse(input.data(), input.size(), &hm) > 0;
+    }
+
+    printf(
+            "%llu inputs, %llu complete requests among them\n",
+            (unsigned long long)iterations,
+            (unsigned long long)complete
+          );
+
+    return CheckResult();
+}
@@ -708,12 +708,13 @@ size_t mg_vxprintf(void (*out)(char, void *), void *param, const char *fmt,
 
 
 struct mg_fd *mg_fs_open(struct mg_fs *fs, const char *path, int flags) {
-  struct mg_fd *fd = (struct mg_fd *) calloc(1, sizeof(*fd));
+  struct mg_fd *fd = (struct mg_fd *) mg_alloc(sizeof(*fd));
   if (fd != NULL) {
     fd->fd = fs->op(path, flags);
     fd->fs = fs;
     if (fd->fd == NULL) {
-      free(fd);
+      memset(fd, 0, sizeof(*fd));
+      mg_dealloc(fd, sizeof(*fd));
       fd = NULL;
     }
   }
@@ -723,7 +724,8 @@ struct mg_fd *mg_fs_open(struct mg_fs *fs, const char *path, int flags) {
 void mg_fs_close(struct mg_fd *fd) {
   if (fd != NULL) {
     fd->fs->cl(fd->fd);
-    free(fd);
+    memset(fd, 0, sizeof(*fd));
+    mg_dealloc(fd, sizeof(*fd));
   }
 }
 
@@ -907,7 +909,8 @@ static bool ff_mkdir(const char *path) {
 }
 
 struct mg_fs mg_fs_fat = {ff_stat,  ff_list, ff_open,   ff_close,  ff_read,
-                          ff_write, ff_seek, ff_rename, ff_remove, ff_mkdir};
+                          ff_write, ff_seek, ff_rename, ff_remove, ff_mkdir,
+                          NULL};
 #endif
 
 #ifdef MG_ENABLE_LINES
@@ -1029,7 +1032,8 @@ static bool packed_mkdir(const char *path) {
 
 struct mg_fs mg_fs_packed = {
     packed_stat,  packed_list, packed_open,   packed_close,  packed_read,
-    packed_write, packed_seek, packed_rename, packed_remove, packed_mkdir};
+    packed_write, packed_seek, packed_rename, packed_remove, packed_mkdir,
+    NULL};
 
 #ifdef MG_ENABLE_LINES
 #line 1 "src/fs_posix.c"
@@ -1282,7 +1286,8 @@ static bool p_mkdir(const char *path) {
 #endif
 
 struct mg_fs mg_fs_posix = {p_stat,  p_list, p_open,   p_close,  p_read,
-                            p_write, p_seek, p_rename, p_remove, p_mkdir};
+                            p_write, p_seek, p_rename, p_remove, p_mkdir,
+                            NULL};
 
 #ifdef MG_ENABLE_LINES
 #line 1 "src/http.c"
@@ -1650,7 +1655,11 @@ static void static_cb(struct mg_connection *c, int ev, void *ev_data,
     n = fd->fs->rd(fd->fd, c->send.buf + c->send.len, space);
     c->send.len += n;
     *cl -= n;
-    if (n == 0) restore_http_cb(c);
+    if (n == 0) {
+      // File shrank under us, the response can not be completed
+      if (*cl > 0) c->is_draining = 1;
+      restore_http_cb(c);
+    }
   } else if (ev == MG_EV_CLOSE) {
     restore_http_cb(c);
   }
@@ -1718,6 +1727,10 @@ static struct mg_str guess_content_type(struct mg_str path, const char *extra) {
   return mg_str("text/plain; charset=utf-8");
 }
 
+struct mg_str mg_http_content_type(struct mg_str path, const char *mime_types) {
+  return guess_content_type(path, mime_types);
+}
+
 static int getrange(struct mg_str *s, int64_t *a, int64_t *b) {
   size_t i, numparsed = 0;
   // MG_INFO(("%.*s", (int) s->len, s->ptr));
@@ -1771,7 +1784,8 @@ void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
     mg_http_reply(c, 404, opts->extra_headers, "Not found\n");
     mg_fs_close(fd);
     // NOTE: mg_http_etag() call should go first!
-  } else if (mg_http_etag(etag, sizeof(etag), size, mtime) != NULL &&
+  } else if (((fs->et != NULL && fs->et(path, etag, sizeof(etag))) ||
+              mg_http_etag(etag, sizeof(etag), size, mtime) != NULL) &&
              (inm = mg_http_get_header(hm, "If-None-Match")) != NULL &&
              mg_vcasecmp(inm, etag) == 0) {
     mg_fs_close(fd);
@@ -2237,13 +2251,21 @@ static void deliver_normal_chunks(struct mg_connection *c, size_t hlen,
   }
 }
 
+static mg_http_parser_t s_http_parser = NULL;
+
+void mg_http_set_parser(mg_http_parser_t fn) {
+  s_http_parser = fn;
+}
+
 static void http_cb(struct mg_connection *c, int ev, void *evd, void *fnd) {
   if (ev == MG_EV_READ || ev == MG_EV_CLOSE) {
     struct mg_http_message hm;
     // mg_hexdump(c->recv.buf, c->recv.len);
     while (c->recv.buf != NULL && c->recv.len > 0) {
       bool next = false;
-      int hlen = mg_http_parse((char *) c->recv.buf, c->recv.len, &hm);
+      int hlen = c->is_accepted && s_http_parser != NULL
+                     ? s_http_parser(c, (char *) c->recv.buf, c->recv.len, &hm)
+                     : mg_http_parse((char *) c->recv.buf, c->recv.len, &hm);
       if (hlen < 0) {
         mg_error(c, "HTTP parse:\n%.*s", (int) c->recv.len, c->recv.buf);
         break;
@@ -2312,6 +2334,15 @@ struct mg_connection *mg_http_listen(struct mg_mgr *mgr, const char *url,
   return c;
 }
 
+#if MG_ENABLE_SOCKET
+struct mg_connection *mg_http_listen_fd(struct mg_mgr *mgr, int fd,
+                                        mg_event_handler_t fn, void *fn_data) {
+  struct mg_connection *c = mg_listen_fd(mgr, fd, fn, fn_data);
+  if (c != NULL) c->pfn = http_cb;
+  return c;
+}
+#endif
+
 #ifdef MG_ENABLE_LINES
 #line 1 "src/iobuf.c"
 #endif
@@ -2331,23 +2362,48 @@ static size_t roundup(size_t size, size_t align) {
   return align == 0 ? size : (size + align - 1) / align * align;
 }
 
+static void *default_alloc(size_t size) {
+  return calloc(1, size);
+}
+
+static void default_dealloc(void *ptr, size_t size) {
+  free(ptr);
+  (void) size;
+}
+
+static mg_alloc_t s_alloc = default_alloc;
+static mg_dealloc_t s_dealloc = default_dealloc;
+
+void mg_set_allocator(mg_alloc_t alloc_fn, mg_dealloc_t dealloc_fn) {
+  s_alloc = alloc_fn;
+  s_dealloc = dealloc_fn;
+}
+
+void *mg_alloc(size_t size) {
+  return s_alloc(size);
+}
+
+void mg_dealloc(void *ptr, size_t size) {
+  if (ptr != NULL) s_dealloc(ptr, size);
+}
+
 int mg_iobuf_resize(struct mg_iobuf *io, size_t new_size) {
   int ok = 1;
   new_size = roundup(new_size, io->align);
   if (new_size == 0) {
     zeromem(io->buf, io->size);
-    free(io->buf);
+    mg_dealloc(io->buf, io->size);
     io->buf = NULL;
     io->len = io->size = 0;
   } else if (new_size != io->size) {
     // NOTE(lsm): do not use realloc here. Use calloc/free only, to ease the
     // porting to some obscure platforms like FreeRTOS
-    void *p = calloc(1, new_size);
+    void *p = mg_alloc(new_size);
     if (p != NULL) {
       size_t len = new_size < io->len ? new_size : io->len;
       if (len > 0 && io->buf != NULL) memmove(p, io->buf, len);
       zeromem(io->buf, io->size);
-      free(io->buf);
+      mg_dealloc(io->buf, io->size);
       io->buf = (unsigned char *) p;
       io->size = new_size;
     } else {
@@ -3356,7 +3412,7 @@ bool mg_aton(struct mg_str str, struct mg_addr *addr) {
 
 struct mg_connection *mg_alloc_conn(struct mg_mgr *mgr) {
   struct mg_connection *c =
-      (struct mg_connection *) calloc(1, sizeof(*c) + mgr->extraconnsize);
+      (struct mg_connection *) mg_alloc(sizeof(*c) + mgr->extraconnsize);
   if (c != NULL) {
     c->mgr = mgr;
     c->send.align = c->recv.align = MG_IO_SIZE;
@@ -3365,6 +3421,12 @@ struct mg_connection *mg_alloc_conn(struct mg_mgr *mgr) {
   return c;
 }
 
+void mg_free_conn(struct mg_connection *c) {
+  size_t size = sizeof(*c) + c->mgr->extraconnsize;
+  memset(c, 0, size);
+  mg_dealloc(c, size);
+}
+
 void mg_close_conn(struct mg_connection *c) {
   mg_resolve_cancel(c);  // Close any pending DNS query
   LIST_DELETE(struct mg_connection, &c->mgr->conns, c);
@@ -3378,8 +3440,7 @@ void mg_close_conn(struct mg_connection *c) {
   mg_tls_free(c);
   mg_iobuf_free(&c->recv);
   mg_iobuf_free(&c->send);
-  memset(c, 0, sizeof(*c));
-  free(c);
+  mg_free_conn(c);
 }
 
 struct mg_connection *mg_connect(struct mg_mgr *mgr, const char *url,
@@ -3410,7 +3471,7 @@ struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
     MG_ERROR(("OOM %s", url));
   } else if (!mg_open_listener(c, url)) {
     MG_ERROR(("Failed: %s, errno %d", url, errno));
-    free(c);
+    mg_free_conn(c);
     c = NULL;
   } else {
     c->is_listening = 1;
@@ -3461,16 +3522,21 @@ void mg_mgr_free(struct mg_mgr *mgr) {
   MG_DEBUG(("All connections closed"));
 #if MG_ENABLE_EPOLL
   if (mgr->epoll_fd >= 0) close(mgr->epoll_fd), mgr->epoll_fd = -1;
+#elif MG_ENABLE_IO_URING
+  mg_uring_free(mgr);
 #endif
 }
 
 void mg_mgr_init(struct mg_mgr *mgr) {
   memset(mgr, 0, sizeof(*mgr));
 #if MG_ENABLE_EPOLL
-  if ((mgr->epoll_fd = epoll_create1(0)) < 0) MG_ERROR(("epoll: %d", errno));
+  if ((mgr->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) MG_ERROR(("epoll: %d", errno));
 #else
   mgr->epoll_fd = -1;
 #endif
+#if MG_ENABLE_IO_URING
+  if (!mg_uring_init(mgr)) MG_ERROR(("io_uring: %d, using poll", errno));
+#endif
 #if MG_ARCH == MG_ARCH_WIN32 && MG_ENABLE_WINSOCK
   // clang-format off
   { WSADATA data; WSAStartup(MAKEWORD(2, 2), &data); }
@@ -4175,6 +4241,9 @@ static void iolog(struct mg_connection *c, char *buf, long n, bool r) {
 
 long mg_io_send(struct mg_connection *c, const void *buf, size_t len) {
   long n;
+#if MG_ENABLE_IO_URING
+  if (mg_uring_busy(c)) return MG_IO_WAIT;  // Would overtake the send buffer
+#endif
   if (c->is_udp) {
     union usa usa;
     socklen_t slen = tousa(&c->rem, &usa);
@@ -4290,6 +4359,26 @@ bool mg_open_listener(struct mg_connection *c, const char *url) {
   return success;
 }
 
+struct mg_connection *mg_listen_fd(struct mg_mgr *mgr, int fd,
+                                   mg_event_handler_t fn, void *fn_data) {
+  struct mg_connection *c = mg_alloc_conn(mgr);
+  if (c == NULL) {
+    MG_ERROR(("OOM fd %d", fd));
+  } else {
+    setlocaddr((MG_SOCKET_TYPE) fd, &c->loc);
+    mg_set_non_blocking_mode((MG_SOCKET_TYPE) fd);
+    c->fd = S2PTR(fd);
+    c->is_listening = 1;
+    MG_EPOLL_ADD(c);
+    LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
+    c->fn = fn;
+    c->fn_data = fn_data;
+    mg_call(c, MG_EV_OPEN, NULL);
+    MG_DEBUG(("%lu %p inherited", c->id, c->fd));
+  }
+  return c;
+}
+
 long mg_io_recv(struct mg_connection *c, void *buf, size_t len) {
   long n = 0;
   if (c->is_udp) {
@@ -4340,6 +4429,8 @@ static void close_conn(struct mg_connection *c) {
   if (FD(c) != MG_INVALID_SOCKET) {
 #if MG_ENABLE_EPOLL
     epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_DEL, FD(c), NULL);
+#elif MG_ENABLE_IO_URING
+    mg_uring_close(c);
 #endif
     closesocket(FD(c));
 #if MG_ENABLE_FREERTOS_TCP
@@ -4426,30 +4517,15 @@ static MG_SOCKET_TYPE raccept(MG_SOCKET_TYPE sock, union usa *usa,
   return fd;
 }
 
-static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
+static void setup_accepted_conn(struct mg_mgr *mgr, struct mg_connection *lsn,
+                                MG_SOCKET_TYPE fd, union usa *usa,
+                                socklen_t sa_len) {
   struct mg_connection *c = NULL;
-  union usa usa;
-  socklen_t sa_len = sizeof(usa);
-  MG_SOCKET_TYPE fd = raccept(FD(lsn), &usa, &sa_len);
-  if (fd == MG_INVALID_SOCKET) {
-#if MG_ARCH == MG_ARCH_AZURERTOS
-    // AzureRTOS, in non-block socket mode can mark listening socket readable
-    // even it is not. See comment for 'select' func implementation in
-    // nx_bsd.c That's not an error, just should try later
-    if (errno != EAGAIN)
-#endif
-      MG_ERROR(("%lu accept failed, errno %d", lsn->id, MG_SOCK_ERR(-1)));
-#if (MG_ARCH != MG_ARCH_WIN32) && !MG_ENABLE_FREERTOS_TCP && \
-    (MG_ARCH != MG_ARCH_TIRTOS) && !MG_ENABLE_POLL
-  } else if ((long) fd >= FD_SETSIZE) {
-    MG_ERROR(("%ld > %ld", (long) fd, (long) FD_SETSIZE));
-    closesocket(fd);
-#endif
-  } else if ((c = mg_alloc_conn(mgr)) == NULL) {
+  if ((c = mg_alloc_conn(mgr)) == NULL) {
     MG_ERROR(("%lu OOM", lsn->id));
     closesocket(fd);
   } else {
-    tomgaddr(&usa, &c->rem, sa_len != sizeof(usa.sin));
+    tomgaddr(usa, &c->rem, sa_len != sizeof(usa->sin));
     LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
     c->fd = S2PTR(fd);
     MG_EPOLL_ADD(c);
@@ -4469,6 +4545,29 @@ static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
   }
 }
 
+static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
+  union usa usa;
+  socklen_t sa_len = sizeof(usa);
+  MG_SOCKET_TYPE fd = raccept(FD(lsn), &usa, &sa_len);
+  if (fd == MG_INVALID_SOCKET) {
+#if MG_ARCH == MG_ARCH_AZURERTOS
+    // AzureRTOS, in non-block socket mode can mark listening socket readable
+    // even it is not. See comment for 'select' func implementation in
+    // nx_bsd.c That's not an error, just should try later
+    if (errno != EAGAIN)
+#endif
+      MG_ERROR(("%lu accept failed, errno %d", lsn->id, MG_SOCK_ERR(-1)));
+#if (MG_ARCH != MG_ARCH_WIN32) && !MG_ENABLE_FREERTOS_TCP && \
+    (MG_ARCH != MG_ARCH_TIRTOS) && !MG_ENABLE_POLL
+  } else if ((long) fd >= FD_SETSIZE) {
+    MG_ERROR(("%ld > %ld", (long) fd, (long) FD_SETSIZE));
+    closesocket(fd);
+#endif
+  } else {
+    setup_accepted_conn(mgr, lsn, fd, &usa, sa_len);
+  }
+}
+
 static bool mg_socketpair(MG_SOCKET_TYPE sp[2], union usa usa[2], bool udp) {
   MG_SOCKET_TYPE sock;
   socklen_t n = sizeof(usa[0].sin);
@@ -4540,7 +4639,603 @@ static bool skip_iotest(const struct mg_connection *c) {
          (can_read(c) == false && can_write(c) == false);
 }
 
+// Clock for mg_mgr::wait_us, the time mg_iotest() blocks for events
+static uint64_t mg_wait_clock(void) {
+#if MG_ARCH == MG_ARCH_UNIX
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+#else
+  return mg_millis() * 1000;
+#endif
+}
+
+#if MG_ENABLE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+// io_uring backend. Plain TCP connections run on completions: listeners
+// keep a multishot accept armed, connections a multishot recv that picks
+// buffers from a registered buffer ring, and whatever a connection has in
+// its send buffer is handed to the kernel once per iteration, all in one
+// io_uring_enter() together with the wait. TLS, UDP and connecting sockets
+// get one-shot poll requests instead and go through read_conn/write_conn.
+// Sockets are registered as fixed files, indexed by descriptor.
+
+enum { MG_URING_ACCEPT = 1, MG_URING_RECV, MG_URING_SEND, MG_URING_POLL };
+#define MG_URING_OP_MASK 7U  // user_data is mg_uring_conn pointer | op
+
+struct mg_uring_conn {
+  struct mg_connection *c;    // NULL once the connection is closed
+  struct mg_iobuf out;        // Send buffer owned by the kernel while sending
+  size_t sent;                // Bytes of `out` sent so far
+  unsigned pending;           // Requests in flight
+  unsigned pollmask;          // Events of the armed poll request
+  int fd;                     // Socket, or its fixed file index
+  unsigned is_fixed : 1;      // `fd` is a fixed file index
+  unsigned is_direct : 1;     // Reads and writes go through completions
+  unsigned is_accepting : 1;  // Multishot accept armed
+  unsigned is_receiving : 1;  // Multishot recv armed
+  unsigned is_sending : 1;    // Send in flight
+  unsigned is_polling : 1;    // Poll armed
+  unsigned is_cancelled : 1;  // Accept or recv cancel submitted
+};
+
+struct mg_uring {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_array, sq_mask, sq_entries, sq_local;
+  unsigned *cq_head, *cq_tail, cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+  struct io_uring_buf_ring *bufring;  // Provided receive buffers
+  char *bufs;
+  unsigned short bufring_tail;
+  int nfiles;       // Size of the fixed file table
+  unsigned closed;  // Closed connections with requests in flight
+};
+
+static int mg_uring_enter(int fd, unsigned n, unsigned min, unsigned flags,
+                          void *arg, size_t argsz) {
+  return (int) syscall(__NR_io_uring_enter, fd, n, min, flags, arg, argsz);
+}
+
+static int mg_uring_register(int fd, unsigned op, void *arg, unsigned n) {
+  return (int) syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+static void mg_uring_put_buf(struct mg_uring *u, unsigned short bid) {
+  struct io_uring_buf *b =
+      &u->bufring->bufs[u->bufring_tail & (MG_IO_URING_BUFS - 1)];
+  b->addr = (uint64_t) (size_t) (u->bufs + (size_t) bid * MG_IO_URING_BUF_SIZE);
+  b->len = MG_IO_URING_BUF_SIZE;
+  b->bid = bid;
+  u->bufring_tail++;
+  __atomic_store_n(&u->bufring->tail, u->bufring_tail, __ATOMIC_RELEASE);
+}
+
+static int mg_uring_submit(struct mg_uring *u, unsigned wait, void *arg) {
+  unsigned n;
+  __atomic_store_n(u->sq_tail, u->sq_local, __ATOMIC_RELEASE);
+  n = u->sq_local - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+  return mg_uring_enter(u->fd, n, wait, IORING_ENTER_GETEVENTS |
+                        (arg == NULL ? 0 : IORING_ENTER_EXT_ARG),
+                        arg, arg == NULL ? 0 : sizeof(struct io_uring_getevents_arg));
+}
+
+// Queues a request for `uc`, NULL if the submission queue stays full
+static struct io_uring_sqe *mg_uring_sqe(struct mg_uring *u,
+                                         struct mg_uring_conn *uc, unsigned op,
+                                         unsigned char opcode) {
+  struct io_uring_sqe *sqe;
+  unsigned i = u->sq_local & u->sq_mask;
+  if (u->sq_local - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+          u->sq_entries &&
+      (mg_uring_submit(u, 0, NULL) < 0 ||
+       u->sq_local - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+           u->sq_entries)) {
+    return NULL;
+  }
+  sqe = &u->sqes[i];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  if (op == 0) {
+    sqe->user_data = 0;  // Completion is ignored
+  } else {
+    sqe->fd = uc->fd;
+    sqe->flags = uc->is_fixed ? IOSQE_FIXED_FILE : 0;
+    sqe->user_data = (uint64_t) (size_t) uc | op;
+    uc->pending++;
+  }
+  u->sq_array[i] = i;
+  u->sq_local++;
+  return sqe;
+}
+
+static bool mg_uring_cancel(struct mg_uring *u, struct mg_uring_conn *uc,
+                            unsigned op) {
+  struct io_uring_sqe *sqe = mg_uring_sqe(u, NULL, 0, IORING_OP_ASYNC_CANCEL);
+  if (sqe != NULL) sqe->addr = (uint64_t) (size_t) uc | op;
+  return sqe != NULL;
+}
+
+static void mg_uring_release(struct mg_uring_conn *uc) {
+  mg_iobuf_free(&uc->out);
+  memset(uc, 0, sizeof(*uc));
+  mg_dealloc(uc, sizeof(*uc));
+}
+
+static struct mg_uring_conn *mg_uring_attach(struct mg_connection *c) {
+  struct mg_uring *u = c->mgr->uring;
+  struct mg_uring_conn *uc =
+      (struct mg_uring_conn *) mg_alloc(sizeof(*uc));
+  int fd = (int) FD(c);
+  if (uc == NULL) return NULL;
+  uc->c = c;
+  uc->fd = fd;
+  uc->out.align = MG_IO_SIZE;
+  if (fd < u->nfiles) {
+    struct io_uring_files_update up;
+    memset(&up, 0, sizeof(up));
+    up.offset = (unsigned) fd;
+    up.fds = (uint64_t) (size_t) &fd;
+    uc->is_fixed = mg_uring_register(u->fd, IORING_REGISTER_FILES_UPDATE,
+                                     &up, 1) == 1;
+  }
+  c->uring = uc;
+  return uc;
+}
+
+static void mg_uring_send(struct mg_uring *u, struct mg_uring_conn *uc) {
+  struct io_uring_sqe *sqe = mg_uring_sqe(u, uc, MG_URING_SEND, IORING_OP_SEND);
+  if (sqe == NULL) return;
+  sqe->addr = (uint64_t) (size_t) (uc->out.buf + uc->sent);
+  sqe->len = (unsigned) (uc->out.len - uc->sent);
+  sqe->msg_flags = MSG_NOSIGNAL;
+  uc->is_sending = 1;
+}
+
+// Arms what the connection needs for the next wait
+static void mg_uring_arm(struct mg_connection *c, int *ms) {
+  struct mg_uring *u = c->mgr->uring;
+  struct mg_uring_conn *uc = c->uring;
+  struct io_uring_sqe *sqe;
+  unsigned mask = 0;
+  if (uc == NULL && (uc = mg_uring_attach(c)) == NULL) return;
+
+  if (c->is_listening && !c->is_udp) {
+    // is_full pauses accepting, see mg_connection
+    if (c->is_full && uc->is_accepting && !uc->is_cancelled) {
+      uc->is_cancelled = mg_uring_cancel(u, uc, MG_URING_ACCEPT);
+    } else if (!c->is_full && !uc->is_accepting &&
+               (sqe = mg_uring_sqe(u, uc, MG_URING_ACCEPT,
+                                   IORING_OP_ACCEPT)) != NULL) {
+      sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+      sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+      uc->is_accepting = 1;
+    }
+    return;
+  }
+
+  // TLS reads the socket itself, so it stays on readiness for good
+  if (!uc->is_direct && !uc->is_polling && !c->is_tls && !c->is_udp &&
+      !c->is_connecting && !c->is_listening) {
+    uc->is_direct = 1;
+  }
+
+  if (uc->is_direct) {
+    if (c->is_full && uc->is_receiving && !uc->is_cancelled) {
+      uc->is_cancelled = mg_uring_cancel(u, uc, MG_URING_RECV);
+    } else if (!c->is_full && !uc->is_receiving &&
+               (sqe = mg_uring_sqe(u, uc, MG_URING_RECV, IORING_OP_RECV)) !=
+                   NULL) {
+      sqe->flags |= IOSQE_BUFFER_SELECT;
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->buf_group = 0;
+      uc->is_receiving = 1;
+    }
+    if (c->send.len > 0 && !uc->is_sending) {
+      // Swap in the buffer of the previous send, so that anything queued
+      // meanwhile does not move the memory the kernel is sending from
+      struct mg_iobuf tmp = uc->out;
+      uc->out = c->send;
+      c->send = tmp;
+      uc->sent = 0;
+      mg_uring_send(u, uc);
+    }
+    return;
+  }
+
+  if (mg_tls_pending(c) > 0) *ms = 0, c->is_readable = 1;
+  if (!skip_iotest(c)) {
+    if (can_read(c)) mask |= POLLIN;
+    if (can_write(c)) mask |= POLLOUT;
+  }
+  if (uc->is_polling && mask != uc->pollmask) {
+    if ((sqe = mg_uring_sqe(u, NULL, 0, IORING_OP_POLL_REMOVE)) != NULL) {
+      sqe->addr = (uint64_t) (size_t) uc | MG_URING_POLL;
+      if (mask != 0) {
+        sqe->len = IORING_POLL_UPDATE_EVENTS;
+        sqe->poll32_events = mask;
+      }
+      uc->pollmask = mask;
+    }
+  } else if (!uc->is_polling && mask != 0 &&
+             (sqe = mg_uring_sqe(u, uc, MG_URING_POLL, IORING_OP_POLL_ADD)) !=
+                 NULL) {
+    sqe->poll32_events = mask;
+    uc->pollmask = mask;
+    uc->is_polling = 1;
+  }
+}
+
+static void mg_uring_complete(struct mg_mgr *mgr, struct io_uring_cqe *cqe) {
+  struct mg_uring *u = mgr->uring;
+  struct mg_uring_conn *uc =
+      (struct mg_uring_conn *) (size_t) (cqe->user_data & ~(uint64_t) MG_URING_OP_MASK);
+  unsigned op = (unsigned) (cqe->user_data & MG_URING_OP_MASK);
+  bool more = cqe->flags & IORING_CQE_F_MORE;
+  struct mg_connection *c;
+  int res = cqe->res;
+  if (uc == NULL) return;
+  c = uc->c;
+  if (!more) uc->pending--;
+
+  if (op == MG_URING_ACCEPT) {
+    if (!more) uc->is_accepting = uc->is_cancelled = 0;
+    if (res >= 0 && c == NULL) {
+      closesocket(res);
+    } else if (res >= 0) {
+      union usa usa;
+      socklen_t n = sizeof(usa);
+      memset(&usa, 0, sizeof(usa));
+      if (getpeername(res, &usa.sa, &n) != 0) {
+        closesocket(res);
+      } else {
+        setup_accepted_conn(mgr, c, res, &usa, n);
+      }
+    } else if (res != -ECANCELED) {
+      MG_ERROR(("%lu accept failed, errno %d", c ? c->id : 0, -res));
+    }
+  } else if (op == MG_URING_RECV) {
+    if (!more) uc->is_receiving = uc->is_cancelled = 0;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+      unsigned short bid = (unsigned short) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+      char *buf = u->bufs + (size_t) bid * MG_IO_URING_BUF_SIZE;
+      if (c == NULL || c->is_closing || res <= 0) {
+        // Nothing to deliver
+      } else if (c->recv.len >= MG_MAX_RECV_SIZE) {
+        mg_error(c, "max_recv_buf_size reached");
+      } else if (!mg_iobuf_add(&c->recv, c->recv.len, buf, (size_t) res)) {
+        mg_error(c, "oom");
+      } else {
+        c->recv.len -= (size_t) res;  // iolog() counts it in
+        iolog(c, (char *) &c->recv.buf[c->recv.len], res, true);
+      }
+      mg_uring_put_buf(u, bid);
+    } else if (c != NULL && res != -ENOBUFS && res != -ECANCELED) {
+      iolog(c, NULL, res == 0 ? 0 : MG_IO_ERR, true);  // EOF or error
+    }
+  } else if (op == MG_URING_SEND) {
+    if (res > 0) uc->sent += (size_t) res;
+    if (c != NULL && res > 0 && uc->sent < uc->out.len) {
+      mg_uring_send(u, uc);
+      return;
+    }
+    uc->is_sending = 0;
+    uc->out.len = 0;
+    if (c != NULL && res <= 0 && res != -ECANCELED) {
+      iolog(c, NULL, MG_IO_ERR, false);
+    } else if (c != NULL && res > 0) {
+      long n = (long) uc->sent;
+      if (c->is_hexdumping) mg_hexdump(uc->out.buf, uc->sent);
+      mg_call(c, MG_EV_WRITE, &n);
+    }
+  } else if (op == MG_URING_POLL) {
+    uc->is_polling = 0;
+    if (c != NULL && res > 0) {
+      if (res & POLLERR) {
+        mg_error(c, "socket error");
+      } else {
+        c->is_readable |= can_read(c) && (res & (POLLIN | POLLHUP)) ? 1U : 0;
+        c->is_writable = can_write(c) && (res & POLLOUT) ? 1U : 0;
+      }
+    }
+  }
+
+  if (c == NULL && uc->pending == 0) {
+    mg_uring_release(uc);
+    u->closed--;
+  }
+}
+
+static void mg_uring_wait(struct mg_mgr *mgr, int ms) {
+  struct mg_uring *u = mgr->uring;
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  unsigned head = *u->cq_head;
+  unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000L;
+  uint64_t start = mg_wait_clock();
+  memset(&arg, 0, sizeof(arg));
+  arg.ts = (uint64_t) (size_t) &ts;
+  if (mg_uring_submit(u, ms > 0 && head == tail ? 1 : 0, &arg) < 0 &&
+      errno != ETIME && errno != EINTR && errno != EBUSY) {
+    MG_ERROR(("io_uring_enter: %d", errno));
+  }
+  // Completions are handled below, they count as work
+  mgr->wait_us += mg_wait_clock() - start;
+  tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    struct io_uring_cqe cqe = u->cqes[head & u->cq_mask];
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    mg_uring_complete(mgr, &cqe);
+  }
+}
+
+static void mg_uring_iotest(struct mg_mgr *mgr, int ms) {
+  struct mg_connection *c;
+  for (c = mgr->conns; c != NULL; c = c->next) {
+    c->is_readable = c->is_writable = 0;
+    if (c->is_closing || c->is_resolving || FD(c) == MG_INVALID_SOCKET) continue;
+    mg_uring_arm(c, &ms);
+  }
+  mg_uring_wait(mgr, ms);
+}
+
+bool mg_uring_busy(const struct mg_connection *c) {
+  return c->uring != NULL && c->uring->is_sending;
+}
+
+void mg_uring_close(struct mg_connection *c) {
+  struct mg_uring *u = c->mgr->uring;
+  struct mg_uring_conn *uc = c->uring;
+  bool cancelled = true;
+  if (uc == NULL) return;
+  c->uring = NULL;
+  uc->c = NULL;
+  if (uc->is_accepting) cancelled &= mg_uring_cancel(u, uc, MG_URING_ACCEPT);
+  if (uc->is_receiving) cancelled &= mg_uring_cancel(u, uc, MG_URING_RECV);
+  if (uc->is_sending) cancelled &= mg_uring_cancel(u, uc, MG_URING_SEND);
+  if (uc->is_polling) cancelled &= mg_uring_cancel(u, uc, MG_URING_POLL);
+  // Requests hold on to the socket past close(), make them finish anyway
+  if (!cancelled) shutdown(FD(c), SHUT_RDWR);
+  if (uc->is_fixed) {
+    int fd = -1;
+    struct io_uring_files_update up;
+    memset(&up, 0, sizeof(up));
+    up.offset = (unsigned) uc->fd;
+    up.fds = (uint64_t) (size_t) &fd;
+    mg_uring_register(u->fd, IORING_REGISTER_FILES_UPDATE, &up, 1);
+  }
+  if (uc->pending == 0) {
+    mg_uring_release(uc);
+  } else {
+    u->closed++;
+  }
+}
+
+void mg_uring_free(struct mg_mgr *mgr) {
+  struct mg_uring *u = mgr->uring;
+  int i;
+  if (u == NULL) return;
+  // The kernel may still use the buffers of cancelled requests
+  for (i = 0; i < 100 && u->closed > 0; i++) mg_uring_wait(mgr, 10);
+  if (u->fd >= 0) close(u->fd);
+  if (u->sq_ring != NULL) munmap(u->sq_ring, u->sq_ring_size);
+  if (u->cq_ring != NULL && u->cq_ring != u->sq_ring) {
+    munmap(u->cq_ring, u->cq_ring_size);
+  }
+  if (u->sqes != NULL) munmap(u->sqes, u->sqes_size);
+  if (u->bufring != NULL) {
+    munmap(u->bufring, MG_IO_URING_BUFS * sizeof(struct io_uring_buf));
+  }
+  if (u->bufs != NULL) {
+    memset(u->bufs, 0, (size_t) MG_IO_URING_BUFS * MG_IO_URING_BUF_SIZE);
+    mg_dealloc(u->bufs, (size_t) MG_IO_URING_BUFS * MG_IO_URING_BUF_SIZE);
+  }
+  memset(u, 0, sizeof(*u));
+  mg_dealloc(u, sizeof(*u));
+  mgr->uring = NULL;
+}
+
+// Kernels before 6.0 set the ring up and then fail every multishot recv
+// with -EINVAL, and backports may lack other pieces, so the opcodes are
+// probed and a multishot accept and recv tried on a local socket pair
+static bool mg_uring_probe(struct mg_uring *u) {
+  static const unsigned char ops[] = {
+      IORING_OP_ACCEPT,    IORING_OP_RECV,        IORING_OP_SEND,
+      IORING_OP_POLL_ADD,  IORING_OP_POLL_REMOVE, IORING_OP_ASYNC_CANCEL};
+  size_t probe_size = sizeof(struct io_uring_probe) +
+                      256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = (struct io_uring_probe *) mg_alloc(probe_size);
+  struct mg_uring_conn lc, rc;  // Listener and receiving end
+  struct io_uring_sqe *sqe;
+  struct sockaddr_un sun;
+  socklen_t sunlen = sizeof(sun);
+  int sv[2] = {-1, -1}, lfd = -1, cfd = -1, accepted = 0, received = 0, i;
+  bool ok = probe != NULL &&
+            mg_uring_register(u->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+  for (i = 0; ok && i < (int) sizeof(ops); i++) {
+    ok = ops[i] <= probe->last_op &&
+         (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+  }
+  if (probe != NULL) memset(probe, 0, probe_size);
+  mg_dealloc(probe, probe_size);
+  if (!ok) return false;
+
+  // An autobound abstract address for the listener, then the pair
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  cfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  ok = lfd >= 0 && cfd >= 0 &&
+       bind(lfd, (struct sockaddr *) &sun, sizeof(sa_family_t)) == 0 &&
+       listen(lfd, 1) == 0 &&
+       getsockname(lfd, (struct sockaddr *) &sun, &sunlen) == 0 &&
+       socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == 0;
+
+  memset(&lc, 0, sizeof(lc));
+  memset(&rc, 0, sizeof(rc));
+  lc.fd = lfd, rc.fd = sv[0];
+  if (ok && (sqe = mg_uring_sqe(u, &lc, MG_URING_ACCEPT, IORING_OP_ACCEPT)) != NULL) {
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+  }
+  if (ok && (sqe = mg_uring_sqe(u, &rc, MG_URING_RECV, IORING_OP_RECV)) != NULL) {
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->buf_group = 0;
+  }
+  ok = ok && lc.pending == 1 && rc.pending == 1 &&
+       connect(cfd, (struct sockaddr *) &sun, sunlen) == 0 &&
+       send(sv[1], "x", 1, MSG_NOSIGNAL) == 1;
+
+  // Both have to deliver and stay armed, then both are cancelled. Whatever
+  // is still in flight at the end is dropped with the ring.
+  for (i = 0; i < 100 && (lc.pending > 0 || rc.pending > 0); i++) {
+    struct __kernel_timespec ts = {0, 10000000L};
+    struct io_uring_getevents_arg arg;
+    unsigned head = *u->cq_head, tail;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t) (size_t) &ts;
+    if (ok && accepted != 0 && received != 0 && !lc.is_cancelled) {
+      lc.is_cancelled = mg_uring_cancel(u, &lc, MG_URING_ACCEPT);
+      rc.is_cancelled = mg_uring_cancel(u, &rc, MG_URING_RECV);
+    } else if (!ok && !lc.is_cancelled) {
+      break;
+    }
+    mg_uring_submit(u, head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) ? 1 : 0, &arg);
+    tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe cqe = u->cqes[head & u->cq_mask];
+      struct mg_uring_conn *uc =
+          (struct mg_uring_conn *) (size_t) (cqe.user_data & ~(uint64_t) MG_URING_OP_MASK);
+      bool more = cqe.flags & IORING_CQE_F_MORE;
+      int *seen = uc == &lc ? &accepted : &received;
+      __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+      if (uc == NULL) continue;  // Cancel request
+      if (!more) uc->pending--;
+      if (uc == &lc && cqe.res >= 0) close(cqe.res);
+      if (cqe.flags & IORING_CQE_F_BUFFER) {
+        mg_uring_put_buf(u, (unsigned short) (cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+      }
+      if (*seen == 0) {
+        *seen = cqe.res > 0 || (uc == &lc && cqe.res == 0) ? 1 : -1;
+        if (*seen < 0 || !more) ok = false;
+      }
+    }
+  }
+
+  if (lfd >= 0) close(lfd);
+  if (cfd >= 0) close(cfd);
+  if (sv[0] >= 0) close(sv[0]), close(sv[1]);
+  ok = ok && lc.pending == 0 && rc.pending == 0;
+  if (!ok) errno = EOPNOTSUPP;
+  return ok;
+}
+
+bool mg_uring_init(struct mg_mgr *mgr) {
+  struct mg_uring *u = (struct mg_uring *) mg_alloc(sizeof(*u));
+  struct io_uring_params p;
+  struct io_uring_buf_reg reg;
+  struct rlimit rl;
+  void *ring;
+  size_t fds_size;
+  int *fds, i;
+  if ((mgr->uring = u) == NULL) return false;
+
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+  u->fd = (int) syscall(__NR_io_uring_setup, MG_IO_URING_ENTRIES, &p);
+  if (u->fd < 0 || !(p.features & IORING_FEAT_EXT_ARG)) goto fail;
+
+  u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (u->cq_ring_size > u->sq_ring_size) u->sq_ring_size = u->cq_ring_size;
+    u->cq_ring_size = u->sq_ring_size;
+  }
+  ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if (ring == MAP_FAILED) goto fail;
+  u->sq_ring = u->cq_ring = ring;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    if (ring == MAP_FAILED) goto fail;
+    u->cq_ring = ring;
+  }
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (ring == MAP_FAILED) goto fail;
+  u->sqes = (struct io_uring_sqe *) ring;
+  u->sq_head = (unsigned *) ((char *) u->sq_ring + p.sq_off.head);
+  u->sq_tail = (unsigned *) ((char *) u->sq_ring + p.sq_off.tail);
+  u->sq_array = (unsigned *) ((char *) u->sq_ring + p.sq_off.array);
+  u->sq_mask = *(unsigned *) ((char *) u->sq_ring + p.sq_off.ring_mask);
+  u->sq_entries = p.sq_entries;
+  u->sq_local = *u->sq_tail;
+  u->cq_head = (unsigned *) ((char *) u->cq_ring + p.cq_off.head);
+  u->cq_tail = (unsigned *) ((char *) u->cq_ring + p.cq_off.tail);
+  u->cq_mask = *(unsigned *) ((char *) u->cq_ring + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *) ((char *) u->cq_ring + p.cq_off.cqes);
+
+  // Empty fixed file table, a slot per descriptor the process may open
+  u->nfiles = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < 65536
+                  ? (int) rl.rlim_cur
+                  : 65536;
+  fds_size = (size_t) u->nfiles * sizeof(int);
+  if ((fds = (int *) mg_alloc(fds_size)) != NULL) {
+    for (i = 0; i < u->nfiles; i++) fds[i] = -1;
+    if (mg_uring_register(u->fd, IORING_REGISTER_FILES, fds,
+                          (unsigned) u->nfiles) != 0) {
+      u->nfiles = 0;
+    }
+    memset(fds, 0, fds_size);
+    mg_dealloc(fds, fds_size);
+  } else {
+    u->nfiles = 0;
+  }
+
+  ring = mmap(NULL, MG_IO_URING_BUFS * sizeof(struct io_uring_buf),
+              PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED) goto fail;
+  u->bufring = (struct io_uring_buf_ring *) ring;
+  u->bufs = (char *) mg_alloc((size_t) MG_IO_URING_BUFS * MG_IO_URING_BUF_SIZE);
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t) (size_t) u->bufring;
+  reg.ring_entries = MG_IO_URING_BUFS;
+  reg.bgid = 0;
+  if (u->bufs == NULL ||
+      mg_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+    goto fail;
+  }
+  for (i = 0; i < MG_IO_URING_BUFS; i++) mg_uring_put_buf(u, (unsigned short) i);
+  if (!mg_uring_probe(u)) goto fail;
+  MG_DEBUG(("io_uring: %u entries, %d fixed files", p.sq_entries, u->nfiles));
+  return true;
+
+fail:
+  mg_uring_free(mgr);
+  return false;
+}
+#endif
+
 static void mg_iotest(struct mg_mgr *mgr, int ms) {
+  mgr->wait_us = 0;
+#if MG_ENABLE_IO_URING
+  if (mgr->uring != NULL) {
+    mg_uring_iotest(mgr, ms);
+    return;
+  }
+#endif
 #if MG_ENABLE_FREERTOS_TCP
   struct mg_connection *c;
   for (c = mgr->conns; c != NULL; c = c->next) {
@@ -4567,7 +5262,9 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
     max++;
   }
   struct epoll_event *evs = (struct epoll_event *) alloca(max * sizeof(evs[0]));
+  uint64_t start = mg_wait_clock();
   int n = epoll_wait(mgr->epoll_fd, evs, (int) max, ms);
+  mgr->wait_us = mg_wait_clock() - start;
   for (int i = 0; i < n; i++) {
     struct mg_connection *c = (struct mg_connection *) evs[i].data.ptr;
     if (evs[i].events & EPOLLERR) {
@@ -4601,12 +5298,14 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
   }
 
   // MG_INFO(("poll n=%d ms=%d", (int) n, ms));
+  uint64_t start = mg_wait_clock();
   if (poll(fds, n, ms) < 0) {
 #if MG_ARCH == MG_ARCH_WIN32
     if (n == 0) Sleep(ms);  // On Windows, poll fails if no sockets
 #endif
     memset(fds, 0, n * sizeof(fds[0]));
   }
+  mgr->wait_us = mg_wait_clock() - start;
   n = 0;
   for (struct mg_connection *c = mgr->conns; c != NULL; c = c->next) {
     if (skip_iotest(c)) {
@@ -4700,7 +5399,12 @@ void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
       if (c->is_writable) write_conn(c);
     }
 
+#if MG_ENABLE_IO_URING
+    if (c->is_draining && c->send.len == 0 && !mg_uring_busy(c))
+      c->is_closing = 1;
+#else
     if (c->is_draining && c->send.len == 0) c->is_closing = 1;
+#endif
     if (c->is_closing) close_conn(c);
   }
 }
@@ -5142,7 +5846,8 @@ void mg_tls_free(struct mg_connection *c) {
     mbedtls_x509_crt_free(&tls->ca);
     mbedtls_x509_crt_free(&tls->cert);
     mbedtls_ssl_config_free(&tls->conf);
-    free(tls);
+    memset(tls, 0, sizeof(*tls));
+    mg_dealloc(tls, sizeof(*tls));
     c->tls = NULL;
   }
 }
@@ -5210,7 +5915,7 @@ static struct mg_str mg_loadfile(struct mg_fs *fs, const char *path) {
 
 void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
   struct mg_fs *fs = opts->fs == NULL ? &mg_fs_posix : opts->fs;
-  struct mg_tls *tls = (struct mg_tls *) calloc(1, sizeof(*tls));
+  struct mg_tls *tls = (struct mg_tls *) mg_alloc(sizeof(*tls));
   int rc = 0;
   c->tls = tls;
   if (c->tls == NULL) {
@@ -291,7 +291,8 @@ int mkdir(const char *, mode_t);
 #include <mach/mach_time.h>
 #endif
 
-#if !defined(MG_ENABLE_EPOLL) && defined(__linux__)
+#if !defined(MG_ENABLE_EPOLL) && defined(__linux__) && \
+    !(defined(MG_ENABLE_IO_URING) && MG_ENABLE_IO_URING)
 #define MG_ENABLE_EPOLL 1
 #elif !defined(MG_ENABLE_POLL)
 #define MG_ENABLE_POLL 1
@@ -627,6 +628,10 @@ struct timeval {
 #define MG_ENABLE_EPOLL 0
 #endif
 
+#ifndef MG_ENABLE_IO_URING
+#define MG_ENABLE_IO_URING 0  // Linux io_uring event loop, poll() fallback
+#endif
+
 #ifndef MG_ENABLE_FATFS
 #define MG_ENABLE_FATFS 0
 #endif
@@ -684,6 +689,18 @@ struct timeval {
 #define MG_MAX_RECV_SIZE (3 * 1024 * 1024)  // Maximum recv IO buffer size
 #endif
 
+#ifndef MG_IO_URING_ENTRIES
+#define MG_IO_URING_ENTRIES 1024  // io_uring submission queue size
+#endif
+
+#ifndef MG_IO_URING_BUFS
+#define MG_IO_URING_BUFS 256  // io_uring receive buffers, a power of 2
+#endif
+
+#ifndef MG_IO_URING_BUF_SIZE
+#define MG_IO_URING_BUF_SIZE 8192  // Size of each io_uring receive buffer
+#endif
+
 #ifndef MG_DATA_SIZE
 #define MG_DATA_SIZE 32  // struct mg_connection :: data size
 #endif
@@ -933,6 +950,7 @@ struct mg_fs {
   bool (*mv)(const char *from, const char *to);         // Rename file
   bool (*rm)(const char *path);                         // Delete file
   bool (*mkd)(const char *path);                        // Create directory
+  bool (*et)(const char *path, char *buf, size_t len);  // Entity tag, optional
 };
 
 extern struct mg_fs mg_fs_posix;   // POSIX open/close/read/write/seek
@@ -1017,6 +1035,15 @@ struct mg_iobuf {
   size_t align;        // Alignment during allocation
 };
 
+// Allocator for connections, TLS contexts, IO buffers and open files, calloc()
+// and free() by default. Blocks are handed out zeroed and are zeroed when
+// given back
+typedef void *(*mg_alloc_t)(size_t size);
+typedef void (*mg_dealloc_t)(void *ptr, size_t size);
+void mg_set_allocator(mg_alloc_t alloc_fn, mg_dealloc_t dealloc_fn);
+void *mg_alloc(size_t size);
+void mg_dealloc(void *ptr, size_t size);
+
 int mg_iobuf_init(struct mg_iobuf *, size_t, size_t);
 int mg_iobuf_resize(struct mg_iobuf *, size_t);
 void mg_iobuf_free(struct mg_iobuf *);
@@ -1104,6 +1131,9 @@ struct mg_addr {
   bool is_ip6;      // True when address is IPv6 address
 };
 
+struct mg_uring;
+struct mg_uring_conn;
+
 struct mg_mgr {
   struct mg_connection *conns;  // List of active connections
   struct mg_dns dns4;           // DNS for IPv4
@@ -1117,6 +1147,8 @@ struct mg_mgr {
   void *active_dns_requests;    // DNS requests in progress
   struct mg_timer *timers;      // Active timers
   int epoll_fd;                 // Used when MG_EPOLL_ENABLE=1
+  struct mg_uring *uring;       // Used when MG_ENABLE_IO_URING=1
+  uint64_t wait_us;             // Last mg_mgr_poll() blocked for events
   void *priv;                   // Used by the MIP stack
   size_t extraconnsize;         // Used by the MIP stack
 #if MG_ENABLE_FREERTOS_TCP
@@ -1139,6 +1171,7 @@ struct mg_connection {
   void *pfn_data;              // Protocol-specific function parameter
   char data[MG_DATA_SIZE];     // Arbitrary connection data
   void *tls;                   // TLS specific data
+  struct mg_uring_conn *uring; // io_uring requests, MG_ENABLE_IO_URING=1
   unsigned is_listening : 1;   // Listening connection
   unsigned is_client : 1;      // Outbound (client) connection
   unsigned is_accepted : 1;    // Accepted (server) connection
@@ -1169,7 +1202,16 @@ struct mg_connection *mg_connect(struct mg_mgr *, const char *url,
                                  mg_event_handler_t fn, void *fn_data);
 struct mg_connection *mg_wrapfd(struct mg_mgr *mgr, int fd,
                                 mg_event_handler_t fn, void *fn_data);
+// Listens on a socket that is already bound and listening
+struct mg_connection *mg_listen_fd(struct mg_mgr *mgr, int fd,
+                                   mg_event_handler_t fn, void *fn_data);
 void mg_connect_resolved(struct mg_connection *);
+#if MG_ENABLE_IO_URING
+bool mg_uring_init(struct mg_mgr *);
+void mg_uring_free(struct mg_mgr *);
+void mg_uring_close(struct mg_connection *);
+bool mg_uring_busy(const struct mg_connection *);  // Send in flight
+#endif
 bool mg_send(struct mg_connection *, const void *, size_t);
 size_t mg_printf(struct mg_connection *, const char *fmt, ...);
 size_t mg_vprintf(struct mg_connection *, const char *fmt, va_list *ap);
@@ -1178,6 +1220,7 @@ int mg_mkpipe(struct mg_mgr *, mg_event_handler_t, void *, bool udp);
 
 // These functions are used to integrate with custom network stacks
 struct mg_connection *mg_alloc_conn(struct mg_mgr *);
+void mg_free_conn(struct mg_connection *c);
 void mg_close_conn(struct mg_connection *c);
 bool mg_open_listener(struct mg_connection *c, const char *url);
 
@@ -1229,18 +1272,26 @@ struct mg_http_part {
 };
 
 int mg_http_parse(const char *s, size_t len, struct mg_http_message *);
+// Parser http_cb uses for requests on accepted connections instead of
+// mg_http_parse(), given the connection whose receive buffer it parses
+typedef int (*mg_http_parser_t)(struct mg_connection *, const char *, size_t,
+                                struct mg_http_message *);
+void mg_http_set_parser(mg_http_parser_t fn);
 int mg_http_get_request_len(const unsigned char *buf, size_t buf_len);
 void mg_http_printf_chunk(struct mg_connection *cnn, const char *fmt, ...);
 void mg_http_write_chunk(struct mg_connection *c, const char *buf, size_t len);
 void mg_http_delete_chunk(struct mg_connection *c, struct mg_http_message *hm);
 struct mg_connection *mg_http_listen(struct mg_mgr *, const char *url,
                                      mg_event_handler_t fn, void *fn_data);
+struct mg_connection *mg_http_listen_fd(struct mg_mgr *, int fd,
+                                        mg_event_handler_t fn, void *fn_data);
 struct mg_connection *mg_http_connect(struct mg_mgr *, const char *url,
                                       mg_event_handler_t fn, void *fn_data);
 void mg_http_serve_dir(struct mg_connection *, struct mg_http_message *hm,
                        const struct mg_http_serve_opts *);
 void mg_http_serve_file(struct mg_connection *, struct mg_http_message *hm,
                         const char *path, const struct mg_http_serve_opts *);
+struct mg_str mg_http_content_type(struct mg_str path, const char *mime_types);
 void mg_http_reply(struct mg_connection *, int status_code, const char *headers,
                    const char *body_fmt, ...);
 struct mg_str *mg_http_get_header(struct mg_http_message *, const char *name);
@@ -0,0 +1,767 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// Reports over the access log files written with Server::SetAccessLog.
+//
+//   min-server-log [filters] report path...
+//
+// Paths are files or directories of them. Files are scanned in parallel,
+// blocks outside the time filter are skipped by their header, the rest are
+// decoded into columns and filtered a column at a time into a mask.
+
+#include "Types.hpp"
+#include "AccessLogFormat.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <map>
+
+
+static constexpr StrView usage =
+    "usage: min-server-log [filters] report path...\n"
+    "\n"
+    "reports:\n"
+    "  summary         requests, bytes and status classes\n"
+    "  top-paths       most requested paths\n"
+    "  latency         latency percentiles per route\n"
+    "  bytes-by-ip     response bytes per client address\n"
+    "\n"
+    "filters:\n"
+    "  --from S --to S     unix time range in seconds\n"
+    "  --status LO[-HI]    status range, 5xx style classes too\n"
+    "  --method M          GET, POST, ...\n"
+    "  --route NAME        route pattern as registered\n"
+    "  --path-prefix P     request paths starting with P\n"
+    "  --ip A.B.C.D[/N]    client address or network\n"
+    "  --slower MS         latency above MS milliseconds\n"
+    "  --tls, --plain      over TLS or not\n"
+    "  --limit N           rows of the top lists, 20\n"
+    "  --threads N         files scanned at once, one per CPU\n";
+
+
+struct Filters
+{
+    U64 fromMs = 0;
+    U64 toMs = ~U64(0);
+    U16 minStatus = 0;
+    U16 maxStatus = 0xffff;
+    I32 method = -1;
+    Str route;
+    Str pathPrefix;
+    U32 ipNetwork = 0;
+    U32 ipMask = 0;
+    U32 minLatencyUs = 0;
+    I32 tls = -1;
+};
+
+
+// Latency histogram with 16 linear buckets per power of two, within about
+// 6% of the exact percentile and mergeable across threads.
+class Histogram
+{
+public:
+    Histogram() : buckets(bucketCount, 0), count(0) {}
+
+    void Add(U32 valueUs)
+    {
+        buckets[Index(valueUs)]++;
+        count++;
+    }
+
+    void Merge(const Histogram& other)
+    {
+        for (Size i = 0; i < bucketCount; ++i)
+        {
+            buckets[i] += other.buckets[i];
+        }
+        count += other.count;
+    }
+
+    U64 GetCount() const { return count; }
+
+    // Upper bound of the bucket holding the percentile.
+    U64 GetPercentile(D percentile) const
+    {
+        auto rank = U64(percentile / 100.0 * D(count - 1));
+        U64 seen = 0;
+        for (Size i = 0; i < bucketCount; ++i)
+        {
+            seen += buckets[i];
+            if (seen > rank)
+            {
+                return UpperBound(i);
+            }
+        }
+        return UpperBound(bucketCount - 1);
+    }
+
+private:
+    static constexpr Size subBuckets = 16;
+    static constexpr Size bucketCount = 33 * subBuckets;
+
+    Vec<U64> buckets;
+    U64 count;
+
+    static Size Index(U32 value)
+    {
+        if (value < subBuckets)
+        {
+            return value;
+        }
+        auto exponent = 31 - __builtin_clz(value);
+        auto mantissa = (value >> (exponent - 4)) & (subBuckets - 1);
+        return (exponent - 3) * subBuckets + mantissa;
+    }
+
+    static U64 UpperBound(Size index)
+    {
+        if (index < subBuckets)
+        {
+            return index;
+        }
+        auto exponent = index / subBuckets + 3;
+        auto mantissa = index % subBuckets;
+        return ((U64(subBuckets + mantissa + 1)) << (exponent - 4)) - 1;
+    }
+};
+
+
+struct Totals
+{
+    U64 requests = 0;
+    U64 bytes = 0;
+    U64 tls = 0;
+    U64 http2 = 0;
+    U64 minTimeMs = ~U64(0);
+    U64 maxTimeMs = 0;
+    Arr<U64, 6> statusClasses = {};
+    U64 files = 0;
+    U64 blocks = 0;
+    U64 skippedBlocks = 0;
+    U64 damagedFiles = 0;
+
+    UMap<Str, Pair<U64, U64>> paths;
+    std::map<Str, Histogram> routes;
+    UMap<U32, Pair<U64, U64>> ips;
+
+    void Merge(Totals& other)
+    {
+        requests += other.requests;
+        bytes += other.bytes;
+        tls += other.tls;
+        http2 += other.http2;
+        minTimeMs = std::min(minTimeMs, other.minTimeMs);
+        maxTimeMs = std::max(maxTimeMs, other.maxTimeMs);
+        for (Size i = 0; i < statusClasses.size(); ++i)
+        {
+            statusClasses[i] += other.statusClasses[i];
+        }
+        files += other.files;
+        blocks += other.blocks;
+        skippedBlocks += other.skippedBlocks;
+        damagedFiles += other.damagedFiles;
+
+        for (auto& [path, counts] : other.paths)
+        {
+            auto& mine = paths[path];
+            mine.first += counts.first;
+            mine.second += counts.second;
+        }
+        for (auto& [route, histogram] : other.routes)
+        {
+            routes[route].Merge(histogram);
+        }
+        for (auto& [ip, counts] : other.ips)
+        {
+            auto& mine = ips[ip];
+            mine.first += counts.first;
+            mine.second += counts.second;
+        }
+    }
+};
+
+
+enum class Report : U8
+{
+    Summary,
+    TopPaths,
+    Latency,
+    BytesByIp
+};
+
+
+// Scratch columns reused from block to block.
+struct Scan
+{
+    AccessBlock block;
+    Vec<U8> keep;
+    Vec<U8> routeMatches;
+    Vec<U8> pathMatches;
+    Vec<U64> pathCounts;
+    Vec<U64> pathBytes;
+    Vec<U8> buffer;
+};
+
+
+static auto Fail(StrView message) -> I
+{
+    std::fprintf(stderr, "%.*s\n", I(message.size()), message.data());
+    return 1;
+}
+
+
+static auto ParseIp(StrView text, U32* ip, U32* mask) -> B
+{
+    U32 parts[4];
+    U32 bits = 32;
+    Str copy(text);
+    auto slash = copy.find('/');
+    if (slash != Str::npos)
+    {
+        bits = U32(std::atoi(copy.c_str() + slash + 1));
+        copy.resize(slash);
+    }
+    if (bits > 32 || std::sscanf(copy.c_str(), "%u.%u.%u.%u", &parts[0], &parts[1], &parts[2], &parts[3]) != 4)
+    {
+        return false;
+    }
+
+    *ip = (parts[0] << 24) | (parts[1] << 16) | (parts[2] << 8) | parts[3];
+    *mask = bits? ~U32(0) << (32 - bits) : 0;
+    *ip &= *mask;
+
+    return true;
+}
+
+
+static auto ParseStatus(StrView text, Filters* filters) -> B
+{
+    // 5xx
+    if (text.size() == 3 && text[1] == 'x' && text[2] == 'x' && text[0] >= '1' && text[0] <= '5')
+    {
+        filters->minStatus = U16((text[0] - '0') * 100);
+        filters->maxStatus = U16(filters->minStatus + 99);
+        return true;
+    }
+
+    Str copy(text);
+    auto dash = copy.find('-');
+    filters->minStatus = U16(std::atoi(copy.c_str()));
+    filters->maxStatus = (dash == Str::npos)? filters->minStatus : U16(std::atoi(copy.c_str() + dash + 1));
+
+    return filters->minStatus <= filters->maxStatus;
+}
+
+
+// Narrows scan.keep down to the records the filters let through, one
+// column at a time in loops without branches the compiler vectorizes.
+static auto Filter(Scan& scan, const Filters& filters) -> void
+{
+    auto& block = scan.block;
+    auto count = block.GetCount();
+    auto keep = scan.keep.data();
+    std::fill(scan.keep.begin(), scan.keep.end(), U8(1));
+
+    if (filters.fromMs != 0 || filters.toMs != ~U64(0))
+    {
+        auto time = block.timeMs.data();
+        for (Size i = 0; i < count; ++i)
+        {
+            keep[i] &= U8(time[i] >= filters.fromMs) & U8(time[i] < filters.toMs);
+        }
+    }
+    if (filters.minStatus != 0 || filters.maxStatus != 0xffff)
+    {
+        auto status = block.status.data();
+        for (Size i = 0; i < count; ++i)
+        {
+            keep[i] &= U8(status[i] >= filters.minStatus) & U8(status[i] <= filters.maxStatus);
+        }
+    }
+    if (filters.method >= 0)
+    {
+        auto method = block.method.data();
+        auto wanted = U8(filters.method);
+        for (Size i = 0; i < count; ++i)
+        {
+            keep[i] &= U8(method[i] == wanted);
+        }
+    }
+    if (filters.ipMask != 0)
+    {
+        auto ip = block.ip.data();
+        for (Size i = 0; i < count; ++i)
+        {
+            keep[i] &= U8((ip[i] & filters.ipMask) == filters.ipNetwork);
+        }
+    }
+    if (filters.minLatencyUs != 0)
+    {
+        auto latency = block.latencyUs.data();
+        for (Size i = 0; i < count; ++i)
+        {
+            keep[i] &= U8(latency[i] > filters.minLatencyUs);
+        }
+    }
+    if (filters.tls >= 0)
+    {
+        auto flags = block.flags.data();
+        auto wanted = U8(filters.tls);
+        for (Size i = 0; i < count; ++i)
+        {
+            keep[i] &= U8((flags[i] & accessTLS) == wanted);
+        }
+    }
+
+    // Names are matched once per block, records look up the result.
+    if (!filters.route.empty())
+    {
+        std::fill(scan.routeMatches.begin(), scan.routeMatches.end(), U8(0));
+        for (Size i = 0; i < block.routes.size() && i < scan.routeMatches.size(); ++i)
+        {
+            scan.routeMatches[i] = U8(block.routes[i] == filters.route);
+        }
+        auto route = block.route.data();
+        auto matches = scan.routeMatches.data();
+        for (Size i = 0; i < count; ++i)
+        {
+            keep[i] &= matches[route[i]];
+        }
+    }
+    if (!filters.pathPrefix.empty())
+    {
+        scan.pathMatches.resize(block.paths.size());
+        for (Size i = 0; i < block.paths.size(); ++i)
+        {
+            scan.pathMatches[i] = U8(block.paths[i].starts_with(filters.pathPrefix));
+        }
+        auto path = block.path.data();
+        auto matches = scan.pathMatches.data();
+        for (Size i = 0; i < count; ++i)
+        {
+            keep[i] &= matches[path[i]];
+        }
+    }
+}
+
+
+static auto Aggregate(Scan& scan, Report report, Totals* totals) -> void
+{
+    auto& block = scan.block;
+    auto count = block.GetCount();
+    auto keep = scan.keep.data();
+
+    U64 requests = 0;
+    U64 bytes = 0;
+    U64 tls = 0;
+    U64 http2 = 0;
+    for (Size i = 0; i < count; ++i)
+    {
+        requests += keep[i];
+        bytes += block.bytes[i] * keep[i];
+        tls += keep[i] & (block.flags[i] & accessTLS);
+        http2 += keep[i] & ((block.flags[i] & accessHttp2) >> 1);
+    }
+    totals->requests += requests;
+    totals->bytes += bytes;
+    totals->tls += tls;
+    totals->http2 += http2;
+
+    for (Size i = 0; i < count; ++i)
+    {
+        if (keep[i])
+        {
+            totals->minTimeMs = std::min(totals->minTimeMs, block.timeMs[i]);
+            totals->maxTimeMs = std::max(totals->maxTimeMs, block.timeMs[i]);
+            totals->statusClasses[std::min<Size>(block.status[i] / 100, 5)]++;
+        }
+    }
+
+    if (report == Report::TopPaths)
+    {
+        // Counted by index first, merged by name once per block.
+        scan.pathCounts.assign(block.paths.size(), 0);
+        scan.pathBytes.assign(block.paths.size(), 0);
+        for (Size i = 0; i < count; ++i)
+        {
+            scan.pathCounts[block.path[i]] += keep[i];
+            scan.pathBytes[block.path[i]] += block.bytes[i] * keep[i];
+        }
+        for (Size i = 0; i < block.paths.size(); ++i)
+        {
+            if (scan.pathCounts[i] != 0)
+            {
+                auto& entry = totals->paths[Str(block.paths[i].empty()? "(not recorded)" : block.paths[i])];
+                entry.first += scan.pathCounts[i];
+                entry.second += scan.pathBytes[i];
+            }
+        }
+    }
+    else if (report == Report::Latency)
+    {
+        Vec<Histogram*> histograms(block.routes.size(), nullptr);
+        for (Size i = 0; i < count; ++i)
+        {
+            auto route = block.route[i];
+            if (!keep[i] || route >= histograms.size())
+            {
+                continue;
+            }
+            if (histograms[route] == nullptr)
+            {
+                histograms[route] = &totals->routes[Str(block.routes[route])];
+            }
+            histograms[route]->Add(block.latencyUs[i]);
+        }
+    }
+    else if (report == Report::BytesByIp)
+    {
+        for (Size i = 0; i < count; ++i)
+        {
+            if (keep[i])
+            {
+                auto& entry = totals->ips[block.ip[i]];
+                entry.first += block.bytes[i];
+                entry.second++;
+            }
+        }
+    }
+}
+
+
+static auto ScanFile(const Str& path, Report report, const Filters& filters, Scan& scan, Totals* totals) -> void
+{
+    auto file = std::fopen(path.c_str(), "rb");
+    if (file == nullptr)
+    {
+        totals->damagedFiles++;
+        return;
+    }
+
+    std::fseek(file, 0, SEEK_END);
+    auto size = std::ftell(file);
+    std::fseek(file, 0, SEEK_SET);
+    scan.buffer.resize(size > 0? Size(size) : 0);
+    auto read = std::fread(scan.buffer.data(), 1, scan.buffer.size(), file);
+    std::fclose(file);
+
+    auto data = scan.buffer.data();
+    U32 header[2] = { 0, 0 };
+    if (read >= accessFileHeaderSize)
+    {
+        memcpy(header, data, sizeof(header));
+    }
+    if (header[0] != accessLogMagic || header[1] != accessLogVersion)
+    {
+        totals->damagedFiles++;
+        return;
+    }
+    totals->files++;
+
+    // Whatever follows a cut or damaged block is not trusted, the file
+    // being written ends with one.
+    Size offset = accessFileHeaderSize;
+    while (offset < read)
+    {
+        U64 minTimeMs;
+        U64 maxTimeMs;
+        auto blockSize = PeekAccessBlock(data + offset, read - offset, &minTimeMs, &maxTimeMs);
+        if (blockSize == 0)
+        {
+            break;
+        }
+        if (maxTimeMs < filters.fromMs || minTimeMs >= filters.toMs)
+        {
+            totals->skippedBlocks++;
+            offset += blockSize;
+            continue;
+        }
+
+        if (DecodeAccessBlock(data + offset, read - offset, &scan.block) == 0)
+        {
+            totals->damagedFiles++;
+            break;
+        }
+        totals->blocks++;
+        scan.keep.resize(scan.block.GetCount());
+        Filter(scan, filters);
+        Aggregate(scan, report, totals);
+
+        offset += blockSize;
+    }
+}
+
+
+static auto CollectFiles(StrView path, Vec<Str>* files) -> void
+{
+    std::error_code error;
+    if (!std::filesystem::is_directory(path, error))
+    {
+        files->emplace_back(path);
+        return;
+    }
+
+    for (auto& entry : std::filesystem::directory_iterator(path, error))
+    {
+        if (entry.is_regular_file(error) && entry.path().extension() == ".msal")
+        {
+            files->push_back(entry.path().string());
+        }
+    }
+}
+
+
+static auto FormatIp(U32 ip) -> Str
+{
+    C text[16];
+    std::snprintf(text, sizeof(text), "%u.%u.%u.%u", ip >> 24, (ip >> 16) & 255, (ip >> 8) & 255, ip & 255);
+    return text;
+}
+
+
+template <typename K>
+static auto TopEntries(const UMap<K, Pair<U64, U64>>& entries, B byBytes, Size limit) -> Vec<Pair<K, Pair<U64, U64>>>
+{
+    Vec<Pair<K, Pair<U64, U64>>> top(entries.begin(), entries.end());
+    auto key = [byBytes](const auto& entry) { return byBytes? entry.second.first : entry.second.second; };
+    limit = std::min(limit, top.size());
+    std::partial_sort(
+                       top.begin(),
+                       top.begin() + limit,
+                       top.end(),
+                       [&](const auto& a, const auto& b) { return key(a) > key(b); }
+                     );
+    top.resize(limit);
+
+    return top;
+}
+
+
+static auto Print(const Totals& totals, Report report, Size limit) -> void
+{
+    if (report == Report::Summary)
+    {
+        std::printf("files        %llu\n", (unsigned long long)totals.files);
+        std::printf("blocks       %llu read, %llu skipped\n",
+                    (unsigned long long)totals.blocks, (unsigned long long)totals.skippedBlocks);
+        std::printf("requests     %llu\n", (unsigned long long)totals.requests);
+        std::printf("bytes        %llu\n", (unsigned long long)totals.bytes);
+        std::printf("tls          %llu\n", (unsigned long long)totals.tls);
+        std::printf("http2        %llu\n", (unsigned long long)totals.http2);
+        if (totals.requests != 0)
+        {
+            std::printf("from         %llu\n", (unsigned long long)(totals.minTimeMs / 1000));
+            std::printf("to           %llu\n", (unsigned long long)(totals.maxTimeMs / 1000));
+        }
+        std::printf("no status    %llu\n", (unsigned long long)totals.statusClasses[0]);
+        for (Size i = 1; i < totals.statusClasses.size(); ++i)
+        {
+            std::printf("%zuxx          %llu\n", i, (unsigned long long)totals.statusClasses[i]);
+        }
+    }
+    else if (report == Report::TopPaths)
+    {
+        std::printf("%12s %14s  %s\n", "requests", "bytes", "path");
+        for (auto& [path, counts] : TopEntries(totals.paths, false, limit))
+        {
+            std::printf("%12llu %14llu  %s\n",
+                        (unsigned long long)counts.first, (unsigned long long)counts.second, path.c_str());
+        }
+    }
+    else if (report == Report::Latency)
+    {
+        std::printf("%12s %10s %10s %10s %10s %10s  %s\n", "requests", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us", "route");
+        for (auto& [route, histogram] : totals.routes)
+        {
+            std::printf(
+                         "%12llu %10llu %10llu %10llu %10llu %10llu  %s\n",
+                         (unsigned long long)histogram.GetCount(),
+                         (unsigned long long)histogram.GetPercentile(50),
+                         (unsigned long long)histogram.GetPercentile(90),
+                         (unsigned long long)histogram.GetPercentile(99),
+                         (unsigned long long)histogram.GetPercentile(99.9),
+                         (unsigned long long)histogram.GetPercentile(100),
+                         route.c_str()
+                       );
+        }
+    }
+    else if (report == Report::BytesByIp)
+    {
+        std::printf("%14s %12s  %s\n", "bytes", "requests", "address");
+        for (auto& [ip, counts] : TopEntries(totals.ips, true, limit))
+        {
+            std::printf("%14llu %12llu  %s\n",
+                        (unsigned long long)counts.first, (unsigned long long)counts.second, FormatIp(ip).c_str());
+        }
+    }
+
+    if (totals.damagedFiles != 0)
+    {
+        std::fprintf(stderr, "%llu files could not be read completely\n", (unsigned long long)totals.damagedFiles);
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    Filters filters;
+    Size limit = 20;
+    U32 threadCount = std::max(1u, Thread::hardware_concurrency());
+    Vec<StrView> positional;
+
+    for (auto i = 1; i < argc; ++i)
+    {
+        StrView arg = argv[i];
+        CStr value = (i + 1 < argc)? argv[i + 1] : "";
+
+        if (arg == "--tls" || arg == "--plain")
+        {
+            filters.tls = (arg == "--tls")? accessTLS : 0;
+            continue;
+        }
+        if (!arg.starts_with("--"))
+        {
+            positional.push_back(arg);
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            return Fail(usage);
+        }
+
+        if (arg == "--from")
+        {
+            filters.fromMs = U64(std::atoll(value)) * 1000;
+        }
+        else if (arg == "--to")
+        {
+            filters.toMs = U64(std::atoll(value)) * 1000;
+        }
+        else if (arg == "--status")
+        {
+            if (!ParseStatus(value, &filters))
+            {
+                return Fail("Bad --status");
+            }
+        }
+        else if (arg == "--method")
+        {
+            filters.method = (I32)ParseAccessMethod(value);
+        }
+        else if (arg == "--route")
+        {
+            filters.route = value;
+        }
+        else if (arg == "--path-prefix")
+        {
+            filters.pathPrefix = value;
+        }
+        else if (arg == "--ip")
+        {
+            if (!ParseIp(value, &filters.ipNetwork, &filters.ipMask))
+            {
+                return Fail("Bad --ip");
+            }
+            // A /0 network matches everything, same as no filter.
+        }
+        else if (arg == "--slower")
+        {
+            filters.minLatencyUs = U32(std::atof(value) * 1000);
+        }
+        else if (arg == "--limit")
+        {
+            limit = Size(std::atoll(value));
+        }
+        else if (arg == "--threads")
+        {
+            threadCount = std::max(1, std::atoi(value));
+        }
+        else
+        {
+            return Fail(usage);
+        }
+        ++i;
+    }
+
+    if (positional.size() < 2)
+    {
+        return Fail(usage);
+    }
+
+    Report report;
+    auto name = positional[0];
+    if (name == "summary")
+    {
+        report = Report::Summary;
+    }
+    else if (name == "top-paths")
+    {
+        report = Report::TopPaths;
+    }
+    else if (name == "latency")
+    {
+        report = Report::Latency;
+    }
+    else if (name == "bytes-by-ip")
+    {
+        report = Report::BytesByIp;
+    }
+    else
+    {
+        return Fail(usage);
+    }
+
+    Vec<Str> files;
+    for (Size i = 1; i < positional.size(); ++i)
+    {
+        CollectFiles(positional[i], &files);
+    }
+    std::sort(files.begin(), files.end());
+
+    threadCount = std::min<U32>(threadCount, U32(std::max<Size>(files.size(), 1)));
+    Vec<Totals> totals(threadCount);
+    Atomic<Size> next = 0;
+    Vec<Thread> threads;
+
+    for (U32 t = 0; t < threadCount; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            Scan scan;
+            // Any U16 route id indexes it, whatever the block holds.
+            scan.routeMatches.assign(0x10000, 0);
+            for (auto i = next++; i < files.size(); i = next++)
+            {
+                ScanFile(files[i], report, filters, scan, &totals[t]);
+            }
+        });
+    }
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    for (U32 t = 1; t < threadCount; ++t)
+    {
+        totals[0].Merge(totals[t]);
+    }
+    Print(totals[0], report, limit);
+
+    return 0;
+}
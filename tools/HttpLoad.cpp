@@ -0,0 +1,312 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// Keep-alive HTTP/1.1 load against one path on the local host.
+//
+//   min-server-load [options] port path
+//
+// Every connection keeps `--pipeline` requests in flight and sends the next
+// one as soon as a response is complete. Responses need a Content-Length.
+// Connections the server closes are opened again and counted.
+
+#include "Types.hpp"
+#include "Utils.hpp"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+
+
+static constexpr StrView usage =
+    "usage: min-server-load [options] port path\n"
+    "\n"
+    "options:\n"
+    "  --connections N   connections to 127.0.0.1, 10\n"
+    "  --seconds S       duration, 5\n"
+    "  --pipeline N      requests in flight per connection, 1\n"
+    "  --header H        extra request header, \"Name: value\"\n";
+
+
+struct Connection
+{
+    I fd = -1;
+    Str inbox;
+    // Send times of the requests in flight, oldest first.
+    Deque<U64> sentNs;
+};
+
+
+struct Load
+{
+    sockaddr_in address = {};
+    Str request;
+    U32 pipeline = 1;
+    I epollFd = -1;
+
+    Vec<U32> latenciesUs;
+    U64 reconnects = 0;
+};
+
+
+static auto Fail(StrView message) -> I
+{
+    std::fprintf(stderr, "%.*s\n", I(message.size()), message.data());
+    return 1;
+}
+
+
+static auto Send(Load* load, Connection* connection, U32 count) -> void
+{
+    Str batch;
+    for (U32 i = 0; i < count; ++i)
+    {
+        batch.append(load->request);
+        connection->sentNs.push_back(GetHighResTimeNS());
+    }
+
+    // Requests are small, a full socket buffer means the server stalled.
+    for (Size sent = 0; sent < batch.size();)
+    {
+        auto n = send(connection->fd, batch.data() + sent, batch.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0 && errno != EAGAIN)
+        {
+            return;
+        }
+        sent += (n > 0)? Size(n) : 0;
+    }
+}
+
+
+static auto Open(Load* load, Connection* connection) -> B
+{
+    connection->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connection->fd < 0 || connect(connection->fd, (sockaddr*)&load->address, sizeof(load->address)) != 0)
+    {
+        return false;
+    }
+
+    I on = 1;
+    setsockopt(connection->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    fcntl(connection->fd, F_SETFL, O_NONBLOCK);
+
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = connection;
+    epoll_ctl(load->epollFd, EPOLL_CTL_ADD, connection->fd, &event);
+
+    connection->inbox.clear();
+    connection->sentNs.clear();
+    Send(load, connection, load->pipeline);
+
+    return true;
+}
+
+
+// Length of the first complete response in the inbox, zero until there is
+// one.
+static auto ResponseLength(StrView inbox) -> Size
+{
+    static constexpr StrView contentLength = "\r\ncontent-length:";
+
+    auto headEnd = inbox.find("\r\n\r\n");
+    if (headEnd == StrView::npos)
+    {
+        return 0;
+    }
+
+    Size bodyLength = 0;
+    for (auto at = inbox.find("\r\n"); at < headEnd; at = inbox.find("\r\n", at + 2))
+    {
+        if (strncasecmp(inbox.data() + at, contentLength.data(), contentLength.size()) == 0)
+        {
+            bodyLength = std::strtoull(inbox.data() + at + contentLength.size(), nullptr, 10);
+            break;
+        }
+    }
+
+    auto length = headEnd + 4 + bodyLength;
+    return (inbox.size() >= length)? length : 0;
+}
+
+
+static auto Receive(Load* load, Connection* connection) -> B
+{
+    C buffer[65536];
+
+    while (true)
+    {
+        auto n = recv(connection->fd, buffer, sizeof(buffer), 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN))
+        {
+            return false;
+        }
+        if (n < 0)
+        {
+            return true;
+        }
+        connection->inbox.append(buffer, Size(n));
+
+        Size consumed = 0;
+        U32 completed = 0;
+        for (Size length; (length = ResponseLength(StrView(connection->inbox).substr(consumed))) != 0;)
+        {
+            consumed += length;
+            completed++;
+
+            if (!connection->sentNs.empty())
+            {
+                auto nowNs = GetHighResTimeNS();
+                load->latenciesUs.push_back(U32((nowNs - connection->sentNs.front()) / 1000));
+                connection->sentNs.pop_front();
+            }
+        }
+        connection->inbox.erase(0, consumed);
+
+        if (completed != 0)
+        {
+            Send(load, connection, completed);
+        }
+    }
+}
+
+
+static auto Percentile(const Vec<U32>& sorted, F64 fraction) -> F64
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+
+    return sorted[std::min(sorted.size() - 1, Size(F64(sorted.size()) * fraction))] / 1000.0;
+}
+
+
+int main(int argc, char** argv)
+{
+    U32 connectionCount = 10;
+    F64 seconds = 5;
+    Str headers;
+    U32 pipeline = 1;
+    Vec<StrView> positional;
+
+    for (auto i = 1; i < argc; ++i)
+    {
+        StrView arg = argv[i];
+        if (!arg.starts_with("--"))
+        {
+            positional.push_back(arg);
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            return Fail(usage);
+        }
+
+        CStr value = argv[++i];
+        if (arg == "--connections")
+        {
+            connectionCount = U32(std::max(1, std::atoi(value)));
+        }
+        else if (arg == "--seconds")
+        {
+            seconds = std::atof(value);
+        }
+        else if (arg == "--pipeline")
+        {
+            pipeline = U32(std::max(1, std::atoi(value)));
+        }
+        else if (arg == "--header")
+        {
+            headers.append(value).append("\r\n");
+        }
+        else
+        {
+            return Fail(usage);
+        }
+    }
+
+    if (positional.size() != 2)
+    {
+        return Fail(usage);
+    }
+
+    Load load;
+    load.address.sin_family = AF_INET;
+    load.address.sin_port = htons(U16(std::atoi(positional[0].data())));
+    load.address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    load.request = "GET " + Str(positional[1]) + " HTTP/1.1\r\nHost: localhost\r\n" + headers + "\r\n";
+    load.pipeline = pipeline;
+    load.epollFd = epoll_create1(EPOLL_CLOEXEC);
+
+    Vec<Connection> connections(connectionCount);
+    for (auto& connection : connections)
+    {
+        if (!Open(&load, &connection))
+        {
+            return Fail("Cannot connect");
+        }
+    }
+
+    auto startNs = GetHighResTimeNS();
+    auto endNs = startNs + U64(seconds * 1e9);
+    epoll_event events[512];
+
+    while (GetHighResTimeNS() < endNs)
+    {
+        auto count = epoll_wait(load.epollFd, events, 512, 100);
+        for (auto i = 0; i < count; ++i)
+        {
+            auto connection = (Connection*)events[i].data.ptr;
+            if (!Receive(&load, connection))
+            {
+                // Closed after its request limit, or failed.
+                close(connection->fd);
+                load.reconnects++;
+                if (!Open(&load, connection))
+                {
+                    return Fail("Cannot reconnect");
+                }
+            }
+        }
+    }
+
+    auto elapsedS = F64(GetHighResTimeNS() - startNs) / 1e9;
+    auto& latencies = load.latenciesUs;
+    std::sort(latencies.begin(), latencies.end());
+
+    std::printf(
+                 "%.0f req/s  p50 %.3f ms  p99 %.3f ms  max %.3f ms  requests %zu  reconnects %llu\n",
+                 F64(latencies.size()) / elapsedS,
+                 Percentile(latencies, 0.5),
+                 Percentile(latencies, 0.99),
+                 Percentile(latencies, 1.0),
+                 latencies.size(),
+                 (unsigned long long)load.reconnects
+               );
+
+    return 0;
+}
@@ -0,0 +1,228 @@
+// Copyright 2023 Mihail Mladenov
+//
+// This file is part of min-server.
+//
+// min-server is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// min-server is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with min-server.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// Request parser throughput on pipelined input, HttpParser against
+// mg_http_parse.
+//
+//   min-server-parse-bench [options]
+//
+// The buffer holds browser-like requests back to back. It is parsed one
+// request after the other, either all received already or arriving `--read`
+// bytes at a time. Arriving bytes make mongoose search the unfinished
+// request from its start on every read, HttpParser resumes where it stopped.
+
+#include "Types.hpp"
+#include "Utils.hpp"
+#include "HttpParser.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+
+
+static constexpr StrView usage =
+    "usage: min-server-parse-bench [options]\n"
+    "\n"
+    "options:\n"
+    "  --requests N   pipelined requests in the buffer, 1000\n"
+    "  --read N       bytes received per read, 0 for all at once, 0\n"
+    "  --seconds S    per parser, 2\n";
+
+
+static constexpr StrView requestTemplate =
+    "GET /res/app-%u.wasm?v=3 HTTP/1.1\r\n"
+    "Host: example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+    "Accept: */*\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: cors\r\n"
+    "Sec-Fetch-Dest: empty\r\n"
+    "Referer: https://example.com/\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: session=6b1f0e2c9d8a7b6c5d4e3f2a1b0c9d8e; theme=dark\r\n"
+    "If-None-Match: \"5d41402abc4b2a76b9719d911017c592\"\r\n"
+    "\r\n";
+
+
+struct Bench
+{
+    Str input;
+    U32 requests;
+    U32 readSize;
+};
+
+
+static auto Fail(StrView message) -> I
+{
+    std::fprintf(stderr, "%.*s\n", I(message.size()), message.data());
+    return 1;
+}
+
+
+static auto ParseMongoose(const Bench& bench) -> U32
+{
+    auto buf = bench.input.data();
+    auto len = bench.input.size();
+    U32 parsed = 0;
+    Size offset = 0;
+    Size received = (bench.readSize == 0)? len : 0;
+
+    while (offset < len)
+    {
+        mg_http_message hm;
+        auto n = mg_http_parse(buf + offset, received - offset, &hm);
+        if (n < 0 || (n == 0 && received == len))
+        {
+            return 0;
+        }
+        if (n == 0)
+        {
+            received = std::min(len, received + bench.readSize);
+            continue;
+        }
+        offset += (Size)n;
+        parsed++;
+    }
+
+    return parsed;
+}
+
+
+static auto ParseResuming(const Bench& bench) -> U32
+{
+    auto buf = bench.input.data();
+    auto len = bench.input.size();
+    U32 parsed = 0;
+    Size offset = 0;
+    Size received = (bench.readSize == 0)? len : 0;
+
+    HttpParser parser;
+    mg_connection c = {};
+    U32 scanned = 0;
+
+    while (offset < len)
+    {
+        c.recv.buf = (unsigned char*)buf + offset;
+        c.recv.len = received - offset;
+
+        mg_http_message hm;
+        auto n = parser.Parse(&c, &scanned, &hm);
+        parser.Forget();
+        if (n < 0 || (n == 0 && received == len))
+        {
+            return 0;
+        }
+        if (n == 0)
+        {
+            received = std::min(len, received + bench.readSize);
+            continue;
+        }
+        offset += (Size)n;
+        parsed++;
+    }
+
+    return parsed;
+}
+
+
+static auto Run(CStr name, const Bench& bench, U32 (*parse)(const Bench&), F64 seconds) -> B
+{
+    U64 rounds = 0;
+    auto startNs = GetHighResTimeNS();
+    auto endNs = startNs + U64(seconds * 1e9);
+
+    do
+    {
+        if (parse(bench) != bench.requests)
+        {
+            std::fprintf(stderr, "%s: the input did not parse\n", name);
+            return false;
+        }
+        rounds++;
+    }
+    while (GetHighResTimeNS() < endNs);
+
+    auto elapsedS = F64(GetHighResTimeNS() - startNs) / 1e9;
+    std::printf(
+                 "%-12s %12.0f req/s  %8.1f MB/s\n",
+                 name,
+                 F64(rounds) * bench.requests / elapsedS,
+                 F64(rounds) * F64(bench.input.size()) / elapsedS / 1e6
+               );
+
+    return true;
+}
+
+
+int main(int argc, char** argv)
+{
+    U32 requests = 1000;
+    U32 readSize = 0;
+    F64 seconds = 2;
+
+    for (auto i = 1; i < argc; ++i)
+    {
+        StrView arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            return Fail(usage);
+        }
+
+        CStr value = argv[++i];
+        if (arg == "--requests")
+        {
+            requests = U32(std::max(1, std::atoi(value)));
+        }
+        else if (arg == "--read")
+        {
+            readSize = U32(std::max(0, std::atoi(value)));
+        }
+        else if (arg == "--seconds")
+        {
+            seconds = std::atof(value);
+        }
+        else
+        {
+            return Fail(usage);
+        }
+    }
+
+    Bench bench;
+    bench.requests = requests;
+    bench.readSize = readSize;
+    for (U32 i = 0; i < requests; ++i)
+    {
+        C request[1024];
+        auto length = std::snprintf(request, sizeof(request), requestTemplate.data(), i);
+        bench.input.append(request, Size(length));
+    }
+
+    std::printf(
+                 "%u requests, %zu bytes, %s\n",
+                 requests,
+                 bench.input.size(),
+                 (readSize == 0)? "received at once" : (std::to_string(readSize) + " bytes per read").c_str()
+               );
+
+    auto ok =
+        Run("mongoose", bench, ParseMongoose, seconds) &&
+        Run("HttpParser", bench, ParseResuming, seconds);
+
+    return ok? 0 : 1;
+}